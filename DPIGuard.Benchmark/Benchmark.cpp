@@ -0,0 +1,238 @@
+#include "StdAfx.h"
+#include "Benchmark.h"
+
+#include <ctime>
+
+static volatile uint64_t g_sink = 0;
+
+Benchmark::Benchmark()
+    : m_minTime(100), m_repetitions(3), m_listOnly(false)
+{
+}
+
+void Benchmark::SetFilter(const std::string& filter)
+{
+    m_filter = filter;
+}
+
+void Benchmark::SetMinTime(std::chrono::milliseconds minTime)
+{
+    m_minTime = minTime;
+}
+
+void Benchmark::SetRepetitions(size_t repetitions)
+{
+    m_repetitions = std::max<size_t>(repetitions, 1);
+}
+
+void Benchmark::SetListOnly(bool listOnly)
+{
+    m_listOnly = listOnly;
+}
+
+bool Benchmark::ListOnly() const
+{
+    return m_listOnly;
+}
+
+bool Benchmark::Enabled(const std::string& group) const
+{
+    if (m_filter.empty())
+        return true;
+
+    // Names are "group/benchmark", the filter up to its first '/' has to be part of the group
+    return group.find(m_filter.substr(0, m_filter.find('/'))) != std::string::npos;
+}
+
+bool Benchmark::Listed(const std::vector<std::string>& names)
+{
+    if (!m_listOnly)
+        return false;
+
+    for (const std::string& name : names)
+        Run(name, [](size_t) {});
+
+    return true;
+}
+
+void Benchmark::Run(const std::string& name, const Function& function, size_t bytesPerIteration /*= 0*/)
+{
+    if (!Matches(name))
+        return;
+
+    if (m_listOnly)
+    {
+        printf("%s\n", name.c_str());
+        return;
+    }
+
+    double minTime = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(m_minTime).count());
+
+    // Warm up caches and lazily built state
+    function(1);
+
+    size_t iterations = 1;
+    double elapsed = Measure(function, iterations);
+
+    while (elapsed < minTime)
+    {
+        double scale = elapsed > 0 ? minTime * 1.2 / elapsed : 10.0;
+        scale = std::min(std::max(scale, 1.5), 10.0);
+
+        iterations = static_cast<size_t>(iterations * scale) + 1;
+        elapsed = Measure(function, iterations);
+    }
+
+    std::vector<double> samples;
+    samples.reserve(m_repetitions);
+
+    for (size_t i = 0; i < m_repetitions; i++)
+        samples.push_back(Measure(function, iterations) / iterations);
+
+    std::sort(samples.begin(), samples.end());
+
+    Result result;
+    result.name = name;
+    result.iterations = iterations;
+    result.nanoseconds = samples[samples.size() / 2];
+    result.minNanoseconds = samples.front();
+    result.maxNanoseconds = samples.back();
+    result.bytesPerIteration = bytesPerIteration;
+
+    // Progress goes to stderr, stdout is reserved for the JSON report
+    fprintf(stderr, "%-64s %14.1f ns %12llu iterations\n",
+        name.c_str(), result.nanoseconds, static_cast<unsigned long long>(iterations));
+
+    m_results.push_back(result);
+}
+
+std::string Benchmark::ToJson() const
+{
+    std::string json;
+    char buffer[256];
+
+#if defined(_WIN32)
+    const char* platform = "windows";
+#elif defined(__linux__)
+    const char* platform = "linux";
+#else
+    const char* platform = "unknown";
+#endif
+
+#if defined(_MSC_VER)
+    snprintf(buffer, sizeof(buffer), "msvc %d", _MSC_FULL_VER);
+#elif defined(__clang__)
+    snprintf(buffer, sizeof(buffer), "clang %s", __clang_version__);
+#elif defined(__GNUC__)
+    snprintf(buffer, sizeof(buffer), "gcc %s", __VERSION__);
+#else
+    snprintf(buffer, sizeof(buffer), "unknown");
+#endif
+
+    std::string compiler = buffer;
+
+    time_t now = time(nullptr);
+    tm utc = {};
+#ifdef _WIN32
+    gmtime_s(&utc, &now);
+#else
+    gmtime_r(&now, &utc);
+#endif
+
+    char timestamp[32];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &utc);
+
+    json.append("{\n");
+    json.append("  \"context\": {\n");
+    json.append("    \"date\": \"").append(timestamp).append("\",\n");
+    json.append("    \"platform\": \"").append(platform).append("\",\n");
+    json.append("    \"compiler\": \"").append(EscapeJson(compiler)).append("\",\n");
+#ifdef NDEBUG
+    json.append("    \"build\": \"release\",\n");
+#else
+    json.append("    \"build\": \"debug\",\n");
+#endif
+    snprintf(buffer, sizeof(buffer), "    \"hardware_threads\": %u,\n", std::thread::hardware_concurrency());
+    json.append(buffer);
+    snprintf(buffer, sizeof(buffer), "    \"min_time_ms\": %lld,\n", static_cast<long long>(m_minTime.count()));
+    json.append(buffer);
+    snprintf(buffer, sizeof(buffer), "    \"repetitions\": %llu\n", static_cast<unsigned long long>(m_repetitions));
+    json.append(buffer);
+    json.append("  },\n");
+    json.append("  \"benchmarks\": [");
+
+    for (size_t i = 0; i < m_results.size(); i++)
+    {
+        const Result& result = m_results[i];
+
+        json.append(i == 0 ? "\n" : ",\n");
+        json.append("    {\"name\": \"").append(EscapeJson(result.name)).append("\"");
+
+        snprintf(buffer, sizeof(buffer),
+            ", \"iterations\": %llu, \"ns_per_op\": %.3f, \"min_ns_per_op\": %.3f, \"max_ns_per_op\": %.3f, \"ops_per_second\": %.1f",
+            static_cast<unsigned long long>(result.iterations), result.nanoseconds, result.minNanoseconds, result.maxNanoseconds,
+            result.nanoseconds > 0 ? 1e9 / result.nanoseconds : 0.0);
+        json.append(buffer);
+
+        if (result.bytesPerIteration != 0)
+        {
+            snprintf(buffer, sizeof(buffer), ", \"bytes_per_op\": %llu, \"bytes_per_second\": %.1f",
+                static_cast<unsigned long long>(result.bytesPerIteration),
+                result.nanoseconds > 0 ? result.bytesPerIteration * 1e9 / result.nanoseconds : 0.0);
+            json.append(buffer);
+        }
+
+        json.append("}");
+    }
+
+    json.append(m_results.empty() ? "]\n" : "\n  ]\n");
+    json.append("}\n");
+
+    return json;
+}
+
+bool Benchmark::Matches(const std::string& name) const
+{
+    return m_filter.empty() || name.find(m_filter) != std::string::npos;
+}
+
+double Benchmark::Measure(const Function& function, size_t iterations)
+{
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    function(iterations);
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+}
+
+void Benchmark::DoNotOptimize(uint64_t value)
+{
+    g_sink = value;
+}
+
+std::string Benchmark::EscapeJson(const std::string& s)
+{
+    std::string result;
+    result.reserve(s.size());
+
+    for (char c : s)
+    {
+        switch (c)
+        {
+        case '"':
+            result.append("\\\"");
+            break;
+        case '\\':
+            result.append("\\\\");
+            break;
+        default:
+            if (static_cast<uint8_t>(c) < 0x20)
+                result.push_back(' ');
+            else
+                result.push_back(c);
+            break;
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <functional>
+
+// Minimal benchmark runner. Every benchmark is calibrated until a single run takes at least the minimum time,
+// then repeated, and the results are reported as JSON so that runs of different versions can be diffed.
+class Benchmark
+{
+public:
+    // Runs the measured code the given number of times, setup belongs outside of it
+    typedef std::function<void(size_t iterations)> Function;
+
+    Benchmark();
+
+    void SetFilter(const std::string& filter);
+    void SetMinTime(std::chrono::milliseconds minTime);
+    void SetRepetitions(size_t repetitions);
+    void SetListOnly(bool listOnly);
+
+    bool ListOnly() const;
+
+    // Lets a group skip expensive setup when the filter names another group
+    bool Enabled(const std::string& group) const;
+    // Under ListOnly lists the names of a group and returns true, so that the group skips its setup as well
+    bool Listed(const std::vector<std::string>& names);
+    // True if the filter selects the benchmark, for setup and reports that belong to a single one
+    bool Matches(const std::string& name) const;
+
+    void Run(const std::string& name, const Function& function, size_t bytesPerIteration = 0);
+
+    std::string ToJson() const;
+
+    // Keeps the compiler from discarding the work that produced value
+    static void DoNotOptimize(uint64_t value);
+private:
+    struct Result
+    {
+        std::string name;
+        uint64_t iterations;
+        double nanoseconds;
+        double minNanoseconds;
+        double maxNanoseconds;
+        size_t bytesPerIteration;
+    };
+
+    static double Measure(const Function& function, size_t iterations);
+    static std::string EscapeJson(const std::string& s);
+private:
+    std::string m_filter;
+    std::chrono::milliseconds m_minTime;
+    size_t m_repetitions;
+    bool m_listOnly;
+
+    std::vector<Result> m_results;
+};
+
+// Benchmark groups, one per source file
+void RegisterParserBenchmarks(Benchmark& benchmark);
+void RegisterMatchingBenchmarks(Benchmark& benchmark);
+void RegisterPacketBenchmarks(Benchmark& benchmark);
+void RegisterQueueBenchmarks(Benchmark& benchmark);
+// Reads captureFile, or a generated capture when it is empty
+void RegisterReplayBenchmarks(Benchmark& benchmark, const std::string& captureFile);
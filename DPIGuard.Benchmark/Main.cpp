@@ -0,0 +1,149 @@
+#include "StdAfx.h"
+#include "Benchmark.h"
+#include "TrafficGenerator.h"
+
+static void PrintUsage()
+{
+    printf(
+        "Usage: DPIGuard.Benchmark [options]\n"
+        "  --filter <text>       Run benchmarks whose name contains text, names are group/benchmark and text\n"
+        "                        up to its first / has to be part of the group\n"
+        "  --min-time <ms>       Minimum duration of a single measurement (default: 100)\n"
+        "  --repetitions <n>     Measurements per benchmark, the median is reported (default: 3)\n"
+        "  --output <file>       Write the JSON report to file instead of stdout\n"
+        "  --list                List benchmark names and exit\n"
+        "  --capture <file>      Replay benchmarks read a pcap or pcapng file instead of a generated capture\n"
+        "\n"
+        "  --generate <file>     Write synthetic TLS and HTTP traffic to a pcap file instead of benchmarking\n"
+        "  --packets <n>         Packets to generate (default: 1000000)\n"
+        "  --flows <n>           Distinct connections before client ports repeat (default: 1000000)\n"
+        "  --domains <file>      Domain list ordered by popularity, one per line (default: 10000 synthetic names)\n"
+        "  --seed <n>            Random seed (default: 1)\n");
+}
+
+int main(int argc, char* argv[])
+{
+    Benchmark benchmark;
+    std::string output;
+    std::string capture;
+    bool listOnly = false;
+
+    std::string generate;
+    std::string domains;
+    uint64_t packets = 1000000;
+    TrafficGenerator::Options options;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--filter" && hasValue)
+        {
+            benchmark.SetFilter(argv[++i]);
+        }
+        else if (arg == "--min-time" && hasValue)
+        {
+            benchmark.SetMinTime(std::chrono::milliseconds(strtoul(argv[++i], nullptr, 10)));
+        }
+        else if (arg == "--repetitions" && hasValue)
+        {
+            benchmark.SetRepetitions(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--output" && hasValue)
+        {
+            output = argv[++i];
+        }
+        else if (arg == "--capture" && hasValue)
+        {
+            capture = argv[++i];
+        }
+        else if (arg == "--generate" && hasValue)
+        {
+            generate = argv[++i];
+        }
+        else if (arg == "--packets" && hasValue)
+        {
+            packets = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--flows" && hasValue)
+        {
+            options.flows = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--domains" && hasValue)
+        {
+            domains = argv[++i];
+        }
+        else if (arg == "--seed" && hasValue)
+        {
+            options.seed = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--list")
+        {
+            listOnly = true;
+            benchmark.SetListOnly(true);
+        }
+        else
+        {
+            PrintUsage();
+            return arg == "--help" || arg == "-h" ? 0 : 1;
+        }
+    }
+
+    if (!generate.empty())
+    {
+        if (!domains.empty() && !TrafficGenerator::LoadDomains(domains, options.domains))
+        {
+            fprintf(stderr, "[-] Failed to read domains from %s\n", domains.c_str());
+            return 1;
+        }
+
+        TrafficGenerator generator(options);
+
+        if (!generator.WritePcap(generate, packets))
+        {
+            fprintf(stderr, "[-] Failed to write %s\n", generate.c_str());
+            return 1;
+        }
+
+        fprintf(stderr, "[+] %llu packets of %llu connections written to %s\n",
+            static_cast<unsigned long long>(generator.Packets()), static_cast<unsigned long long>(generator.Flows()), generate.c_str());
+
+        return 0;
+    }
+
+    RegisterParserBenchmarks(benchmark);
+    RegisterMatchingBenchmarks(benchmark);
+    RegisterPacketBenchmarks(benchmark);
+    RegisterQueueBenchmarks(benchmark);
+    RegisterReplayBenchmarks(benchmark, capture);
+
+    if (listOnly)
+        return 0;
+
+    std::string json = benchmark.ToJson();
+
+    if (output.empty())
+    {
+        fputs(json.c_str(), stdout);
+        return 0;
+    }
+
+    FILE* file = fopen(output.c_str(), "wb");
+    if (!file)
+    {
+        fprintf(stderr, "[-] Failed to open %s\n", output.c_str());
+        return 1;
+    }
+
+    bool written = fwrite(json.data(), 1, json.size(), file) == json.size();
+    written = fclose(file) == 0 && written;
+
+    if (!written)
+    {
+        fprintf(stderr, "[-] Failed to write %s\n", output.c_str());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,473 @@
+#include "StdAfx.h"
+#include "Benchmark.h"
+#include "ApplicationConfig.h"
+#include "BloomFilter.h"
+#include "ControlChannel.h"
+#include "DomainConfigCache.h"
+#include "HostnameStats.h"
+#include "LargePageArena.h"
+#include "PrefixTable.h"
+#include "Utils.h"
+
+#include <cmath>
+#include <random>
+
+static std::string DomainName(size_t index)
+{
+    return "host" + std::to_string(index) + ".example" + std::to_string(index % 997) + ".com";
+}
+
+static std::string DomainsYaml(size_t domains, size_t wildcardDomains)
+{
+    std::string yaml = "global:\n  includeSubdomains: true\n  tlsFragmentation:\n    enabled: true\n    offset: 2\ndomains:\n";
+
+    for (size_t i = 0; i < domains; i++)
+        yaml += "  - " + DomainName(i) + "\n";
+
+    for (size_t i = 0; i < wildcardDomains; i++)
+        yaml += "  - \"cdn" + std::to_string(i) + "-*.example.net\"\n";
+
+    return yaml;
+}
+
+// Indexes in [0, count) with probability proportional to 1 / rank^exponent, like host names in real traffic
+static std::vector<size_t> ZipfSequence(size_t count, size_t length, double exponent, uint32_t seed)
+{
+    std::vector<double> cdf(count);
+
+    double sum = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        sum += 1.0 / std::pow(static_cast<double>(i + 1), exponent);
+        cdf[i] = sum;
+    }
+
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> distribution(0, sum);
+
+    std::vector<size_t> sequence(length);
+    for (size_t i = 0; i < length; i++)
+    {
+        size_t index = std::lower_bound(cdf.begin(), cdf.end(), distribution(random)) - cdf.begin();
+        sequence[i] = std::min(index, count - 1);
+    }
+
+    return sequence;
+}
+
+static void RegisterMatchStringBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("MatchString"))
+        return;
+
+    if (benchmark.Listed({ "MatchString/literal/hit", "MatchString/literal/miss", "MatchString/star/hit",
+        "MatchString/star/miss", "MatchString/star/backtracking", "MatchString/question/hit" }))
+        return;
+
+    struct Case
+    {
+        const char* name;
+        const char* s;
+        const char* pattern;
+    };
+
+    static const Case cases[] = {
+        { "literal/hit", "www.example.com", "www.example.com" },
+        { "literal/miss", "www.example.com", "www.example.org" },
+        { "star/hit", "cdn-123.static.example.com", "cdn-*.example.com" },
+        { "star/miss", "cdn-123.static.example.org", "cdn-*.example.com" },
+        { "star/backtracking", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab", "*a*a*a*a*c" },
+        { "question/hit", "example1.com", "example?.com" },
+    };
+
+    for (const Case& c : cases)
+    {
+        benchmark.Run(std::string("MatchString/") + c.name, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++)
+                Benchmark::DoNotOptimize(Utils::MatchString(c.s, c.pattern));
+        });
+    }
+}
+
+static void RegisterDomainConfigBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("GetDomainConfig"))
+        return;
+
+    if (benchmark.Listed({ "GetDomainConfig/hit/10 domains/0 wildcards", "GetDomainConfig/miss/10 domains/0 wildcards",
+        "GetDomainConfig/hit/10 domains/100 wildcards", "GetDomainConfig/miss/10 domains/100 wildcards",
+        "GetDomainConfig/hit/1000 domains/0 wildcards", "GetDomainConfig/miss/1000 domains/0 wildcards",
+        "GetDomainConfig/hit/1000 domains/100 wildcards", "GetDomainConfig/miss/1000 domains/100 wildcards",
+        "GetDomainConfig/hit/100000 domains/0 wildcards", "GetDomainConfig/miss/100000 domains/0 wildcards",
+        "GetDomainConfig/hit/100000 domains/100 wildcards", "GetDomainConfig/miss/100000 domains/100 wildcards" }))
+        return;
+
+    for (size_t domains : { 10, 1000, 100000 })
+    {
+        for (size_t wildcardDomains : { 0, 100 })
+        {
+            ApplicationConfig appConfig;
+            appConfig.Load(DomainsYaml(domains, wildcardDomains));
+
+            std::string suffix = "/" + std::to_string(domains) + " domains/" + std::to_string(wildcardDomains) + " wildcards";
+
+            std::vector<std::string> hits;
+            std::vector<std::string> misses;
+
+            for (size_t i = 0; i < 1024; i++)
+            {
+                hits.push_back(DomainName(i * 7919 % domains));
+                misses.push_back("www.unlisted" + std::to_string(i) + ".org");
+            }
+
+            benchmark.Run("GetDomainConfig/hit" + suffix, [&](size_t iterations) {
+                for (size_t i = 0; i < iterations; i++)
+                    Benchmark::DoNotOptimize(appConfig.GetDomainConfig(hits[i % hits.size()]) != nullptr);
+            });
+
+            benchmark.Run("GetDomainConfig/miss" + suffix, [&](size_t iterations) {
+                for (size_t i = 0; i < iterations; i++)
+                    Benchmark::DoNotOptimize(appConfig.GetDomainConfig(misses[i % misses.size()]) != nullptr);
+            });
+        }
+    }
+}
+
+static void RegisterLargePageBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("LargePages"))
+        return;
+
+    if (benchmark.Listed({ "LargePages/GetDomainConfig/hit/small pages/1000000 domains",
+        "LargePages/GetDomainConfig/miss/small pages/1000000 domains",
+        "LargePages/GetDomainConfig/hit/large pages/1000000 domains",
+        "LargePages/GetDomainConfig/miss/large pages/1000000 domains" }))
+        return;
+
+    // A million domains and lookups spread over all of them, so that nearly every one touches a page of the
+    // index that is not in the TLB. Only the index nodes and buckets move into the arena, not the names.
+    const size_t domains = 1000000;
+
+    std::mt19937 random(1);
+    std::vector<std::string> hits;
+    std::vector<std::string> misses;
+
+    for (size_t i = 0; i < 65536; i++)
+    {
+        hits.push_back(DomainName(random() % domains));
+        misses.push_back("www.unlisted" + std::to_string(i) + ".org");
+    }
+
+    for (bool largePages : { false, true })
+    {
+        std::string yaml = DomainsYaml(domains, 0);
+        if (largePages)
+            yaml += "engine:\n  largePages: true\n";
+
+        ApplicationConfig appConfig;
+        appConfig.Load(yaml);
+        yaml.clear();
+
+        if (largePages)
+            LargePageArena::Report(stderr);
+
+        std::string suffix = std::string(largePages ? "/large pages" : "/small pages") + "/" + std::to_string(domains) + " domains";
+
+        benchmark.Run("LargePages/GetDomainConfig/hit" + suffix, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++)
+                Benchmark::DoNotOptimize(appConfig.GetDomainConfig(hits[i % hits.size()]) != nullptr);
+        });
+
+        benchmark.Run("LargePages/GetDomainConfig/miss" + suffix, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++)
+                Benchmark::DoNotOptimize(appConfig.GetDomainConfig(misses[i % misses.size()]) != nullptr);
+        });
+    }
+}
+
+static void RegisterDomainConfigCacheBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("DomainConfigCache"))
+        return;
+
+    if (benchmark.Listed({ "DomainConfigCache/Get/zipf/100000 domains" }))
+        return;
+
+    ApplicationConfig appConfig;
+    appConfig.Load(DomainsYaml(100000, 0));
+
+    // Most lookups hit a few popular names, the long tail does not fit into the cache
+    std::vector<std::string> names;
+    for (size_t index : ZipfSequence(1000000, 65536, 1.0, 1))
+        names.push_back(index % 2 ? DomainName(index % 100000) : "www.unlisted" + std::to_string(index) + ".org");
+
+    DomainConfigCache cache;
+
+    benchmark.Run("DomainConfigCache/Get/zipf/100000 domains", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; i++)
+            Benchmark::DoNotOptimize(cache.Get(appConfig, names[i % names.size()]) != nullptr);
+    });
+
+    uint64_t lookups = cache.Hits() + cache.Misses();
+    if (lookups != 0)
+        fprintf(stderr, "%-64s %14.1f %% hit rate\n", "DomainConfigCache/Get/zipf/100000 domains", 100.0 * cache.Hits() / lookups);
+}
+
+static void RegisterBloomFilterBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("BloomFilter"))
+        return;
+
+    if (benchmark.Listed({ "BloomFilter/MayContain/miss/100000 items" }))
+        return;
+
+    BloomFilter filter;
+    filter.Reset(100000);
+
+    for (size_t i = 0; i < 100000; i++)
+    {
+        std::string name = DomainName(i);
+        filter.Insert(Utils::HashString(name.c_str(), name.size()));
+    }
+
+    std::vector<uint64_t> misses;
+    for (size_t i = 0; i < 4096; i++)
+    {
+        std::string name = "www.unlisted" + std::to_string(i) + ".org";
+        misses.push_back(Utils::HashString(name.c_str(), name.size()));
+    }
+
+    benchmark.Run("BloomFilter/MayContain/miss/100000 items", [&](size_t iterations) {
+        uint64_t count = 0;
+
+        for (size_t i = 0; i < iterations; i++)
+            count += filter.MayContain(misses[i % misses.size()]);
+
+        Benchmark::DoNotOptimize(count);
+    });
+}
+
+// Random prefixes rarely share trie nodes, so the sizes are kept close to what routing tables look like
+template<size_t AddressLength>
+static void RegisterPrefixTableBenchmark(Benchmark& benchmark, const char* family, int maxLength)
+{
+    typedef PrefixTable<AddressLength> Table;
+
+    std::mt19937 random(2);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::uniform_int_distribution<int> length(8, maxLength);
+
+    std::vector<typename Table::Prefix> prefixes(10000);
+
+    for (size_t i = 0; i < prefixes.size(); i++)
+    {
+        for (uint8_t& b : prefixes[i].address)
+            b = static_cast<uint8_t>(byte(random));
+
+        prefixes[i].length = static_cast<uint8_t>(length(random));
+        prefixes[i].value = static_cast<uint32_t>(i + 1);
+    }
+
+    Table table;
+    table.Build(prefixes);
+
+    // Half of the lookups fall inside a configured prefix
+    std::vector<typename Table::Address> addresses(4096);
+    for (size_t i = 0; i < addresses.size(); i++)
+    {
+        if (i % 2)
+        {
+            addresses[i] = prefixes[i * 7919 % prefixes.size()].address;
+        }
+        else
+        {
+            for (uint8_t& b : addresses[i])
+                b = static_cast<uint8_t>(byte(random));
+        }
+    }
+
+    benchmark.Run(std::string("PrefixTable/Lookup/") + family + "/10000 prefixes", [&](size_t iterations) {
+        uint64_t sum = 0;
+
+        for (size_t i = 0; i < iterations; i++)
+            sum += table.Lookup(addresses[i % addresses.size()].data());
+
+        Benchmark::DoNotOptimize(sum);
+    });
+}
+
+static void RegisterPrefixTableBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("PrefixTable"))
+        return;
+
+    if (benchmark.Listed({ "PrefixTable/Lookup/IPv4/10000 prefixes", "PrefixTable/Lookup/IPv6/10000 prefixes" }))
+        return;
+
+    RegisterPrefixTableBenchmark<4>(benchmark, "IPv4", 32);
+    RegisterPrefixTableBenchmark<16>(benchmark, "IPv6", 64);
+}
+
+static void RegisterLoadBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("ApplicationConfig"))
+        return;
+
+    if (benchmark.Listed({ "ApplicationConfig/Load/10000 domains", "ApplicationConfig/Load/100000 domains" }))
+        return;
+
+    for (size_t domains : { 10000, 100000 })
+    {
+        std::string yaml = DomainsYaml(domains, 100);
+
+        benchmark.Run("ApplicationConfig/Load/" + std::to_string(domains) + " domains", [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++)
+            {
+                ApplicationConfig appConfig;
+                Benchmark::DoNotOptimize(appConfig.Load(yaml));
+            }
+        }, yaml.size());
+    }
+}
+
+static void RegisterControlChannelBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("ControlChannel"))
+        return;
+
+    if (benchmark.Listed({ "ControlChannel/add+remove/500000 domains", "ControlChannel/update/500000 domains",
+        "ControlChannel/get/500000 domains" }))
+        return;
+
+    ApplicationConfig appConfig;
+    std::string yaml = DomainsYaml(500000, 100);
+
+    // A reload is what a single domain change cost before, once is enough to compare
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    appConfig.Load(yaml);
+    double reload = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    fprintf(stderr, "%-64s %14.1f ms\n", "ControlChannel/reload/500000 domains", reload);
+
+    ControlChannel control(appConfig);
+
+    // Changes and lookups are spread over the index rather than repeating the same entry
+    std::vector<std::string> adds;
+    std::vector<std::string> removes;
+    std::vector<std::string> updates;
+    std::vector<std::string> gets;
+
+    for (size_t i = 0; i < 4096; i++)
+    {
+        adds.push_back("add {domain: www.added" + std::to_string(i) + ".org, tlsFragmentation: {offset: 5}}");
+        removes.push_back("remove www.added" + std::to_string(i) + ".org");
+        updates.push_back("update {domain: " + DomainName(i * 7919 % 500000) + ", tlsFragmentation: {offset: " + std::to_string(i % 8) + "}}");
+        gets.push_back("get " + DomainName(i * 7919 % 500000));
+    }
+
+    benchmark.Run("ControlChannel/add+remove/500000 domains", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; i++)
+        {
+            Benchmark::DoNotOptimize(control.Execute(adds[i % adds.size()]).size());
+            Benchmark::DoNotOptimize(control.Execute(removes[i % removes.size()]).size());
+        }
+    });
+
+    benchmark.Run("ControlChannel/update/500000 domains", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; i++)
+            Benchmark::DoNotOptimize(control.Execute(updates[i % updates.size()]).size());
+    });
+
+    benchmark.Run("ControlChannel/get/500000 domains", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; i++)
+            Benchmark::DoNotOptimize(control.Execute(gets[i % gets.size()]).size());
+    });
+
+    if (control.Failures() != 0)
+        fprintf(stderr, "[-] %llu control requests failed\n", static_cast<unsigned long long>(control.Failures()));
+}
+
+static void RegisterHeavyHittersBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("HeavyHitters"))
+        return;
+
+    if (benchmark.Listed({ "HeavyHitters/Add/zipf/1000000 names/1024 counters",
+        "HeavyHitters/Add/uniform/1000000 names/1024 counters", "HeavyHitters/Add/zipf/1000000 names/16384 counters",
+        "HeavyHitters/Add/uniform/1000000 names/16384 counters", "HeavyHitters/Merge/1024 counters" }))
+        return;
+
+    // Far more distinct names than counters, the sketch size stays the same whatever the cardinality
+    std::vector<std::string> zipfNames;
+    for (size_t index : ZipfSequence(1000000, 1 << 20, 1.0, 3))
+        zipfNames.push_back(DomainName(index));
+
+    // Every name is new to the sketch, each update replaces the least counted name
+    std::vector<std::string> uniformNames;
+    for (size_t i = 0; i < (1 << 16); i++)
+        uniformNames.push_back(DomainName(i * 7919 % 1000000));
+
+    for (size_t capacity : { 1024, 16384 })
+    {
+        std::string suffix = "/1000000 names/" + std::to_string(capacity) + " counters";
+
+        HeavyHitters sketch(capacity);
+        bool added = false;
+
+        benchmark.Run("HeavyHitters/Add/zipf" + suffix, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++)
+                sketch.Add(zipfNames[i % zipfNames.size()]);
+
+            added = true;
+        });
+
+        // The most frequent names are the lowest indexes, at least these should be counted
+        if (added)
+        {
+            std::vector<HeavyHitters::Entry> top = sketch.Top(20);
+            size_t found = 0;
+
+            for (const HeavyHitters::Entry& entry : top)
+            {
+                for (size_t i = 0; i < 20; i++)
+                    found += entry.name == DomainName(i);
+            }
+
+            fprintf(stderr, "%-64s %14zu of the 20 most frequent names\n", ("HeavyHitters/Add/zipf" + suffix).c_str(), found);
+        }
+
+        sketch.Clear();
+
+        benchmark.Run("HeavyHitters/Add/uniform" + suffix, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++)
+                sketch.Add(uniformNames[i % uniformNames.size()]);
+        });
+    }
+
+    // What a worker pays once a second to hand its counts over
+    HeavyHitters local(1024);
+    HeavyHitters merged(1024);
+
+    for (size_t i = 0; i < 65536; i++)
+        local.Add(zipfNames[i]);
+
+    benchmark.Run("HeavyHitters/Merge/1024 counters", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; i++)
+            merged.Merge(local);
+
+        Benchmark::DoNotOptimize(merged.Total());
+    });
+}
+
+void RegisterMatchingBenchmarks(Benchmark& benchmark)
+{
+    RegisterMatchStringBenchmarks(benchmark);
+    RegisterDomainConfigBenchmarks(benchmark);
+    RegisterLargePageBenchmarks(benchmark);
+    RegisterDomainConfigCacheBenchmarks(benchmark);
+    RegisterBloomFilterBenchmarks(benchmark);
+    RegisterPrefixTableBenchmarks(benchmark);
+    RegisterLoadBenchmarks(benchmark);
+    RegisterControlChannelBenchmarks(benchmark);
+    RegisterHeavyHittersBenchmarks(benchmark);
+}
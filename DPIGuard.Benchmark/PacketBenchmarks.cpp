@@ -0,0 +1,974 @@
+#include "StdAfx.h"
+#include "Benchmark.h"
+#include "TestPackets.h"
+#include "TrafficGenerator.h"
+#include "AsyncReceiver.h"
+#include "FlowDispatcher.h"
+#include "PacketPipeline.h"
+#include "PacketProcessor.h"
+#include "SpscRing.h"
+#include "StrategyScoreboard.h"
+
+// Global fragmentation for every stride-th domain of the list
+static std::string DomainsYaml(const std::vector<std::string>& domains, size_t stride)
+{
+    std::string yaml = "global:\n  includeSubdomains: false\n  tlsFragmentation:\n    enabled: true\n    offset: 2\n"
+        "  httpFragmentation:\n    enabled: true\n    offset: 2\ndomains:\n";
+
+    for (size_t i = 0; i < domains.size(); i += stride)
+        yaml += "  - " + domains[i] + "\n";
+
+    return yaml;
+}
+
+// IPv4 server behind a filter that only lets a ClientHello through as out of order fragments split at offset 1.
+// Those connections get a ServerHello after 20 ms, all others a RST after 5 ms. Every connection comes from a new
+// source port and starts 1 ms after the previous one, timestamps are in microseconds.
+class FilteredServerDevice : public PacketDevice
+{
+public:
+    explicit FilteredServerDevice(const std::vector<uint8_t>& hello)
+        : m_hello(hello), m_connections(0), m_completed(0), m_clock(0)
+    {
+        m_flow.sourceAddress = { 192, 0, 2, 1 };
+        m_flow.destinationAddress = { 198, 51, 100, 2 };
+        m_flow.sourcePort = 1024;
+        m_flow.destinationPort = 443;
+        m_flow.sequenceNumber = 0x10000001;
+    }
+
+    void Reset(uint64_t connections)
+    {
+        m_connections = connections;
+        m_completed = 0;
+    }
+
+    bool Recv(WinDivertPacket& packet) override
+    {
+        if (m_connections == 0 && m_responses.empty())
+            return false;
+
+        if (m_responses.empty())
+        {
+            m_connections--;
+            m_clock += 1000;
+            m_flow.sourcePort = static_cast<uint16_t>(1024 + (m_flow.sourcePort - 1024 + 1) % 64512);
+
+            packet = TestPackets::TcpPacket(m_flow, m_hello.data(), m_hello.size());
+            packet.Address().Timestamp = static_cast<INT64>(m_clock);
+
+            // The ClientHello is answered once the processor has sent it on
+            m_responses.push_back(WinDivertPacket());
+            return true;
+        }
+
+        if (m_responses.front().Buffer().empty())
+            Respond();
+
+        packet = m_responses.front();
+        m_responses.pop_front();
+
+        return true;
+    }
+
+    bool Send(const WinDivertPacket& packet) override
+    {
+        // Sequence Number and payload length of outbound segments, IPv4 headers without options
+        if (packet.Address().Outbound && packet.Buffer().size() >= 40)
+        {
+            const uint8_t* tcp = packet.Buffer().data() + 20;
+            uint32_t sequenceNumber = (static_cast<uint32_t>(tcp[4]) << 24) | (tcp[5] << 16) | (tcp[6] << 8) | tcp[7];
+
+            m_sent.push_back(std::make_pair(sequenceNumber, packet.Buffer().size() - 40));
+        }
+
+        return true;
+    }
+
+    uint64_t Completed() const
+    {
+        return m_completed;
+    }
+private:
+    void Respond()
+    {
+        bool passed = m_sent.size() == 2 && m_sent[0].first != m_flow.sequenceNumber &&
+            m_sent[1].first == m_flow.sequenceNumber && m_sent[1].second == 1;
+
+        m_sent.clear();
+
+        m_responses.front() = TestPackets::ServerPacket(m_flow, TestPackets::ServerHello(), !passed);
+        m_responses.front().Address().Timestamp = static_cast<INT64>(m_clock + (passed ? 20000 : 5000));
+
+        if (passed)
+            m_completed++;
+    }
+private:
+    std::vector<uint8_t> m_hello;
+    TestPackets::Flow m_flow;
+
+    uint64_t m_connections;
+    uint64_t m_completed;
+    uint64_t m_clock;
+
+    std::vector<std::pair<uint32_t, size_t>> m_sent;
+    std::deque<WinDivertPacket> m_responses;
+};
+
+// Folds everything sent into one hash, so that two processors can be checked for sending the same packets
+class HashingDevice : public PacketDevice
+{
+public:
+    HashingDevice()
+        : m_hash(14695981039346656037ULL), m_sent(0)
+    {
+    }
+
+    bool Recv(WinDivertPacket&) override
+    {
+        return false;
+    }
+
+    bool Send(const WinDivertPacket& packet) override
+    {
+        for (uint8_t byte : packet.Buffer())
+            m_hash = (m_hash ^ byte) * 1099511628211ULL;
+
+        m_sent++;
+        return true;
+    }
+
+    uint64_t Hash() const
+    {
+        return m_hash;
+    }
+
+    uint64_t Sent() const
+    {
+        return m_sent;
+    }
+private:
+    uint64_t m_hash;
+    uint64_t m_sent;
+};
+
+// Replays packets like ReplayDevice, but every call busy-waits for as long as a WinDivertRecv or WinDivertSend
+// round trip would take. Packets are stamped in nanoseconds when received, Send records how long they took.
+class SyscallDevice : public PacketDevice
+{
+public:
+    SyscallDevice(const std::vector<WinDivertPacket>& packets, std::chrono::nanoseconds cost)
+        : m_packets(packets), m_cost(cost), m_next(0), m_count(0)
+    {
+    }
+
+    void Reset(uint64_t count)
+    {
+        m_next = 0;
+        m_count = count;
+
+        std::unique_lock<std::mutex> locked(m_lock);
+        m_latencies.clear();
+    }
+
+    bool Recv(WinDivertPacket& packet) override
+    {
+        if (m_next >= m_count)
+            return false;
+
+        Wait();
+
+        packet = m_packets[m_next++ % m_packets.size()];
+        packet.Address().Timestamp = Now();
+
+        return true;
+    }
+
+    bool Send(const WinDivertPacket& packet) override
+    {
+        Wait();
+
+        int64_t latency = Now() - packet.Address().Timestamp;
+
+        std::unique_lock<std::mutex> locked(m_lock);
+        m_latencies.push_back(latency);
+
+        return true;
+    }
+
+    // Nanoseconds of the given quantile of all packets sent since the last reset
+    int64_t Latency(double quantile)
+    {
+        std::unique_lock<std::mutex> locked(m_lock);
+
+        if (m_latencies.empty())
+            return 0;
+
+        size_t index = std::min(static_cast<size_t>(quantile * m_latencies.size()), m_latencies.size() - 1);
+        std::nth_element(m_latencies.begin(), m_latencies.begin() + index, m_latencies.end());
+
+        return m_latencies[index];
+    }
+private:
+    void Wait() const
+    {
+        auto deadline = std::chrono::steady_clock::now() + m_cost;
+
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+        }
+    }
+
+    static int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+private:
+    const std::vector<WinDivertPacket>& m_packets;
+    std::chrono::nanoseconds m_cost;
+    uint64_t m_next;
+    uint64_t m_count;
+
+    std::mutex m_lock;
+    std::vector<int64_t> m_latencies;
+};
+
+template<typename Family>
+static void RegisterFragmentBenchmark(Benchmark& benchmark, const char* family)
+{
+    WinDivertPacket packet = TestPackets::TcpPacket(Family::ADDRESS_LENGTH == 16, 50000, 443,
+        TestPackets::ClientHello("www.example.com", 16));
+
+    WinDivertPacket firstPacket;
+    WinDivertPacket secondPacket;
+
+    benchmark.Run(std::string("Pipeline/Fragment/") + family, [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; i++)
+        {
+            Pipeline<Family>::Fragment(packet, 2, firstPacket, secondPacket);
+            Benchmark::DoNotOptimize(secondPacket.Buffer().size());
+        }
+    }, packet.Buffer().size());
+}
+
+// Concatenated bodies of the TLS records at the start of the payload, empty if they do not parse
+static std::vector<uint8_t> RecordBodies(const WinDivertPacket& packet)
+{
+    std::vector<uint8_t> bodies;
+
+    const uint8_t* data = packet.Data();
+    size_t dataLength = packet.DataLength();
+
+    for (size_t i = 0; data && i + 5 <= dataLength; )
+    {
+        size_t recordLength = (static_cast<size_t>(data[i + 3]) << 8) | data[i + 4];
+
+        if (data[i] != 22 || i + 5 + recordLength > dataLength)
+            return std::vector<uint8_t>();
+
+        bodies.insert(bodies.end(), data + i + 5, data + i + 5 + recordLength);
+        i += 5 + recordLength;
+    }
+
+    return bodies;
+}
+
+template<typename Family>
+static void RegisterSplitRecordBenchmark(Benchmark& benchmark, const char* family)
+{
+    WinDivertPacket packet = TestPackets::TcpPacket(Family::ADDRESS_LENGTH == 16, 50000, 443,
+        TestPackets::ClientHello("www.example.com", 16));
+
+    WinDivertPacket splitPacket(packet.Buffer().size() + Pipeline<Family>::RECORD_HEADER_LENGTH);
+
+    // The repository has no test suite, a split that changes the handshake message is reported here instead
+    if (!Pipeline<Family>::SplitRecord(packet, 2, splitPacket) ||
+        splitPacket.DataLength() != packet.DataLength() + Pipeline<Family>::RECORD_HEADER_LENGTH ||
+        RecordBodies(splitPacket) != RecordBodies(packet) || splitPacket.Data()[4] != 2)
+    {
+        fprintf(stderr, "[-] Pipeline::SplitRecord changed the ClientHello (%s)\n", family);
+    }
+
+    benchmark.Run(std::string("Pipeline/SplitRecord/") + family, [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; i++)
+        {
+            Pipeline<Family>::SplitRecord(packet, 2, splitPacket);
+            Benchmark::DoNotOptimize(splitPacket.Buffer().size());
+        }
+    }, packet.Buffer().size());
+}
+
+static void RegisterFragmentationBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("Pipeline"))
+        return;
+
+    if (benchmark.Listed({ "Pipeline/Fragment/IPv4", "Pipeline/Fragment/IPv6", "Pipeline/SplitRecord/IPv4",
+        "Pipeline/SplitRecord/IPv6" }))
+        return;
+
+    RegisterFragmentBenchmark<IPv4>(benchmark, "IPv4");
+    RegisterFragmentBenchmark<IPv6>(benchmark, "IPv6");
+    RegisterSplitRecordBenchmark<IPv4>(benchmark, "IPv4");
+    RegisterSplitRecordBenchmark<IPv6>(benchmark, "IPv6");
+}
+
+static void RegisterProcessorBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("PacketProcessor"))
+        return;
+
+    if (benchmark.Listed({ "PacketProcessor/HandlePacket/TLS matched/IPv4",
+        "PacketProcessor/HandlePacket/HTTP matched/IPv4", "PacketProcessor/HandlePacket/TLS matched/IPv6",
+        "PacketProcessor/HandlePacket/HTTP matched/IPv6" }))
+        return;
+
+    // Every ClientHello matches, so HandlePacket runs through DoTcpFragmentation and sends two packets
+    ApplicationConfig appConfig;
+    appConfig.Load(std::string("global:\n  tlsFragmentation:\n    enabled: true\n    offset: 2\n"
+        "  httpFragmentation:\n    enabled: true\n    offset: 2\ndomains:\n  - example.com\n"));
+
+    NullDevice device;
+
+    for (bool ipv6 : { false, true })
+    {
+        WinDivertPacket https = TestPackets::TcpPacket(ipv6, 50000, 443, TestPackets::ClientHello("www.example.com", 16));
+        WinDivertPacket http = TestPackets::TcpPacket(ipv6, 50000, 80, TestPackets::HttpRequest("www.example.com", 8));
+
+        PacketProcessor processor(appConfig, device);
+        processor.SetVerbose(false);
+
+        std::string family = ipv6 ? "IPv6" : "IPv4";
+
+        benchmark.Run("PacketProcessor/HandlePacket/TLS matched/" + family, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++)
+                Benchmark::DoNotOptimize(processor.HandlePacket(https));
+        }, https.Buffer().size());
+
+        benchmark.Run("PacketProcessor/HandlePacket/HTTP matched/" + family, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++)
+                Benchmark::DoNotOptimize(processor.HandlePacket(http));
+        }, http.Buffer().size());
+    }
+}
+
+static void RegisterFingerprintBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("Fingerprint"))
+        return;
+
+    if (benchmark.Listed({ "Fingerprint/HandlePacket/none", "Fingerprint/HandlePacket/JA3",
+        "Fingerprint/HandlePacket/JA3 hash", "Fingerprint/HandlePacket/JA4", "Fingerprint/HandlePacket/all" }))
+        return;
+
+    // A browser ClientHello that no domain, network or fingerprint matches, so that the difference to "none"
+    // is what fingerprinting adds to each ClientHello: the full extension walk and the formats configured
+    TestPackets::ClientHelloOptions options;
+    options.serverName = "www.example.com";
+    options.grease = true;
+    options.keyShareGroups = { TestPackets::X25519 };
+
+    WinDivertPacket packet = TestPackets::TcpPacket(false, 50000, 443, TestPackets::ClientHello(options));
+
+    const std::pair<const char*, const char*> rules[] =
+    {
+        { "none", "" },
+        { "JA3", "  - \"771,4865-4866-4867,0-23-65281,29-23-24,0\"\n" },
+        { "JA3 hash", "  - 0123456789abcdef0123456789abcdef\n" },
+        { "JA4", "  - t13d1516h2_8daaf6152771_e5627efa2ab1\n" },
+        { "all", "  - \"771,4865-4866-4867,0-23-65281,29-23-24,0\"\n  - 0123456789abcdef0123456789abcdef\n"
+            "  - t13d1516h2_8daaf6152771_e5627efa2ab1\n" }
+    };
+
+    NullDevice device;
+
+    // The same ClientHello cut two bytes into the extension header after server_name, where a segment may end.
+    // The fingerprint is given up, but the server name still matches its domain
+    std::vector<uint8_t> hello = TestPackets::ClientHello(options);
+    hello.resize(std::search(hello.begin(), hello.end(), options.serverName.begin(), options.serverName.end()) - hello.begin() +
+        options.serverName.size() + 2);
+
+    WinDivertPacket cut = TestPackets::TcpPacket(false, 50000, 443, hello);
+
+    for (bool fingerprints : { false, true })
+    {
+        ApplicationConfig appConfig;
+        appConfig.Load(std::string("global:\n  tlsFragmentation:\n    enabled: true\n    offset: 2\ndomains:\n  - example.com\n") +
+            (fingerprints ? "fingerprints:\n  - t13d1516h2_8daaf6152771_e5627efa2ab1\n" : ""));
+
+        PacketProcessor processor(appConfig, device);
+        processor.SetVerbose(false);
+
+        if (!processor.HandlePacket(cut))
+        {
+            fprintf(stderr, "[-] Fingerprint/HandlePacket: a ClientHello cut after server_name was not fragmented%s\n",
+                fingerprints ? " with fingerprints configured" : "");
+            return;
+        }
+    }
+
+    for (const std::pair<const char*, const char*>& rule : rules)
+    {
+        ApplicationConfig appConfig;
+        if (*rule.second)
+            appConfig.Load(std::string("fingerprints:\n") + rule.second);
+
+        PacketProcessor processor(appConfig, device);
+        processor.SetVerbose(false);
+
+        benchmark.Run(std::string("Fingerprint/HandlePacket/") + rule.first, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++)
+                Benchmark::DoNotOptimize(processor.HandlePacket(packet));
+        }, packet.Buffer().size());
+    }
+}
+
+static void RegisterBatchBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("Batch"))
+        return;
+
+    if (benchmark.Listed({ "Batch/per packet/1000000 domains", "Batch/8 packets/1000000 domains",
+        "Batch/32 packets/1000000 domains" }))
+        return;
+
+    // A million configured domains and as many unlisted ones, drawn uniformly over a quarter million flows so
+    // that nearly every lookup misses the domain cache and lands on a cold part of the filter and the index.
+    // Fragmentation is disabled, only classification is measured.
+    std::vector<std::string> domains = TrafficGenerator::SyntheticDomains(2000000);
+
+    std::string yaml = "global:\n  includeSubdomains: true\ndomains:\n";
+    for (size_t i = 0; i < domains.size(); i += 2)
+        yaml += "  - " + domains[i] + "\n";
+
+    ApplicationConfig appConfig;
+    appConfig.Load(yaml);
+    yaml.clear();
+
+    TrafficGenerator::Options options;
+    options.domains = domains;
+    options.zipfExponent = 0.0;
+    options.postQuantumRatio = 0.0;
+
+    TrafficGenerator generator(options);
+
+    std::vector<WinDivertPacket> packets(262144);
+    for (WinDivertPacket& packet : packets)
+        generator.Next(packet);
+
+    NullDevice device;
+
+    for (size_t batchSize : { 1, 8, 32 })
+    {
+        PacketProcessor processor(appConfig, device);
+        processor.SetVerbose(false);
+
+        std::vector<WinDivertPacket*> batch(batchSize);
+        size_t next = 0;
+
+        std::string name = batchSize == 1 ? "Batch/per packet/1000000 domains" : "Batch/" + std::to_string(batchSize) + " packets/1000000 domains";
+
+        benchmark.Run(name, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i += batchSize)
+            {
+                size_t count = std::min(batchSize, iterations - i);
+
+                for (size_t j = 0; j < count; j++)
+                {
+                    batch[j] = &packets[next];
+                    next = (next + 1) % packets.size();
+                }
+
+                if (batchSize > 1)
+                    processor.PrepareBatch(batch.data(), count);
+
+                for (size_t j = 0; j < count; j++)
+                    Benchmark::DoNotOptimize(processor.HandlePacket(*batch[j]));
+            }
+        });
+
+        const DomainConfigCache& cache = processor.DomainCache();
+        uint64_t lookups = cache.Hits() + cache.Misses();
+        if (lookups != 0)
+            fprintf(stderr, "%-64s %14.1f %% domain cache hit rate\n", name.c_str(), 100.0 * cache.Hits() / lookups);
+    }
+}
+
+static void RegisterSpscRingBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("SpscRing"))
+        return;
+
+    SpscRing<uint64_t> ring(1024);
+
+    benchmark.Run("SpscRing/TryPush+TryPop/1 thread", [&](size_t iterations) {
+        uint64_t value = 0;
+
+        for (size_t i = 0; i < iterations; i++)
+        {
+            ring.TryPush(i);
+            ring.TryPop(value);
+        }
+
+        Benchmark::DoNotOptimize(value);
+    });
+
+    if (std::thread::hardware_concurrency() < 2)
+        return;
+
+    benchmark.Run("SpscRing/TryPush+TryPop/2 threads", [&](size_t iterations) {
+        std::thread consumer([&]() {
+            uint64_t value = 0;
+            uint64_t sum = 0;
+
+            for (size_t i = 0; i < iterations; )
+            {
+                if (ring.TryPop(value))
+                {
+                    sum += value;
+                    i++;
+                }
+            }
+
+            Benchmark::DoNotOptimize(sum);
+        });
+
+        for (size_t i = 0; i < iterations; )
+        {
+            if (ring.TryPush(i))
+                i++;
+        }
+
+        consumer.join();
+    });
+}
+
+static void RegisterDispatcherBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("FlowDispatcher"))
+        return;
+
+    std::vector<std::string> names;
+    for (size_t workers : { 1, 2, 4 })
+    {
+        if (workers == 1 || workers <= std::thread::hardware_concurrency())
+            names.push_back("FlowDispatcher/Run/" + std::to_string(workers) + " workers");
+    }
+
+    if (benchmark.Listed(names))
+        return;
+
+    // Generated connections with every fourth domain configured, the dispatching thread copies every packet in
+    // like WinDivertRecv would
+    std::vector<std::string> domains = TrafficGenerator::SyntheticDomains(10000);
+
+    ApplicationConfig appConfig;
+    appConfig.Load(DomainsYaml(domains, 4));
+
+    TrafficGenerator::Options options;
+    options.domains = domains;
+
+    TrafficGenerator generator(options);
+
+    std::vector<WinDivertPacket> packets(65536);
+    for (WinDivertPacket& packet : packets)
+        generator.Next(packet);
+
+    ReplayDevice device(packets);
+
+    for (size_t workers : { 1, 2, 4 })
+    {
+        if (workers > 1 && workers > std::thread::hardware_concurrency())
+            break;
+
+        benchmark.Run("FlowDispatcher/Run/" + std::to_string(workers) + " workers", [&](size_t iterations) {
+            device.Reset(iterations);
+
+            FlowDispatcher dispatcher(appConfig, device, nullptr, workers);
+            dispatcher.SetVerbose(false);
+            dispatcher.Run();
+
+            Benchmark::DoNotOptimize(device.Sent());
+        });
+    }
+}
+
+static void RegisterEngineBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("Engine"))
+        return;
+
+    std::vector<std::string> names = { "Engine/run to completion", "Engine/dispatcher/1 workers", "Engine/staged/1 workers" };
+    if (std::thread::hardware_concurrency() >= 4)
+        names.insert(names.end(), { "Engine/dispatcher/2 workers", "Engine/staged/2 workers" });
+
+    if (benchmark.Listed(names))
+        return;
+
+    // The dispatcher workload behind a device that costs 1 us per call, so that receiving and sending take about
+    // as long as classifying and the staged pipeline has something to overlap
+    std::vector<std::string> domains = TrafficGenerator::SyntheticDomains(10000);
+
+    ApplicationConfig appConfig;
+    appConfig.Load(DomainsYaml(domains, 4));
+
+    TrafficGenerator::Options options;
+    options.domains = domains;
+
+    TrafficGenerator generator(options);
+
+    std::vector<WinDivertPacket> packets(65536);
+    for (WinDivertPacket& packet : packets)
+        generator.Next(packet);
+
+    SyscallDevice device(packets, std::chrono::microseconds(1));
+
+    auto report = [&](const std::string& name) {
+        if (device.Latency(0.5) == 0)
+            return;
+
+        fprintf(stderr, "%-64s %10.1f us p50 %10.1f us p99 %10.1f us p999\n", name.c_str(),
+            device.Latency(0.5) / 1000.0, device.Latency(0.99) / 1000.0, device.Latency(0.999) / 1000.0);
+    };
+
+    PacketProcessor processor(appConfig, device);
+    processor.SetVerbose(false);
+
+    benchmark.Run("Engine/run to completion", [&](size_t iterations) {
+        device.Reset(iterations);
+
+        WinDivertPacket packet;
+        while (device.Recv(packet))
+            processor.Process(packet);
+    });
+
+    report("Engine/run to completion");
+
+    // Receive, classify and send on three threads need at least that many cores to show a difference
+    for (size_t workers : { 1, 2 })
+    {
+        if (workers > 1 && workers + 2 > std::thread::hardware_concurrency())
+            break;
+
+        for (bool staged : { false, true })
+        {
+            std::string name = std::string("Engine/") + (staged ? "staged/" : "dispatcher/") + std::to_string(workers) + " workers";
+
+            benchmark.Run(name, [&](size_t iterations) {
+                device.Reset(iterations);
+
+                FlowDispatcher dispatcher(appConfig, device, nullptr, workers, staged);
+                dispatcher.SetVerbose(false);
+                dispatcher.Run();
+            });
+
+            report(name);
+        }
+    }
+}
+
+static void RegisterAsyncReceiverBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("AsyncReceiver"))
+        return;
+
+    if (benchmark.Listed({ "AsyncReceiver/Recv+Process/1 requests, 1 packets",
+        "AsyncReceiver/Recv+Process/1 requests, 16 packets", "AsyncReceiver/Recv+Process/4 requests, 1 packets",
+        "AsyncReceiver/Recv+Process/4 requests, 16 packets", "AsyncReceiver/latency/steady 20 us/block",
+        "AsyncReceiver/latency/steady 20 us/spin 100 us", "AsyncReceiver/latency/bursts of 16/block",
+        "AsyncReceiver/latency/bursts of 16/spin 100 us", "AsyncReceiver/latency/sparse 500 us/block",
+        "AsyncReceiver/latency/sparse 500 us/spin 100 us" }))
+        return;
+
+    // Every receive takes 20 us in the driver, one at a time that is what each packet waits for. With several
+    // batched receives in flight the waits overlap with each other and with processing.
+    std::vector<std::string> domains = TrafficGenerator::SyntheticDomains(10000);
+
+    ApplicationConfig appConfig;
+    appConfig.Load(DomainsYaml(domains, 4));
+
+    TrafficGenerator::Options options;
+    options.domains = domains;
+
+    TrafficGenerator generator(options);
+
+    std::vector<WinDivertPacket> packets(65536);
+    for (WinDivertPacket& packet : packets)
+        generator.Next(packet);
+
+    SimulatedCompletionSource source(packets, std::chrono::microseconds(20));
+    NullDevice device;
+
+    PacketProcessor processor(appConfig, device);
+    processor.SetVerbose(false);
+
+    for (size_t requests : { 1, 4 })
+    {
+        for (size_t batch : { 1, 16 })
+        {
+            std::string name = "AsyncReceiver/Recv+Process/" + std::to_string(requests) + " requests, " + std::to_string(batch) + " packets";
+
+            benchmark.Run(name, [&](size_t iterations) {
+                source.Reset(iterations);
+
+                AsyncReceiver receiver(source, device, requests, batch);
+
+                WinDivertPacket packet;
+                while (receiver.Recv(packet))
+                    processor.Process(packet);
+            });
+        }
+    }
+
+    // Scripted arrivals on a source that takes 30 us to wake a blocked thread. Spinning should catch the short
+    // gaps and give up on the long ones, a zero budget blocks for every packet.
+    struct Pattern
+    {
+        const char* name;
+        std::vector<std::chrono::nanoseconds> gaps;
+    };
+
+    std::vector<Pattern> patterns(3);
+
+    patterns[0].name = "steady 20 us";
+    patterns[0].gaps.push_back(std::chrono::microseconds(20));
+
+    patterns[1].name = "bursts of 16";
+    patterns[1].gaps.assign(15, std::chrono::microseconds(5));
+    patterns[1].gaps.push_back(std::chrono::milliseconds(1));
+
+    patterns[2].name = "sparse 500 us";
+    patterns[2].gaps.push_back(std::chrono::microseconds(500));
+
+    SimulatedCompletionSource arrivals(packets, std::chrono::nanoseconds(0));
+
+    for (const Pattern& pattern : patterns)
+    {
+        for (uint64_t maxBudget : { 0, 100 })
+        {
+            std::string name = std::string("AsyncReceiver/latency/") + pattern.name + (maxBudget ? "/spin 100 us" : "/block");
+
+            SpinPolicy policy(maxBudget);
+            arrivals.SetArrivals(pattern.gaps, std::chrono::microseconds(30));
+
+            benchmark.Run(name, [&](size_t iterations) {
+                arrivals.Reset(iterations);
+
+                AsyncReceiver receiver(arrivals, device, 1, 16);
+                receiver.SetSpinPolicy(&policy, 1000000000);
+
+                WinDivertPacket packet;
+                while (receiver.Recv(packet))
+                    processor.Process(packet);
+            });
+
+            const SpinPolicy::Metrics& metrics = policy.Stats();
+            uint64_t delays = metrics.caughtDelays + metrics.blockedDelays;
+
+            if (delays != 0)
+            {
+                fprintf(stderr, "%-64s %10.1f us delay %7.1f %% caught %10.1f us spinning per wait, budget %llu us\n", name.c_str(),
+                    static_cast<double>(metrics.caughtDelay + metrics.blockedDelay) / delays, 100.0 * metrics.caught / std::max<uint64_t>(metrics.waits, 1),
+                    static_cast<double>(metrics.spinTime) / delays, static_cast<unsigned long long>(policy.Budget()));
+            }
+        }
+    }
+}
+
+static void RegisterTrafficBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("Traffic"))
+        return;
+
+    if (benchmark.Listed({ "Traffic/TrafficGenerator/Next",
+        "Traffic/PacketProcessor/HandlePacket/zipf 100000 domains" }))
+        return;
+
+    std::vector<std::string> domains = TrafficGenerator::SyntheticDomains(100000);
+
+    TrafficGenerator::Options options;
+    options.domains = domains;
+
+    TrafficGenerator generator(options);
+
+    benchmark.Run("Traffic/TrafficGenerator/Next", [&](size_t iterations) {
+        WinDivertPacket packet;
+
+        for (size_t i = 0; i < iterations; i++)
+        {
+            generator.Next(packet);
+            Benchmark::DoNotOptimize(packet.Buffer().size());
+        }
+    });
+
+    // A quarter of the domains is configured, popular names hit the domain cache
+    ApplicationConfig appConfig;
+    appConfig.Load(DomainsYaml(domains, 4));
+
+    std::vector<WinDivertPacket> packets(65536);
+    for (WinDivertPacket& packet : packets)
+        generator.Next(packet);
+
+    NullDevice device;
+
+    PacketProcessor processor(appConfig, device);
+    processor.SetVerbose(false);
+
+    benchmark.Run("Traffic/PacketProcessor/HandlePacket/zipf 100000 domains", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; i++)
+            Benchmark::DoNotOptimize(processor.HandlePacket(packets[i % packets.size()]));
+    });
+}
+
+static void RegisterFeedbackBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("Feedback"))
+        return;
+
+    if (benchmark.Listed({ "Feedback/StrategyScoreboard/Select+Report/10000 domains",
+        "Feedback/PacketProcessor/Process/filtered server" }))
+        return;
+
+    std::vector<std::string> domains = TrafficGenerator::SyntheticDomains(10000);
+
+    StrategyScoreboard scoreboard;
+
+    benchmark.Run("Feedback/StrategyScoreboard/Select+Report/10000 domains", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; i++)
+        {
+            const std::string& domain = domains[i % domains.size()];
+
+            StrategyScoreboard::Strategy strategy = scoreboard.Select(StrategyScoreboard::Protocol::Tls, domain, StrategyScoreboard::Strategy(2, true));
+            scoreboard.Report(StrategyScoreboard::Protocol::Tls, domain, strategy, strategy.offset == 1, 20000 + strategy.offset * 1000);
+        }
+    });
+
+    // The configured strategy (offset 2 out of order) is always reset, the scoreboard has to find offset 1 out of order
+    ApplicationConfig appConfig;
+    appConfig.Load(std::string("global:\n  tlsFragmentation:\n    enabled: true\n    offset: 2\n    outOfOrder: true\n"
+        "domains:\n  - example.com\n"));
+
+    StrategyScoreboard filteredScoreboard;
+    FilteredServerDevice device(TestPackets::ClientHello("www.example.com", 8));
+
+    PacketProcessor processor(appConfig, device);
+    processor.SetVerbose(false);
+    processor.EnableFeedback(filteredScoreboard, 1000000);
+
+    uint64_t connections = 0;
+    uint64_t completed = 0;
+
+    benchmark.Run("Feedback/PacketProcessor/Process/filtered server", [&](size_t iterations) {
+        device.Reset(iterations);
+
+        WinDivertPacket packet;
+        while (device.Recv(packet))
+            processor.Process(packet);
+
+        connections += iterations;
+        completed += device.Completed();
+    });
+
+    StrategyScoreboard::Strategy best;
+    if (connections != 0 && filteredScoreboard.Best(StrategyScoreboard::Protocol::Tls, "www.example.com", best))
+    {
+        fprintf(stderr, "%-64s %14.1f %% completed, offset %zu%s\n", "Feedback/PacketProcessor/Process/filtered server",
+            100.0 * completed / connections, best.offset, best.outOfOrder ? " out of order" : "");
+    }
+}
+
+static void RegisterRetransmissionBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("Retransmission"))
+        return;
+
+    if (benchmark.Listed({ "Retransmission/HandlePacket/uncached", "Retransmission/HandlePacket/cached" }))
+        return;
+
+    // Every ClientHello and HTTP request of the generated traffic is fragmented once, then all of them are sent
+    // again as if the fragments had been lost. Without the cache each copy is parsed and matched like the first.
+    // About as many flows as fit the default table, those that collide in a full set take the slow path again.
+    ApplicationConfig appConfig;
+    appConfig.Load(std::string("global:\n  tlsFragmentation:\n    enabled: true\n    offset: 2\n"
+        "  httpFragmentation:\n    enabled: true\n    offset: 2\ndomains:\n  - '*.com'\n"));
+
+    TrafficGenerator generator((TrafficGenerator::Options()));
+
+    std::vector<WinDivertPacket> packets(8192);
+    for (WinDivertPacket& packet : packets)
+        generator.Next(packet);
+
+    HashingDevice uncachedDevice;
+    HashingDevice cachedDevice;
+
+    PacketProcessor uncached(appConfig, uncachedDevice);
+    uncached.SetVerbose(false);
+
+    PacketProcessor cached(appConfig, cachedDevice);
+    cached.SetVerbose(false);
+    cached.EnableRetransmissionCache(1000000);
+
+    for (WinDivertPacket& packet : packets)
+    {
+        uncached.HandlePacket(packet);
+        cached.HandlePacket(packet);
+    }
+
+    // One pass of retransmissions must come out of the cache exactly as it was split the first time
+    uint64_t recorded = cached.Retransmissions()->Recorded();
+
+    for (WinDivertPacket& packet : packets)
+    {
+        uncached.HandlePacket(packet);
+        cached.HandlePacket(packet);
+    }
+
+    const RetransmissionCache* retransmissions = cached.Retransmissions();
+
+    if (retransmissions->Retransmissions() == 0 || cachedDevice.Hash() != uncachedDevice.Hash() ||
+        cachedDevice.Sent() != uncachedDevice.Sent())
+    {
+        fprintf(stderr, "[-] Retransmission/HandlePacket: %llu of %llu segments split again from the cache, %s output\n",
+            static_cast<unsigned long long>(retransmissions->Retransmissions()), static_cast<unsigned long long>(recorded),
+            cachedDevice.Hash() == uncachedDevice.Hash() ? "same" : "different");
+        return;
+    }
+
+    // Timed without hashing what is sent
+    NullDevice device;
+
+    for (bool cache : { false, true })
+    {
+        PacketProcessor processor(appConfig, device);
+        processor.SetVerbose(false);
+
+        if (cache)
+            processor.EnableRetransmissionCache(1000000);
+
+        for (WinDivertPacket& packet : packets)
+            processor.HandlePacket(packet);
+
+        benchmark.Run(std::string("Retransmission/HandlePacket/") + (cache ? "cached" : "uncached"), [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++)
+                Benchmark::DoNotOptimize(processor.HandlePacket(packets[i % packets.size()]));
+        });
+    }
+
+    fprintf(stderr, "%-64s %14.1f %% of packets split again from the cache\n", "Retransmission/HandlePacket/cached",
+        100.0 * retransmissions->Retransmissions() / packets.size());
+}
+
+void RegisterPacketBenchmarks(Benchmark& benchmark)
+{
+    RegisterFragmentationBenchmarks(benchmark);
+    RegisterProcessorBenchmarks(benchmark);
+    RegisterFingerprintBenchmarks(benchmark);
+    RegisterBatchBenchmarks(benchmark);
+    RegisterSpscRingBenchmarks(benchmark);
+    RegisterDispatcherBenchmarks(benchmark);
+    RegisterEngineBenchmarks(benchmark);
+    RegisterAsyncReceiverBenchmarks(benchmark);
+    RegisterTrafficBenchmarks(benchmark);
+    RegisterFeedbackBenchmarks(benchmark);
+    RegisterRetransmissionBenchmarks(benchmark);
+}
@@ -0,0 +1,296 @@
+#include "StdAfx.h"
+#include "Benchmark.h"
+#include "TestPackets.h"
+#include "TrafficGenerator.h"
+#include "BufferReader.h"
+#include "HttpRequestParser.h"
+#include "PacketDissector.h"
+#include "PacketProcessor.h"
+
+#include <random>
+
+static void RegisterBufferReaderBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("BufferReader"))
+        return;
+
+    if (benchmark.Listed({ "BufferReader/UInt8/4096", "BufferReader/UInt16/4096", "BufferReader/UInt32/4096" }))
+        return;
+
+    std::vector<uint8_t> buffer(4096);
+    for (size_t i = 0; i < buffer.size(); i++)
+        buffer[i] = static_cast<uint8_t>(i * 31);
+
+    benchmark.Run("BufferReader/UInt8/4096", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; i++)
+        {
+            BufferReader reader(buffer.data(), buffer.size());
+            uint64_t sum = 0;
+
+            for (size_t j = 0; j < buffer.size(); j++)
+                sum += reader.UInt8();
+
+            Benchmark::DoNotOptimize(sum);
+        }
+    }, buffer.size());
+
+    benchmark.Run("BufferReader/UInt16/4096", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; i++)
+        {
+            BufferReader reader(buffer.data(), buffer.size());
+            uint64_t sum = 0;
+
+            for (size_t j = 0; j < buffer.size() / 2; j++)
+                sum += reader.UInt16();
+
+            Benchmark::DoNotOptimize(sum);
+        }
+    }, buffer.size());
+
+    benchmark.Run("BufferReader/UInt32/4096", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; i++)
+        {
+            BufferReader reader(buffer.data(), buffer.size());
+            uint64_t sum = 0;
+
+            for (size_t j = 0; j < buffer.size() / 4; j++)
+                sum += reader.UInt32();
+
+            Benchmark::DoNotOptimize(sum);
+        }
+    }, buffer.size());
+}
+
+static void RegisterHttpBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("HttpRequestParser"))
+        return;
+
+    if (benchmark.Listed({ "HttpRequestParser/Parse+GetHeader/4 headers/Host first",
+        "HttpRequestParser/Parse+GetHeader/4 headers/Host last",
+        "HttpRequestParser/Parse+GetHeader/16 headers/Host first",
+        "HttpRequestParser/Parse+GetHeader/16 headers/Host last" }))
+        return;
+
+    for (size_t headerCount : { 4, 16 })
+    {
+        for (bool hostLast : { false, true })
+        {
+            std::vector<uint8_t> request = TestPackets::HttpRequest("www.example.com", headerCount, hostLast ? headerCount - 1 : 0);
+
+            std::string name = "HttpRequestParser/Parse+GetHeader/" + std::to_string(headerCount) + " headers/Host " + (hostLast ? "last" : "first");
+
+            benchmark.Run(name, [&](size_t iterations) {
+                for (size_t i = 0; i < iterations; i++)
+                {
+                    HttpRequestParser parser;
+                    HttpRequestParser::Result result = parser.Parse(request.data(), static_cast<uint32_t>(request.size()));
+
+                    const std::array<int, 4>* header = parser.GetHeader("Host");
+
+                    Benchmark::DoNotOptimize(static_cast<uint64_t>(result) + (header ? (*header)[3] : 0));
+                }
+            }, request.size());
+        }
+    }
+}
+
+// IPv6 packet with an extension header of nextHeader inserted in front of its TCP header
+static std::vector<uint8_t> InsertExtensionHeader(const std::vector<uint8_t>& packet, uint8_t nextHeader, uint16_t fragmentField)
+{
+    std::vector<uint8_t> extended(packet.begin(), packet.begin() + 40);
+
+    // Next Header, Length in 8 bytes beyond the first 8 (Hop-by-Hop) or Reserved, Fragment Offset/M, Identification
+    uint8_t header[8] = { packet[6], 0, static_cast<uint8_t>(fragmentField >> 8), static_cast<uint8_t>(fragmentField), 0, 0, 0, 1 };
+    extended.insert(extended.end(), header, header + sizeof(header));
+    extended.insert(extended.end(), packet.begin() + 40, packet.end());
+
+    size_t payloadLength = extended.size() - 40;
+    extended[4] = static_cast<uint8_t>(payloadLength >> 8);
+    extended[5] = static_cast<uint8_t>(payloadLength);
+    extended[6] = nextHeader;
+
+    return extended;
+}
+
+// The repository has no test suite, the dissector is checked here over generated traffic, packets cut at every
+// length of their headers and packets with random header bytes changed. Its layers have to stay within the packet,
+// and on Windows they have to be the ones WinDivertHelperParsePacket finds.
+static void CheckDissector()
+{
+    std::vector<std::vector<uint8_t>> packets;
+
+    TrafficGenerator::Options options;
+    options.domains = TrafficGenerator::SyntheticDomains(1000);
+    options.ipv6Ratio = 0.5;
+
+    TrafficGenerator generator(options);
+    WinDivertPacket packet(65536);
+
+    for (size_t i = 0; i < 4096; i++)
+    {
+        generator.Next(packet);
+        packets.emplace_back(packet.Buffer().begin(), packet.Buffer().end());
+    }
+
+    // Layouts the generator does not produce: IPv4 fragments, IPv6 extension and fragment headers
+    for (size_t i = 0; i < 64; i++)
+    {
+        const std::vector<uint8_t>& generated = packets[i];
+
+        if (generated[0] >> 4 == 4)
+        {
+            std::vector<uint8_t> fragment = generated;
+
+            // More Fragments on the first, an offset on a later one
+            fragment[6] = 0x20;
+            packets.push_back(fragment);
+
+            fragment[6] = 0x00;
+            fragment[7] = 0x10;
+            packets.push_back(fragment);
+        }
+        else
+        {
+            packets.push_back(InsertExtensionHeader(generated, 0, 0));
+            packets.push_back(InsertExtensionHeader(generated, 60, 0));
+            packets.push_back(InsertExtensionHeader(generated, 44, 0x0001));
+            packets.push_back(InsertExtensionHeader(generated, 44, 0x0010));
+        }
+    }
+
+    size_t wellFormed = packets.size();
+
+    for (size_t i = 0; i < wellFormed; i += 16)
+    {
+        for (size_t length = 0; length < std::min<size_t>(packets[i].size(), 128); length++)
+            packets.emplace_back(packets[i].begin(), packets[i].begin() + length);
+    }
+
+    std::mt19937 random(1);
+
+    for (size_t i = 0; i < 65536; i++)
+    {
+        std::vector<uint8_t> corrupted = packets[random() % wellFormed];
+
+        for (size_t changes = 1 + random() % 4; changes != 0; changes--)
+            corrupted[random() % std::min<size_t>(corrupted.size(), 80)] = static_cast<uint8_t>(random());
+
+        packets.push_back(std::move(corrupted));
+    }
+
+    size_t outside = 0;
+    size_t disagreements = 0;
+
+    for (std::vector<uint8_t>& buffer : packets)
+    {
+        const uint8_t* begin = buffer.data();
+        const uint8_t* end = begin + buffer.size();
+
+        PacketDissector::Layers layers;
+        PacketDissector::Dissect(begin, buffer.size(), layers);
+
+        if ((layers.tcp && (layers.tcp < begin || layers.tcp + 20 > end)) ||
+            (layers.data && (layers.data < begin || layers.data + layers.dataLength > end)))
+        {
+            outside++;
+        }
+
+#ifdef _WIN32
+        PWINDIVERT_IPHDR ipv4 = nullptr;
+        PWINDIVERT_IPV6HDR ipv6 = nullptr;
+        PWINDIVERT_TCPHDR tcp = nullptr;
+        uint8_t* data = nullptr;
+        uint32_t dataLength = 0;
+
+        WinDivertHelperParsePacket(buffer.data(), static_cast<uint32_t>(buffer.size()),
+            &ipv4, &ipv6, nullptr, nullptr, nullptr, &tcp, nullptr,
+            reinterpret_cast<void**>(&data), &dataLength,
+            nullptr, nullptr);
+
+        // Like the debug build cross check, other protocols are left in the payload on purpose
+        if ((layers.tcp || tcp) &&
+            (reinterpret_cast<const uint8_t*>(ipv4) != layers.ipv4 || reinterpret_cast<const uint8_t*>(ipv6) != layers.ipv6 ||
+            reinterpret_cast<const uint8_t*>(tcp) != layers.tcp || data != layers.data || dataLength != layers.dataLength))
+        {
+            disagreements++;
+        }
+#endif
+    }
+
+    if (outside != 0)
+        fprintf(stderr, "[-] PacketDissector: layers outside the packet in %zu of %zu packets\n", outside, packets.size());
+
+    if (disagreements != 0)
+        fprintf(stderr, "[-] PacketDissector: disagrees with WinDivert on %zu of %zu packets\n", disagreements, packets.size());
+}
+
+static void RegisterDissectorBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("PacketDissector"))
+        return;
+
+    if (benchmark.Listed({ "PacketDissector/Dissect/IPv4", "PacketDissector/Dissect/IPv6" }))
+        return;
+
+    CheckDissector();
+
+    std::vector<uint8_t> hello = TestPackets::ClientHello("www.example.com");
+
+    for (bool ipv6 : { false, true })
+    {
+        WinDivertPacket packet = TestPackets::TcpPacket(ipv6, 50000, 443, hello);
+
+        benchmark.Run(std::string("PacketDissector/Dissect/") + (ipv6 ? "IPv6" : "IPv4"), [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++)
+            {
+                packet.Dissect();
+                Benchmark::DoNotOptimize(packet.DataLength());
+            }
+        });
+    }
+}
+
+static void RegisterTlsBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("ClientHello"))
+        return;
+
+    if (benchmark.Listed({ "ClientHello/HandlePacket/8 extensions/SNI first",
+        "ClientHello/HandlePacket/8 extensions/SNI last", "ClientHello/HandlePacket/32 extensions/SNI first",
+        "ClientHello/HandlePacket/32 extensions/SNI last" }))
+        return;
+
+    // No domains and no networks, so the walk ends in an unmatched lookup and nothing is sent
+    ApplicationConfig appConfig;
+    appConfig.Load(std::string("global:\n  includeSubdomains: false\n"));
+
+    NullDevice device;
+
+    for (size_t extensions : { 8, 32 })
+    {
+        for (bool serverNameLast : { false, true })
+        {
+            WinDivertPacket packet = TestPackets::TcpPacket(false, 50000, 443,
+                TestPackets::ClientHello("www.example.com", extensions, serverNameLast));
+
+            PacketProcessor processor(appConfig, device);
+            processor.SetVerbose(false);
+
+            std::string name = "ClientHello/HandlePacket/" + std::to_string(extensions) + " extensions/SNI " + (serverNameLast ? "last" : "first");
+
+            benchmark.Run(name, [&](size_t iterations) {
+                for (size_t i = 0; i < iterations; i++)
+                    Benchmark::DoNotOptimize(processor.HandlePacket(packet));
+            }, packet.DataLength());
+        }
+    }
+}
+
+void RegisterParserBenchmarks(Benchmark& benchmark)
+{
+    RegisterBufferReaderBenchmarks(benchmark);
+    RegisterHttpBenchmarks(benchmark);
+    RegisterDissectorBenchmarks(benchmark);
+    RegisterTlsBenchmarks(benchmark);
+}
@@ -0,0 +1,179 @@
+#include "StdAfx.h"
+#include "Benchmark.h"
+#include "QueueController.h"
+
+#include <deque>
+
+// The WinDivert packet queue: packets are dropped on arrival when the length or size limit is reached,
+// and on receive when they waited longer than the queue time
+class SimulatedQueue
+{
+public:
+    explicit SimulatedQueue(const QueueController::Parameters& parameters)
+        : m_parameters(parameters), m_size(0), m_droppedFull(0), m_droppedExpired(0)
+    {
+    }
+
+    void SetParameters(const QueueController::Parameters& parameters)
+    {
+        m_parameters = parameters;
+    }
+
+    bool Empty() const
+    {
+        return m_packets.empty();
+    }
+
+    uint64_t FrontTime() const
+    {
+        return m_packets.front().first;
+    }
+
+    void Push(uint64_t time, size_t length)
+    {
+        if (m_packets.size() >= m_parameters.length || m_size + length > m_parameters.size)
+        {
+            m_droppedFull++;
+            return;
+        }
+
+        m_packets.push_back(std::make_pair(time, length));
+        m_size += length;
+    }
+
+    bool Pop(uint64_t time, uint64_t& enqueued, size_t& length)
+    {
+        while (!m_packets.empty() && time - m_packets.front().first > m_parameters.time * 1000)
+        {
+            m_size -= m_packets.front().second;
+            m_packets.pop_front();
+            m_droppedExpired++;
+        }
+
+        if (m_packets.empty())
+            return false;
+
+        enqueued = m_packets.front().first;
+        length = m_packets.front().second;
+
+        m_size -= length;
+        m_packets.pop_front();
+
+        return true;
+    }
+
+    uint64_t Dropped() const
+    {
+        return m_droppedFull + m_droppedExpired;
+    }
+private:
+    QueueController::Parameters m_parameters;
+
+    std::deque<std::pair<uint64_t, size_t>> m_packets;
+    uint64_t m_size;
+
+    uint64_t m_droppedFull;
+    uint64_t m_droppedExpired;
+};
+
+// Ten seconds of 20000 packets per second with a 20 ms burst at 500000 packets per second every second,
+// received by a thread that needs 8 us per packet. Returns the dropped packets.
+static uint64_t SimulateBursts(QueueController& controller)
+{
+    static const uint64_t DURATION = 10000000;
+    static const uint64_t BURST_INTERVAL = 1000000;
+    static const uint64_t BURST_DURATION = 20000;
+    static const uint64_t SERVICE_TIME = 8;
+    static const size_t PACKET_LENGTH = 1000;
+
+    SimulatedQueue queue(controller.Current());
+
+    uint64_t readerFree = 0;
+    uint64_t arrival = 0;
+
+    while (arrival < DURATION)
+    {
+        // Receive everything the reader gets to before the next arrival
+        while (!queue.Empty())
+        {
+            uint64_t start = std::max(readerFree, queue.FrontTime());
+            if (start > arrival)
+                break;
+
+            uint64_t enqueued = 0;
+            size_t length = 0;
+
+            if (!queue.Pop(start, enqueued, length))
+                break;
+
+            if (controller.Observe(enqueued, start, length))
+                queue.SetParameters(controller.Current());
+
+            readerFree = start + SERVICE_TIME;
+        }
+
+        queue.Push(arrival, PACKET_LENGTH);
+
+        arrival += arrival % BURST_INTERVAL < BURST_DURATION ? 2 : 50;
+    }
+
+    return queue.Dropped();
+}
+
+static void RegisterControllerBenchmarks(Benchmark& benchmark)
+{
+    if (!benchmark.Enabled("QueueController"))
+        return;
+
+    if (benchmark.Listed({ "QueueController/Observe", "QueueController/Simulated bursts/fixed",
+        "QueueController/Simulated bursts/adaptive" }))
+        return;
+
+    QueueController controller;
+    controller.Configure(QueueController::Parameters(), true);
+
+    // A steady stream with a backlog of a few packets
+    uint64_t time = 0;
+
+    benchmark.Run("QueueController/Observe", [&](size_t iterations) {
+        bool changed = false;
+
+        for (size_t i = 0; i < iterations; i++)
+        {
+            time += 10;
+            changed |= controller.Observe(time - 35, time, 1000);
+        }
+
+        Benchmark::DoNotOptimize(changed);
+    });
+
+    for (bool adaptive : { false, true })
+    {
+        std::string name = std::string("QueueController/Simulated bursts/") + (adaptive ? "adaptive" : "fixed");
+
+        QueueController simulated;
+        uint64_t dropped = 0;
+
+        benchmark.Run(name, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++)
+            {
+                simulated.Configure(QueueController::Parameters(), adaptive);
+                dropped = SimulateBursts(simulated);
+            }
+        });
+
+        const QueueController::Metrics& metrics = simulated.Stats();
+
+        if (metrics.packets != 0)
+        {
+            fprintf(stderr, "%-64s %14llu dropped, p99 wait %llu us, queue length %llu\n", name.c_str(),
+                static_cast<unsigned long long>(dropped), static_cast<unsigned long long>(simulated.WaitPercentile(0.99)),
+                static_cast<unsigned long long>(simulated.Current().length));
+        }
+    }
+}
+
+void RegisterQueueBenchmarks(Benchmark& benchmark)
+{
+    RegisterControllerBenchmarks(benchmark);
+}
@@ -0,0 +1,374 @@
+#include "StdAfx.h"
+#include "Benchmark.h"
+#include "TrafficGenerator.h"
+#include "CaptureReader.h"
+#include "PacketProcessor.h"
+#include "Utils.h"
+
+// Generated when no capture is given, about 250 MB. Pass a multi-gigabyte file with --capture to measure
+// reading from the page cache or the disk rather than from a file that stays in the CPU caches' reach.
+static const uint64_t GENERATED_PACKETS = 1000000;
+
+// Wildcard patterns that match none of the generated names, so that every domain cache miss tries all of them
+// the way a large configuration would, and the load shedding budget in microseconds
+static const size_t OVERLOAD_PATTERNS = 200;
+static const uint64_t OVERLOAD_BUDGET = 1000;
+
+// Replays a capture at a fixed packet rate. Every packet is stamped with its scheduled arrival in steady clock
+// nanoseconds whether or not the processor keeps up, as if it had waited in a queue since then, and Send records
+// how long after its arrival each packet left.
+class PacedCaptureDevice : public PacketDevice
+{
+public:
+    explicit PacedCaptureDevice(CaptureReader& reader)
+        : m_reader(reader), m_count(0), m_interval(0), m_received(0), m_start(0)
+    {
+    }
+
+    void Reset(uint64_t count, std::chrono::nanoseconds interval)
+    {
+        m_count = count;
+        m_interval = interval.count();
+        m_received = 0;
+        m_start = Now();
+        m_latencies.clear();
+    }
+
+    bool Recv(WinDivertPacket& packet) override
+    {
+        CaptureReader::PacketView view;
+
+        if (m_received >= m_count)
+            return false;
+
+        if (!m_reader.Next(view))
+        {
+            m_reader.Rewind();
+
+            if (!m_reader.Next(view))
+                return false;
+        }
+
+        int64_t arrival = m_start + static_cast<int64_t>(m_received++) * m_interval;
+
+        // A processor that is ahead idles until the packet arrives
+        while (Now() < arrival)
+        {
+        }
+
+        packet.Buffer().assign(view.data, view.data + view.length);
+        packet.Address() = view.address;
+        packet.Address().Timestamp = arrival;
+
+        return true;
+    }
+
+    bool Send(const WinDivertPacket& packet) override
+    {
+        m_latencies.push_back(Now() - packet.Address().Timestamp);
+        return true;
+    }
+
+    // Nanoseconds of the given quantile of all packets sent since the last reset
+    int64_t Latency(double quantile)
+    {
+        if (m_latencies.empty())
+            return 0;
+
+        size_t index = std::min(static_cast<size_t>(quantile * m_latencies.size()), m_latencies.size() - 1);
+        std::nth_element(m_latencies.begin(), m_latencies.begin() + index, m_latencies.end());
+
+        return m_latencies[index];
+    }
+
+    static int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+private:
+    CaptureReader& m_reader;
+    uint64_t m_count;
+    int64_t m_interval;
+    uint64_t m_received;
+    int64_t m_start;
+
+    std::vector<int64_t> m_latencies;
+};
+
+static std::string TemporaryPath(const char* fileName)
+{
+#ifdef _WIN32
+    char directory[MAX_PATH + 1] = {};
+
+    if (GetTempPathA(sizeof(directory), directory) == 0)
+        return fileName;
+
+    return std::string(directory) + fileName;
+#else
+    const char* directory = getenv("TMPDIR");
+
+    return std::string(directory != nullptr && *directory != '\0' ? directory : "/tmp") + "/" + fileName;
+#endif
+}
+
+// Rewrites a capture as pcapng with a single raw IP interface and the direction in the packet flags,
+// the way PacketCapture writes its files
+static bool WritePcapng(CaptureReader& reader, const std::string& filePath)
+{
+    FILE* file = fopen(filePath.c_str(), "wb");
+    if (!file)
+        return false;
+
+    std::vector<uint8_t> buffer;
+
+    auto appendUInt32 = [&buffer](uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            buffer.push_back(static_cast<uint8_t>(value >> (i * 8)));
+    };
+
+    // Section Header Block: Byte-Order Magic, Version 1.0, Section Length unspecified
+    appendUInt32(0x0a0d0d0a);
+    appendUInt32(28);
+    appendUInt32(0x1a2b3c4d);
+    appendUInt32(1);
+    appendUInt32(0xffffffff);
+    appendUInt32(0xffffffff);
+    appendUInt32(28);
+
+    // Interface Description Block: LINKTYPE_RAW, no snapshot length, microsecond timestamps
+    appendUInt32(0x00000001);
+    appendUInt32(20);
+    appendUInt32(101);
+    appendUInt32(0);
+    appendUInt32(20);
+
+    bool written = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+
+    CaptureReader::PacketView view;
+
+    while (written && reader.Next(view))
+    {
+        uint32_t padded = (view.length + 3) & ~3u;
+        uint32_t totalLength = 44 + padded;
+        uint64_t timestamp = static_cast<uint64_t>(view.address.Timestamp);
+
+        // Enhanced Packet Block with epb_flags and opt_endofopt
+        buffer.clear();
+        appendUInt32(0x00000006);
+        appendUInt32(totalLength);
+        appendUInt32(0);
+        appendUInt32(static_cast<uint32_t>(timestamp >> 32));
+        appendUInt32(static_cast<uint32_t>(timestamp));
+        appendUInt32(view.length);
+        appendUInt32(view.length);
+        buffer.insert(buffer.end(), view.data, view.data + view.length);
+        buffer.resize(buffer.size() + padded - view.length, 0);
+        appendUInt32(2 | 4 << 16);
+        appendUInt32(view.address.Outbound ? 2 : 1);
+        appendUInt32(0);
+        appendUInt32(totalLength);
+
+        written = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+    }
+
+    reader.Rewind();
+
+    return fclose(file) == 0 && written;
+}
+
+static void RegisterCaptureBenchmarks(Benchmark& benchmark, const std::string& name, const std::string& filePath)
+{
+    CaptureReader reader;
+
+    if (!reader.Open(Utils::Utf8ToWide(filePath)))
+    {
+        fprintf(stderr, "[-] Failed to open %s\n", filePath.c_str());
+        return;
+    }
+
+    // One pass to count packets and to get the file into the page cache
+    CaptureReader::PacketView view;
+
+    while (reader.Next(view))
+        ;
+
+    uint64_t packets = reader.Packets();
+
+    if (packets == 0 || reader.Malformed())
+    {
+        fprintf(stderr, "[-] No packets in %s%s\n", filePath.c_str(), reader.Malformed() ? " (malformed)" : "");
+        return;
+    }
+
+    fprintf(stderr, "%-64s %14llu packets, %llu MB, %llu skipped\n", ("Replay/" + name).c_str(),
+        static_cast<unsigned long long>(packets), static_cast<unsigned long long>(reader.FileSize() >> 20),
+        static_cast<unsigned long long>(reader.Skipped()));
+
+    reader.Rewind();
+
+    size_t bytesPerPacket = static_cast<size_t>(reader.FileSize() / packets);
+
+    // Views only, what a consumer of the descriptors pays before touching the payload
+    benchmark.Run("Replay/Next/" + name, [&](size_t iterations) {
+        uint64_t length = 0;
+
+        for (size_t i = 0; i < iterations; i++)
+        {
+            if (!reader.Next(view))
+            {
+                reader.Rewind();
+                reader.Next(view);
+            }
+
+            length += view.length;
+        }
+
+        Benchmark::DoNotOptimize(length);
+    }, bytesPerPacket);
+
+    // Copied into a WinDivertPacket and dissected, the same work as a receive from WinDivert
+    CaptureReplayDevice device(reader, 0);
+    WinDivertPacket packet(65536);
+
+    benchmark.Run("Replay/Recv/" + name, [&](size_t iterations) {
+        uint64_t length = 0;
+
+        for (size_t i = 0; i < iterations; i++)
+        {
+            device.Recv(packet);
+            length += packet.DataLength();
+        }
+
+        Benchmark::DoNotOptimize(length);
+    }, bytesPerPacket);
+}
+
+// The capture offered at one and a half times the rate at which it can be classified, without load shedding the
+// delay grows for as long as the run lasts
+static void RegisterOverloadBenchmarks(Benchmark& benchmark, const std::string& filePath)
+{
+    const char* actions[] = { "none", "pass", "cached" };
+    bool selected = false;
+
+    for (const char* action : actions)
+        selected = selected || benchmark.Matches(std::string("Replay/overload/") + action);
+
+    if (!selected)
+        return;
+
+    CaptureReader reader;
+
+    if (!reader.Open(Utils::Utf8ToWide(filePath)))
+        return;
+
+    std::string yaml = "domains:\n";
+
+    for (size_t i = 0; i < OVERLOAD_PATTERNS; i++)
+        yaml += "  - '*.pattern" + std::to_string(i) + ".invalid'\n";
+
+    ApplicationConfig appConfig;
+    appConfig.Load(yaml);
+
+    PacedCaptureDevice device(reader);
+    WinDivertPacket packet(65536);
+
+    // Processing time with a warm domain cache, the offered rate follows from it
+    PacketProcessor calibration(appConfig, device);
+    calibration.SetVerbose(false);
+
+    device.Reset(20000, std::chrono::nanoseconds(0));
+    while (device.Recv(packet))
+        calibration.Process(packet);
+
+    device.Reset(100000, std::chrono::nanoseconds(0));
+
+    int64_t started = PacedCaptureDevice::Now();
+    while (device.Recv(packet))
+        calibration.Process(packet);
+
+    std::chrono::nanoseconds interval((PacedCaptureDevice::Now() - started) / 100000 * 2 / 3);
+
+    fprintf(stderr, "%-64s %10.1f us per packet offered every %.1f us\n", "Replay/overload",
+        (PacedCaptureDevice::Now() - started) / 100000 / 1000.0, interval.count() / 1000.0);
+
+    for (const char* action : actions)
+    {
+        std::string name = std::string("Replay/overload/") + action;
+
+        // The latencies of another action would be reported
+        if (!benchmark.Matches(name))
+            continue;
+
+        PacketProcessor processor(appConfig, device);
+        processor.SetVerbose(false);
+
+        if (strcmp(action, "none") != 0)
+        {
+            processor.EnableOverloadControl(OVERLOAD_BUDGET, strcmp(action, "pass") == 0 ?
+                OverloadController::Action::Pass : OverloadController::Action::Cached, 1000000000);
+        }
+
+        benchmark.Run(name, [&](size_t iterations) {
+            device.Reset(iterations, interval);
+
+            while (device.Recv(packet))
+                processor.Process(packet);
+        });
+
+        const OverloadController* overload = processor.Overload();
+        uint64_t packets = overload ? overload->Stats().packets : 0;
+        uint64_t shed = overload ? overload->Stats().shed : 0;
+
+        fprintf(stderr, "%-64s %10.1f us p50 %10.1f us p99 %10.1f us max, %5.1f %% shed\n", name.c_str(),
+            device.Latency(0.5) / 1000.0, device.Latency(0.99) / 1000.0, device.Latency(1.0) / 1000.0,
+            100.0 * shed / std::max<uint64_t>(packets, 1));
+    }
+}
+
+void RegisterReplayBenchmarks(Benchmark& benchmark, const std::string& captureFile)
+{
+    if (!benchmark.Enabled("Replay"))
+        return;
+
+    if (benchmark.Listed({ "Replay/Next/pcap", "Replay/Recv/pcap", "Replay/Next/pcapng", "Replay/Recv/pcapng",
+        "Replay/overload/none", "Replay/overload/pass", "Replay/overload/cached" }))
+        return;
+
+    if (!captureFile.empty())
+    {
+        CaptureReader reader;
+        bool pcapng = reader.Open(Utils::Utf8ToWide(captureFile)) && reader.FileFormat() == CaptureReader::Format::Pcapng;
+
+        reader.Close();
+
+        RegisterCaptureBenchmarks(benchmark, pcapng ? "pcapng" : "pcap", captureFile);
+        RegisterOverloadBenchmarks(benchmark, captureFile);
+        return;
+    }
+
+    std::string pcapPath = TemporaryPath("DPIGuard.Benchmark.pcap");
+    std::string pcapngPath = TemporaryPath("DPIGuard.Benchmark.pcapng");
+
+    TrafficGenerator generator((TrafficGenerator::Options()));
+
+    if (!generator.WritePcap(pcapPath, GENERATED_PACKETS))
+    {
+        fprintf(stderr, "[-] Failed to write %s\n", pcapPath.c_str());
+        remove(pcapPath.c_str());
+        return;
+    }
+
+    CaptureReader reader;
+
+    if (!reader.Open(Utils::Utf8ToWide(pcapPath)) || !WritePcapng(reader, pcapngPath))
+        fprintf(stderr, "[-] Failed to write %s\n", pcapngPath.c_str());
+
+    reader.Close();
+
+    RegisterCaptureBenchmarks(benchmark, "pcap", pcapPath);
+    RegisterCaptureBenchmarks(benchmark, "pcapng", pcapngPath);
+    RegisterOverloadBenchmarks(benchmark, pcapPath);
+
+    remove(pcapPath.c_str());
+    remove(pcapngPath.c_str());
+}
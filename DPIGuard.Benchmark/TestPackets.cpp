@@ -0,0 +1,596 @@
+#include "StdAfx.h"
+#include "TestPackets.h"
+
+#include <random>
+
+static void AppendUInt16(std::vector<uint8_t>& buffer, uint16_t value)
+{
+    buffer.push_back(static_cast<uint8_t>(value >> 8));
+    buffer.push_back(static_cast<uint8_t>(value));
+}
+
+static void AppendUInt24(std::vector<uint8_t>& buffer, uint32_t value)
+{
+    buffer.push_back(static_cast<uint8_t>(value >> 16));
+    buffer.push_back(static_cast<uint8_t>(value >> 8));
+    buffer.push_back(static_cast<uint8_t>(value));
+}
+
+static void AppendUInt16List(std::vector<uint8_t>& buffer, std::initializer_list<uint16_t> values)
+{
+    for (uint16_t value : values)
+        AppendUInt16(buffer, value);
+}
+
+// Type, Length and Data of a single extension
+static std::vector<uint8_t> Extension(uint16_t type, const std::vector<uint8_t>& data)
+{
+    std::vector<uint8_t> extension;
+    extension.reserve(4 + data.size());
+
+    AppendUInt16(extension, type);
+    AppendUInt16(extension, static_cast<uint16_t>(data.size()));
+    extension.insert(extension.end(), data.begin(), data.end());
+
+    return extension;
+}
+
+// Prefixes data with its length in lengthSize bytes
+static std::vector<uint8_t> Vector(size_t lengthSize, const std::vector<uint8_t>& data)
+{
+    std::vector<uint8_t> result;
+
+    if (lengthSize == 1)
+        result.push_back(static_cast<uint8_t>(data.size()));
+    else
+        AppendUInt16(result, static_cast<uint16_t>(data.size()));
+
+    result.insert(result.end(), data.begin(), data.end());
+
+    return result;
+}
+
+size_t TestPackets::KeyShareLength(uint16_t group)
+{
+    switch (group)
+    {
+    case SECP256R1:
+        return 65;
+    case X25519:
+        return 32;
+    case X25519MLKEM768:
+        return 1216;
+    default:
+        return 32;
+    }
+}
+
+std::vector<uint8_t> TestPackets::ClientHello(const ClientHelloOptions& options)
+{
+    std::mt19937_64 random(options.random);
+
+    // GREASE values are 0x0a0a, 0x1a1a ... 0xfafa
+    uint16_t greaseValues[4];
+    for (uint16_t& value : greaseValues)
+        value = static_cast<uint16_t>(0x0a0a | ((random() % 16) << 12) | ((random() % 16) << 4));
+
+    const std::string& serverName = options.serverName;
+
+    // server_name, then the extensions whose order does not matter
+    std::vector<std::vector<uint8_t>> extensions;
+
+    // Server Name list length, Type: host_name (0), Length, Name
+    std::vector<uint8_t> serverNameData;
+    AppendUInt16(serverNameData, static_cast<uint16_t>(serverName.size() + 3));
+    serverNameData.push_back(0);
+    AppendUInt16(serverNameData, static_cast<uint16_t>(serverName.size()));
+    serverNameData.insert(serverNameData.end(), serverName.begin(), serverName.end());
+    extensions.push_back(Extension(0, serverNameData));
+
+    if (options.commonExtensions)
+    {
+        std::vector<uint8_t> data;
+
+        // extended_master_secret, renegotiation_info, ec_point_formats, session_ticket
+        extensions.push_back(Extension(23, {}));
+        extensions.push_back(Extension(0xff01, { 0 }));
+        extensions.push_back(Extension(11, { 1, 0 }));
+        extensions.push_back(Extension(35, {}));
+
+        // supported_groups
+        data.clear();
+        if (options.grease)
+            AppendUInt16(data, greaseValues[1]);
+        for (uint16_t group : options.keyShareGroups)
+        {
+            if (group == X25519MLKEM768)
+                AppendUInt16(data, group);
+        }
+        AppendUInt16List(data, { X25519, SECP256R1, 0x0018 });
+        extensions.push_back(Extension(10, Vector(2, data)));
+
+        // application_layer_protocol_negotiation: h2, http/1.1
+        data = { 2, 'h', '2', 8, 'h', 't', 't', 'p', '/', '1', '.', '1' };
+        extensions.push_back(Extension(16, Vector(2, data)));
+
+        // status_request: OCSP, no responder ids, no extensions
+        extensions.push_back(Extension(5, { 1, 0, 0, 0, 0 }));
+
+        // signature_algorithms
+        data.clear();
+        AppendUInt16List(data, { 0x0403, 0x0804, 0x0401, 0x0503, 0x0805, 0x0501, 0x0806, 0x0601 });
+        extensions.push_back(Extension(13, Vector(2, data)));
+
+        // signed_certificate_timestamp, psk_key_exchange_modes: psk_dhe_ke
+        extensions.push_back(Extension(18, {}));
+        extensions.push_back(Extension(45, { 1, 1 }));
+
+        // supported_versions: TLS 1.3, TLS 1.2
+        data.clear();
+        if (options.grease)
+            AppendUInt16(data, greaseValues[2]);
+        AppendUInt16List(data, { 0x0304, 0x0303 });
+        extensions.push_back(Extension(43, Vector(1, data)));
+
+        // compress_certificate: brotli, application_settings: h2
+        extensions.push_back(Extension(27, { 2, 0, 2 }));
+        extensions.push_back(Extension(0x44cd, { 0, 3, 2, 'h', '2' }));
+    }
+
+    if (!options.keyShareGroups.empty())
+    {
+        std::vector<uint8_t> shares;
+
+        if (options.grease)
+        {
+            AppendUInt16(shares, greaseValues[1]);
+            AppendUInt16(shares, 1);
+            shares.push_back(0);
+        }
+
+        for (uint16_t group : options.keyShareGroups)
+        {
+            size_t length = KeyShareLength(group);
+
+            AppendUInt16(shares, group);
+            AppendUInt16(shares, static_cast<uint16_t>(length));
+
+            uint64_t key = 0;
+            for (size_t i = 0; i < length; i++)
+            {
+                if (i % 8 == 0)
+                    key = random();
+
+                shares.push_back(static_cast<uint8_t>(key >> (i % 8 * 8)));
+            }
+        }
+
+        extensions.push_back(Extension(51, Vector(2, shares)));
+    }
+
+    for (size_t i = 0; i < options.fillerExtensions; i++)
+        extensions.push_back(Extension(static_cast<uint16_t>(0xff00 + i), std::vector<uint8_t>(4 + i % 8, static_cast<uint8_t>(i))));
+
+    if (options.shuffleExtensions)
+        std::shuffle(extensions.begin(), extensions.end(), random);
+
+    if (options.serverNameLast)
+    {
+        std::stable_partition(extensions.begin(), extensions.end(), [](const std::vector<uint8_t>& extension) {
+            return extension[0] != 0 || extension[1] != 0;
+        });
+    }
+
+    if (options.grease)
+    {
+        extensions.insert(extensions.begin(), Extension(greaseValues[0], {}));
+        extensions.push_back(Extension(greaseValues[3], { 0 }));
+    }
+
+    std::vector<uint8_t> hello;
+
+    // Version: TLS 1.2, Random, Session ID
+    AppendUInt16(hello, 0x0303);
+    for (size_t i = 0; i < 32; i++)
+        hello.push_back(static_cast<uint8_t>(random()));
+
+    hello.push_back(32);
+    for (size_t i = 0; i < 32; i++)
+        hello.push_back(static_cast<uint8_t>(random()));
+
+    // Cipher Suites, Compression Methods: null
+    std::vector<uint8_t> cipherSuites;
+
+    if (options.grease)
+        AppendUInt16(cipherSuites, greaseValues[0]);
+
+    if (options.commonExtensions)
+    {
+        AppendUInt16List(cipherSuites, { 0x1301, 0x1302, 0x1303, 0xc02b, 0xc02f, 0xc02c, 0xc030, 0xcca9,
+            0xcca8, 0xc013, 0xc014, 0x009c, 0x009d, 0x002f, 0x0035 });
+    }
+    else
+    {
+        for (uint16_t i = 0; i < 16; i++)
+            AppendUInt16(cipherSuites, static_cast<uint16_t>(0xc02b + i));
+    }
+
+    std::vector<uint8_t> cipherSuitesVector = Vector(2, cipherSuites);
+    hello.insert(hello.end(), cipherSuitesVector.begin(), cipherSuitesVector.end());
+
+    hello.push_back(1);
+    hello.push_back(0);
+
+    size_t extensionsLength = 0;
+    for (const std::vector<uint8_t>& extension : extensions)
+        extensionsLength += extension.size();
+
+    // Handshake header, Extensions Length and the padding extension header come on top
+    size_t handshakeLength = 4 + hello.size() + 2 + extensionsLength;
+    if (options.paddedLength != 0 && handshakeLength + 4 <= options.paddedLength)
+    {
+        extensions.push_back(Extension(21, std::vector<uint8_t>(options.paddedLength - handshakeLength - 4, 0)));
+        extensionsLength += extensions.back().size();
+    }
+
+    AppendUInt16(hello, static_cast<uint16_t>(extensionsLength));
+    for (const std::vector<uint8_t>& extension : extensions)
+        hello.insert(hello.end(), extension.begin(), extension.end());
+
+    std::vector<uint8_t> record;
+
+    // Content Type: Handshake (22), Version: TLS 1.0, Length
+    record.push_back(22);
+    AppendUInt16(record, 0x0301);
+    AppendUInt16(record, static_cast<uint16_t>(hello.size() + 4));
+
+    // Handshake Type: Client Hello (1), Length
+    record.push_back(1);
+    AppendUInt24(record, static_cast<uint32_t>(hello.size()));
+    record.insert(record.end(), hello.begin(), hello.end());
+
+    return record;
+}
+
+std::vector<uint8_t> TestPackets::ClientHello(const std::string& serverName, size_t fillerExtensions /*= 8*/, bool serverNameLast /*= false*/)
+{
+    ClientHelloOptions options;
+    options.serverName = serverName;
+    options.commonExtensions = false;
+    options.serverNameLast = serverNameLast;
+    options.fillerExtensions = fillerExtensions;
+
+    return ClientHello(options);
+}
+
+std::vector<uint8_t> TestPackets::HttpRequest(const std::string& host, size_t headerCount /*= 8*/, size_t hostIndex /*= 0*/, const std::string& path /*= "/index.html"*/)
+{
+    std::string request = "GET " + path + " HTTP/1.1\r\n";
+
+    headerCount = std::max<size_t>(headerCount, 1);
+    hostIndex = std::min(hostIndex, headerCount - 1);
+
+    for (size_t i = 0; i < headerCount; i++)
+    {
+        if (i == hostIndex)
+            request += "Host: " + host + "\r\n";
+        else
+            request += "X-Header-" + std::to_string(i) + ": value-" + std::to_string(i * 7919) + "\r\n";
+    }
+
+    request += "\r\n";
+
+    return std::vector<uint8_t>(request.begin(), request.end());
+}
+
+std::vector<uint8_t> TestPackets::ServerHello()
+{
+    std::vector<uint8_t> hello;
+
+    // Version: TLS 1.2, Random, Session ID, Cipher Suite: TLS_AES_128_GCM_SHA256, Compression Method: null
+    AppendUInt16(hello, 0x0303);
+    for (size_t i = 0; i < 32; i++)
+        hello.push_back(static_cast<uint8_t>(i * 37));
+
+    hello.push_back(32);
+    for (size_t i = 0; i < 32; i++)
+        hello.push_back(static_cast<uint8_t>(i));
+
+    AppendUInt16(hello, 0x1301);
+    hello.push_back(0);
+
+    // supported_versions: TLS 1.3, key_share: X25519
+    std::vector<uint8_t> keyShare;
+    AppendUInt16(keyShare, X25519);
+    keyShare.push_back(0);
+    keyShare.push_back(static_cast<uint8_t>(KeyShareLength(X25519)));
+    keyShare.resize(keyShare.size() + KeyShareLength(X25519), 0x5a);
+
+    std::vector<uint8_t> extensions = Extension(43, { 0x03, 0x04 });
+    std::vector<uint8_t> keyShareExtension = Extension(51, keyShare);
+    extensions.insert(extensions.end(), keyShareExtension.begin(), keyShareExtension.end());
+
+    std::vector<uint8_t> extensionsVector = Vector(2, extensions);
+    hello.insert(hello.end(), extensionsVector.begin(), extensionsVector.end());
+
+    std::vector<uint8_t> record;
+
+    // Content Type: Handshake (22), Version: TLS 1.2, Length
+    record.push_back(22);
+    AppendUInt16(record, 0x0303);
+    AppendUInt16(record, static_cast<uint16_t>(hello.size() + 4));
+
+    // Handshake Type: Server Hello (2), Length
+    record.push_back(2);
+    AppendUInt24(record, static_cast<uint32_t>(hello.size()));
+    record.insert(record.end(), hello.begin(), hello.end());
+
+    return record;
+}
+
+WinDivertPacket TestPackets::TcpPacket(const Flow& flow, const uint8_t* payload, size_t payloadLength)
+{
+    std::vector<uint8_t> buffer;
+    buffer.reserve(60 + payloadLength);
+
+    size_t tcpLength = 20 + payloadLength;
+
+    if (flow.ipv6)
+    {
+        // Version, Payload Length, Next Header: TCP, Hop Limit, Source Address, Destination Address
+        buffer.push_back(0x60);
+        buffer.resize(4, 0);
+        AppendUInt16(buffer, static_cast<uint16_t>(tcpLength));
+        buffer.push_back(6);
+        buffer.push_back(64);
+
+        buffer.insert(buffer.end(), flow.sourceAddress.begin(), flow.sourceAddress.end());
+        buffer.insert(buffer.end(), flow.destinationAddress.begin(), flow.destinationAddress.end());
+    }
+    else
+    {
+        // Version/IHL, Total Length, Flags: DF, TTL, Protocol: TCP, Source Address, Destination Address
+        buffer.push_back(0x45);
+        buffer.push_back(0);
+        AppendUInt16(buffer, static_cast<uint16_t>(20 + tcpLength));
+        AppendUInt16(buffer, 0x1234);
+        AppendUInt16(buffer, 0x4000);
+        buffer.push_back(64);
+        buffer.push_back(6);
+        AppendUInt16(buffer, 0);
+
+        buffer.insert(buffer.end(), flow.sourceAddress.begin(), flow.sourceAddress.begin() + 4);
+        buffer.insert(buffer.end(), flow.destinationAddress.begin(), flow.destinationAddress.begin() + 4);
+    }
+
+    // Ports, Sequence Number, Acknowledgment Number, Data Offset: 5, Flags: PSH ACK, Window, Checksum, Urgent Pointer
+    AppendUInt16(buffer, flow.sourcePort);
+    AppendUInt16(buffer, flow.destinationPort);
+    AppendUInt16(buffer, static_cast<uint16_t>(flow.sequenceNumber >> 16));
+    AppendUInt16(buffer, static_cast<uint16_t>(flow.sequenceNumber));
+    AppendUInt16(buffer, 0x2000);
+    AppendUInt16(buffer, 0x0001);
+    buffer.push_back(0x50);
+    buffer.push_back(0x18);
+    AppendUInt16(buffer, 0xffff);
+    AppendUInt16(buffer, 0);
+    AppendUInt16(buffer, 0);
+
+    buffer.insert(buffer.end(), payload, payload + payloadLength);
+
+    WinDivertPacket packet(std::max<size_t>(buffer.size(), 4096));
+    packet.Buffer().assign(buffer.begin(), buffer.end());
+    packet.Address().Outbound = 1;
+    packet.Dissect();
+
+    return packet;
+}
+
+WinDivertPacket TestPackets::TcpPacket(bool ipv6, uint16_t sourcePort, uint16_t destinationPort, const std::vector<uint8_t>& payload)
+{
+    // 192.0.2.1 -> 198.51.100.2 or 2001:db8::1 -> 2001:db8::2
+    Flow flow;
+    flow.ipv6 = ipv6;
+
+    if (ipv6)
+    {
+        flow.sourceAddress = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+        flow.destinationAddress = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2 };
+    }
+    else
+    {
+        flow.sourceAddress = { 192, 0, 2, 1 };
+        flow.destinationAddress = { 198, 51, 100, 2 };
+    }
+
+    flow.sourcePort = sourcePort;
+    flow.destinationPort = destinationPort;
+    flow.sequenceNumber = 0x10000001;
+
+    return TcpPacket(flow, payload.data(), payload.size());
+}
+
+WinDivertPacket TestPackets::ServerPacket(const Flow& flow, const std::vector<uint8_t>& payload, bool reset /*= false*/)
+{
+    Flow reverse;
+    reverse.ipv6 = flow.ipv6;
+    reverse.sourceAddress = flow.destinationAddress;
+    reverse.destinationAddress = flow.sourceAddress;
+    reverse.sourcePort = flow.destinationPort;
+    reverse.destinationPort = flow.sourcePort;
+    reverse.sequenceNumber = 0x20000001;
+
+    WinDivertPacket packet = reset ? TcpPacket(reverse, nullptr, 0) : TcpPacket(reverse, payload.data(), payload.size());
+
+    // Flags: RST ACK
+    if (reset)
+        packet.Buffer()[(flow.ipv6 ? 40 : 20) + 13] = 0x14;
+
+    packet.Address().Outbound = 0;
+    packet.Dissect();
+
+    return packet;
+}
+
+NullDevice::NullDevice()
+    : m_sent(0)
+{
+}
+
+bool NullDevice::Recv(WinDivertPacket&)
+{
+    return false;
+}
+
+bool NullDevice::Send(const WinDivertPacket&)
+{
+    m_sent.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+uint64_t NullDevice::Sent() const
+{
+    return m_sent.load(std::memory_order_relaxed);
+}
+
+ReplayDevice::ReplayDevice(const std::vector<WinDivertPacket>& packets)
+    : m_packets(packets), m_next(0), m_count(0), m_sent(0)
+{
+}
+
+void ReplayDevice::Reset(uint64_t count)
+{
+    m_next = 0;
+    m_count = count;
+    m_sent.store(0, std::memory_order_relaxed);
+}
+
+bool ReplayDevice::Recv(WinDivertPacket& packet)
+{
+    if (m_next >= m_count || m_packets.empty())
+        return false;
+
+    packet = m_packets[m_next++ % m_packets.size()];
+    return true;
+}
+
+bool ReplayDevice::Send(const WinDivertPacket&)
+{
+    m_sent.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+uint64_t ReplayDevice::Sent() const
+{
+    return m_sent.load(std::memory_order_relaxed);
+}
+
+SimulatedCompletionSource::SimulatedCompletionSource(const std::vector<WinDivertPacket>& packets, std::chrono::nanoseconds latency)
+    : m_packets(packets), m_latency(latency), m_next(0), m_count(0), m_wakeup(0)
+{
+}
+
+void SimulatedCompletionSource::SetArrivals(const std::vector<std::chrono::nanoseconds>& gaps, std::chrono::nanoseconds wakeup)
+{
+    m_gaps = gaps;
+    m_wakeup = wakeup;
+}
+
+void SimulatedCompletionSource::Reset(uint64_t count)
+{
+    m_next = 0;
+    m_count = count;
+    m_arrival = std::chrono::steady_clock::now();
+}
+
+bool SimulatedCompletionSource::Submit(Request& request)
+{
+    m_pending.push_back(std::make_pair(&request, std::chrono::steady_clock::now() + m_latency));
+    return true;
+}
+
+bool SimulatedCompletionSource::Complete(Request*& request)
+{
+    if (m_pending.empty())
+        return false;
+
+    std::chrono::steady_clock::time_point ready = Ready();
+
+    // The thread only notices a packet some time after it arrived
+    if (std::chrono::steady_clock::now() < ready)
+        ready += m_wakeup;
+
+    while (std::chrono::steady_clock::now() < ready)
+    {
+    }
+
+    Fill(request);
+    return true;
+}
+
+bool SimulatedCompletionSource::Poll(Request*& request)
+{
+    if (m_pending.empty() || std::chrono::steady_clock::now() < Ready())
+        return false;
+
+    Fill(request);
+    return true;
+}
+
+void SimulatedCompletionSource::Cancel()
+{
+    // Nothing is written into requests outside of Complete
+    for (auto& pending : m_pending)
+        pending.second = std::chrono::steady_clock::now();
+}
+
+std::chrono::steady_clock::time_point SimulatedCompletionSource::Ready() const
+{
+    std::chrono::steady_clock::time_point ready = m_pending.front().second;
+
+    if (!m_gaps.empty() && m_next < m_count)
+        ready = std::max(ready, m_arrival);
+
+    return ready;
+}
+
+void SimulatedCompletionSource::Fill(Request*& request)
+{
+    request = m_pending.front().first;
+    m_pending.pop_front();
+
+    request->length = 0;
+    request->addressLength = 0;
+    request->error = 0;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    while (m_next < m_count && !m_packets.empty() && request->addressLength / sizeof(WINDIVERT_ADDRESS) < request->addresses.size())
+    {
+        const WinDivertPacket& packet = m_packets[m_next % m_packets.size()];
+
+        if (request->length + packet.Buffer().size() > request->buffer.size())
+            break;
+
+        if (!m_gaps.empty() && m_arrival > now)
+            break;
+
+        WINDIVERT_ADDRESS& address = request->addresses[request->addressLength / sizeof(WINDIVERT_ADDRESS)];
+        address = packet.Address();
+        address.Timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>((m_gaps.empty() ? now : m_arrival).time_since_epoch()).count();
+
+        memcpy(request->buffer.data() + request->length, packet.Buffer().data(), packet.Buffer().size());
+
+        request->length += static_cast<uint32_t>(packet.Buffer().size());
+        request->addressLength += sizeof(WINDIVERT_ADDRESS);
+
+        if (!m_gaps.empty())
+            m_arrival += m_gaps[m_next % m_gaps.size()];
+
+        m_next++;
+    }
+
+    // ERROR_NO_DATA
+    if (request->length == 0)
+        request->error = 232;
+}
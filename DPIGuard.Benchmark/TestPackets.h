@@ -0,0 +1,166 @@
+#pragma once
+
+#include "CompletionSource.h"
+#include "PacketDevice.h"
+
+#include <deque>
+
+// Well formed packets and payloads for benchmarks. Checksums are left zero, nothing here is sent.
+class TestPackets
+{
+public:
+    enum NamedGroup : uint16_t
+    {
+        SECP256R1 = 0x0017,
+        X25519 = 0x001d,
+        X25519MLKEM768 = 0x11ec
+    };
+
+    struct ClientHelloOptions
+    {
+        ClientHelloOptions()
+        {
+            commonExtensions = true;
+            grease = false;
+            shuffleExtensions = false;
+            serverNameLast = false;
+            fillerExtensions = 0;
+            paddedLength = 0;
+            random = 0;
+        }
+
+        std::string serverName;
+
+        // The extensions a current browser sends: supported_groups, signature_algorithms, ALPN, supported_versions...
+        bool commonExtensions;
+        // Reserved GREASE values in the cipher suites, groups, versions and as first and last extension (RFC 8701)
+        bool grease;
+        // Randomizes the extension order like Chrome does, GREASE and padding stay in place
+        bool shuffleExtensions;
+        bool serverNameLast;
+        // Unassigned extensions with a few bytes each
+        size_t fillerExtensions;
+        // Pads the handshake message to this length with the padding extension (RFC 7685), 0 disables padding
+        size_t paddedLength;
+
+        // Named groups of the key_share entries, each with a key of the size the group uses
+        std::vector<uint16_t> keyShareGroups;
+
+        // Seeds the random, the session id, GREASE values and the extension order
+        uint64_t random;
+    };
+
+    // Endpoints of a client to server TCP connection, addresses in network order
+    struct Flow
+    {
+        Flow()
+        {
+            ipv6 = false;
+            sourceAddress.fill(0);
+            destinationAddress.fill(0);
+            sourcePort = 0;
+            destinationPort = 0;
+            sequenceNumber = 0;
+        }
+
+        bool ipv6;
+        std::array<uint8_t, 16> sourceAddress;
+        std::array<uint8_t, 16> destinationAddress;
+        uint16_t sourcePort;
+        uint16_t destinationPort;
+        uint32_t sequenceNumber;
+    };
+
+    // Size of the client key share for a named group
+    static size_t KeyShareLength(uint16_t group);
+
+    // TLS record carrying a ClientHello
+    static std::vector<uint8_t> ClientHello(const ClientHelloOptions& options);
+
+    // TLS 1.2 ClientHello record with only server_name and fillerExtensions before or after it
+    static std::vector<uint8_t> ClientHello(const std::string& serverName, size_t fillerExtensions = 8, bool serverNameLast = false);
+
+    // GET request with headerCount headers, Host being the one at hostIndex
+    static std::vector<uint8_t> HttpRequest(const std::string& host, size_t headerCount = 8, size_t hostIndex = 0, const std::string& path = "/index.html");
+
+    // TLS record carrying a TLS 1.3 ServerHello with an X25519 key share
+    static std::vector<uint8_t> ServerHello();
+
+    // TCP segment with PSH and ACK from the client side, dissected and ready for PacketProcessor
+    static WinDivertPacket TcpPacket(const Flow& flow, const uint8_t* payload, size_t payloadLength);
+    static WinDivertPacket TcpPacket(bool ipv6, uint16_t sourcePort, uint16_t destinationPort, const std::vector<uint8_t>& payload);
+
+    // Inbound segment from the server side of flow, RST and ACK without payload if reset is set
+    static WinDivertPacket ServerPacket(const Flow& flow, const std::vector<uint8_t>& payload, bool reset = false);
+};
+
+// Discards sent packets, receives nothing
+class NullDevice : public PacketDevice
+{
+public:
+    NullDevice();
+
+    bool Recv(WinDivertPacket& packet) override;
+    bool Send(const WinDivertPacket& packet) override;
+
+    uint64_t Sent() const;
+private:
+    std::atomic<uint64_t> m_sent;
+};
+
+// Delivers count packets by cycling over a fixed set, then stops like a closed WinDivert handle
+class ReplayDevice : public PacketDevice
+{
+public:
+    explicit ReplayDevice(const std::vector<WinDivertPacket>& packets);
+
+    void Reset(uint64_t count);
+
+    bool Recv(WinDivertPacket& packet) override;
+    bool Send(const WinDivertPacket& packet) override;
+
+    uint64_t Sent() const;
+private:
+    const std::vector<WinDivertPacket>& m_packets;
+    uint64_t m_next;
+    uint64_t m_count;
+
+    std::atomic<uint64_t> m_sent;
+};
+
+// Completes receives like the WinDivert driver on a completion port, in submission order and latency after they
+// were submitted, with as many of the replayed packets as have arrived and fit. Without arrivals every packet is
+// there right away. Once count packets were delivered receives fail like on a shut down handle. Packets are
+// stamped with their arrival in nanoseconds of std::chrono::steady_clock. Waits by spinning, so that microsecond
+// latencies are kept.
+class SimulatedCompletionSource : public CompletionSource
+{
+public:
+    SimulatedCompletionSource(const std::vector<WinDivertPacket>& packets, std::chrono::nanoseconds latency);
+
+    // Packets arrive the given gaps apart, cycling over them. A blocked Complete returns wakeup after the arrival
+    void SetArrivals(const std::vector<std::chrono::nanoseconds>& gaps, std::chrono::nanoseconds wakeup);
+
+    void Reset(uint64_t count);
+
+    bool Submit(Request& request) override;
+    bool Complete(Request*& request) override;
+    bool Poll(Request*& request) override;
+    void Cancel() override;
+private:
+    // When the oldest pending request can complete
+    std::chrono::steady_clock::time_point Ready() const;
+    void Fill(Request*& request);
+private:
+    const std::vector<WinDivertPacket>& m_packets;
+    std::chrono::nanoseconds m_latency;
+    uint64_t m_next;
+    uint64_t m_count;
+
+    std::vector<std::chrono::nanoseconds> m_gaps;
+    std::chrono::nanoseconds m_wakeup;
+    // Arrival of packet m_next
+    std::chrono::steady_clock::time_point m_arrival;
+
+    std::deque<std::pair<Request*, std::chrono::steady_clock::time_point>> m_pending;
+};
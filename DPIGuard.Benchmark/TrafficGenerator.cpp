@@ -0,0 +1,275 @@
+#include "StdAfx.h"
+#include "TrafficGenerator.h"
+
+#include <cmath>
+
+// Maximum segment sizes for a 1500 byte MTU
+static const size_t IPV4_MSS = 1460;
+static const size_t IPV6_MSS = 1440;
+
+static const char* HTTP_PATHS[] = { "/", "/index.html", "/favicon.ico", "/api/v1/status", "/static/app.js", "/images/logo.png" };
+
+TrafficGenerator::TrafficGenerator(const Options& options)
+    : m_options(options), m_random(options.seed), m_uniform(0.0, 1.0), m_flows(0), m_packets(0)
+{
+    if (m_options.domains.empty())
+        m_options.domains = SyntheticDomains(10000);
+
+    m_options.flows = std::max<uint64_t>(m_options.flows, 1);
+    m_options.minHeaders = std::max<size_t>(m_options.minHeaders, 1);
+    m_options.maxHeaders = std::max(m_options.maxHeaders, m_options.minHeaders);
+
+    m_cdf.resize(m_options.domains.size());
+
+    double sum = 0;
+    for (size_t i = 0; i < m_cdf.size(); i++)
+    {
+        sum += 1.0 / std::pow(static_cast<double>(i + 1), m_options.zipfExponent);
+        m_cdf[i] = sum;
+    }
+
+    for (double& value : m_cdf)
+        value /= sum;
+}
+
+void TrafficGenerator::Next(WinDivertPacket& packet)
+{
+    if (m_pending.empty())
+        NextFlow();
+
+    packet = m_pending.front();
+    m_pending.pop_front();
+
+    m_packets++;
+}
+
+uint64_t TrafficGenerator::Flows() const
+{
+    return m_flows;
+}
+
+uint64_t TrafficGenerator::Packets() const
+{
+    return m_packets;
+}
+
+bool TrafficGenerator::WritePcap(const std::string& filePath, uint64_t packets)
+{
+    FILE* file = fopen(filePath.c_str(), "wb");
+    if (!file)
+        return false;
+
+    std::vector<uint8_t> buffer;
+
+    auto appendUInt16 = [&buffer](uint16_t value) {
+        buffer.push_back(static_cast<uint8_t>(value));
+        buffer.push_back(static_cast<uint8_t>(value >> 8));
+    };
+
+    auto appendUInt32 = [&buffer](uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            buffer.push_back(static_cast<uint8_t>(value >> (i * 8)));
+    };
+
+    // Magic Number (microseconds, little endian), Version 2.4, Reserved, SnapLen, LinkType: LINKTYPE_RAW (101)
+    appendUInt32(0xa1b2c3d4);
+    appendUInt16(2);
+    appendUInt16(4);
+    appendUInt32(0);
+    appendUInt32(0);
+    appendUInt32(65535);
+    appendUInt32(101);
+
+    bool written = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+
+    // One packet every 10 microseconds from a fixed start, so that the same options give the same file
+    uint64_t timestamp = 1700000000ULL * 1000000;
+
+    WinDivertPacket packet;
+
+    for (uint64_t i = 0; i < packets && written; i++)
+    {
+        Next(packet);
+
+        uint32_t length = static_cast<uint32_t>(packet.Buffer().size());
+
+        buffer.clear();
+        appendUInt32(static_cast<uint32_t>(timestamp / 1000000));
+        appendUInt32(static_cast<uint32_t>(timestamp % 1000000));
+        appendUInt32(length);
+        appendUInt32(length);
+        buffer.insert(buffer.end(), packet.Buffer().begin(), packet.Buffer().end());
+
+        written = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+
+        timestamp += 10;
+    }
+
+    return fclose(file) == 0 && written;
+}
+
+std::vector<std::string> TrafficGenerator::SyntheticDomains(size_t count)
+{
+    std::vector<std::string> domains;
+    domains.reserve(count);
+
+    for (size_t i = 0; i < count; i++)
+        domains.push_back("host" + std::to_string(i) + ".example" + std::to_string(i % 997) + ".com");
+
+    return domains;
+}
+
+bool TrafficGenerator::LoadDomains(const std::string& filePath, std::vector<std::string>& domains)
+{
+    FILE* file = fopen(filePath.c_str(), "rb");
+    if (!file)
+        return false;
+
+    domains.clear();
+
+    char line[512];
+    while (fgets(line, sizeof(line), file))
+    {
+        std::string domain = line;
+
+        while (!domain.empty() && (domain.back() == '\n' || domain.back() == '\r' || domain.back() == ' '))
+            domain.pop_back();
+
+        if (domain.empty() || domain[0] == '#')
+            continue;
+
+        domains.push_back(domain);
+    }
+
+    fclose(file);
+
+    return !domains.empty();
+}
+
+void TrafficGenerator::NextFlow()
+{
+    uint64_t index = m_flows++ % m_options.flows;
+    uint64_t hash = Mix(index ^ m_options.seed);
+
+    size_t domainIndex = NextDomain();
+    const std::string& domain = m_options.domains[domainIndex];
+
+    // Clients in 10.0.0.0/8 or 2001:db8::/64 numbered by the flow index, servers in 198.18.0.0/15 or
+    // 2001:db8:ffff::/64 numbered by the domain. A flow index that comes around again keeps its client address
+    // and port, but meets the server of the domain drawn this time.
+    TestPackets::Flow flow;
+    flow.ipv6 = static_cast<double>(hash >> 11) / static_cast<double>(1ULL << 53) < m_options.ipv6Ratio;
+    flow.sourcePort = static_cast<uint16_t>(1024 + (hash >> 16) % 64512);
+    flow.sequenceNumber = static_cast<uint32_t>(hash >> 32);
+
+    if (flow.ipv6)
+    {
+        flow.sourceAddress = { 0x20, 0x01, 0x0d, 0xb8 };
+        flow.destinationAddress = { 0x20, 0x01, 0x0d, 0xb8, 0xff, 0xff };
+
+        for (int i = 0; i < 8; i++)
+        {
+            flow.sourceAddress[15 - i] = static_cast<uint8_t>(index >> (i * 8));
+            flow.destinationAddress[15 - i] = static_cast<uint8_t>(static_cast<uint64_t>(domainIndex) >> (i * 8));
+        }
+    }
+    else
+    {
+        flow.sourceAddress = { 10, static_cast<uint8_t>(index >> 16), static_cast<uint8_t>(index >> 8), static_cast<uint8_t>(index) };
+        flow.destinationAddress = { 198, static_cast<uint8_t>(18 + ((domainIndex >> 16) & 1)),
+            static_cast<uint8_t>(domainIndex >> 8), static_cast<uint8_t>(domainIndex) };
+
+        // Past 2^24 flows the source port keeps the 5-tuples apart
+        flow.sourcePort = static_cast<uint16_t>(1024 + ((index >> 24) + (hash >> 16)) % 64512);
+    }
+
+    std::vector<uint8_t> payload;
+
+    if (Chance(m_options.httpRatio))
+    {
+        std::uniform_int_distribution<size_t> headers(m_options.minHeaders, m_options.maxHeaders);
+        size_t headerCount = headers(m_random);
+
+        std::uniform_int_distribution<size_t> hostIndex(0, headerCount - 1);
+        std::uniform_int_distribution<size_t> path(0, sizeof(HTTP_PATHS) / sizeof(HTTP_PATHS[0]) - 1);
+
+        flow.destinationPort = 80;
+        payload = TestPackets::HttpRequest(domain, headerCount, hostIndex(m_random), HTTP_PATHS[path(m_random)]);
+    }
+    else
+    {
+        TestPackets::ClientHelloOptions options;
+        options.serverName = domain;
+        options.grease = Chance(m_options.greaseRatio);
+        options.shuffleExtensions = options.grease;
+        options.paddedLength = Chance(m_options.paddingRatio) ? 512 : 0;
+        options.random = m_random();
+
+        if (Chance(m_options.postQuantumRatio))
+            options.keyShareGroups.push_back(TestPackets::X25519MLKEM768);
+
+        options.keyShareGroups.push_back(TestPackets::X25519);
+
+        flow.destinationPort = 443;
+        payload = TestPackets::ClientHello(options);
+    }
+
+    size_t mss = flow.ipv6 ? IPV6_MSS : IPV4_MSS;
+
+    for (size_t offset = 0; offset < payload.size(); offset += mss)
+    {
+        size_t length = std::min(mss, payload.size() - offset);
+
+        m_pending.push_back(TestPackets::TcpPacket(flow, payload.data() + offset, length));
+        flow.sequenceNumber += static_cast<uint32_t>(length);
+    }
+}
+
+size_t TrafficGenerator::NextDomain()
+{
+    size_t index = std::lower_bound(m_cdf.begin(), m_cdf.end(), m_uniform(m_random)) - m_cdf.begin();
+
+    return std::min(index, m_cdf.size() - 1);
+}
+
+bool TrafficGenerator::Chance(double ratio)
+{
+    return m_uniform(m_random) < ratio;
+}
+
+uint64_t TrafficGenerator::Mix(uint64_t value)
+{
+    // SplitMix64 finalizer
+    value += 0x9e3779b97f4a7c15ULL;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+
+    return value ^ (value >> 31);
+}
+
+GeneratorDevice::GeneratorDevice(TrafficGenerator& generator, uint64_t count)
+    : m_generator(generator), m_count(count), m_sent(0)
+{
+}
+
+bool GeneratorDevice::Recv(WinDivertPacket& packet)
+{
+    if (m_count == 0)
+        return false;
+
+    m_count--;
+    m_generator.Next(packet);
+
+    return true;
+}
+
+bool GeneratorDevice::Send(const WinDivertPacket&)
+{
+    m_sent.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+uint64_t GeneratorDevice::Sent() const
+{
+    return m_sent.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "TestPackets.h"
+
+#include <deque>
+#include <random>
+
+// Synthetic client traffic: the first data segments of TLS and HTTP connections with a mix of ClientHello
+// shapes like browsers send them, and host names drawn from a Zipf distribution over a domain list.
+// Every connection gets its own client address and port until the flow count wraps, so flow dependent code sees
+// millions of flows. The server side follows the domain drawn for the connection.
+class TrafficGenerator
+{
+public:
+    struct Options
+    {
+        Options()
+        {
+            flows = 1000000;
+            zipfExponent = 1.0;
+            ipv6Ratio = 0.3;
+            httpRatio = 0.1;
+            greaseRatio = 0.7;
+            postQuantumRatio = 0.4;
+            paddingRatio = 0.5;
+            minHeaders = 3;
+            maxHeaders = 16;
+            seed = 1;
+        }
+
+        // Ordered by popularity, the first domain is the most frequent one
+        std::vector<std::string> domains;
+        // Distinct connections before client addresses and ports repeat
+        uint64_t flows;
+        double zipfExponent;
+
+        double ipv6Ratio;
+        double httpRatio;
+
+        // Share of ClientHellos with GREASE, an X25519MLKEM768 key share (spans two segments) and padding to 512 bytes
+        double greaseRatio;
+        double postQuantumRatio;
+        double paddingRatio;
+
+        // Header count of HTTP requests, Host is placed at a random position
+        size_t minHeaders;
+        size_t maxHeaders;
+
+        uint64_t seed;
+    };
+
+    explicit TrafficGenerator(const Options& options);
+
+    // Payloads larger than a segment continue in the following packets
+    void Next(WinDivertPacket& packet);
+
+    uint64_t Flows() const;
+    uint64_t Packets() const;
+
+    bool WritePcap(const std::string& filePath, uint64_t packets);
+
+    // hostN.exampleM.com names for benchmarks without a real domain list
+    static std::vector<std::string> SyntheticDomains(size_t count);
+    // One domain per line, empty lines and lines starting with '#' are skipped
+    static bool LoadDomains(const std::string& filePath, std::vector<std::string>& domains);
+private:
+    void NextFlow();
+
+    size_t NextDomain();
+    bool Chance(double ratio);
+
+    static uint64_t Mix(uint64_t value);
+private:
+    Options m_options;
+    std::vector<double> m_cdf;
+
+    std::mt19937_64 m_random;
+    std::uniform_real_distribution<double> m_uniform;
+
+    std::deque<WinDivertPacket> m_pending;
+
+    uint64_t m_flows;
+    uint64_t m_packets;
+};
+
+// Generates count packets, then stops like a closed WinDivert handle
+class GeneratorDevice : public PacketDevice
+{
+public:
+    GeneratorDevice(TrafficGenerator& generator, uint64_t count);
+
+    bool Recv(WinDivertPacket& packet) override;
+    bool Send(const WinDivertPacket& packet) override;
+
+    uint64_t Sent() const;
+private:
+    TrafficGenerator& m_generator;
+    uint64_t m_count;
+
+    std::atomic<uint64_t> m_sent;
+};
@@ -1,8 +1,11 @@
 #include "StdAfx.h"
 #include "Application.h"
 #include "ApplicationVersion.h"
-#include "BufferReader.h"
-#include "HttpRequestParser.h"
+#include "AsyncReceiver.h"
+#include "FlowDispatcher.h"
+#include "LargePageArena.h"
+#include "OverloadController.h"
+#include "ShadowDevice.h"
 #include "Utils.h"
 
 Application theApp;
@@ -16,9 +19,24 @@ static const char* WINDIVERT_HTTPS_FILTER = \
 "(tcp.DstPort == 443 && tcp.Payload[0] == 22 && tcp.Payload[1] == 3 && tcp.Payload[2] == 1)"
 ")";
 
+// Server responses that decide a handshake: RST, ServerHello, TLS alert or the status line of an HTTP response
+static const char* WINDIVERT_FEEDBACK_FILTER = \
+"!loopback && inbound && (ip || ipv6) && length <= 4096 && "
+"("
+"(tcp.SrcPort == 443 && (tcp.Rst || (tcp.PayloadLength >= 6 && tcp.Payload[0] == 22 && tcp.Payload[5] == 2) || "
+"(tcp.PayloadLength >= 1 && tcp.Payload[0] == 21))) || "
+"(tcp.SrcPort == 80 && (tcp.Rst || (tcp.PayloadLength >= 5 && tcp.Payload[0] == 72 && tcp.Payload[1] == 84 && "
+"tcp.Payload[2] == 84 && tcp.Payload[3] == 80 && tcp.Payload[4] == 47)))"
+")";
+
+// Every segment of HTTPS connections in both directions, the sequence numbers of flows whose ClientHello was split
+// into two records are shifted by the inserted record header. Whatever their length, LSO and coalesced packets too.
+static const char* WINDIVERT_RECORDS_FILTER = \
+"!loopback && (ip || ipv6) && ((outbound && tcp.DstPort == 443) || (inbound && tcp.SrcPort == 443))";
+
 Application::Application()
-    : m_appConfigModifiedTime(), m_serviceMode(false), m_serviceStatusHandle(nullptr)
-    , m_configMonitorStop(false), m_commandType(CommandType::None)
+    : m_appConfigModifiedTime(), m_shadowMode(false), m_serviceMode(false), m_serviceStatusHandle(nullptr)
+    , m_configMonitorStop(false), m_control(m_appConfig), m_commandType(CommandType::None)
 {
 }
 
@@ -42,7 +60,8 @@ int Application::Run(int argc, wchar_t* argv[])
         break;
     }
 
-    if (!StartServiceMode())
+    // Shadow runs are interactive, never as the service
+    if (m_shadowMode || !StartServiceMode())
         StartMainThread();
 
     WaitMainThread();
@@ -58,7 +77,10 @@ int Application::CommandHelp()
         "  -h, --help               display this help and exit\n"
         "      --version            display version information and exit\n"
         "      --install            install DPIGuard service\n"
-        "      --uninstall          uninstall DPIGuard service\n";
+        "      --uninstall          uninstall DPIGuard service\n"
+        "      --shadow             classify a copy of the traffic without modifying it,\n"
+        "                           print what would have been done on exit\n"
+        "      --config FILE        read the configuration from FILE\n";
 
     printf(MESSAGE);
     return 0;
@@ -330,6 +352,14 @@ bool Application::ParseCommandLine(int argc, wchar_t* argv[])
 
             m_commandType = CommandType::Uninstall;
         }
+        else if (wcscmp(argv[i], L"--shadow") == 0)
+        {
+            m_shadowMode = true;
+        }
+        else if (wcscmp(argv[i], L"--config") == 0 && i + 1 < argc)
+        {
+            m_appConfigPath = argv[++i];
+        }
         else
         {
             accepted = false;
@@ -344,7 +374,8 @@ void Application::Main()
 {
     printf("[+] Loading configuration\n");
 
-    m_appConfigPath = Utils::GetApplicationConfigPath();
+    if (m_appConfigPath.empty())
+        m_appConfigPath = Utils::GetApplicationConfigPath();
 
     if (!m_appConfig.LoadFile(m_appConfigPath))
     {
@@ -354,7 +385,56 @@ void Application::Main()
         return;
     }
 
-    m_appConfig.SaveFile(m_appConfigPath);
+    // A configuration under evaluation is left as it was written
+    if (!m_shadowMode)
+        m_appConfig.SaveFile(m_appConfigPath);
+
+    // Copied once, the configuration may be reloaded while packets are processed
+    ApplicationConfig::FeedbackConfig feedbackConfig = m_appConfig.Feedback();
+    const ApplicationConfig::EngineConfig engineConfig = m_appConfig.Engine();
+    const ApplicationConfig::QueueConfig queueConfig = m_appConfig.Queue();
+    const ApplicationConfig::CaptureConfig captureConfig = m_appConfig.Capture();
+    const ApplicationConfig::OverloadConfig overloadConfig = m_appConfig.Overload();
+
+    // Unmodified connections say nothing about fragmentation strategies
+    if (m_shadowMode)
+        feedbackConfig.enabled = false;
+
+    if (feedbackConfig.enabled)
+    {
+        m_scoreboardPath = Utils::GetApplicationFeedbackPath();
+        m_scoreboard.Configure(feedbackConfig.timeout, feedbackConfig.offsets);
+
+        if (m_scoreboard.LoadFile(m_scoreboardPath))
+            printf("[+] Selecting strategies from server responses (%zu domains known)\n", m_scoreboard.Domains());
+        else
+            printf("[-] The feedback file is invalid or corrupted, starting over\n");
+    }
+
+    m_statsConfig = m_appConfig.Stats();
+
+    if (m_statsConfig.enabled)
+    {
+        m_hostnameStats.reset(new HostnameStats(m_statsConfig.capacity));
+        m_hostnameStatsReported = std::chrono::steady_clock::now();
+    }
+
+    m_controlConfig = m_appConfig.Control();
+
+    // A configuration under evaluation is left as it was written
+    if (m_shadowMode)
+        m_controlConfig.persist = false;
+
+    if (m_controlConfig.enabled)
+    {
+        if (m_controlConfig.path.empty())
+            m_controlConfig.path = "\\\\.\\pipe\\DPIGuard";
+
+        if (m_control.Start(m_controlConfig.path))
+            printf("[+] Control channel on %s\n", m_controlConfig.path.c_str());
+        else
+            printf("[-] Failed to open control channel %s: %u\n", m_controlConfig.path.c_str(), GetLastError());
+    }
 
     StartConfigMonitor();
 
@@ -367,314 +447,385 @@ void Application::Main()
 
         printf("[+] Initializing packet filter module\n");
 
-        if (!m_divert.Open(WINDIVERT_HTTPS_FILTER))
+        std::string filter = WINDIVERT_HTTPS_FILTER;
+
+        if (feedbackConfig.enabled)
+            filter = "(" + filter + ") || (" + WINDIVERT_FEEDBACK_FILTER + ")";
+
+        // Sniffed packets cannot be changed, so a configuration under evaluation keeps the short filter
+        bool recordSplitting = m_appConfig.UsesTlsRecords() && !m_shadowMode;
+
+        if (recordSplitting)
+        {
+            filter = "(" + filter + ") || (" + WINDIVERT_RECORDS_FILTER + ")";
+            printf("[+] TLS record splitting: following every packet of port 443\n");
+        }
+
+        if (!m_divert.Open(filter.c_str(), WINDIVERT_LAYER_NETWORK, 0, m_shadowMode ? WINDIVERT_FLAG_SNIFF : 0))
             throw std::system_error(GetLastError(), std::system_category());
 
-        printf("[+] Initialization complete\n");
+        // The driver fills the next batches while the packets of a completed one are processed
+        std::unique_ptr<AsyncReceiver> asyncReceiver;
+        std::unique_ptr<SpinPolicy> spinPolicy;
 
-        ReportRunning();
+        uint64_t spin = engineConfig.spin;
 
-        while (m_divert.Recv(packet))
+        // Only completions can be polled for, so the latency mode needs at least one overlapped receive. Record
+        // splitting receives into buffers that fit the largest packet and copies each packet out at its length.
+        if (queueConfig.receives != 0 || spin != 0 || recordSplitting)
         {
-            if (packet.Dissect())
-            {
-                if (HandlePacket(packet))
-                    continue;
-            }
+            size_t receives = std::max<size_t>(queueConfig.receives, 1);
+            size_t packetSize = recordSplitting ? WINDIVERT_MTU_MAX : 4096;
 
-            m_divert.Send(packet);
+            asyncReceiver.reset(new AsyncReceiver(m_divert, m_divert, receives, queueConfig.batch, packetSize));
+            printf("[+] Overlapped receives: %zu in flight, %zu packets each\n", receives, queueConfig.batch);
         }
 
-        m_divert.Close();
-    }
-    catch (const std::exception& e)
-    {
-        printf("[-] Unexpected error. Aborting (%s)\n", e.what());
-    }
+        if (spin != 0)
+        {
+            LARGE_INTEGER timestampFrequency;
+            QueryPerformanceFrequency(&timestampFrequency);
 
-    StopConfigMonitor();
-    StopWinDivert();
+            // std::chrono::steady_clock counts the performance counter, so timestamps compare to it
+            spinPolicy.reset(new SpinPolicy(spin));
+            asyncReceiver->SetSpinPolicy(spinPolicy.get(), timestampFrequency.QuadPart);
 
-    ReportStopped();
-
-    printf("[+] Stopped\n");
-}
+            printf("[+] Latency mode: spinning up to %llu us before blocking\n", static_cast<unsigned long long>(spin));
+        }
 
-void Application::ConfigMonitor()
-{
-    bool result = false;
+        PacketDevice& divert = asyncReceiver ? static_cast<PacketDevice&>(*asyncReceiver) : m_divert;
 
-    while (!result)
-    {
-        std::unique_lock<std::mutex> locked(m_configMonitorLock);
+        // Sniffed packets go on by themselves, nothing may be sent back
+        ShadowDevice shadowDevice(divert);
+        PacketDevice& device = m_shadowMode ? static_cast<PacketDevice&>(shadowDevice) : divert;
 
-        result = m_configMonitorCv.wait_for(locked, std::chrono::seconds(5), [&]() {
-            return m_configMonitorStop;
-        });
+        if (m_shadowMode)
+            printf("[+] Shadow mode, packets are not modified\n");
 
-        if (!result) {
-            if (!Utils::CheckFileModified(m_appConfigPath.c_str(), m_appConfigModifiedTime))
-                continue;
+        QueueController::Parameters queueParameters;
+        queueParameters.length = queueConfig.length;
+        queueParameters.time = queueConfig.time;
+        queueParameters.size = queueConfig.size;
 
-            if (!m_appConfig.LoadFile(m_appConfigPath))
-            {
-                printf("[-] The new configuration file is invalid or corrupted.\n");
-                continue;
-            }
-            
-            printf("[+] The configuration file has been reloaded.\n");
-        }
-    }
-}
+        m_queueController.Configure(queueParameters, queueConfig.adaptive);
 
-bool Application::HandlePacket(WinDivertPacket& packet)
-{
-    if (!packet.IPv4() && !packet.IPv6())
-        return false;
+        if (!m_divert.SetQueueController(&m_queueController))
+            printf("[-] Failed to set WinDivert queue parameters: %u\n", GetLastError());
 
-    if (!packet.Tcp())
-        return false;
+        if (captureConfig.enabled)
+        {
+            if (m_capture.Start(Utils::GetApplicationCapturePath(), captureConfig.maxFileSize, captureConfig.maxFiles))
+                printf("[+] Capturing unexpected packets\n");
+            else
+                printf("[-] Failed to open packet capture file: %u\n", GetLastError());
+        }
 
-    switch (Utils::ntohs(packet.Tcp()->DstPort))
-    {
-    case 80:
-        return HandleHttp(packet);
-    case 443:
-        return HandleHttps(packet);
-    default:
-        break;
-    }
+        printf("[+] Initialization complete\n");
 
-    return false;
-}
+        ReportRunning();
 
-bool Application::HandleHttp(WinDivertPacket& packet)
-{
-    if (!packet.Data())
-        return false;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
 
-    try
-    {
-        const uint8_t* data = packet.Data();
-        uint32_t dataLength = packet.DataLength();
+        uint64_t completed = 0;
+        uint64_t resets = 0;
+        uint64_t retransmissions = 0;
+        uint64_t timeouts = 0;
 
-        HttpRequestParser parser;
-        HttpRequestParser::Result result = parser.Parse(data, dataLength);
+        auto addHandshakes = [&](const PacketProcessor& processor) {
+            if (const HandshakeTracker* handshakes = processor.Handshakes())
+            {
+                completed += handshakes->Completed();
+                resets += handshakes->Resets();
+                retransmissions += handshakes->Retransmissions();
+                timeouts += handshakes->Timeouts();
+            }
+        };
 
-        if (result == HttpRequestParser::Result::Bad)
-            return false;
+        ShadowRecorder shadow;
 
-        const std::array<int, 4>* header = parser.GetHeader("Host");
-        if (header == nullptr)
-            return false;
+        uint64_t split = 0;
+        uint64_t shifted = 0;
+        uint64_t refused = 0;
+        uint64_t expired = 0;
 
-        int valueBegin = header->at(2);
-        int valueEnd = header->at(3);
+        auto addRecordSplits = [&](const PacketProcessor& processor) {
+            if (const RecordSplitTracker* recordSplits = processor.RecordSplits())
+            {
+                split += recordSplits->Split();
+                shifted += recordSplits->Shifted();
+                refused += recordSplits->Refused();
+                expired += recordSplits->Expired();
+            }
+        };
 
-        std::string hostName(data + valueBegin, data + valueEnd);
+        uint64_t recorded = 0;
+        uint64_t resplit = 0;
+        uint64_t evicted = 0;
 
-        return HandleHttpFragmentation(packet, hostName, valueBegin);
-    }
-    catch (const std::exception& e)
-    {
-        printf("[-] Unexpected error while parsing HTTP packet (%s)\n", e.what());
+        auto addRetransmissions = [&](const PacketProcessor& processor) {
+            if (const RetransmissionCache* retransmissionCache = processor.Retransmissions())
+            {
+                recorded += retransmissionCache->Recorded();
+                resplit += retransmissionCache->Retransmissions();
+                evicted += retransmissionCache->Evicted();
+            }
+        };
 
-        // TODO Dump raw packet bytes
-    }
+        auto addShadow = [&](const PacketProcessor& processor) {
+            if (const ShadowRecorder* recorder = processor.Shadow())
+                shadow.Merge(*recorder);
+        };
 
-    return false;
-}
+        // WINDIVERT_ADDRESS::Timestamp is a performance counter value
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
 
-bool Application::HandleHttps(WinDivertPacket& packet)
-{
-    if (!packet.Data())
-        return false;
+        OverloadController::Action overloadAction = overloadConfig.action == "cached" ?
+            OverloadController::Action::Cached : OverloadController::Action::Pass;
 
-    try
-    {
-        BufferReader reader(packet.Data(), packet.DataLength());
+        OverloadController overload(overloadConfig.budget * 1000, overloadAction);
 
-        // Content Type: Handshake (22)
-        // Version: TLS 1.0 (0x0301)
-        // Length: 512
+        auto addOverload = [&](const PacketProcessor& processor) {
+            if (const OverloadController* controller = processor.Overload())
+                overload.Merge(*controller);
+        };
 
-        try
-        {
-            uint8_t contentType = reader.UInt8();
-            uint16_t version = Utils::ntohs(reader.UInt16());
-            uint16_t length = Utils::ntohs(reader.UInt16());
+        // Once everything that allocates from them is set up
+        auto reportArenas = [&]() {
+            if (engineConfig.largePages)
+                LargePageArena::Report();
+        };
 
-            if (contentType != 22 || version != 0x0301)
-                return false;
-        }
-        catch (const std::out_of_range&)
+        if (overloadConfig.budget != 0)
         {
-            return false;
+            printf("[+] Shedding load over %llu us per packet (%s)\n", static_cast<unsigned long long>(overloadConfig.budget),
+                overloadConfig.action.c_str());
         }
 
-        // Handshake Type: Client Hello (1)
-        // Length: 508
-        // Version: TLS 1.2 (0x0303)
-        // Random: 19ecfc70399dbe45a24a73d099ba4a3b8ad91042e90105c8e6271fb93cd6b78f
-        // Session ID Length: 32
-        // Session ID: 51ca63b4499b93beba73f581ef06c088abc7cd0e7a21166bd60dce014a00b321
-        // Cipher Suites Length: 62
-        // Cipher Suites (31 suites)
-        // Compression Methods Length: 1
-        // Compression Methods (1 method)
-
-        uint8_t handshakeType = reader.UInt8();
-        if (handshakeType != 1)
-            return false;
-
-        uint8_t handshakeLengthBytes[4];
-        handshakeLengthBytes[0] = 0;
-        handshakeLengthBytes[1] = reader.UInt8();
-        handshakeLengthBytes[2] = reader.UInt8();
-        handshakeLengthBytes[3] = reader.UInt8();
-        uint8_t handshakeLength = Utils::ntohl(*reinterpret_cast<uint32_t*>(handshakeLengthBytes));
-
-        uint16_t handshakeVersion = Utils::ntohs(reader.UInt16());
-        // TLS 1.0, TLS 1.1, TLS 1.2
-        if (handshakeVersion != 0x0301 && handshakeVersion != 0x0302 && handshakeVersion != 0x0303)
-            return false;
-
-        reader.Forward(32);
-
-        uint8_t sessionIdLength = reader.UInt8();
-        reader.Forward(sessionIdLength);
-
-        uint16_t cipherSuitesLength = Utils::ntohs(reader.UInt16());
-        reader.Forward(cipherSuitesLength);
-
-        uint8_t compressionMethodsLength = reader.UInt8();
-        reader.Forward(compressionMethodsLength);
-
-        // Extensions Length: 373
-        uint16_t extensionsLength = Utils::ntohs(reader.UInt16());
-        while (extensionsLength)
+        size_t workers = engineConfig.workers;
+        bool staged = engineConfig.staged;
+
+        if (workers > 1 || staged)
         {
-            // Extension: server_name (len=14)
-            // Type: server_name (0)
-            // Length: 14
+            if (staged)
+                printf("[+] Staged pipeline: receive, %zu classify workers, send\n", workers);
+            else
+                printf("[+] Dispatching flows to %zu workers\n", workers);
+
+            FlowDispatcher dispatcher(m_appConfig, device, &m_capture, workers, staged);
 
-            uint16_t extensionType = Utils::ntohs(reader.UInt16());
-            uint16_t extensionLength = Utils::ntohs(reader.UInt16());
+            if (feedbackConfig.enabled)
+                dispatcher.EnableFeedback(m_scoreboard, frequency.QuadPart);
 
-            size_t nextOffset = reader.Offset() + extensionLength;
+            if (recordSplitting)
+                dispatcher.EnableRecordSplitting(frequency.QuadPart);
 
-            if (extensionType == 0)
+            if (m_shadowMode)
             {
-                // Server Name list length: 12
+                dispatcher.SetVerbose(false);
+                dispatcher.EnableShadow();
+            }
+            else
+            {
+                // Sniffed packets are never split, so neither are their retransmissions
+                dispatcher.EnableRetransmissionCache(frequency.QuadPart);
+            }
 
-                // Extension: server_name (len=14)
-                // Type: server_name (0)
-                // Length: 14
+            if (m_hostnameStats)
+                dispatcher.EnableHostnameStats(*m_hostnameStats);
 
-                uint16_t serverNameListLength = Utils::ntohs(reader.UInt16());
+            // std::chrono::steady_clock counts the performance counter, so capture times compare to it
+            if (overloadConfig.budget != 0)
+                dispatcher.EnableOverloadControl(overloadConfig.budget, overloadAction, frequency.QuadPart);
 
-                uint16_t serverNameType = reader.UInt8();
-                uint16_t serverNameLength = Utils::ntohs(reader.UInt16());
+            reportArenas();
+            dispatcher.Run();
 
-                size_t serverNameOffset = reader.Offset();
+            for (size_t i = 0; i < dispatcher.Workers(); i++)
+            {
+                hits += dispatcher.Processor(i).DomainCache().Hits();
+                misses += dispatcher.Processor(i).DomainCache().Misses();
+
+                addHandshakes(dispatcher.Processor(i));
+                addRecordSplits(dispatcher.Processor(i));
+                addRetransmissions(dispatcher.Processor(i));
+                addShadow(dispatcher.Processor(i));
+                addOverload(dispatcher.Processor(i));
+            }
+        }
+        else
+        {
+            PacketProcessor processor(m_appConfig, device, &m_capture);
+
+            if (feedbackConfig.enabled)
+                processor.EnableFeedback(m_scoreboard, frequency.QuadPart);
 
-                const char* serverNameBuffer = reinterpret_cast<const char*>(reader.Consume(serverNameLength));
-                std::string serverName = std::string(serverNameBuffer, serverNameBuffer + serverNameLength);
+            if (recordSplitting)
+                processor.EnableRecordSplitting(frequency.QuadPart);
 
-                return HandleTlsFragmentation(packet, serverName, serverNameOffset);
+            if (m_shadowMode)
+            {
+                processor.SetVerbose(false);
+                processor.EnableShadow();
+            }
+            else
+            {
+                // Sniffed packets are never split, so neither are their retransmissions
+                processor.EnableRetransmissionCache(frequency.QuadPart);
             }
 
-            reader.Offset(nextOffset);
+            if (m_hostnameStats)
+                processor.EnableHostnameStats(*m_hostnameStats);
 
-            uint32_t totalExtensionLength = sizeof(uint16_t) * 2 + extensionLength;
-            if (extensionsLength < totalExtensionLength)
-                break;
+            if (overloadConfig.budget != 0)
+                processor.EnableOverloadControl(overloadConfig.budget, overloadAction, frequency.QuadPart);
+
+            reportArenas();
+
+            while (device.Recv(packet))
+                processor.Process(packet);
+
+            processor.FlushHostnameStats();
+
+            hits = processor.DomainCache().Hits();
+            misses = processor.DomainCache().Misses();
 
-            extensionsLength -= totalExtensionLength;
+            addHandshakes(processor);
+            addRecordSplits(processor);
+            addRetransmissions(processor);
+            addShadow(processor);
+            addOverload(processor);
         }
-    }
-    catch (const std::exception& e)
-    {
-        printf("[-] Unexpected error while parsing TLS packet (%s)\n", e.what());
 
-        // TODO Dump raw packet bytes
-    }
+        m_divert.Close();
+        m_control.Stop();
 
-    return false;
-}
+        printf("[+] Domain cache: %llu hits, %llu misses\n",
+            static_cast<unsigned long long>(hits), static_cast<unsigned long long>(misses));
 
-bool Application::HandleHttpFragmentation(WinDivertPacket& packet, const std::string& hostName, size_t hostNameOffset)
-{
-    std::shared_ptr<const ApplicationConfig::DomainConfig> domainConfig = m_appConfig.GetDomainConfig(hostName);
+        if (spinPolicy)
+            spinPolicy->Print();
 
-    if (!domainConfig)
-    {
-        printf("[+] HTTP[Skip]: %s\n", hostName.c_str());
-        return false;
-    }
+        if (overloadConfig.budget != 0)
+            overload.Print();
 
-    if (!domainConfig->httpFragmentationEnabled)
-        return false;
+        if (asyncReceiver && asyncReceiver->Completions() != 0)
+        {
+            printf("[+] Overlapped receives: %llu completions, %.1f packets each, %llu truncated batches\n",
+                static_cast<unsigned long long>(asyncReceiver->Completions()),
+                static_cast<double>(asyncReceiver->Packets()) / asyncReceiver->Completions(),
+                static_cast<unsigned long long>(asyncReceiver->Truncated()));
+        }
 
-    printf("[+] HTTP[OK]: %s\n", hostName.c_str());
-    return DoTcpFragmentation(packet, domainConfig->httpFragmentationOffset, domainConfig->httpFragmentationOutOfOrder);
-}
+        const QueueController::Metrics& queueMetrics = m_queueController.Stats();
 
-bool Application::HandleTlsFragmentation(WinDivertPacket& packet, const std::string& serverName, size_t serverNameOffset)
-{
-    std::shared_ptr<const ApplicationConfig::DomainConfig> domainConfig = m_appConfig.GetDomainConfig(serverName);
+        printf("[+] WinDivert queue: %llu packets, wait p50 %llu us, p99 %llu us, max %llu us, %llu late, "
+            "up to %llu packets and %llu bytes queued, %llu adjustments\n",
+            static_cast<unsigned long long>(queueMetrics.packets),
+            static_cast<unsigned long long>(m_queueController.WaitPercentile(0.5)),
+            static_cast<unsigned long long>(m_queueController.WaitPercentile(0.99)),
+            static_cast<unsigned long long>(queueMetrics.maxWait), static_cast<unsigned long long>(queueMetrics.latePackets),
+            static_cast<unsigned long long>(queueMetrics.maxQueueLength), static_cast<unsigned long long>(queueMetrics.maxQueueSize),
+            static_cast<unsigned long long>(queueMetrics.adjustments));
+
+        if (m_shadowMode)
+        {
+            printf("[+] Shadow: %llu packets received, %llu packets would have been sent\n",
+                static_cast<unsigned long long>(shadowDevice.Received()), static_cast<unsigned long long>(shadowDevice.Sent()));
+
+            shadow.Print(50);
+        }
+
+        if (feedbackConfig.enabled)
+        {
+            printf("[+] Handshakes: %llu completed, %llu reset, %llu retransmitted, %llu timed out\n",
+                static_cast<unsigned long long>(completed), static_cast<unsigned long long>(resets),
+                static_cast<unsigned long long>(retransmissions), static_cast<unsigned long long>(timeouts));
+        }
+
+        if (recordSplitting)
+        {
+            printf("[+] TLS record splitting: %llu flows split, %llu packets shifted, %llu refused, %llu expired\n",
+                static_cast<unsigned long long>(split), static_cast<unsigned long long>(shifted),
+                static_cast<unsigned long long>(refused), static_cast<unsigned long long>(expired));
+        }
+
+        if (!m_shadowMode)
+        {
+            printf("[+] Retransmissions: %llu split again from %llu segments recorded, %llu flows evicted\n",
+                static_cast<unsigned long long>(resplit), static_cast<unsigned long long>(recorded),
+                static_cast<unsigned long long>(evicted));
+        }
 
-    if (!domainConfig)
+        if (m_controlConfig.enabled)
+        {
+            printf("[+] Control channel: %llu requests, %llu failed\n",
+                static_cast<unsigned long long>(m_control.Requests()), static_cast<unsigned long long>(m_control.Failures()));
+        }
+
+        if (m_hostnameStats)
+            m_hostnameStats->Print(m_statsConfig.top);
+
+        m_capture.Stop();
+
+        if (captureConfig.enabled)
+        {
+            printf("[+] Packet capture: %llu captured, %llu dropped\n",
+                static_cast<unsigned long long>(m_capture.Captured()), static_cast<unsigned long long>(m_capture.Dropped()));
+        }
+    }
+    catch (const std::exception& e)
     {
-        printf("[+] TLS[Skip]: %s\n", serverName.c_str());
-        return false;
+        printf("[-] Unexpected error. Aborting (%s)\n", e.what());
     }
 
-    if (!domainConfig->tlsFragmentationEnabled)
-        return false;
+    StopConfigMonitor();
+    m_control.Stop();
+    SaveScoreboard();
+    SaveControlChanges();
+    StopWinDivert();
+
+    ReportStopped();
 
-    printf("[+] TLS[OK]: %s\n", serverName.c_str());
-    return DoTcpFragmentation(packet, domainConfig->tlsFragmentationOffset, domainConfig->tlsFragmentationOutOfOrder);
+    printf("[+] Stopped\n");
 }
 
-bool Application::DoTcpFragmentation(WinDivertPacket& packet, size_t offset, bool outOfOrder)
+void Application::ConfigMonitor()
 {
-    size_t headerLength = packet.Data() - packet.Buffer().data();
-
-    if (packet.DataLength() <= offset)
-        return false;
-
-    size_t firstDataOffset = 0;
-    size_t firstDataLength = offset;
-    size_t secondDataOffset = firstDataOffset + firstDataLength;
-    size_t secondDataLength = packet.DataLength() - secondDataOffset;
+    bool result = false;
 
-    WinDivertPacket firstPacket(packet);
-    WinDivertPacket secondPacket(packet);
+    while (!result)
+    {
+        std::unique_lock<std::mutex> locked(m_configMonitorLock);
 
-    firstPacket.Buffer().resize(headerLength + firstDataOffset + firstDataLength);
-    if (firstPacket.IPv4())
-        firstPacket.IPv4()->Length = Utils::htons(static_cast<uint16_t>(firstPacket.Buffer().size()));
-    else
-        firstPacket.IPv6()->Length = Utils::htons(static_cast<uint16_t>(firstPacket.Buffer().size()));
-    firstPacket.RecalcChecksum();
+        result = m_configMonitorCv.wait_for(locked, std::chrono::seconds(5), [&]() {
+            return m_configMonitorStop;
+        });
 
-    secondPacket.Buffer().resize(headerLength + secondDataLength);
-    memcpy(secondPacket.Data(), packet.Data() + secondDataOffset, secondDataLength);
-    if (secondPacket.IPv4())
-        secondPacket.IPv4()->Length = Utils::htons(static_cast<uint16_t>(secondPacket.Buffer().size()));
-    else
-        secondPacket.IPv6()->Length = Utils::htons(static_cast<uint16_t>(secondPacket.Buffer().size()));
-    secondPacket.Tcp()->SeqNum = Utils::htonl(Utils::ntohl(firstPacket.Tcp()->SeqNum) + static_cast<uint32_t>(firstDataLength));
-    secondPacket.RecalcChecksum();
+        if (!result) {
+            SaveScoreboard();
+            ReportHostnameStats();
 
-    if (outOfOrder)
-        std::swap(firstPacket, secondPacket);
+            // Control channel changes are only written while the file is not being edited
+            if (!Utils::CheckFileModified(m_appConfigPath.c_str(), m_appConfigModifiedTime))
+            {
+                SaveControlChanges();
+                continue;
+            }
 
-    m_divert.Send(firstPacket);
-    m_divert.Send(secondPacket);
+            if (!m_appConfig.LoadFile(m_appConfigPath))
+            {
+                printf("[-] The new configuration file is invalid or corrupted.\n");
+                continue;
+            }
 
-    return true;
+            // The file replaced them
+            m_control.TakeModified();
+            
+            printf("[+] The configuration file has been reloaded.\n");
+        }
+    }
 }
 
 void Application::StartMainThread()
@@ -733,6 +884,44 @@ void Application::StopWinDivert()
     CloseServiceHandle(scmHandle);
 }
 
+void Application::SaveScoreboard()
+{
+    if (m_scoreboardPath.empty() || !m_scoreboard.Modified())
+        return;
+
+    if (!m_scoreboard.SaveFile(m_scoreboardPath))
+        printf("[-] Failed to save feedback file\n");
+}
+
+void Application::SaveControlChanges()
+{
+    if (!m_control.TakeModified() || !m_controlConfig.persist)
+        return;
+
+    if (!m_appConfig.SaveFile(m_appConfigPath))
+    {
+        printf("[-] Failed to save the configuration file\n");
+        return;
+    }
+
+    // Written by ourselves, nothing to reload
+    Utils::CheckFileModified(m_appConfigPath.c_str(), m_appConfigModifiedTime);
+}
+
+void Application::ReportHostnameStats()
+{
+    if (!m_hostnameStats || m_statsConfig.interval == 0)
+        return;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    if (now - m_hostnameStatsReported < std::chrono::seconds(m_statsConfig.interval))
+        return;
+
+    m_hostnameStats->Print(m_statsConfig.top);
+    m_hostnameStatsReported = now;
+}
+
 BOOL Application::ConsoleCtrlHandler(DWORD ctrlType)
 {
     if (ctrlType == CTRL_C_EVENT ||
@@ -1,6 +1,10 @@
 #pragma once
 
 #include "ApplicationConfig.h"
+#include "ControlChannel.h"
+#include "HostnameStats.h"
+#include "PacketCapture.h"
+#include "StrategyScoreboard.h"
 #include "WinDivertLib.h"
 
 class Application
@@ -20,15 +24,6 @@ private:
     void Main();
     void ConfigMonitor();
 
-    bool HandlePacket(WinDivertPacket& packet);
-    bool HandleHttp(WinDivertPacket& packet);
-    bool HandleHttps(WinDivertPacket& packet);
-
-    bool HandleHttpFragmentation(WinDivertPacket& packet, const std::string& hostName, size_t hostNameOffset);
-    bool HandleTlsFragmentation(WinDivertPacket& packet, const std::string& serverName, size_t serverNameOffset);
-
-    bool DoTcpFragmentation(WinDivertPacket& packet, size_t offset, bool outOfOrder);
-
     void StartMainThread();
     void WaitMainThread();
 
@@ -36,6 +31,10 @@ private:
     void StopConfigMonitor();
 
     void StopWinDivert();
+
+    void SaveScoreboard();
+    void ReportHostnameStats();
+    void SaveControlChanges();
 private:
     BOOL ConsoleCtrlHandler(DWORD ctrlType);
 
@@ -58,6 +57,9 @@ private:
     std::wstring m_appConfigPath;
     FILETIME m_appConfigModifiedTime;
 
+    // Sniffs instead of diverting and only reports what would have been done
+    bool m_shadowMode;
+
     bool m_serviceMode;
     SERVICE_STATUS_HANDLE m_serviceStatusHandle;
 
@@ -70,6 +72,19 @@ private:
     bool m_configMonitorStop;
 
     WinDivertLib m_divert;
+    QueueController m_queueController;
+    PacketCapture m_capture;
+
+    StrategyScoreboard m_scoreboard;
+    std::wstring m_scoreboardPath;
+
+    // Copied at startup, reported by the configuration monitor every interval
+    ApplicationConfig::StatsConfig m_statsConfig;
+    std::unique_ptr<HostnameStats> m_hostnameStats;
+    std::chrono::steady_clock::time_point m_hostnameStatsReported;
+
+    ApplicationConfig::ControlConfig m_controlConfig;
+    ControlChannel m_control;
 
     enum class CommandType
     {
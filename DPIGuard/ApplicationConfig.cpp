@@ -2,32 +2,308 @@
 #include "ApplicationConfig.h"
 #include "Utils.h"
 
-const ApplicationConfig::GlobalConfig& ApplicationConfig::Global() const
+ApplicationConfig::GlobalConfig ApplicationConfig::Global() const
 {
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
     return m_globalConfig;
 }
 
+ApplicationConfig::EngineConfig ApplicationConfig::Engine() const
+{
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    return m_engineConfig;
+}
+
+ApplicationConfig::CaptureConfig ApplicationConfig::Capture() const
+{
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    return m_captureConfig;
+}
+
+ApplicationConfig::QueueConfig ApplicationConfig::Queue() const
+{
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    return m_queueConfig;
+}
+
+ApplicationConfig::FeedbackConfig ApplicationConfig::Feedback() const
+{
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    return m_feedbackConfig;
+}
+
+ApplicationConfig::StatsConfig ApplicationConfig::Stats() const
+{
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    return m_statsConfig;
+}
+
+ApplicationConfig::ControlConfig ApplicationConfig::Control() const
+{
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    return m_controlConfig;
+}
+
+ApplicationConfig::OverloadConfig ApplicationConfig::Overload() const
+{
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    return m_overloadConfig;
+}
+
+ApplicationConfig::NfQueueConfig ApplicationConfig::NfQueue() const
+{
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    return m_nfQueueConfig;
+}
+
 const std::list<std::shared_ptr<ApplicationConfig::DomainConfig>>& ApplicationConfig::Domains() const
 {
     return m_domainConfigs;
 }
 
+const std::vector<std::shared_ptr<ApplicationConfig::NetworkConfig>>& ApplicationConfig::Networks() const
+{
+    return m_networkConfigs;
+}
+
+const std::vector<std::shared_ptr<ApplicationConfig::FingerprintConfig>>& ApplicationConfig::Fingerprints() const
+{
+    return m_fingerprintConfigs;
+}
+
 std::shared_ptr<const ApplicationConfig::DomainConfig> ApplicationConfig::GetDomainConfig(const std::string& domain)
 {
     std::shared_lock<std::shared_mutex> locked(m_lock);
 
-    for (const std::shared_ptr<DomainConfig>& domainConfig : Domains())
+    return MatchDomain(domain, FindLiteralDomain(domain));
+}
+
+void ApplicationConfig::GetDomainConfigs(const std::string* const* domains, size_t count, std::shared_ptr<const DomainConfig>* domainConfigs)
+{
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    // The filter blocks of every suffix FindLiteralDomain will test are requested first
+    for (size_t i = 0; i < count; i++)
     {
-        for (const std::string& domainPattern : domainConfig->domainPatterns)
+        const std::string& domain = *domains[i];
+        uint64_t hash = 0xcbf29ce484222325ULL;
+
+        for (size_t j = domain.size(); j > 0; j--)
         {
-            if (Utils::MatchString(domain.c_str(), domainPattern.c_str()))
-                return domainConfig;
+            hash ^= static_cast<uint8_t>(tolower(static_cast<uint8_t>(domain[j - 1])));
+            hash *= 0x100000001b3ULL;
+
+            if (j == 1 || domain[j - 2] == '.')
+                m_domainFilter.Prefetch(hash);
         }
     }
 
+    // Then the index entries are found and the entries they point to requested, again before any is used
+    std::vector<const DomainIndexEntry*> literals(count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        literals[i] = FindLiteralDomain(*domains[i]);
+
+        if (literals[i])
+            Utils::Prefetch(&*literals[i]->domainConfig);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (literals[i])
+            Utils::Prefetch(literals[i]->domainConfig->get());
+    }
+
+    for (size_t i = 0; i < count; i++)
+        domainConfigs[i] = MatchDomain(*domains[i], literals[i]);
+}
+
+std::shared_ptr<const ApplicationConfig::NetworkConfig> ApplicationConfig::GetNetworkConfig(const uint8_t* address, bool ipv6)
+{
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    uint32_t value = ipv6 ? m_ipv6Networks.Lookup(address) : m_ipv4Networks.Lookup(address);
+    if (value == 0)
+        return nullptr;
+
+    return m_networkConfigs[value - 1];
+}
+
+bool ApplicationConfig::UsesFingerprints() const
+{
+    return m_fingerprintFormats.load(std::memory_order_relaxed) != 0;
+}
+
+std::shared_ptr<const ApplicationConfig::FingerprintConfig> ApplicationConfig::GetFingerprintConfig(const TlsFingerprint& fingerprint)
+{
+    uint32_t formats = m_fingerprintFormats.load(std::memory_order_relaxed);
+
+    // Computed before taking the lock, the digests take longer than the lookups
+    std::string texts[3];
+    size_t count = 0;
+
+    if (formats & (1u << static_cast<int>(TlsFingerprint::Format::Ja3)))
+        texts[count++] = fingerprint.Ja3();
+    if (formats & (1u << static_cast<int>(TlsFingerprint::Format::Ja3Hash)))
+        texts[count++] = fingerprint.Ja3Hash();
+    if (formats & (1u << static_cast<int>(TlsFingerprint::Format::Ja4)))
+        texts[count++] = fingerprint.Ja4();
+
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        auto it = m_fingerprintIndex.find(Utils::HashString(texts[i].c_str(), texts[i].size()));
+
+        if (it != m_fingerprintIndex.end() && it->second->fingerprint == texts[i])
+            return it->second;
+    }
+
     return nullptr;
 }
 
+bool ApplicationConfig::UsesTlsRecords() const
+{
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    if (m_globalConfig.tlsFragmentationEnabled && m_globalConfig.tlsFragmentationRecords)
+        return true;
+
+    for (const std::shared_ptr<NetworkConfig>& networkConfig : m_networkConfigs)
+    {
+        if (networkConfig->tlsFragmentationEnabled && networkConfig->tlsFragmentationRecords)
+            return true;
+    }
+
+    for (const std::shared_ptr<FingerprintConfig>& fingerprintConfig : m_fingerprintConfigs)
+    {
+        if (fingerprintConfig->tlsFragmentationEnabled && fingerprintConfig->tlsFragmentationRecords)
+            return true;
+    }
+
+    for (const std::shared_ptr<DomainConfig>& domainConfig : m_domainConfigs)
+    {
+        if (domainConfig->tlsFragmentationEnabled && domainConfig->tlsFragmentationRecords)
+            return true;
+    }
+
+    return false;
+}
+
+bool ApplicationConfig::ParseDomain(YAML::Node domainConfigNode, DomainConfig& domainConfig)
+{
+    GlobalConfig globalConfig;
+
+    {
+        std::shared_lock<std::shared_mutex> locked(m_lock);
+        globalConfig = m_globalConfig;
+    }
+
+    return ParseDomain(domainConfigNode, globalConfig, domainConfig);
+}
+
+YAML::Node ApplicationConfig::SaveDomain(const DomainConfig& domainConfig) const
+{
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    return SaveDomain(m_globalConfig, domainConfig);
+}
+
+std::shared_ptr<const ApplicationConfig::DomainConfig> ApplicationConfig::FindDomain(const std::string& domain)
+{
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    auto it = m_domainIndex.find(NormalizeDomain(domain));
+    if (it == m_domainIndex.end())
+        return nullptr;
+
+    return *it->second.domainConfig;
+}
+
+bool ApplicationConfig::AddDomain(const std::shared_ptr<DomainConfig>& domainConfig)
+{
+    std::string normalizedDomain = NormalizeDomain(domainConfig->domain);
+
+    std::unique_lock<std::shared_mutex> locked(m_lock);
+
+    if (m_domainIndex.find(normalizedDomain) != m_domainIndex.end())
+        return false;
+
+    DomainIndexEntry indexEntry;
+    indexEntry.domainConfig = m_domainConfigs.insert(m_domainConfigs.end(), domainConfig);
+    indexEntry.wildcard = !IsLiteralDomain(domainConfig->domain);
+    indexEntry.order = m_nextOrder++;
+
+    if (indexEntry.wildcard)
+        indexEntry.wildcardDomainConfig = m_wildcardDomainConfigs.emplace(m_wildcardDomainConfigs.end(), indexEntry.order, domainConfig);
+    else
+        InsertDomainFilter(*domainConfig);
+
+    m_domainIndex.emplace(std::move(normalizedDomain), indexEntry);
+    m_generation.fetch_add(1, std::memory_order_release);
+
+    return true;
+}
+
+bool ApplicationConfig::UpdateDomain(const std::shared_ptr<DomainConfig>& domainConfig)
+{
+    std::string normalizedDomain = NormalizeDomain(domainConfig->domain);
+
+    std::unique_lock<std::shared_mutex> locked(m_lock);
+
+    auto it = m_domainIndex.find(normalizedDomain);
+    if (it == m_domainIndex.end())
+        return false;
+
+    // The name is the same, so is whether it has wildcards. The entry keeps its position.
+    *it->second.domainConfig = domainConfig;
+    if (it->second.wildcard)
+        it->second.wildcardDomainConfig->domainConfig = domainConfig;
+
+    m_generation.fetch_add(1, std::memory_order_release);
+
+    return true;
+}
+
+bool ApplicationConfig::RemoveDomain(const std::string& domain)
+{
+    std::unique_lock<std::shared_mutex> locked(m_lock);
+
+    auto it = m_domainIndex.find(NormalizeDomain(domain));
+    if (it == m_domainIndex.end())
+        return false;
+
+    // The domain filter keeps the name until it is rebuilt, a false positive that only costs an index lookup
+    m_domainConfigs.erase(it->second.domainConfig);
+    if (it->second.wildcard)
+        m_wildcardDomainConfigs.erase(it->second.wildcardDomainConfig);
+
+    m_domainIndex.erase(it);
+    m_generation.fetch_add(1, std::memory_order_release);
+
+    return true;
+}
+
+uint64_t ApplicationConfig::Generation() const
+{
+    return m_generation.load(std::memory_order_acquire);
+}
+
+size_t ApplicationConfig::DomainFilterSize() const
+{
+    return m_domainFilter.Size();
+}
+
 bool ApplicationConfig::LoadFile(const std::wstring& filePath)
 {
     const std::string configString = Utils::ReadTextFile(filePath.c_str());
@@ -57,7 +333,23 @@ bool ApplicationConfig::Load(const std::string& configString)
 bool ApplicationConfig::Load(YAML::Node configNode)
 {
     GlobalConfig globalConfig;
+    EngineConfig engineConfig;
+    CaptureConfig captureConfig;
+    QueueConfig queueConfig;
+    FeedbackConfig feedbackConfig;
+    StatsConfig statsConfig;
+    ControlConfig controlConfig;
+    OverloadConfig overloadConfig;
+    NfQueueConfig nfQueueConfig;
     std::list<std::shared_ptr<DomainConfig>> domainConfigs;
+    std::list<WildcardDomainConfig> wildcardDomainConfigs;
+    BloomFilter domainFilter;
+    std::vector<std::shared_ptr<NetworkConfig>> networkConfigs;
+    PrefixTable<4> ipv4Networks;
+    PrefixTable<16> ipv6Networks;
+    std::vector<std::shared_ptr<FingerprintConfig>> fingerprintConfigs;
+    std::unordered_map<uint64_t, std::shared_ptr<FingerprintConfig>> fingerprintIndex;
+    uint32_t fingerprintFormats = 0;
 
     globalConfig.includeSubdomains = true;
     globalConfig.httpFragmentationEnabled = true;
@@ -72,6 +364,15 @@ bool ApplicationConfig::Load(YAML::Node configNode)
         std::unique_lock<std::shared_mutex> locked(m_lock);
 
         m_globalConfig = globalConfig;
+        m_engineConfig = engineConfig;
+        m_captureConfig = captureConfig;
+        m_queueConfig = queueConfig;
+        m_feedbackConfig = feedbackConfig;
+        m_statsConfig = statsConfig;
+        m_controlConfig = controlConfig;
+        m_overloadConfig = overloadConfig;
+        m_nfQueueConfig = nfQueueConfig;
+        m_generation.fetch_add(1, std::memory_order_release);
         return true;
     }
 
@@ -79,7 +380,17 @@ bool ApplicationConfig::Load(YAML::Node configNode)
         return false;
 
     YAML::Node globalConfigNode = configNode["global"];
+    YAML::Node engineConfigNode = configNode["engine"];
+    YAML::Node captureConfigNode = configNode["capture"];
+    YAML::Node queueConfigNode = configNode["queue"];
+    YAML::Node feedbackConfigNode = configNode["feedback"];
+    YAML::Node statsConfigNode = configNode["stats"];
+    YAML::Node controlConfigNode = configNode["control"];
+    YAML::Node overloadConfigNode = configNode["overload"];
+    YAML::Node nfQueueConfigNode = configNode["nfqueue"];
     YAML::Node domainConfigsNode = configNode["domains"];
+    YAML::Node networkConfigsNode = configNode["networks"];
+    YAML::Node fingerprintConfigsNode = configNode["fingerprints"];
 
     if (globalConfigNode.IsDefined())
     {
@@ -153,6 +464,7 @@ bool ApplicationConfig::Load(YAML::Node configNode)
             YAML::Node tlsFragmentationEnabledNode = tlsFragmentationNode["enabled"];
             YAML::Node tlsFragmentationOffsetNode = tlsFragmentationNode["offset"];
             YAML::Node tlsFragmentationOutOfOrderNode = tlsFragmentationNode["outOfOrder"];
+            YAML::Node tlsFragmentationRecordsNode = tlsFragmentationNode["records"];
 
             if (tlsFragmentationEnabledNode.IsDefined() && !tlsFragmentationEnabledNode.IsScalar())
                 return false;
@@ -160,6 +472,8 @@ bool ApplicationConfig::Load(YAML::Node configNode)
                 return false;
             if (tlsFragmentationOutOfOrderNode.IsDefined() && !tlsFragmentationOutOfOrderNode.IsScalar())
                 return false;
+            if (tlsFragmentationRecordsNode.IsDefined() && !tlsFragmentationRecordsNode.IsScalar())
+                return false;
 
             try
             {
@@ -184,249 +498,969 @@ bool ApplicationConfig::Load(YAML::Node configNode)
             catch (const YAML::Exception&)
             {
             }
+
+            try
+            {
+                globalConfig.tlsFragmentationRecords = tlsFragmentationRecordsNode.as<bool>();
+            }
+            catch (const YAML::Exception&)
+            {
+            }
         }
     }
 
-    if (domainConfigsNode.IsDefined())
+    if (engineConfigNode.IsDefined())
     {
-        if (!domainConfigsNode.IsSequence())
+        if (!engineConfigNode.IsMap())
             return false;
 
-        for (YAML::Node domainConfigNode : domainConfigsNode)
+        YAML::Node workersNode = engineConfigNode["workers"];
+
+        if (workersNode.IsDefined())
         {
-            std::shared_ptr<DomainConfig> domainConfig = std::make_shared<DomainConfig>();
+            if (!workersNode.IsScalar())
+                return false;
+
+            try
+            {
+                engineConfig.workers = std::max<size_t>(workersNode.as<size_t>(), 1);
+            }
+            catch (const YAML::Exception&)
+            {
+                return false;
+            }
+        }
 
-            domainConfig->includeSubdomains = globalConfig.includeSubdomains;
-            domainConfig->httpFragmentationEnabled = globalConfig.httpFragmentationEnabled;
-            domainConfig->httpFragmentationOffset = globalConfig.httpFragmentationOffset;
-            domainConfig->httpFragmentationOutOfOrder = globalConfig.httpFragmentationOutOfOrder;
-            domainConfig->tlsFragmentationEnabled = globalConfig.tlsFragmentationEnabled;
-            domainConfig->tlsFragmentationOffset = globalConfig.tlsFragmentationOffset;
-            domainConfig->tlsFragmentationOutOfOrder = globalConfig.tlsFragmentationOutOfOrder;
+        YAML::Node stagedNode = engineConfigNode["staged"];
 
-            if (domainConfigNode.IsMap())
+        if (stagedNode.IsDefined())
+        {
+            if (!stagedNode.IsScalar())
+                return false;
+
+            try
             {
-                YAML::Node domainNode = domainConfigNode["domain"];
-                YAML::Node includeSubdomainsNode = domainConfigNode["includeSubdomains"];
-                YAML::Node httpFragmentationNode = globalConfigNode["httpFragmentation"];
-                YAML::Node tlsFragmentationNode = domainConfigNode["tlsFragmentation"];
+                engineConfig.staged = stagedNode.as<bool>();
+            }
+            catch (const YAML::Exception&)
+            {
+                return false;
+            }
+        }
 
-                if (!domainNode.IsScalar())
-                    return false;
+        YAML::Node spinNode = engineConfigNode["spin"];
 
-                try
-                {
-                    std::string domain = domainNode.as<std::string>();
-
-                    if (domain.empty())
-                        return false;
-
-                    domainConfig->domain = domain;
-                }
-                catch (const YAML::Exception&)
-                {
-                }
-
-                if (includeSubdomainsNode.IsDefined())
-                {
-                    if (!includeSubdomainsNode.IsScalar())
-                        return false;
-
-                    try
-                    {
-                        domainConfig->includeSubdomains = includeSubdomainsNode.as<bool>();
-                    }
-                    catch (const YAML::Exception&)
-                    {
-                    }
-                }
-
-                if (httpFragmentationNode.IsDefined())
-                {
-                    if (!httpFragmentationNode.IsMap())
-                        return false;
-
-                    YAML::Node httpFragmentationEnabledNode = httpFragmentationNode["enabled"];
-                    YAML::Node httpFragmentationOffsetNode = httpFragmentationNode["offset"];
-                    YAML::Node httpFragmentationOutOfOrderNode = httpFragmentationNode["outOfOrder"];
-
-                    if (httpFragmentationEnabledNode.IsDefined() && !httpFragmentationEnabledNode.IsScalar())
-                        return false;
-                    if (httpFragmentationOffsetNode.IsDefined() && !httpFragmentationOffsetNode.IsScalar())
-                        return false;
-                    if (httpFragmentationOutOfOrderNode.IsDefined() && !httpFragmentationOutOfOrderNode.IsScalar())
-                        return false;
-
-                    try
-                    {
-                        domainConfig->httpFragmentationEnabled = httpFragmentationEnabledNode.as<bool>();
-                    }
-                    catch (const YAML::Exception&)
-                    {
-                    }
-
-                    try
-                    {
-                        domainConfig->httpFragmentationOffset = httpFragmentationOffsetNode.as<size_t>();
-                    }
-                    catch (const YAML::Exception&)
-                    {
-                    }
-
-                    try
-                    {
-                        domainConfig->httpFragmentationOutOfOrder = httpFragmentationOutOfOrderNode.as<bool>();
-                    }
-                    catch (const YAML::Exception&)
-                    {
-                    }
-                }
-
-                if (tlsFragmentationNode.IsDefined())
-                {
-                    if (!tlsFragmentationNode.IsMap())
-                        return false;
-
-                    YAML::Node tlsFragmentationEnabledNode = tlsFragmentationNode["enabled"];
-                    YAML::Node tlsFragmentationOffsetNode = tlsFragmentationNode["offset"];
-                    YAML::Node tlsFragmentationOutOfOrderNode = tlsFragmentationNode["outOfOrder"];
-
-                    if (tlsFragmentationEnabledNode.IsDefined() && !tlsFragmentationEnabledNode.IsScalar())
-                        return false;
-                    if (tlsFragmentationOffsetNode.IsDefined() && !tlsFragmentationOffsetNode.IsScalar())
-                        return false;
-                    if (tlsFragmentationOutOfOrderNode.IsDefined() && !tlsFragmentationOutOfOrderNode.IsScalar())
-                        return false;
-
-                    try
-                    {
-                        domainConfig->tlsFragmentationEnabled = tlsFragmentationEnabledNode.as<bool>();
-                    }
-                    catch (const YAML::Exception&)
-                    {
-                    }
-
-                    try
-                    {
-                        domainConfig->tlsFragmentationOffset = tlsFragmentationOffsetNode.as<size_t>();
-                    }
-                    catch (const YAML::Exception&)
-                    {
-                    }
-
-                    try
-                    {
-                        domainConfig->tlsFragmentationOutOfOrder = tlsFragmentationOutOfOrderNode.as<bool>();
-                    }
-                    catch (const YAML::Exception&)
-                    {
-                    }
-                }
-            }
-            else if (domainConfigNode.IsScalar())
-            {
-                try
-                {
-                    std::string domain = domainConfigNode.as<std::string>();
-
-                    if (domain.empty())
-                        return false;
-
-                    domainConfig->domain = domain;
-                }
-                catch (const YAML::Exception&)
-                {
-                    return false;
-                }
+        if (spinNode.IsDefined())
+        {
+            if (!spinNode.IsScalar())
+                return false;
+
+            try
+            {
+                engineConfig.spin = spinNode.as<uint64_t>();
             }
-            else
+            catch (const YAML::Exception&)
             {
                 return false;
             }
+        }
 
-            domainConfig->domainPatterns.push_back(domainConfig->domain);
-            if (domainConfig->includeSubdomains)
-                domainConfig->domainPatterns.push_back("*." + domainConfig->domain);
+        YAML::Node largePagesNode = engineConfigNode["largePages"];
 
-            domainConfigs.push_back(std::move(domainConfig));
+        if (largePagesNode.IsDefined())
+        {
+            if (!largePagesNode.IsScalar())
+                return false;
+
+            try
+            {
+                engineConfig.largePages = largePagesNode.as<bool>();
+            }
+            catch (const YAML::Exception&)
+            {
+                return false;
+            }
         }
     }
 
+    if (captureConfigNode.IsDefined())
     {
-        std::unique_lock<std::shared_mutex> locked(m_lock);
+        if (!captureConfigNode.IsMap())
+            return false;
 
-        m_globalConfig = globalConfig;
-        m_domainConfigs = std::move(domainConfigs);
-    }
+        YAML::Node enabledNode = captureConfigNode["enabled"];
+        YAML::Node maxFileSizeNode = captureConfigNode["maxFileSize"];
+        YAML::Node maxFilesNode = captureConfigNode["maxFiles"];
 
-    return true;
-}
+        try
+        {
+            if (enabledNode.IsDefined())
+                captureConfig.enabled = enabledNode.as<bool>();
+            if (maxFileSizeNode.IsDefined())
+                captureConfig.maxFileSize = maxFileSizeNode.as<uint64_t>();
+            if (maxFilesNode.IsDefined())
+                captureConfig.maxFiles = std::max<size_t>(maxFilesNode.as<size_t>(), 1);
+        }
+        catch (const YAML::Exception&)
+        {
+            return false;
+        }
+    }
 
-bool ApplicationConfig::SaveFile(const std::wstring& filePath) const
-{
-    try
+    if (queueConfigNode.IsDefined())
     {
-        const YAML::Node configNode = Save();
-        const std::string configString = YAML::Dump(configNode);
+        if (!queueConfigNode.IsMap())
+            return false;
 
-        return Utils::WriteTextFile(configString, filePath.c_str());
-    }
-    catch (const YAML::Exception&)
-    {
-        return false;
+        YAML::Node lengthNode = queueConfigNode["length"];
+        YAML::Node timeNode = queueConfigNode["time"];
+        YAML::Node sizeNode = queueConfigNode["size"];
+        YAML::Node adaptiveNode = queueConfigNode["adaptive"];
+        YAML::Node receivesNode = queueConfigNode["receives"];
+        YAML::Node batchNode = queueConfigNode["batch"];
+
+        try
+        {
+            if (lengthNode.IsDefined())
+                queueConfig.length = lengthNode.as<uint64_t>();
+            if (timeNode.IsDefined())
+                queueConfig.time = timeNode.as<uint64_t>();
+            if (sizeNode.IsDefined())
+                queueConfig.size = sizeNode.as<uint64_t>();
+            if (adaptiveNode.IsDefined())
+                queueConfig.adaptive = adaptiveNode.as<bool>();
+            if (receivesNode.IsDefined())
+                queueConfig.receives = receivesNode.as<size_t>();
+            if (batchNode.IsDefined())
+                queueConfig.batch = std::min<size_t>(std::max<size_t>(batchNode.as<size_t>(), 1), WINDIVERT_BATCH_MAX);
+        }
+        catch (const YAML::Exception&)
+        {
+            return false;
+        }
     }
-}
 
-YAML::Node ApplicationConfig::Save() const
-{
-    YAML::Node configNode;
+    if (feedbackConfigNode.IsDefined())
+    {
+        if (!feedbackConfigNode.IsMap())
+            return false;
 
-    YAML::Node globalConfigNode = configNode["global"];
-    globalConfigNode["includeSubdomains"] = m_globalConfig.includeSubdomains;
+        YAML::Node enabledNode = feedbackConfigNode["enabled"];
+        YAML::Node timeoutNode = feedbackConfigNode["timeout"];
+        YAML::Node offsetsNode = feedbackConfigNode["offsets"];
 
-    YAML::Node httpFragmentationNode = globalConfigNode["httpFragmentation"];
-    httpFragmentationNode["enabled"] = m_globalConfig.httpFragmentationEnabled;
-    httpFragmentationNode["offset"] = m_globalConfig.httpFragmentationOffset;
-    httpFragmentationNode["outOfOrder"] = m_globalConfig.httpFragmentationOutOfOrder;
+        if (offsetsNode.IsDefined() && !offsetsNode.IsSequence())
+            return false;
+
+        try
+        {
+            if (enabledNode.IsDefined())
+                feedbackConfig.enabled = enabledNode.as<bool>();
+            if (timeoutNode.IsDefined())
+                feedbackConfig.timeout = std::max<uint32_t>(timeoutNode.as<uint32_t>(), 1);
+
+            if (offsetsNode.IsDefined())
+            {
+                feedbackConfig.offsets.clear();
+
+                for (const YAML::Node& offsetNode : offsetsNode)
+                    feedbackConfig.offsets.push_back(offsetNode.as<size_t>());
+            }
+        }
+        catch (const YAML::Exception&)
+        {
+            return false;
+        }
+    }
+
+    if (statsConfigNode.IsDefined())
+    {
+        if (!statsConfigNode.IsMap())
+            return false;
+
+        YAML::Node enabledNode = statsConfigNode["enabled"];
+        YAML::Node capacityNode = statsConfigNode["capacity"];
+        YAML::Node topNode = statsConfigNode["top"];
+        YAML::Node intervalNode = statsConfigNode["interval"];
+
+        try
+        {
+            if (enabledNode.IsDefined())
+                statsConfig.enabled = enabledNode.as<bool>();
+            if (capacityNode.IsDefined())
+                statsConfig.capacity = std::max<size_t>(capacityNode.as<size_t>(), 16);
+            if (topNode.IsDefined())
+                statsConfig.top = topNode.as<size_t>();
+            if (intervalNode.IsDefined())
+                statsConfig.interval = intervalNode.as<uint32_t>();
+        }
+        catch (const YAML::Exception&)
+        {
+            return false;
+        }
+    }
+
+    if (controlConfigNode.IsDefined())
+    {
+        if (!controlConfigNode.IsMap())
+            return false;
+
+        YAML::Node enabledNode = controlConfigNode["enabled"];
+        YAML::Node pathNode = controlConfigNode["path"];
+        YAML::Node persistNode = controlConfigNode["persist"];
+
+        try
+        {
+            if (enabledNode.IsDefined())
+                controlConfig.enabled = enabledNode.as<bool>();
+            if (pathNode.IsDefined() && !pathNode.IsNull())
+                controlConfig.path = pathNode.as<std::string>();
+            if (persistNode.IsDefined())
+                controlConfig.persist = persistNode.as<bool>();
+        }
+        catch (const YAML::Exception&)
+        {
+            return false;
+        }
+    }
+
+    if (overloadConfigNode.IsDefined())
+    {
+        if (!overloadConfigNode.IsMap())
+            return false;
+
+        YAML::Node budgetNode = overloadConfigNode["budget"];
+        YAML::Node actionNode = overloadConfigNode["action"];
+
+        try
+        {
+            if (budgetNode.IsDefined())
+                overloadConfig.budget = budgetNode.as<uint64_t>();
+            if (actionNode.IsDefined())
+                overloadConfig.action = actionNode.as<std::string>();
+        }
+        catch (const YAML::Exception&)
+        {
+            return false;
+        }
+
+        if (overloadConfig.action != "pass" && overloadConfig.action != "cached")
+            return false;
+    }
+
+    if (nfQueueConfigNode.IsDefined())
+    {
+        if (!nfQueueConfigNode.IsMap())
+            return false;
+
+        YAML::Node numberNode = nfQueueConfigNode["number"];
+        YAML::Node injectionNode = nfQueueConfigNode["injection"];
+        YAML::Node markNode = nfQueueConfigNode["mark"];
+        YAML::Node mtuNode = nfQueueConfigNode["mtu"];
+        YAML::Node batchNode = nfQueueConfigNode["batch"];
+
+        try
+        {
+            if (numberNode.IsDefined())
+                nfQueueConfig.number = numberNode.as<uint16_t>();
+            if (injectionNode.IsDefined())
+                nfQueueConfig.injection = injectionNode.as<std::string>();
+            if (markNode.IsDefined())
+                nfQueueConfig.mark = markNode.as<uint32_t>();
+            if (mtuNode.IsDefined())
+                nfQueueConfig.mtu = std::max<size_t>(mtuNode.as<size_t>(), 1280);
+            if (batchNode.IsDefined())
+                nfQueueConfig.batch = std::max<size_t>(batchNode.as<size_t>(), 1);
+        }
+        catch (const YAML::Exception&)
+        {
+            return false;
+        }
+
+        if (nfQueueConfig.injection != "raw" && nfQueueConfig.injection != "verdict")
+            return false;
+    }
+
+    if (domainConfigsNode.IsDefined())
+    {
+        if (!domainConfigsNode.IsSequence())
+            return false;
+
+        for (YAML::Node domainConfigNode : domainConfigsNode)
+        {
+            std::shared_ptr<DomainConfig> domainConfig = std::make_shared<DomainConfig>();
+
+            if (!ParseDomain(domainConfigNode, globalConfig, *domainConfig))
+                return false;
+
+            domainConfigs.push_back(std::move(domainConfig));
+        }
+    }
+
+    if (networkConfigsNode.IsDefined())
+    {
+        if (!networkConfigsNode.IsSequence())
+            return false;
+
+        for (YAML::Node networkConfigNode : networkConfigsNode)
+        {
+            std::shared_ptr<NetworkConfig> networkConfig = std::make_shared<NetworkConfig>();
+
+            networkConfig->httpFragmentationEnabled = globalConfig.httpFragmentationEnabled;
+            networkConfig->httpFragmentationOffset = globalConfig.httpFragmentationOffset;
+            networkConfig->httpFragmentationOutOfOrder = globalConfig.httpFragmentationOutOfOrder;
+            networkConfig->tlsFragmentationEnabled = globalConfig.tlsFragmentationEnabled;
+            networkConfig->tlsFragmentationOffset = globalConfig.tlsFragmentationOffset;
+            networkConfig->tlsFragmentationOutOfOrder = globalConfig.tlsFragmentationOutOfOrder;
+            networkConfig->tlsFragmentationRecords = globalConfig.tlsFragmentationRecords;
+
+            if (!networkConfigNode.IsMap() && !networkConfigNode.IsScalar())
+                return false;
+
+            YAML::Node networkNode = networkConfigNode.IsMap() ? networkConfigNode["network"] : networkConfigNode;
+            if (!networkNode.IsScalar())
+                return false;
+
+            try
+            {
+                if (!ParseNetwork(networkNode.as<std::string>(), *networkConfig))
+                    return false;
+            }
+            catch (const YAML::Exception&)
+            {
+                return false;
+            }
+
+            if (networkConfigNode.IsMap())
+            {
+                if (!ParseFragmentation(networkConfigNode["httpFragmentation"],
+                    networkConfig->httpFragmentationEnabled, networkConfig->httpFragmentationOffset, networkConfig->httpFragmentationOutOfOrder))
+                    return false;
+
+                if (!ParseFragmentation(networkConfigNode["tlsFragmentation"],
+                    networkConfig->tlsFragmentationEnabled, networkConfig->tlsFragmentationOffset, networkConfig->tlsFragmentationOutOfOrder,
+                    &networkConfig->tlsFragmentationRecords))
+                    return false;
+            }
+
+            networkConfigs.push_back(std::move(networkConfig));
+        }
+    }
+
+    if (fingerprintConfigsNode.IsDefined())
+    {
+        if (!fingerprintConfigsNode.IsSequence())
+            return false;
+
+        for (YAML::Node fingerprintConfigNode : fingerprintConfigsNode)
+        {
+            std::shared_ptr<FingerprintConfig> fingerprintConfig = std::make_shared<FingerprintConfig>();
+
+            fingerprintConfig->tlsFragmentationEnabled = globalConfig.tlsFragmentationEnabled;
+            fingerprintConfig->tlsFragmentationOffset = globalConfig.tlsFragmentationOffset;
+            fingerprintConfig->tlsFragmentationOutOfOrder = globalConfig.tlsFragmentationOutOfOrder;
+            fingerprintConfig->tlsFragmentationRecords = globalConfig.tlsFragmentationRecords;
+
+            if (!fingerprintConfigNode.IsMap() && !fingerprintConfigNode.IsScalar())
+                return false;
+
+            YAML::Node fingerprintNode = fingerprintConfigNode.IsMap() ? fingerprintConfigNode["fingerprint"] : fingerprintConfigNode;
+            if (!fingerprintNode.IsScalar())
+                return false;
+
+            try
+            {
+                fingerprintConfig->fingerprint = fingerprintNode.as<std::string>();
+            }
+            catch (const YAML::Exception&)
+            {
+                return false;
+            }
+
+            fingerprintConfig->format = TlsFingerprint::Parse(fingerprintConfig->fingerprint);
+            if (fingerprintConfig->format == TlsFingerprint::Format::Invalid)
+                return false;
+
+            if (fingerprintConfigNode.IsMap())
+            {
+                if (!ParseFragmentation(fingerprintConfigNode["tlsFragmentation"],
+                    fingerprintConfig->tlsFragmentationEnabled, fingerprintConfig->tlsFragmentationOffset,
+                    fingerprintConfig->tlsFragmentationOutOfOrder, &fingerprintConfig->tlsFragmentationRecords))
+                    return false;
+            }
+
+            // The first entry of a fingerprint wins, like for domains
+            fingerprintIndex.emplace(Utils::HashString(fingerprintConfig->fingerprint.c_str(), fingerprintConfig->fingerprint.size()),
+                fingerprintConfig);
+            fingerprintFormats |= 1u << static_cast<int>(fingerprintConfig->format);
+
+            fingerprintConfigs.push_back(std::move(fingerprintConfig));
+        }
+    }
+
+    std::vector<PrefixTable<4>::Prefix> ipv4Prefixes;
+    std::vector<PrefixTable<16>::Prefix> ipv6Prefixes;
+
+    for (size_t i = 0; i < networkConfigs.size(); i++)
+    {
+        const NetworkConfig& networkConfig = *networkConfigs[i];
+
+        if (networkConfig.ipv6)
+        {
+            PrefixTable<16>::Prefix prefix;
+            std::copy(networkConfig.address.begin(), networkConfig.address.end(), prefix.address.begin());
+            prefix.length = networkConfig.prefixLength;
+            prefix.value = static_cast<uint32_t>(i + 1);
+
+            ipv6Prefixes.push_back(prefix);
+        }
+        else
+        {
+            PrefixTable<4>::Prefix prefix;
+            std::copy(networkConfig.address.begin(), networkConfig.address.begin() + 4, prefix.address.begin());
+            prefix.length = networkConfig.prefixLength;
+            prefix.value = static_cast<uint32_t>(i + 1);
+
+            ipv4Prefixes.push_back(prefix);
+        }
+    }
+
+    ipv4Networks.Build(ipv4Prefixes);
+    ipv6Networks.Build(ipv6Prefixes);
+
+    size_t domainFilterCapacity = domainConfigs.size();
+    domainFilter.Reset(domainFilterCapacity);
+
+    // Nodes and buckets of the index, the key strings themselves stay on the heap
+    std::shared_ptr<LargePageArena> domainIndexArena;
+    if (engineConfig.largePages && !domainConfigs.empty())
+        domainIndexArena = std::make_shared<LargePageArena>("domain index", domainConfigs.size() * (sizeof(DomainIndex::value_type) + 64));
+
+    DomainIndex domainIndex(0, std::hash<std::string>(), std::equal_to<std::string>(), DomainIndex::allocator_type(domainIndexArena));
+    domainIndex.reserve(domainConfigs.size());
+
+    uint64_t order = 0;
+
+    for (auto it = domainConfigs.begin(); it != domainConfigs.end(); ++it)
+    {
+        const std::shared_ptr<DomainConfig>& domainConfig = *it;
+
+        DomainIndexEntry indexEntry;
+        indexEntry.domainConfig = it;
+        indexEntry.wildcard = !IsLiteralDomain(domainConfig->domain);
+        indexEntry.order = order++;
+
+        std::string normalizedDomain = NormalizeDomain(domainConfig->domain);
+
+        // The first entry of a name is the one that is indexed. Later ones can still match subdomains the first
+        // one does not include, so they are matched one by one like wildcard domains.
+        if (indexEntry.wildcard || domainIndex.find(normalizedDomain) != domainIndex.end())
+            indexEntry.wildcardDomainConfig = wildcardDomainConfigs.emplace(wildcardDomainConfigs.end(), indexEntry.order, domainConfig);
+        else
+            domainFilter.Insert(HashDomain(domainConfig->domain.c_str(), domainConfig->domain.size()));
+
+        domainIndex.emplace(std::move(normalizedDomain), indexEntry);
+    }
+
+    {
+        std::unique_lock<std::shared_mutex> locked(m_lock);
+
+        m_globalConfig = globalConfig;
+        m_engineConfig = engineConfig;
+        m_captureConfig = captureConfig;
+        m_queueConfig = queueConfig;
+        m_feedbackConfig = feedbackConfig;
+        m_statsConfig = statsConfig;
+        m_controlConfig = controlConfig;
+        m_overloadConfig = overloadConfig;
+        m_nfQueueConfig = nfQueueConfig;
+        // Swapped rather than moved, the index keeps pointing into the lists. The old entries are freed
+        // after the lock is released.
+        m_domainConfigs.swap(domainConfigs);
+        m_wildcardDomainConfigs.swap(wildcardDomainConfigs);
+        m_domainIndex.swap(domainIndex);
+        m_nextOrder = m_domainConfigs.size();
+        m_domainFilter = std::move(domainFilter);
+        m_domainFilterCapacity = domainFilterCapacity;
+        m_networkConfigs = std::move(networkConfigs);
+        m_ipv4Networks = std::move(ipv4Networks);
+        m_ipv6Networks = std::move(ipv6Networks);
+        m_fingerprintConfigs = std::move(fingerprintConfigs);
+        m_fingerprintIndex = std::move(fingerprintIndex);
+        m_fingerprintFormats.store(fingerprintFormats, std::memory_order_relaxed);
+        m_generation.fetch_add(1, std::memory_order_release);
+    }
+
+    return true;
+}
+
+bool ApplicationConfig::SaveFile(const std::wstring& filePath) const
+{
+    try
+    {
+        const YAML::Node configNode = Save();
+        const std::string configString = YAML::Dump(configNode);
+
+        return Utils::WriteTextFile(configString, filePath.c_str());
+    }
+    catch (const YAML::Exception&)
+    {
+        return false;
+    }
+}
+
+YAML::Node ApplicationConfig::Save() const
+{
+    // Domains may be changed through the control channel while the file is written
+    std::shared_lock<std::shared_mutex> locked(m_lock);
+
+    YAML::Node configNode;
+
+    YAML::Node globalConfigNode = configNode["global"];
+    globalConfigNode["includeSubdomains"] = m_globalConfig.includeSubdomains;
+
+    YAML::Node httpFragmentationNode = globalConfigNode["httpFragmentation"];
+    httpFragmentationNode["enabled"] = m_globalConfig.httpFragmentationEnabled;
+    httpFragmentationNode["offset"] = m_globalConfig.httpFragmentationOffset;
+    httpFragmentationNode["outOfOrder"] = m_globalConfig.httpFragmentationOutOfOrder;
 
     YAML::Node tlsFragmentationNode = globalConfigNode["tlsFragmentation"];
     tlsFragmentationNode["enabled"] = m_globalConfig.tlsFragmentationEnabled;
     tlsFragmentationNode["offset"] = m_globalConfig.tlsFragmentationOffset;
     tlsFragmentationNode["outOfOrder"] = m_globalConfig.tlsFragmentationOutOfOrder;
+    tlsFragmentationNode["records"] = m_globalConfig.tlsFragmentationRecords;
+
+    YAML::Node engineConfigNode = configNode["engine"];
+    engineConfigNode["workers"] = m_engineConfig.workers;
+    engineConfigNode["staged"] = m_engineConfig.staged;
+    engineConfigNode["spin"] = m_engineConfig.spin;
+    engineConfigNode["largePages"] = m_engineConfig.largePages;
+
+    YAML::Node captureConfigNode = configNode["capture"];
+    captureConfigNode["enabled"] = m_captureConfig.enabled;
+    captureConfigNode["maxFileSize"] = m_captureConfig.maxFileSize;
+    captureConfigNode["maxFiles"] = m_captureConfig.maxFiles;
+
+    YAML::Node queueConfigNode = configNode["queue"];
+    queueConfigNode["length"] = m_queueConfig.length;
+    queueConfigNode["time"] = m_queueConfig.time;
+    queueConfigNode["size"] = m_queueConfig.size;
+    queueConfigNode["adaptive"] = m_queueConfig.adaptive;
+    queueConfigNode["receives"] = m_queueConfig.receives;
+    queueConfigNode["batch"] = m_queueConfig.batch;
+
+    YAML::Node feedbackConfigNode = configNode["feedback"];
+    feedbackConfigNode["enabled"] = m_feedbackConfig.enabled;
+    feedbackConfigNode["timeout"] = m_feedbackConfig.timeout;
+    feedbackConfigNode["offsets"] = m_feedbackConfig.offsets;
+
+    YAML::Node statsConfigNode = configNode["stats"];
+    statsConfigNode["enabled"] = m_statsConfig.enabled;
+    statsConfigNode["capacity"] = m_statsConfig.capacity;
+    statsConfigNode["top"] = m_statsConfig.top;
+    statsConfigNode["interval"] = m_statsConfig.interval;
+
+    YAML::Node controlConfigNode = configNode["control"];
+    controlConfigNode["enabled"] = m_controlConfig.enabled;
+    controlConfigNode["path"] = m_controlConfig.path;
+    controlConfigNode["persist"] = m_controlConfig.persist;
+
+    YAML::Node overloadConfigNode = configNode["overload"];
+    overloadConfigNode["budget"] = m_overloadConfig.budget;
+    overloadConfigNode["action"] = m_overloadConfig.action;
+
+    YAML::Node nfQueueConfigNode = configNode["nfqueue"];
+    nfQueueConfigNode["number"] = m_nfQueueConfig.number;
+    nfQueueConfigNode["injection"] = m_nfQueueConfig.injection;
+    nfQueueConfigNode["mark"] = m_nfQueueConfig.mark;
+    nfQueueConfigNode["mtu"] = m_nfQueueConfig.mtu;
+    nfQueueConfigNode["batch"] = m_nfQueueConfig.batch;
 
     YAML::Node domainsConfigNode = configNode["domains"];
     for (const std::shared_ptr<DomainConfig>& domainConfig : m_domainConfigs)
-    {
-        YAML::Node domainConfigNode;
+        domainsConfigNode.push_back(SaveDomain(m_globalConfig, *domainConfig));
 
-        if (m_globalConfig == *domainConfig)
+    YAML::Node networkConfigsNode = configNode["networks"];
+    for (const std::shared_ptr<NetworkConfig>& networkConfig : m_networkConfigs)
+    {
+        YAML::Node networkConfigNode;
+
+        if (m_globalConfig.httpFragmentationEnabled == networkConfig->httpFragmentationEnabled &&
+            m_globalConfig.httpFragmentationOffset == networkConfig->httpFragmentationOffset &&
+            m_globalConfig.httpFragmentationOutOfOrder == networkConfig->httpFragmentationOutOfOrder &&
+            m_globalConfig.tlsFragmentationEnabled == networkConfig->tlsFragmentationEnabled &&
+            m_globalConfig.tlsFragmentationOffset == networkConfig->tlsFragmentationOffset &&
+            m_globalConfig.tlsFragmentationOutOfOrder == networkConfig->tlsFragmentationOutOfOrder &&
+            m_globalConfig.tlsFragmentationRecords == networkConfig->tlsFragmentationRecords)
         {
-            domainConfigNode = domainConfig->domain;
+            networkConfigNode = networkConfig->network;
         }
         else
         {
-            domainConfigNode["domain"] = domainConfig->domain;
+            networkConfigNode["network"] = networkConfig->network;
+
+            if (m_globalConfig.httpFragmentationEnabled != networkConfig->httpFragmentationEnabled)
+                networkConfigNode["httpFragmentation"]["enabled"] = networkConfig->httpFragmentationEnabled;
+            if (m_globalConfig.httpFragmentationOffset != networkConfig->httpFragmentationOffset)
+                networkConfigNode["httpFragmentation"]["offset"] = networkConfig->httpFragmentationOffset;
+            if (m_globalConfig.httpFragmentationOutOfOrder != networkConfig->httpFragmentationOutOfOrder)
+                networkConfigNode["httpFragmentation"]["outOfOrder"] = networkConfig->httpFragmentationOutOfOrder;
+
+            if (m_globalConfig.tlsFragmentationEnabled != networkConfig->tlsFragmentationEnabled)
+                networkConfigNode["tlsFragmentation"]["enabled"] = networkConfig->tlsFragmentationEnabled;
+            if (m_globalConfig.tlsFragmentationOffset != networkConfig->tlsFragmentationOffset)
+                networkConfigNode["tlsFragmentation"]["offset"] = networkConfig->tlsFragmentationOffset;
+            if (m_globalConfig.tlsFragmentationOutOfOrder != networkConfig->tlsFragmentationOutOfOrder)
+                networkConfigNode["tlsFragmentation"]["outOfOrder"] = networkConfig->tlsFragmentationOutOfOrder;
+            if (m_globalConfig.tlsFragmentationRecords != networkConfig->tlsFragmentationRecords)
+                networkConfigNode["tlsFragmentation"]["records"] = networkConfig->tlsFragmentationRecords;
+        }
 
-            if (m_globalConfig.includeSubdomains != domainConfig->includeSubdomains)
-                domainConfigNode["includeSubdomains"] = domainConfig->includeSubdomains;
+        networkConfigsNode.push_back(networkConfigNode);
+    }
 
-            if (m_globalConfig.httpFragmentationEnabled != domainConfig->httpFragmentationEnabled)
-                domainConfigNode["httpFragmentation"]["enabled"] = domainConfig->httpFragmentationEnabled;
-            if (m_globalConfig.httpFragmentationOffset != domainConfig->httpFragmentationOffset)
-                domainConfigNode["httpFragmentation"]["offset"] = domainConfig->httpFragmentationOffset;
-            if (m_globalConfig.httpFragmentationOutOfOrder != domainConfig->httpFragmentationOutOfOrder)
-                domainConfigNode["httpFragmentation"]["outOfOrder"] = domainConfig->httpFragmentationOutOfOrder;
+    YAML::Node fingerprintConfigsNode = configNode["fingerprints"];
+    for (const std::shared_ptr<FingerprintConfig>& fingerprintConfig : m_fingerprintConfigs)
+    {
+        YAML::Node fingerprintConfigNode;
 
-            if (m_globalConfig.tlsFragmentationEnabled != domainConfig->tlsFragmentationEnabled)
-                domainConfigNode["tlsFragmentation"]["enabled"] = domainConfig->tlsFragmentationEnabled;
-            if (m_globalConfig.tlsFragmentationOffset != domainConfig->tlsFragmentationOffset)
-                domainConfigNode["tlsFragmentation"]["offset"] = domainConfig->tlsFragmentationOffset;
-            if (m_globalConfig.tlsFragmentationOutOfOrder != domainConfig->tlsFragmentationOutOfOrder)
-                domainConfigNode["tlsFragmentation"]["outOfOrder"] = domainConfig->tlsFragmentationOutOfOrder;
+        if (m_globalConfig.tlsFragmentationEnabled == fingerprintConfig->tlsFragmentationEnabled &&
+            m_globalConfig.tlsFragmentationOffset == fingerprintConfig->tlsFragmentationOffset &&
+            m_globalConfig.tlsFragmentationOutOfOrder == fingerprintConfig->tlsFragmentationOutOfOrder &&
+            m_globalConfig.tlsFragmentationRecords == fingerprintConfig->tlsFragmentationRecords)
+        {
+            fingerprintConfigNode = fingerprintConfig->fingerprint;
+        }
+        else
+        {
+            fingerprintConfigNode["fingerprint"] = fingerprintConfig->fingerprint;
+
+            if (m_globalConfig.tlsFragmentationEnabled != fingerprintConfig->tlsFragmentationEnabled)
+                fingerprintConfigNode["tlsFragmentation"]["enabled"] = fingerprintConfig->tlsFragmentationEnabled;
+            if (m_globalConfig.tlsFragmentationOffset != fingerprintConfig->tlsFragmentationOffset)
+                fingerprintConfigNode["tlsFragmentation"]["offset"] = fingerprintConfig->tlsFragmentationOffset;
+            if (m_globalConfig.tlsFragmentationOutOfOrder != fingerprintConfig->tlsFragmentationOutOfOrder)
+                fingerprintConfigNode["tlsFragmentation"]["outOfOrder"] = fingerprintConfig->tlsFragmentationOutOfOrder;
+            if (m_globalConfig.tlsFragmentationRecords != fingerprintConfig->tlsFragmentationRecords)
+                fingerprintConfigNode["tlsFragmentation"]["records"] = fingerprintConfig->tlsFragmentationRecords;
         }
 
-        domainsConfigNode.push_back(domainConfigNode);
+        fingerprintConfigsNode.push_back(fingerprintConfigNode);
     }
 
     return configNode;
 }
+
+bool ApplicationConfig::ParseDomain(YAML::Node domainConfigNode, const GlobalConfig& globalConfig, DomainConfig& domainConfig)
+{
+    domainConfig.includeSubdomains = globalConfig.includeSubdomains;
+    domainConfig.httpFragmentationEnabled = globalConfig.httpFragmentationEnabled;
+    domainConfig.httpFragmentationOffset = globalConfig.httpFragmentationOffset;
+    domainConfig.httpFragmentationOutOfOrder = globalConfig.httpFragmentationOutOfOrder;
+    domainConfig.tlsFragmentationEnabled = globalConfig.tlsFragmentationEnabled;
+    domainConfig.tlsFragmentationOffset = globalConfig.tlsFragmentationOffset;
+    domainConfig.tlsFragmentationOutOfOrder = globalConfig.tlsFragmentationOutOfOrder;
+    domainConfig.tlsFragmentationRecords = globalConfig.tlsFragmentationRecords;
+
+    if (!domainConfigNode.IsMap() && !domainConfigNode.IsScalar())
+        return false;
+
+    YAML::Node domainNode = domainConfigNode.IsMap() ? domainConfigNode["domain"] : domainConfigNode;
+    if (!domainNode.IsScalar())
+        return false;
+
+    try
+    {
+        domainConfig.domain = domainNode.as<std::string>();
+    }
+    catch (const YAML::Exception&)
+    {
+        return false;
+    }
+
+    if (domainConfig.domain.empty())
+        return false;
+
+    if (domainConfigNode.IsMap())
+    {
+        YAML::Node includeSubdomainsNode = domainConfigNode["includeSubdomains"];
+
+        if (includeSubdomainsNode.IsDefined())
+        {
+            if (!includeSubdomainsNode.IsScalar())
+                return false;
+
+            try
+            {
+                domainConfig.includeSubdomains = includeSubdomainsNode.as<bool>();
+            }
+            catch (const YAML::Exception&)
+            {
+            }
+        }
+
+        if (!ParseFragmentation(domainConfigNode["httpFragmentation"],
+            domainConfig.httpFragmentationEnabled, domainConfig.httpFragmentationOffset, domainConfig.httpFragmentationOutOfOrder))
+            return false;
+
+        if (!ParseFragmentation(domainConfigNode["tlsFragmentation"],
+            domainConfig.tlsFragmentationEnabled, domainConfig.tlsFragmentationOffset, domainConfig.tlsFragmentationOutOfOrder,
+            &domainConfig.tlsFragmentationRecords))
+            return false;
+    }
+
+    domainConfig.domainPatterns.clear();
+    domainConfig.domainPatterns.push_back(domainConfig.domain);
+    if (domainConfig.includeSubdomains)
+        domainConfig.domainPatterns.push_back("*." + domainConfig.domain);
+
+    return true;
+}
+
+YAML::Node ApplicationConfig::SaveDomain(const GlobalConfig& globalConfig, const DomainConfig& domainConfig)
+{
+    YAML::Node domainConfigNode;
+
+    if (globalConfig == domainConfig)
+    {
+        domainConfigNode = domainConfig.domain;
+        return domainConfigNode;
+    }
+
+    domainConfigNode["domain"] = domainConfig.domain;
+
+    if (globalConfig.includeSubdomains != domainConfig.includeSubdomains)
+        domainConfigNode["includeSubdomains"] = domainConfig.includeSubdomains;
+
+    if (globalConfig.httpFragmentationEnabled != domainConfig.httpFragmentationEnabled)
+        domainConfigNode["httpFragmentation"]["enabled"] = domainConfig.httpFragmentationEnabled;
+    if (globalConfig.httpFragmentationOffset != domainConfig.httpFragmentationOffset)
+        domainConfigNode["httpFragmentation"]["offset"] = domainConfig.httpFragmentationOffset;
+    if (globalConfig.httpFragmentationOutOfOrder != domainConfig.httpFragmentationOutOfOrder)
+        domainConfigNode["httpFragmentation"]["outOfOrder"] = domainConfig.httpFragmentationOutOfOrder;
+
+    if (globalConfig.tlsFragmentationEnabled != domainConfig.tlsFragmentationEnabled)
+        domainConfigNode["tlsFragmentation"]["enabled"] = domainConfig.tlsFragmentationEnabled;
+    if (globalConfig.tlsFragmentationOffset != domainConfig.tlsFragmentationOffset)
+        domainConfigNode["tlsFragmentation"]["offset"] = domainConfig.tlsFragmentationOffset;
+    if (globalConfig.tlsFragmentationOutOfOrder != domainConfig.tlsFragmentationOutOfOrder)
+        domainConfigNode["tlsFragmentation"]["outOfOrder"] = domainConfig.tlsFragmentationOutOfOrder;
+    if (globalConfig.tlsFragmentationRecords != domainConfig.tlsFragmentationRecords)
+        domainConfigNode["tlsFragmentation"]["records"] = domainConfig.tlsFragmentationRecords;
+
+    return domainConfigNode;
+}
+
+bool ApplicationConfig::ParseNetwork(const std::string& network, NetworkConfig& networkConfig)
+{
+    // 192.0.2.0/24, 2001:db8::/32 or a single address
+    size_t slashOffset = network.find('/');
+    std::string address = network.substr(0, slashOffset);
+
+    uint8_t ipv4Address[4];
+    uint8_t ipv6Address[16];
+    size_t maxPrefixLength = 0;
+
+    networkConfig.address.fill(0);
+
+    if (Utils::ParseIPv4Address(address.c_str(), ipv4Address))
+    {
+        networkConfig.ipv6 = false;
+        std::copy(ipv4Address, ipv4Address + 4, networkConfig.address.begin());
+        maxPrefixLength = 32;
+    }
+    else if (Utils::ParseIPv6Address(address.c_str(), ipv6Address))
+    {
+        networkConfig.ipv6 = true;
+        std::copy(ipv6Address, ipv6Address + 16, networkConfig.address.begin());
+        maxPrefixLength = 128;
+    }
+    else
+    {
+        return false;
+    }
+
+    size_t prefixLength = maxPrefixLength;
+
+    if (slashOffset != std::string::npos)
+    {
+        const std::string prefixLengthString = network.substr(slashOffset + 1);
+
+        if (prefixLengthString.empty() || prefixLengthString.size() > 3 ||
+            prefixLengthString.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+
+        prefixLength = std::stoul(prefixLengthString);
+        if (prefixLength > maxPrefixLength)
+            return false;
+    }
+
+    networkConfig.network = network;
+    networkConfig.prefixLength = static_cast<uint8_t>(prefixLength);
+
+    return true;
+}
+
+bool ApplicationConfig::ParseFragmentation(YAML::Node fragmentationNode, bool& enabled, size_t& offset, bool& outOfOrder,
+    bool* records /*= nullptr*/)
+{
+    if (!fragmentationNode.IsDefined())
+        return true;
+
+    if (!fragmentationNode.IsMap())
+        return false;
+
+    YAML::Node enabledNode = fragmentationNode["enabled"];
+    YAML::Node offsetNode = fragmentationNode["offset"];
+    YAML::Node outOfOrderNode = fragmentationNode["outOfOrder"];
+    YAML::Node recordsNode = fragmentationNode["records"];
+
+    if (enabledNode.IsDefined() && !enabledNode.IsScalar())
+        return false;
+    if (offsetNode.IsDefined() && !offsetNode.IsScalar())
+        return false;
+    if (outOfOrderNode.IsDefined() && !outOfOrderNode.IsScalar())
+        return false;
+    if (recordsNode.IsDefined() && !recordsNode.IsScalar())
+        return false;
+
+    try
+    {
+        enabled = enabledNode.as<bool>();
+    }
+    catch (const YAML::Exception&)
+    {
+    }
+
+    try
+    {
+        offset = offsetNode.as<size_t>();
+    }
+    catch (const YAML::Exception&)
+    {
+    }
+
+    try
+    {
+        outOfOrder = outOfOrderNode.as<bool>();
+    }
+    catch (const YAML::Exception&)
+    {
+    }
+
+    if (records)
+    {
+        try
+        {
+            *records = recordsNode.as<bool>();
+        }
+        catch (const YAML::Exception&)
+        {
+        }
+    }
+
+    return true;
+}
+
+const ApplicationConfig::DomainIndexEntry* ApplicationConfig::FindLiteralDomain(const std::string& domain) const
+{
+    // A literal domain matches either the whole name or, with includeSubdomains, one of its suffixes
+    // starting after a dot. The name is hashed backwards, so every such suffix hash falls out of one pass,
+    // and only suffixes the filter does not rule out are looked up in the index.
+    std::string normalizedDomain;
+    const DomainIndexEntry* literal = nullptr;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = domain.size(); i > 0; i--)
+    {
+        hash ^= static_cast<uint8_t>(tolower(static_cast<uint8_t>(domain[i - 1])));
+        hash *= 0x100000001b3ULL;
+
+        if (i != 1 && domain[i - 2] != '.')
+            continue;
+
+        if (!m_domainFilter.MayContain(hash))
+            continue;
+
+        if (normalizedDomain.empty())
+            normalizedDomain = NormalizeDomain(domain);
+
+        auto it = m_domainIndex.find(normalizedDomain.substr(i - 1));
+        if (it == m_domainIndex.end() || it->second.wildcard)
+            continue;
+
+        if (i != 1 && !(*it->second.domainConfig)->includeSubdomains)
+            continue;
+
+        if (!literal || it->second.order < literal->order)
+            literal = &it->second;
+    }
+
+    return literal;
+}
+
+std::shared_ptr<ApplicationConfig::DomainConfig> ApplicationConfig::MatchDomain(const std::string& domain, const DomainIndexEntry* literal) const
+{
+    // Wildcard domains are in list order, only those configured before the literal domain can still win
+    for (const WildcardDomainConfig& wildcardDomainConfig : m_wildcardDomainConfigs)
+    {
+        if (literal && literal->order < wildcardDomainConfig.order)
+            break;
+
+        for (const std::string& domainPattern : wildcardDomainConfig.domainConfig->domainPatterns)
+        {
+            if (Utils::MatchString(domain.c_str(), domainPattern.c_str()))
+                return wildcardDomainConfig.domainConfig;
+        }
+    }
+
+    return literal ? *literal->domainConfig : nullptr;
+}
+
+void ApplicationConfig::InsertDomainFilter(const DomainConfig& domainConfig)
+{
+    if (m_domainFilter.Items() < m_domainFilterCapacity)
+    {
+        m_domainFilter.Insert(HashDomain(domainConfig.domain.c_str(), domainConfig.domain.size()));
+        return;
+    }
+
+    // Grown to twice the domains, so that rebuilding costs a constant per added domain. Removed domains
+    // are dropped from the filter here as well.
+    m_domainFilterCapacity = std::max<size_t>(m_domainConfigs.size() * 2, 1024);
+    m_domainFilter.Reset(m_domainFilterCapacity);
+
+    for (const std::shared_ptr<DomainConfig>& literalDomainConfig : m_domainConfigs)
+    {
+        if (IsLiteralDomain(literalDomainConfig->domain))
+            m_domainFilter.Insert(HashDomain(literalDomainConfig->domain.c_str(), literalDomainConfig->domain.size()));
+    }
+}
+
+std::string ApplicationConfig::NormalizeDomain(const std::string& domain)
+{
+    std::string normalizedDomain(domain);
+    std::transform(normalizedDomain.begin(), normalizedDomain.end(), normalizedDomain.begin(), [](char c) {
+        return static_cast<char>(tolower(static_cast<uint8_t>(c)));
+    });
+
+    return normalizedDomain;
+}
+
+bool ApplicationConfig::IsLiteralDomain(const std::string& domain)
+{
+    return domain.find_first_of("*?") == std::string::npos;
+}
+
+uint64_t ApplicationConfig::HashDomain(const char* domain, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = length; i > 0; i--)
+    {
+        hash ^= static_cast<uint8_t>(tolower(static_cast<uint8_t>(domain[i - 1])));
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
@@ -1,5 +1,13 @@
 #pragma once
 
+#include "BloomFilter.h"
+#include "PrefixTable.h"
+
+#include "LargePageArena.h"
+#include "TlsFingerprint.h"
+
+#include <unordered_map>
+
 class ApplicationConfig
 {
 public:
@@ -16,6 +24,7 @@ public:
             tlsFragmentationEnabled = false;
             tlsFragmentationOffset = 0;
             tlsFragmentationOutOfOrder = false;
+            tlsFragmentationRecords = false;
         }
 
         std::list<std::string> domainPatterns;
@@ -29,6 +38,63 @@ public:
         bool tlsFragmentationEnabled;
         size_t tlsFragmentationOffset;
         bool tlsFragmentationOutOfOrder;
+        // Split into two TLS records within one segment instead of two segments
+        bool tlsFragmentationRecords;
+    };
+
+    struct NetworkConfig
+    {
+        NetworkConfig()
+        {
+            ipv6 = false;
+            address.fill(0);
+            prefixLength = 0;
+
+            httpFragmentationEnabled = false;
+            httpFragmentationOffset = 0;
+            httpFragmentationOutOfOrder = false;
+
+            tlsFragmentationEnabled = false;
+            tlsFragmentationOffset = 0;
+            tlsFragmentationOutOfOrder = false;
+            tlsFragmentationRecords = false;
+        }
+
+        std::string network;
+        bool ipv6;
+        std::array<uint8_t, 16> address;
+        uint8_t prefixLength;
+
+        bool httpFragmentationEnabled;
+        size_t httpFragmentationOffset;
+        bool httpFragmentationOutOfOrder;
+
+        bool tlsFragmentationEnabled;
+        size_t tlsFragmentationOffset;
+        bool tlsFragmentationOutOfOrder;
+        bool tlsFragmentationRecords;
+    };
+
+    // TLS settings for clients whose ClientHello has the fingerprint, matched before domains and networks
+    struct FingerprintConfig
+    {
+        FingerprintConfig()
+        {
+            format = TlsFingerprint::Format::Invalid;
+
+            tlsFragmentationEnabled = false;
+            tlsFragmentationOffset = 0;
+            tlsFragmentationOutOfOrder = false;
+            tlsFragmentationRecords = false;
+        }
+
+        std::string fingerprint;
+        TlsFingerprint::Format format;
+
+        bool tlsFragmentationEnabled;
+        size_t tlsFragmentationOffset;
+        bool tlsFragmentationOutOfOrder;
+        bool tlsFragmentationRecords;
     };
 
     struct GlobalConfig
@@ -44,6 +110,7 @@ public:
             tlsFragmentationEnabled = false;
             tlsFragmentationOffset = 0;
             tlsFragmentationOutOfOrder = false;
+            tlsFragmentationRecords = false;
         }
 
         bool operator==(const DomainConfig& rhs) const
@@ -64,6 +131,8 @@ public:
                 return false;
             if (tlsFragmentationOutOfOrder != rhs.tlsFragmentationOutOfOrder)
                 return false;
+            if (tlsFragmentationRecords != rhs.tlsFragmentationRecords)
+                return false;
 
             return true;
         }
@@ -77,14 +146,201 @@ public:
         bool tlsFragmentationEnabled;
         size_t tlsFragmentationOffset;
         bool tlsFragmentationOutOfOrder;
+        bool tlsFragmentationRecords;
+    };
+
+    // Packet engine settings, read once at startup
+    struct EngineConfig
+    {
+        EngineConfig()
+        {
+            workers = 1;
+            staged = false;
+            spin = 0;
+            largePages = false;
+        }
+
+        size_t workers;
+        // Separate receive and send threads around the workers
+        bool staged;
+        // Microseconds the receiving thread may busy-poll for the next packet before blocking, 0 blocks right away
+        uint64_t spin;
+        // The domain index, flow tables and packet pools are put into large pages where the system allows
+        bool largePages;
+    };
+
+    // Anomaly packet capture, read once at startup
+    struct CaptureConfig
+    {
+        CaptureConfig()
+        {
+            enabled = false;
+            maxFileSize = 16 * 1024 * 1024;
+            maxFiles = 4;
+        }
+
+        bool enabled;
+        uint64_t maxFileSize;
+        size_t maxFiles;
+    };
+
+    // WinDivert packet queue, read once at startup
+    struct QueueConfig
+    {
+        QueueConfig()
+        {
+            length = WINDIVERT_PARAM_QUEUE_LENGTH_DEFAULT;
+            time = WINDIVERT_PARAM_QUEUE_TIME_DEFAULT;
+            size = WINDIVERT_PARAM_QUEUE_SIZE_DEFAULT;
+            adaptive = true;
+            receives = 0;
+            batch = 16;
+        }
+
+        // Packets, milliseconds and bytes, the adaptive controller only goes above these
+        uint64_t length;
+        uint64_t time;
+        uint64_t size;
+        bool adaptive;
+        // Overlapped receives kept in flight, 0 receives one packet at a time
+        size_t receives;
+        // Packets per overlapped receive
+        size_t batch;
+    };
+
+    // Per-domain strategy selection from server responses, read once at startup
+    struct FeedbackConfig
+    {
+        FeedbackConfig()
+        {
+            enabled = false;
+            timeout = 3000;
+            offsets = { 1, 2, 5 };
+        }
+
+        bool enabled;
+        // Milliseconds without a response before a handshake counts as failed
+        uint32_t timeout;
+        // Fragmentation offsets tried in order and out of order besides the configured one
+        std::vector<size_t> offsets;
+    };
+
+    // Host name statistics, read once at startup
+    struct StatsConfig
+    {
+        StatsConfig()
+        {
+            enabled = false;
+            capacity = 1024;
+            top = 20;
+            interval = 300;
+        }
+
+        bool enabled;
+        // Names counted per sketch, memory does not grow beyond this
+        size_t capacity;
+        // Names printed per list
+        size_t top;
+        // Seconds between reports, 0 reports on exit only
+        uint32_t interval;
+    };
+
+    // Control channel for single domain changes, read once at startup
+    struct ControlConfig
+    {
+        ControlConfig()
+        {
+            enabled = false;
+            persist = true;
+        }
+
+        bool enabled;
+        // Pipe name or socket path, empty for the default next to the configuration file
+        std::string path;
+        // Changes are written to the configuration file, otherwise they last until it is reloaded
+        bool persist;
+    };
+
+    // Load shedding when packets cannot be classified in time, read once at startup
+    struct OverloadConfig
+    {
+        OverloadConfig()
+        {
+            budget = 0;
+            action = "pass";
+        }
+
+        // Microseconds from capture to the decision a packet may take, 0 never sheds
+        uint64_t budget;
+        // "pass" forwards shed packets unmodified, "cached" only matches names already in the domain cache
+        std::string action;
+    };
+
+    // Linux netfilter queue, read once at startup. The queue length comes from QueueConfig
+    struct NfQueueConfig
+    {
+        NfQueueConfig()
+        {
+            number = 0;
+            injection = "raw";
+            mark = 0x4447;
+            mtu = 1500;
+            batch = 64;
+        }
+
+        uint16_t number;
+        // "raw" sends fragments through raw sockets, "verdict" replaces the queued packet with the first one
+        std::string injection;
+        // Set on injected packets, the ruleset must not queue packets carrying it
+        uint32_t mark;
+        // Larger fragments, such as the rest of a GSO packet, are segmented before injection
+        size_t mtu;
+        // Accept verdicts sent at once while packets keep arriving
+        size_t batch;
     };
 public:
     ApplicationConfig() = default;
 
-    const GlobalConfig& Global() const;
+    // Copies, a reload replaces the sections while packet threads may be reading them
+    GlobalConfig Global() const;
+    EngineConfig Engine() const;
+    CaptureConfig Capture() const;
+    QueueConfig Queue() const;
+    FeedbackConfig Feedback() const;
+    StatsConfig Stats() const;
+    ControlConfig Control() const;
+    OverloadConfig Overload() const;
+    NfQueueConfig NfQueue() const;
     const std::list<std::shared_ptr<DomainConfig>>& Domains() const;
+    const std::vector<std::shared_ptr<NetworkConfig>>& Networks() const;
+    const std::vector<std::shared_ptr<FingerprintConfig>>& Fingerprints() const;
 
     std::shared_ptr<const DomainConfig> GetDomainConfig(const std::string& domain);
+    // GetDomainConfig for count names under one lock. The filter blocks of all names are requested before the
+    // first one is matched, so that their cache misses overlap instead of following one another.
+    void GetDomainConfigs(const std::string* const* domains, size_t count, std::shared_ptr<const DomainConfig>* domainConfigs);
+    std::shared_ptr<const NetworkConfig> GetNetworkConfig(const uint8_t* address, bool ipv6);
+    // False if no fingerprints are configured, ClientHellos then need not be fingerprinted. Does not lock
+    bool UsesFingerprints() const;
+    // Only the formats that are configured are computed, a JA3 hash costs an MD5 and JA4 two SHA-256
+    std::shared_ptr<const FingerprintConfig> GetFingerprintConfig(const TlsFingerprint& fingerprint);
+    // True if the global settings, a network, a fingerprint or a domain split TLS records, which takes every packet of port 443
+    bool UsesTlsRecords() const;
+
+    // Single domain changes without reloading, each costs about the same whatever the number of domains.
+    // Domains are identified by name, case insensitive; changes last until the configuration is reloaded.
+    bool ParseDomain(YAML::Node domainConfigNode, DomainConfig& domainConfig);
+    YAML::Node SaveDomain(const DomainConfig& domainConfig) const;
+    std::shared_ptr<const DomainConfig> FindDomain(const std::string& domain);
+    // False if the domain is already configured
+    bool AddDomain(const std::shared_ptr<DomainConfig>& domainConfig);
+    // False if the domain is not configured
+    bool UpdateDomain(const std::shared_ptr<DomainConfig>& domainConfig);
+    bool RemoveDomain(const std::string& domain);
+
+    uint64_t Generation() const;
+
+    size_t DomainFilterSize() const;
 
     bool LoadFile(const std::wstring& filePath);
     bool Load(const std::string& configString);
@@ -92,9 +348,92 @@ public:
 
     bool SaveFile(const std::wstring& filePath) const;
     YAML::Node Save() const;
+private:
+    // A wildcard domain and the order of its index entry
+    struct WildcardDomainConfig
+    {
+        WildcardDomainConfig(uint64_t order, const std::shared_ptr<DomainConfig>& domainConfig)
+            : order(order), domainConfig(domainConfig)
+        {
+        }
+
+        uint64_t order;
+        std::shared_ptr<DomainConfig> domainConfig;
+    };
+
+    struct DomainIndexEntry
+    {
+        DomainIndexEntry()
+        {
+            wildcard = false;
+            order = 0;
+        }
+
+        std::list<std::shared_ptr<DomainConfig>>::iterator domainConfig;
+        // Only valid for wildcard domains
+        std::list<WildcardDomainConfig>::iterator wildcardDomainConfig;
+        bool wildcard;
+        // Increases along m_domainConfigs, the earliest entry that matches a name wins
+        uint64_t order;
+    };
+
+    typedef std::unordered_map<std::string, DomainIndexEntry, std::hash<std::string>, std::equal_to<std::string>,
+        ArenaAllocator<std::pair<const std::string, DomainIndexEntry>>> DomainIndex;
+
+    // The caller holds the lock. The earliest literal domain that matches the name, null if none does
+    const DomainIndexEntry* FindLiteralDomain(const std::string& domain) const;
+    // The caller holds the lock. literal is what FindLiteralDomain found for the name, a wildcard domain
+    // configured before it still wins
+    std::shared_ptr<DomainConfig> MatchDomain(const std::string& domain, const DomainIndexEntry* literal) const;
+    void InsertDomainFilter(const DomainConfig& domainConfig);
+
+    static bool ParseDomain(YAML::Node domainConfigNode, const GlobalConfig& globalConfig, DomainConfig& domainConfig);
+    static YAML::Node SaveDomain(const GlobalConfig& globalConfig, const DomainConfig& domainConfig);
+    static bool ParseNetwork(const std::string& network, NetworkConfig& networkConfig);
+    // records is only given for TLS
+    static bool ParseFragmentation(YAML::Node fragmentationNode, bool& enabled, size_t& offset, bool& outOfOrder,
+        bool* records = nullptr);
+
+    static std::string NormalizeDomain(const std::string& domain);
+    static bool IsLiteralDomain(const std::string& domain);
+    static uint64_t HashDomain(const char* domain, size_t length);
 private:
     GlobalConfig m_globalConfig;
+    EngineConfig m_engineConfig;
+    CaptureConfig m_captureConfig;
+    QueueConfig m_queueConfig;
+    FeedbackConfig m_feedbackConfig;
+    StatsConfig m_statsConfig;
+    ControlConfig m_controlConfig;
+    OverloadConfig m_overloadConfig;
+    NfQueueConfig m_nfQueueConfig;
     std::list<std::shared_ptr<DomainConfig>> m_domainConfigs;
 
-    std::shared_mutex m_lock;
+    // Domains without wildcards are summarized in m_domainFilter, so that most unmatched names are rejected
+    // after looking at a few cache lines, and the others are found in m_domainIndex. Wildcard domains still
+    // have to be matched one by one.
+    BloomFilter m_domainFilter;
+    std::list<WildcardDomainConfig> m_wildcardDomainConfigs;
+    // Domains the filter was sized for, it is rebuilt when domains added at run time exceed them
+    size_t m_domainFilterCapacity = 0;
+
+    // Lower case names to their entries, for matching literal domains and single domain changes
+    DomainIndex m_domainIndex;
+    uint64_t m_nextOrder = 0;
+
+    // Prefix table values are indexes into m_networkConfigs plus one
+    std::vector<std::shared_ptr<NetworkConfig>> m_networkConfigs;
+    PrefixTable<4> m_ipv4Networks;
+    PrefixTable<16> m_ipv6Networks;
+
+    std::vector<std::shared_ptr<FingerprintConfig>> m_fingerprintConfigs;
+    // Utils::HashString of the fingerprint to the first entry that has it
+    std::unordered_map<uint64_t, std::shared_ptr<FingerprintConfig>> m_fingerprintIndex;
+    // Bit per TlsFingerprint::Format with entries, read without the lock
+    std::atomic<uint32_t> m_fingerprintFormats{ 0 };
+
+    // Incremented whenever the configuration is replaced, so that cached lookups can be invalidated
+    std::atomic<uint64_t> m_generation{ 0 };
+
+    mutable std::shared_mutex m_lock;
 };
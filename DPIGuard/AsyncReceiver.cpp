@@ -0,0 +1,197 @@
+#include "StdAfx.h"
+#include "AsyncReceiver.h"
+#include "Utils.h"
+
+AsyncReceiver::AsyncReceiver(CompletionSource& source, PacketDevice& device, size_t requests /*= 4*/, size_t batch /*= 16*/, size_t packetSize /*= 4096*/)
+    : m_source(source), m_device(device), m_pending(0), m_started(false), m_stopped(false)
+    , m_spinPolicy(nullptr), m_timestampFrequency(0), m_current(nullptr), m_offset(0), m_index(0)
+    , m_completions(0), m_packets(0), m_truncated(0)
+{
+    requests = std::max<size_t>(requests, 1);
+    batch = std::min<size_t>(std::max<size_t>(batch, 1), WINDIVERT_BATCH_MAX);
+
+    for (size_t i = 0; i < requests; i++)
+    {
+        m_requests.push_back(std::make_unique<CompletionSource::Request>());
+        m_requests.back()->buffer.resize(batch * packetSize);
+        m_requests.back()->addresses.resize(batch);
+    }
+}
+
+AsyncReceiver::~AsyncReceiver()
+{
+    // The source writes into requests until they complete
+    if (m_pending == 0)
+        return;
+
+    m_source.Cancel();
+
+    CompletionSource::Request* request = nullptr;
+
+    while (m_pending > 0 && m_source.Complete(request))
+        m_pending--;
+}
+
+void AsyncReceiver::SetSpinPolicy(SpinPolicy* policy, int64_t timestampFrequency)
+{
+    m_spinPolicy = policy;
+    m_timestampFrequency = timestampFrequency;
+}
+
+bool AsyncReceiver::Recv(WinDivertPacket& packet)
+{
+    if (!m_started)
+    {
+        m_started = true;
+
+        for (std::unique_ptr<CompletionSource::Request>& request : m_requests)
+        {
+            if (!Submit(*request))
+                break;
+        }
+    }
+
+    while (true)
+    {
+        if (m_current)
+        {
+            if (NextPacket(packet))
+                return true;
+
+            CompletionSource::Request* request = m_current;
+            m_current = nullptr;
+
+            if (!m_stopped)
+                Submit(*request);
+        }
+
+        if (m_pending == 0)
+            return false;
+
+        CompletionSource::Request* request = nullptr;
+
+        if (!Wait(request))
+        {
+            m_pending = 0;
+            return false;
+        }
+
+        m_pending--;
+        m_completions++;
+
+        // Usually the handle was shut down, requests still in flight deliver what they got
+        if (request->error != 0)
+        {
+            m_stopped = true;
+            continue;
+        }
+
+        m_current = request;
+        m_offset = 0;
+        m_index = 0;
+    }
+}
+
+bool AsyncReceiver::Send(const WinDivertPacket& packet)
+{
+    return m_device.Send(packet);
+}
+
+uint64_t AsyncReceiver::Completions() const
+{
+    return m_completions;
+}
+
+uint64_t AsyncReceiver::Packets() const
+{
+    return m_packets;
+}
+
+uint64_t AsyncReceiver::Truncated() const
+{
+    return m_truncated;
+}
+
+bool AsyncReceiver::Submit(CompletionSource::Request& request)
+{
+    if (!m_source.Submit(request))
+    {
+        m_stopped = true;
+        return false;
+    }
+
+    m_pending++;
+    return true;
+}
+
+bool AsyncReceiver::Wait(CompletionSource::Request*& request)
+{
+    if (!m_spinPolicy)
+        return m_source.Complete(request);
+
+    // Only time actually spent waiting tells the policy something
+    if (m_source.Poll(request))
+        return true;
+
+    uint64_t started = SpinPolicy::Now();
+    uint64_t budget = m_spinPolicy->Budget();
+    uint64_t now = started;
+    bool caught = false;
+
+    while (now - started < budget)
+    {
+        if (m_source.Poll(request))
+        {
+            caught = true;
+            break;
+        }
+
+        SpinPolicy::Pause();
+        now = SpinPolicy::Now();
+    }
+
+    uint64_t spinTime = now - started;
+
+    if (!caught && !m_source.Complete(request))
+        return false;
+
+    uint64_t finished = SpinPolicy::Now();
+    m_spinPolicy->Observe(finished - started, caught ? finished - started : spinTime, caught);
+
+    // The first packet of the batch is the one that was waited for
+    if (m_timestampFrequency > 0 && request->error == 0 && request->addressLength >= sizeof(WINDIVERT_ADDRESS) && request->addresses[0].Timestamp > 0)
+    {
+        uint64_t captured = Utils::ConvertTicks(request->addresses[0].Timestamp, m_timestampFrequency, 1000000);
+
+        if (finished >= captured)
+            m_spinPolicy->ObserveDelay(finished - captured, caught);
+    }
+
+    return true;
+}
+
+bool AsyncReceiver::NextPacket(WinDivertPacket& packet)
+{
+    const CompletionSource::Request& request = *m_current;
+
+    if (m_index >= request.addressLength / sizeof(WINDIVERT_ADDRESS) || m_offset >= request.length)
+        return false;
+
+    const uint8_t* data = request.buffer.data() + m_offset;
+    size_t length = CompletionSource::PacketLength(data, request.length - m_offset);
+
+    if (length == 0)
+    {
+        m_truncated++;
+        return false;
+    }
+
+    packet.Buffer().assign(data, data + length);
+    packet.Address() = request.addresses[m_index];
+
+    m_index++;
+    m_offset += length;
+    m_packets++;
+
+    return true;
+}
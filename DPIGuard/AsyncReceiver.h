@@ -0,0 +1,54 @@
+#pragma once
+
+#include "CompletionSource.h"
+#include "PacketDevice.h"
+#include "SpinPolicy.h"
+
+// Keeps several batched receives in flight on a completion source, so that the driver fills the next batches
+// while the packets of a completed one are processed. Packets are handed out one by one in completion order,
+// sends go to the given device. Recv must only be called from one thread.
+class AsyncReceiver : public PacketDevice
+{
+public:
+    // requests receives of up to batch packets of up to packetSize bytes each
+    AsyncReceiver(CompletionSource& source, PacketDevice& device, size_t requests = 4, size_t batch = 16, size_t packetSize = 4096);
+    ~AsyncReceiver();
+
+    // Polls for completions within the policy's budget before blocking. WINDIVERT_ADDRESS::Timestamp of received
+    // packets counts at timestampFrequency on the clock of std::chrono::steady_clock, 0 if it does not
+    void SetSpinPolicy(SpinPolicy* policy, int64_t timestampFrequency);
+
+    bool Recv(WinDivertPacket& packet) override;
+    bool Send(const WinDivertPacket& packet) override;
+
+    uint64_t Completions() const;
+    uint64_t Packets() const;
+    // Batches that ended in bytes not forming a packet
+    uint64_t Truncated() const;
+private:
+    bool Submit(CompletionSource::Request& request);
+    // Next completed request, spinning first with a spin policy
+    bool Wait(CompletionSource::Request*& request);
+    // Takes the next packet of the current request
+    bool NextPacket(WinDivertPacket& packet);
+private:
+    CompletionSource& m_source;
+    PacketDevice& m_device;
+
+    std::vector<std::unique_ptr<CompletionSource::Request>> m_requests;
+    size_t m_pending;
+    bool m_started;
+    // Set by the first failed completion, requests are not submitted again after that
+    bool m_stopped;
+
+    SpinPolicy* m_spinPolicy;
+    int64_t m_timestampFrequency;
+
+    CompletionSource::Request* m_current;
+    size_t m_offset;
+    size_t m_index;
+
+    uint64_t m_completions;
+    uint64_t m_packets;
+    uint64_t m_truncated;
+};
@@ -0,0 +1,114 @@
+#include "StdAfx.h"
+#include "BloomFilter.h"
+#include "Utils.h"
+
+static const uint32_t SALT[8] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+BloomFilter::BloomFilter()
+    : m_items(0)
+{
+}
+
+void BloomFilter::Reset(size_t expectedItems, size_t bitsPerItem /*= 12*/)
+{
+    size_t bits = std::max<size_t>(expectedItems * bitsPerItem, 1);
+    size_t blocks = (bits + 511) / 512;
+
+    m_blocks.assign(blocks, Block());
+    m_items = 0;
+}
+
+void BloomFilter::Clear()
+{
+    std::fill(m_blocks.begin(), m_blocks.end(), Block());
+    m_items = 0;
+}
+
+void BloomFilter::Insert(uint64_t hash)
+{
+    if (m_blocks.empty())
+        return;
+
+    hash = Mix(hash);
+
+    Block& block = GetBlock(hash);
+
+    for (size_t i = 0; i < 8; i++)
+        block.words[i] |= Mask(hash, i);
+
+    m_items++;
+}
+
+bool BloomFilter::MayContain(uint64_t hash) const
+{
+    if (m_blocks.empty())
+        return false;
+
+    hash = Mix(hash);
+
+    const Block& block = GetBlock(hash);
+
+    for (size_t i = 0; i < 8; i++)
+    {
+        uint64_t mask = Mask(hash, i);
+
+        if ((block.words[i] & mask) != mask)
+            return false;
+    }
+
+    return true;
+}
+
+void BloomFilter::Prefetch(uint64_t hash) const
+{
+    if (m_blocks.empty())
+        return;
+
+    Utils::Prefetch(&GetBlock(Mix(hash)));
+}
+
+bool BloomFilter::Empty() const
+{
+    return m_items == 0;
+}
+
+size_t BloomFilter::Size() const
+{
+    return m_blocks.size() * sizeof(Block);
+}
+
+size_t BloomFilter::Items() const
+{
+    return m_items;
+}
+
+const BloomFilter::Block& BloomFilter::GetBlock(uint64_t hash) const
+{
+    return m_blocks[static_cast<size_t>(((hash >> 32) * m_blocks.size()) >> 32)];
+}
+
+BloomFilter::Block& BloomFilter::GetBlock(uint64_t hash)
+{
+    return m_blocks[static_cast<size_t>(((hash >> 32) * m_blocks.size()) >> 32)];
+}
+
+uint64_t BloomFilter::Mix(uint64_t hash)
+{
+    // SplitMix64 finalizer
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+
+    return hash;
+}
+
+uint64_t BloomFilter::Mask(uint64_t hash, size_t word)
+{
+    uint32_t bit = (static_cast<uint32_t>(hash) * SALT[word]) >> 26;
+    return 1ULL << bit;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+// Split block Bloom filter, every lookup touches a single 64 byte block.
+class BloomFilter
+{
+public:
+    BloomFilter();
+
+    void Reset(size_t expectedItems, size_t bitsPerItem = 12);
+    void Clear();
+
+    void Insert(uint64_t hash);
+    bool MayContain(uint64_t hash) const;
+    // Starts loading the block MayContain(hash) will test
+    void Prefetch(uint64_t hash) const;
+
+    bool Empty() const;
+    // Bytes
+    size_t Size() const;
+    // Insertions since the last reset
+    size_t Items() const;
+private:
+    struct alignas(64) Block
+    {
+        uint64_t words[8];
+    };
+
+    const Block& GetBlock(uint64_t hash) const;
+    Block& GetBlock(uint64_t hash);
+
+    static uint64_t Mix(uint64_t hash);
+    static uint64_t Mask(uint64_t hash, size_t word);
+
+    std::vector<Block> m_blocks;
+    size_t m_items;
+};
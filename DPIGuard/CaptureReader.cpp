@@ -0,0 +1,664 @@
+#include "StdAfx.h"
+#include "CaptureReader.h"
+#include "PacketDissector.h"
+#include "Utils.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// pcap file header magic numbers with microsecond and nanosecond timestamps, as written on a little endian host
+static const uint32_t PCAP_MAGIC = 0xa1b2c3d4;
+static const uint32_t PCAP_MAGIC_SWAPPED = 0xd4c3b2a1;
+static const uint32_t PCAP_NANOSECOND_MAGIC = 0xa1b23c4d;
+static const uint32_t PCAP_NANOSECOND_MAGIC_SWAPPED = 0x4d3cb2a1;
+
+static const size_t PCAP_HEADER_LENGTH = 24;
+static const size_t PCAP_RECORD_LENGTH = 16;
+
+// Every record length gates the address of the next record, without streaming the file into the cache ahead
+// of the cursor each packet waits for a full memory access
+static const uint64_t PREFETCH_DISTANCE = 4096;
+static const uint64_t CACHE_LINE_SIZE = 64;
+
+// pcapng block types and options, see draft-ietf-opsawg-pcapng
+static const uint32_t SECTION_HEADER_BLOCK = 0x0a0d0d0a;
+static const uint32_t INTERFACE_DESCRIPTION_BLOCK = 0x00000001;
+static const uint32_t SIMPLE_PACKET_BLOCK = 0x00000003;
+static const uint32_t ENHANCED_PACKET_BLOCK = 0x00000006;
+
+static const uint32_t BYTE_ORDER_MAGIC = 0x1a2b3c4d;
+static const uint32_t BYTE_ORDER_MAGIC_SWAPPED = 0x4d3c2b1a;
+
+static const uint16_t OPT_ENDOFOPT = 0;
+static const uint16_t IF_TSRESOL = 9;
+static const uint16_t IF_TSOFFSET = 14;
+static const uint16_t EPB_FLAGS = 2;
+
+static const uint32_t EPB_FLAGS_INBOUND = 1;
+static const uint32_t EPB_FLAGS_OUTBOUND = 2;
+
+static const uint16_t LINKTYPE_ETHERNET = 1;
+static const uint16_t LINKTYPE_RAW = 101;
+static const uint16_t LINKTYPE_LINUX_SLL = 113;
+static const uint16_t LINKTYPE_IPV4 = 228;
+static const uint16_t LINKTYPE_IPV6 = 229;
+static const uint16_t LINKTYPE_LINUX_SLL2 = 276;
+
+static const uint16_t ETHERTYPE_IPV4 = 0x0800;
+static const uint16_t ETHERTYPE_IPV6 = 0x86dd;
+static const uint16_t ETHERTYPE_VLAN = 0x8100;
+static const uint16_t ETHERTYPE_QINQ = 0x88a8;
+
+static uint16_t ReadNetwork16(const uint8_t* data)
+{
+    return static_cast<uint16_t>((data[0] << 8) | data[1]);
+}
+
+static uint32_t Padded(uint32_t length)
+{
+    return (length + 3) & ~3u;
+}
+
+CaptureReader::CaptureReader()
+    : m_data(nullptr), m_size(0), m_offset(0), m_prefetched(0)
+#ifdef _WIN32
+    , m_file(INVALID_HANDLE_VALUE), m_mapping(nullptr)
+#else
+    , m_file(-1)
+#endif
+    , m_format(Format::None), m_swapped(false), m_malformed(false), m_linkType(0), m_ticksPerSecond(1000000)
+    , m_timeOffset(0), m_firstTimestamp(0), m_lastTimestamp(0), m_packets(0), m_skipped(0)
+{
+}
+
+CaptureReader::~CaptureReader()
+{
+    Close();
+}
+
+bool CaptureReader::Open(const std::wstring& filePath)
+{
+    Close();
+
+#ifdef _WIN32
+    m_file = CreateFileW(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size = {};
+    if (!GetFileSizeEx(m_file, &size) || size.QuadPart < static_cast<LONGLONG>(PCAP_HEADER_LENGTH) ||
+        static_cast<uint64_t>(size.QuadPart) > SIZE_MAX)
+    {
+        Close();
+        return false;
+    }
+
+    m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping == nullptr)
+    {
+        Close();
+        return false;
+    }
+
+    m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (m_data == nullptr)
+    {
+        Close();
+        return false;
+    }
+
+    m_size = static_cast<uint64_t>(size.QuadPart);
+#else
+    m_file = open(Utils::WideToUtf8(filePath).c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_file < 0)
+        return false;
+
+    struct stat status = {};
+    if (fstat(m_file, &status) != 0 || status.st_size < static_cast<off_t>(PCAP_HEADER_LENGTH) ||
+        static_cast<uint64_t>(status.st_size) > SIZE_MAX)
+    {
+        Close();
+        return false;
+    }
+
+    void* data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, m_file, 0);
+    if (data == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+
+    // Read ahead aggressively, the file is walked from the beginning to the end
+    madvise(data, static_cast<size_t>(status.st_size), MADV_SEQUENTIAL);
+
+    m_data = static_cast<const uint8_t*>(data);
+    m_size = static_cast<uint64_t>(status.st_size);
+#endif
+
+    uint32_t magic = 0;
+    memcpy(&magic, m_data, sizeof(magic));
+
+    if (magic == PCAP_MAGIC || magic == PCAP_NANOSECOND_MAGIC)
+    {
+        m_format = Format::Pcap;
+        m_swapped = false;
+    }
+    else if (magic == PCAP_MAGIC_SWAPPED || magic == PCAP_NANOSECOND_MAGIC_SWAPPED)
+    {
+        m_format = Format::Pcap;
+        m_swapped = true;
+    }
+    else if (magic == SECTION_HEADER_BLOCK)
+    {
+        m_format = Format::Pcapng;
+    }
+    else
+    {
+        Close();
+        return false;
+    }
+
+    if (m_format == Format::Pcap)
+    {
+        m_ticksPerSecond = magic == PCAP_NANOSECOND_MAGIC || magic == PCAP_NANOSECOND_MAGIC_SWAPPED ? 1000000000 : 1000000;
+
+        // The upper bits of LinkType carry the FCS length
+        m_linkType = static_cast<uint16_t>(Read32(m_data + 20));
+    }
+
+    m_packets = 0;
+    m_skipped = 0;
+    m_timeOffset = 0;
+    m_firstTimestamp = 0;
+    m_lastTimestamp = 0;
+
+    Rewind();
+
+    return true;
+}
+
+void CaptureReader::Close()
+{
+#ifdef _WIN32
+    if (m_data != nullptr)
+        UnmapViewOfFile(m_data);
+
+    if (m_mapping != nullptr)
+        CloseHandle(m_mapping);
+
+    if (m_file != INVALID_HANDLE_VALUE)
+        CloseHandle(m_file);
+
+    m_mapping = nullptr;
+    m_file = INVALID_HANDLE_VALUE;
+#else
+    if (m_data != nullptr)
+        munmap(const_cast<uint8_t*>(m_data), static_cast<size_t>(m_size));
+
+    if (m_file >= 0)
+        close(m_file);
+
+    m_file = -1;
+#endif
+
+    m_data = nullptr;
+    m_size = 0;
+    m_offset = 0;
+    m_prefetched = 0;
+    m_format = Format::None;
+    m_interfaces.clear();
+}
+
+void CaptureReader::Rewind()
+{
+    if (m_packets != 0)
+        m_timeOffset = m_lastTimestamp + 1 - m_firstTimestamp;
+
+    m_offset = m_format == Format::Pcap ? PCAP_HEADER_LENGTH : 0;
+    m_prefetched = 0;
+    m_malformed = false;
+    m_interfaces.clear();
+}
+
+bool CaptureReader::Next(PacketView& view)
+{
+    if (m_format == Format::Pcap)
+        return NextPcap(view);
+
+    if (m_format == Format::Pcapng)
+        return NextPcapng(view);
+
+    return false;
+}
+
+CaptureReader::Format CaptureReader::FileFormat() const
+{
+    return m_format;
+}
+
+uint64_t CaptureReader::FileSize() const
+{
+    return m_size;
+}
+
+uint64_t CaptureReader::Packets() const
+{
+    return m_packets;
+}
+
+uint64_t CaptureReader::Skipped() const
+{
+    return m_skipped;
+}
+
+bool CaptureReader::Malformed() const
+{
+    return m_malformed;
+}
+
+bool CaptureReader::NextPcap(PacketView& view)
+{
+    while (m_size - m_offset >= PCAP_RECORD_LENGTH)
+    {
+        PrefetchAhead();
+
+        const uint8_t* record = m_data + m_offset;
+
+        uint32_t seconds = Read32(record);
+        uint32_t fraction = Read32(record + 4);
+        uint32_t capturedLength = Read32(record + 8);
+
+        if (capturedLength > m_size - m_offset - PCAP_RECORD_LENGTH)
+        {
+            m_malformed = true;
+            return false;
+        }
+
+        m_offset += PCAP_RECORD_LENGTH + capturedLength;
+
+        uint64_t timestamp = static_cast<uint64_t>(seconds) * 1000000 +
+            (m_ticksPerSecond == 1000000 ? fraction : fraction / 1000);
+
+        if (SetPacket(m_linkType, record + PCAP_RECORD_LENGTH, capturedLength, timestamp, view))
+            return true;
+    }
+
+    m_malformed = m_offset != m_size;
+
+    return false;
+}
+
+bool CaptureReader::NextPcapng(PacketView& view)
+{
+    while (m_size - m_offset >= 12)
+    {
+        PrefetchAhead();
+
+        const uint8_t* block = m_data + m_offset;
+        uint32_t type = Read32(block);
+
+        if (type == SECTION_HEADER_BLOCK && !ReadSectionHeader())
+        {
+            m_malformed = true;
+            return false;
+        }
+
+        uint32_t totalLength = Read32(block + 4);
+
+        if (totalLength < 12 || (totalLength & 3) != 0 || totalLength > m_size - m_offset)
+        {
+            m_malformed = true;
+            return false;
+        }
+
+        m_offset += totalLength;
+
+        const uint8_t* body = block + 8;
+        uint32_t bodyLength = totalLength - 12;
+
+        bool valid = true;
+
+        switch (type)
+        {
+        case ENHANCED_PACKET_BLOCK:
+            if (ReadEnhancedPacket(body, bodyLength, view))
+                return true;
+            break;
+        case SIMPLE_PACKET_BLOCK:
+            if (ReadSimplePacket(body, bodyLength, view))
+                return true;
+            break;
+        case INTERFACE_DESCRIPTION_BLOCK:
+            valid = ReadInterfaceDescription(body, bodyLength);
+            break;
+        default:
+            break;
+        }
+
+        if (!valid)
+        {
+            m_malformed = true;
+            return false;
+        }
+    }
+
+    m_malformed = m_offset != m_size;
+
+    return false;
+}
+
+void CaptureReader::PrefetchAhead()
+{
+    uint64_t end = std::min(m_offset + PREFETCH_DISTANCE, m_size);
+
+    while (m_prefetched < end)
+    {
+        Utils::Prefetch(m_data + m_prefetched);
+        m_prefetched += CACHE_LINE_SIZE;
+    }
+}
+
+bool CaptureReader::ReadSectionHeader()
+{
+    // Byte order and interfaces are per section
+    uint32_t magic = 0;
+    memcpy(&magic, m_data + m_offset + 8, sizeof(magic));
+
+    if (magic == BYTE_ORDER_MAGIC)
+        m_swapped = false;
+    else if (magic == BYTE_ORDER_MAGIC_SWAPPED)
+        m_swapped = true;
+    else
+        return false;
+
+    m_interfaces.clear();
+
+    return true;
+}
+
+bool CaptureReader::ReadInterfaceDescription(const uint8_t* body, uint32_t length)
+{
+    if (length < 8)
+        return false;
+
+    Interface description;
+    description.linkType = Read16(body);
+
+    for (uint32_t offset = 8; offset + 4 <= length; )
+    {
+        uint16_t code = Read16(body + offset);
+        uint16_t optionLength = Read16(body + offset + 2);
+
+        offset += 4;
+
+        if (code == OPT_ENDOFOPT || optionLength > length - offset)
+            break;
+
+        const uint8_t* value = body + offset;
+
+        if (code == IF_TSRESOL && optionLength == 1)
+        {
+            // Negative power of 10, or of 2 with the high bit set
+            uint8_t exponent = value[0] & 0x7f;
+            uint64_t ticksPerSecond = 1;
+
+            if (exponent > ((value[0] & 0x80) != 0 ? 63 : 19))
+                return false;
+
+            for (uint8_t i = 0; i < exponent; i++)
+                ticksPerSecond *= (value[0] & 0x80) != 0 ? 2 : 10;
+
+            description.ticksPerSecond = ticksPerSecond;
+        }
+        else if (code == IF_TSOFFSET && optionLength == 8)
+        {
+            uint64_t first = Read32(value);
+            uint64_t second = Read32(value + 4);
+
+            description.offset = (m_swapped ? first << 32 | second : second << 32 | first) * 1000000;
+        }
+
+        offset += Padded(optionLength);
+    }
+
+    m_interfaces.push_back(description);
+
+    return true;
+}
+
+bool CaptureReader::ReadEnhancedPacket(const uint8_t* body, uint32_t length, PacketView& view)
+{
+    if (length < 20)
+    {
+        m_skipped++;
+        return false;
+    }
+
+    uint32_t interfaceId = Read32(body);
+    uint32_t capturedLength = Read32(body + 12);
+
+    if (interfaceId >= m_interfaces.size() || capturedLength > length - 20)
+    {
+        m_skipped++;
+        return false;
+    }
+
+    const Interface& description = m_interfaces[interfaceId];
+
+    uint64_t ticks = static_cast<uint64_t>(Read32(body + 4)) << 32 | Read32(body + 8);
+    uint64_t timestamp = Microseconds(ticks, description.ticksPerSecond) + description.offset;
+
+    if (!SetPacket(description.linkType, body + 20, capturedLength, timestamp, view))
+        return false;
+
+    // Direction from the packet flags takes precedence over the ports
+    for (uint32_t offset = 20 + Padded(capturedLength); offset + 4 <= length; )
+    {
+        uint16_t code = Read16(body + offset);
+        uint16_t optionLength = Read16(body + offset + 2);
+
+        offset += 4;
+
+        if (code == OPT_ENDOFOPT || optionLength > length - offset)
+            break;
+
+        if (code == EPB_FLAGS && optionLength == 4)
+        {
+            uint32_t direction = Read32(body + offset) & 3;
+
+            if (direction == EPB_FLAGS_INBOUND)
+                view.address.Outbound = 0;
+            else if (direction == EPB_FLAGS_OUTBOUND)
+                view.address.Outbound = 1;
+        }
+
+        offset += Padded(optionLength);
+    }
+
+    return true;
+}
+
+bool CaptureReader::ReadSimplePacket(const uint8_t* body, uint32_t length, PacketView& view)
+{
+    // Captured up to the block length, on the first interface and without a timestamp
+    if (length < 4 || m_interfaces.empty())
+    {
+        m_skipped++;
+        return false;
+    }
+
+    uint32_t capturedLength = std::min(Read32(body), length - 4);
+
+    return SetPacket(m_interfaces[0].linkType, body + 4, capturedLength, m_lastTimestamp - m_timeOffset, view);
+}
+
+bool CaptureReader::SetPacket(uint16_t linkType, const uint8_t* data, uint32_t length, uint64_t timestamp, PacketView& view)
+{
+    uint16_t etherType = 0;
+
+    switch (linkType)
+    {
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+        break;
+    case LINKTYPE_ETHERNET:
+        if (length < 14)
+            break;
+
+        etherType = ReadNetwork16(data + 12);
+        data += 14;
+        length -= 14;
+
+        while ((etherType == ETHERTYPE_VLAN || etherType == ETHERTYPE_QINQ) && length >= 4)
+        {
+            etherType = ReadNetwork16(data + 2);
+            data += 4;
+            length -= 4;
+        }
+
+        if (etherType != ETHERTYPE_IPV4 && etherType != ETHERTYPE_IPV6)
+            length = 0;
+        break;
+    case LINKTYPE_LINUX_SLL:
+    case LINKTYPE_LINUX_SLL2:
+        {
+            uint32_t headerLength = linkType == LINKTYPE_LINUX_SLL ? 16 : 20;
+
+            if (length < headerLength)
+                break;
+
+            etherType = ReadNetwork16(linkType == LINKTYPE_LINUX_SLL ? data + 14 : data);
+            data += headerLength;
+            length -= headerLength;
+
+            if (etherType != ETHERTYPE_IPV4 && etherType != ETHERTYPE_IPV6)
+                length = 0;
+        }
+        break;
+    default:
+        length = 0;
+        break;
+    }
+
+    PacketDissector::Layers layers;
+
+    if (length == 0 || !PacketDissector::Dissect(data, length, layers))
+    {
+        m_skipped++;
+        return false;
+    }
+
+    // Same guess as for forwarded traffic: responses come from the well-known server ports
+    uint16_t sourcePort = layers.tcp ? ReadNetwork16(layers.tcp) : 0;
+
+    timestamp += m_timeOffset;
+
+    if (m_packets == 0)
+        m_firstTimestamp = timestamp;
+
+    m_lastTimestamp = timestamp;
+    m_packets++;
+
+    view.data = data;
+    view.length = length;
+
+    view.address = WINDIVERT_ADDRESS();
+    view.address.Timestamp = static_cast<INT64>(timestamp);
+    view.address.Outbound = sourcePort != 80 && sourcePort != 443;
+    view.address.IPv6 = layers.ipv6 != nullptr;
+
+    return true;
+}
+
+uint16_t CaptureReader::Read16(const uint8_t* data) const
+{
+    return m_swapped ? static_cast<uint16_t>((data[0] << 8) | data[1]) : static_cast<uint16_t>(data[0] | (data[1] << 8));
+}
+
+uint32_t CaptureReader::Read32(const uint8_t* data) const
+{
+    if (m_swapped)
+    {
+        return static_cast<uint32_t>(data[0]) << 24 | static_cast<uint32_t>(data[1]) << 16 |
+            static_cast<uint32_t>(data[2]) << 8 | data[3];
+    }
+
+    return static_cast<uint32_t>(data[3]) << 24 | static_cast<uint32_t>(data[2]) << 16 |
+        static_cast<uint32_t>(data[1]) << 8 | data[0];
+}
+
+uint64_t CaptureReader::Microseconds(uint64_t ticks, uint64_t ticksPerSecond)
+{
+    if (ticksPerSecond == 1000000)
+        return ticks;
+
+    if (ticksPerSecond == 1000000000)
+        return ticks / 1000;
+
+    return ticks / ticksPerSecond * 1000000 + ticks % ticksPerSecond * 1000000 / ticksPerSecond;
+}
+
+CaptureReplayDevice::CaptureReplayDevice(CaptureReader& reader, uint64_t loops /*= 1*/, uint64_t packetsPerSecond /*= 0*/)
+    : m_reader(reader), m_loops(loops), m_packetsPerSecond(packetsPerSecond), m_pass(0), m_passPackets(0)
+    , m_received(0), m_start(std::chrono::steady_clock::now()), m_sent(0)
+{
+}
+
+bool CaptureReplayDevice::Recv(WinDivertPacket& packet)
+{
+    CaptureReader::PacketView view;
+
+    while (!m_reader.Next(view))
+    {
+        // An empty or broken file is not looped over
+        if (m_reader.Malformed() || m_passPackets == 0)
+            return false;
+
+        if (m_loops != 0 && ++m_pass >= m_loops)
+            return false;
+
+        m_reader.Rewind();
+        m_passPackets = 0;
+    }
+
+    m_passPackets++;
+
+    if (m_packetsPerSecond != 0)
+    {
+        // Sleeps once far enough ahead, short of that packets go out back to back and the average rate holds
+        std::chrono::steady_clock::time_point due = m_start +
+            std::chrono::nanoseconds(static_cast<int64_t>(m_received * 1000000000.0 / m_packetsPerSecond));
+
+        if (due - std::chrono::steady_clock::now() > std::chrono::milliseconds(1))
+            std::this_thread::sleep_until(due);
+    }
+
+    m_received++;
+
+    packet.Buffer().assign(view.data, view.data + view.length);
+    packet.Address() = view.address;
+    packet.Dissect();
+
+    return true;
+}
+
+bool CaptureReplayDevice::Send(const WinDivertPacket&)
+{
+    m_sent.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+uint64_t CaptureReplayDevice::Received() const
+{
+    return m_received;
+}
+
+uint64_t CaptureReplayDevice::Sent() const
+{
+    return m_sent.load(std::memory_order_relaxed);
+}
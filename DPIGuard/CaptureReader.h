@@ -0,0 +1,145 @@
+#pragma once
+
+#include "PacketDevice.h"
+
+// Reads pcap and pcapng files through a read-only mapping of the whole file. Packets are returned as views
+// into the mapping together with the WINDIVERT_ADDRESS a diverted packet would have, nothing is copied until
+// a packet is received into a WinDivertPacket. Captures of several gigabytes need a 64-bit build.
+class CaptureReader
+{
+public:
+    enum class Format : uint8_t
+    {
+        None = 0,
+        Pcap,
+        Pcapng
+    };
+
+    struct PacketView
+    {
+        PacketView()
+        {
+            data = nullptr;
+            length = 0;
+            address = WINDIVERT_ADDRESS();
+        }
+
+        // IPv4 or IPv6 packet, link layer headers are skipped
+        const uint8_t* data;
+        uint32_t length;
+
+        // Timestamp in microseconds, Outbound from pcapng packet flags or else from the server ports
+        WINDIVERT_ADDRESS address;
+    };
+
+    // WINDIVERT_ADDRESS::Timestamp of packet views is in microseconds
+    static const int64_t TIMESTAMP_FREQUENCY = 1000000;
+
+    CaptureReader();
+    ~CaptureReader();
+
+    bool Open(const std::wstring& filePath);
+    void Close();
+
+    // Starts over at the first packet, timestamps continue from the last packet returned
+    void Rewind();
+
+    // False at the end of the file or at the first malformed block
+    bool Next(PacketView& view);
+
+    Format FileFormat() const;
+    uint64_t FileSize() const;
+
+    uint64_t Packets() const;
+    // Packets of unsupported link types and packets that are not IP
+    uint64_t Skipped() const;
+    bool Malformed() const;
+private:
+    struct Interface
+    {
+        Interface()
+        {
+            linkType = 0;
+            ticksPerSecond = 1000000;
+            offset = 0;
+        }
+
+        uint16_t linkType;
+        uint64_t ticksPerSecond;
+        // if_tsoffset in microseconds
+        uint64_t offset;
+    };
+
+    bool NextPcap(PacketView& view);
+    bool NextPcapng(PacketView& view);
+    void PrefetchAhead();
+
+    bool ReadSectionHeader();
+    bool ReadInterfaceDescription(const uint8_t* body, uint32_t length);
+    bool ReadEnhancedPacket(const uint8_t* body, uint32_t length, PacketView& view);
+    bool ReadSimplePacket(const uint8_t* body, uint32_t length, PacketView& view);
+
+    bool SetPacket(uint16_t linkType, const uint8_t* data, uint32_t length, uint64_t timestamp, PacketView& view);
+
+    uint16_t Read16(const uint8_t* data) const;
+    uint32_t Read32(const uint8_t* data) const;
+
+    static uint64_t Microseconds(uint64_t ticks, uint64_t ticksPerSecond);
+private:
+    const uint8_t* m_data;
+    uint64_t m_size;
+    uint64_t m_offset;
+    uint64_t m_prefetched;
+
+#ifdef _WIN32
+    HANDLE m_file;
+    HANDLE m_mapping;
+#else
+    int m_file;
+#endif
+
+    Format m_format;
+    bool m_swapped;
+    bool m_malformed;
+
+    // pcap
+    uint16_t m_linkType;
+    uint64_t m_ticksPerSecond;
+
+    // pcapng, described by the current section
+    std::vector<Interface> m_interfaces;
+
+    // Added to timestamps after a rewind so that they keep increasing
+    uint64_t m_timeOffset;
+    uint64_t m_firstTimestamp;
+    uint64_t m_lastTimestamp;
+
+    uint64_t m_packets;
+    uint64_t m_skipped;
+};
+
+// Replays a capture as a packet device, optionally several times and paced to a packet rate.
+// Packets sent back are counted and discarded.
+class CaptureReplayDevice : public PacketDevice
+{
+public:
+    // loops is the number of passes over the file, endless if 0; packetsPerSecond 0 means as fast as possible
+    CaptureReplayDevice(CaptureReader& reader, uint64_t loops = 1, uint64_t packetsPerSecond = 0);
+
+    bool Recv(WinDivertPacket& packet) override;
+    bool Send(const WinDivertPacket& packet) override;
+
+    uint64_t Received() const;
+    uint64_t Sent() const;
+private:
+    CaptureReader& m_reader;
+    uint64_t m_loops;
+    uint64_t m_packetsPerSecond;
+
+    uint64_t m_pass;
+    uint64_t m_passPackets;
+    uint64_t m_received;
+    std::chrono::steady_clock::time_point m_start;
+
+    std::atomic<uint64_t> m_sent;
+};
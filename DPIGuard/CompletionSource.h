@@ -0,0 +1,54 @@
+#pragma once
+
+// Asynchronous receives of packet batches, implemented by WinDivertLib on an I/O completion port.
+// A submitted request belongs to the source until Complete hands it back.
+class CompletionSource
+{
+public:
+    struct Request
+    {
+        Request()
+            : length(0), addressLength(0), error(0)
+        {
+#ifdef _WIN32
+            memset(&overlapped, 0, sizeof(overlapped));
+#endif
+        }
+
+#ifdef _WIN32
+        OVERLAPPED overlapped;
+#endif
+        // Packets are stored back to back, one address each
+        std::vector<uint8_t> buffer;
+        std::vector<WINDIVERT_ADDRESS> addresses;
+
+        // Set on completion: bytes received, bytes of addresses filled in and the error, 0 on success
+        uint32_t length;
+        uint32_t addressLength;
+        uint32_t error;
+    };
+
+    virtual ~CompletionSource() = default;
+
+    // Starts receiving into request
+    virtual bool Submit(Request& request) = 0;
+    // Waits for the next completed request, false if none can complete anymore
+    virtual bool Complete(Request*& request) = 0;
+    // Like Complete without waiting, false if no request has completed yet
+    virtual bool Poll(Request*& request) = 0;
+    // Makes every submitted request complete soon, with an error if nothing was received
+    virtual void Cancel() = 0;
+
+    // Length of the IP packet at the start of data, 0 if there is no complete packet
+    static size_t PacketLength(const uint8_t* data, size_t length)
+    {
+        size_t packetLength = 0;
+
+        if (length >= 20 && (data[0] >> 4) == 4)
+            packetLength = (static_cast<size_t>(data[2]) << 8) | data[3];
+        else if (length >= 40 && (data[0] >> 4) == 6)
+            packetLength = 40 + ((static_cast<size_t>(data[4]) << 8) | data[5]);
+
+        return packetLength <= length ? packetLength : 0;
+    }
+};
@@ -0,0 +1,434 @@
+#include "StdAfx.h"
+#include "ControlChannel.h"
+
+#ifdef _WIN32
+#include "Utils.h"
+#else
+#include <cerrno>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Longer lines are dropped, so that a client cannot make the buffer grow without limit
+static const size_t MAX_REQUEST_LENGTH = 65536;
+
+// Single line YAML, the way values are returned to clients
+static std::string FormatNode(const YAML::Node& node)
+{
+    YAML::Emitter emitter;
+    emitter.SetMapFormat(YAML::Flow);
+    emitter.SetSeqFormat(YAML::Flow);
+    emitter << node;
+
+    return emitter.c_str();
+}
+
+ControlChannel::ControlChannel(ApplicationConfig& appConfig)
+    : m_appConfig(appConfig), m_stop(false)
+#ifdef _WIN32
+    , m_pipe(INVALID_HANDLE_VALUE), m_stopEvent(nullptr)
+#else
+    , m_socket(-1), m_stopEvent(-1)
+#endif
+    , m_modified(false), m_requests(0), m_failures(0)
+{
+}
+
+ControlChannel::~ControlChannel()
+{
+    Stop();
+}
+
+bool ControlChannel::Start(const std::string& path)
+{
+    Stop();
+
+    m_stop = false;
+
+#ifdef _WIN32
+    // The default security only lets the owner, administrators and LocalSystem write to the pipe
+    m_pipe = CreateNamedPipeW(Utils::Utf8ToWide(path).c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, 4096, 4096, 0, nullptr);
+
+    if (m_pipe == INVALID_HANDLE_VALUE)
+        return false;
+
+    m_stopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+    if (m_stopEvent == nullptr)
+    {
+        CloseHandle(m_pipe);
+        m_pipe = INVALID_HANDLE_VALUE;
+        return false;
+    }
+
+    m_path = path;
+#else
+    sockaddr_un local = {};
+    local.sun_family = AF_UNIX;
+
+    if (path.empty() || path.size() >= sizeof(local.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    memcpy(local.sun_path, path.c_str(), path.size());
+
+    // A socket left behind by a previous run is replaced, anything else at the path is not
+    struct stat status;
+    if (lstat(path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+        unlink(path.c_str());
+
+    m_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    m_stopEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (m_socket < 0 || m_stopEvent < 0)
+    {
+        int error = errno;
+        Stop();
+        errno = error;
+        return false;
+    }
+
+    // Only the owner may connect, the socket is created with these permissions
+    mode_t mask = umask(0177);
+    int result = bind(m_socket, reinterpret_cast<const sockaddr*>(&local), sizeof(local));
+    umask(mask);
+
+    if (result != 0 || listen(m_socket, 4) != 0)
+    {
+        int error = errno;
+        Stop();
+        errno = error;
+        return false;
+    }
+
+    // Removed again on stop
+    m_path = path;
+#endif
+
+    m_thread.reset(new std::thread(&ControlChannel::Serve, this));
+
+    return true;
+}
+
+void ControlChannel::Stop()
+{
+    m_stop = true;
+
+#ifdef _WIN32
+    if (m_stopEvent != nullptr)
+        SetEvent(m_stopEvent);
+#else
+    if (m_stopEvent >= 0)
+    {
+        uint64_t value = 1;
+        ssize_t written = write(m_stopEvent, &value, sizeof(value));
+        (void)written;
+    }
+#endif
+
+    if (m_thread && m_thread->joinable())
+        m_thread->join();
+
+    m_thread.reset();
+
+#ifdef _WIN32
+    if (m_pipe != INVALID_HANDLE_VALUE)
+        CloseHandle(m_pipe);
+    if (m_stopEvent != nullptr)
+        CloseHandle(m_stopEvent);
+
+    m_pipe = INVALID_HANDLE_VALUE;
+    m_stopEvent = nullptr;
+#else
+    if (m_socket >= 0)
+        close(m_socket);
+
+    if (!m_path.empty())
+        unlink(m_path.c_str());
+
+    if (m_stopEvent >= 0)
+        close(m_stopEvent);
+
+    m_socket = -1;
+    m_stopEvent = -1;
+#endif
+
+    m_path.clear();
+}
+
+std::string ControlChannel::Execute(const std::string& request)
+{
+    m_requests++;
+
+    // Command, blanks, argument; trailing blanks and the carriage return of CRLF clients are ignored
+    size_t end = request.find_last_not_of(" \t\r");
+    size_t begin = request.find_first_not_of(" \t\r");
+
+    std::string line = begin == std::string::npos ? std::string() : request.substr(begin, end - begin + 1);
+    size_t separator = line.find_first_of(" \t");
+
+    std::string command = line.substr(0, separator);
+    std::string argument = separator == std::string::npos ? std::string() : line.substr(line.find_first_not_of(" \t", separator));
+
+    std::string response;
+
+    if (command == "add" || command == "update")
+    {
+        response = ExecuteChange(command, argument);
+    }
+    else if (command == "remove")
+    {
+        if (m_appConfig.RemoveDomain(argument))
+        {
+            m_modified = true;
+            response = "OK";
+        }
+        else
+        {
+            response = "ERROR not configured";
+        }
+    }
+    else if (command == "get")
+    {
+        std::shared_ptr<const ApplicationConfig::DomainConfig> domainConfig = m_appConfig.FindDomain(argument);
+
+        response = domainConfig ? "OK " + FormatNode(m_appConfig.SaveDomain(*domainConfig)) : "ERROR not configured";
+    }
+    else if (command == "match")
+    {
+        std::shared_ptr<const ApplicationConfig::DomainConfig> domainConfig = m_appConfig.GetDomainConfig(argument);
+
+        response = domainConfig ? "OK " + FormatNode(m_appConfig.SaveDomain(*domainConfig)) : "OK ~";
+    }
+    else
+    {
+        response = "ERROR unknown command";
+    }
+
+    if (response.compare(0, 5, "ERROR") == 0)
+        m_failures++;
+
+    return response;
+}
+
+bool ControlChannel::TakeModified()
+{
+    return m_modified.exchange(false);
+}
+
+uint64_t ControlChannel::Requests() const
+{
+    return m_requests.load();
+}
+
+uint64_t ControlChannel::Failures() const
+{
+    return m_failures.load();
+}
+
+std::string ControlChannel::ExecuteChange(const std::string& command, const std::string& argument)
+{
+    // Plain names are taken as they are, so that wildcard names need no quotes
+    YAML::Node domainConfigNode(argument);
+
+    if (!argument.empty() && argument[0] == '{')
+    {
+        try
+        {
+            domainConfigNode = YAML::Load(argument);
+        }
+        catch (const YAML::Exception&)
+        {
+            return "ERROR invalid domain";
+        }
+    }
+
+    std::shared_ptr<ApplicationConfig::DomainConfig> domainConfig = std::make_shared<ApplicationConfig::DomainConfig>();
+
+    if (argument.empty() || !m_appConfig.ParseDomain(domainConfigNode, *domainConfig))
+        return "ERROR invalid domain";
+
+    if (command == "add")
+    {
+        if (!m_appConfig.AddDomain(domainConfig))
+            return "ERROR already configured";
+    }
+    else
+    {
+        if (!m_appConfig.UpdateDomain(domainConfig))
+            return "ERROR not configured";
+    }
+
+    m_modified = true;
+
+    return "OK";
+}
+
+void ControlChannel::Consume(std::string& buffer, std::string& output)
+{
+    size_t begin = 0;
+    size_t end = 0;
+
+    while ((end = buffer.find('\n', begin)) != std::string::npos)
+    {
+        output += Execute(buffer.substr(begin, end - begin));
+        output += '\n';
+
+        begin = end + 1;
+    }
+
+    buffer.erase(0, begin);
+
+    if (buffer.size() > MAX_REQUEST_LENGTH)
+    {
+        buffer.clear();
+
+        output += "ERROR request too long\n";
+        m_failures++;
+    }
+}
+
+#ifdef _WIN32
+void ControlChannel::Serve()
+{
+    char chunk[4096];
+
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+    if (overlapped.hEvent == nullptr)
+        return;
+
+    HANDLE events[2] = { m_stopEvent, overlapped.hEvent };
+
+    // Waits for an overlapped operation, false when it failed or the channel is stopping
+    auto complete = [&](BOOL result, DWORD& bytes) {
+        if (!result && GetLastError() != ERROR_IO_PENDING)
+            return false;
+
+        if (WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0 + 1)
+        {
+            CancelIo(m_pipe);
+            GetOverlappedResult(m_pipe, &overlapped, &bytes, TRUE);
+            return false;
+        }
+
+        return GetOverlappedResult(m_pipe, &overlapped, &bytes, FALSE) != FALSE;
+    };
+
+    while (!m_stop)
+    {
+        DWORD bytes = 0;
+
+        // A client that connected before the call is reported as an error without signaling the event
+        if (!ConnectNamedPipe(m_pipe, &overlapped) && GetLastError() != ERROR_PIPE_CONNECTED)
+        {
+            if (!complete(FALSE, bytes))
+            {
+                DisconnectNamedPipe(m_pipe);
+                continue;
+            }
+        }
+
+        std::string buffer;
+        std::string output;
+
+        while (true)
+        {
+            if (!complete(ReadFile(m_pipe, chunk, sizeof(chunk), &bytes, &overlapped), bytes) || bytes == 0)
+                break;
+
+            buffer.append(chunk, bytes);
+
+            output.clear();
+            Consume(buffer, output);
+
+            if (!output.empty() && !complete(WriteFile(m_pipe, output.data(), static_cast<DWORD>(output.size()), &bytes, &overlapped), bytes))
+                break;
+        }
+
+        DisconnectNamedPipe(m_pipe);
+    }
+
+    CloseHandle(overlapped.hEvent);
+}
+#else
+void ControlChannel::Serve()
+{
+    char chunk[4096];
+
+    pollfd listening[2] = { { m_socket, POLLIN, 0 }, { m_stopEvent, POLLIN, 0 } };
+
+    while (!m_stop)
+    {
+        if (poll(listening, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (listening[1].revents != 0)
+            break;
+
+        int client = accept4(m_socket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0)
+            continue;
+
+        // A client that does not read its responses cannot hold up stopping
+        timeval timeout = { 1, 0 };
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        pollfd connected[2] = { { client, POLLIN, 0 }, { m_stopEvent, POLLIN, 0 } };
+
+        std::string buffer;
+        std::string output;
+
+        while (true)
+        {
+            if (poll(connected, 2, -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+
+            if (connected[1].revents != 0)
+                break;
+
+            ssize_t received = recv(client, chunk, sizeof(chunk), 0);
+            if (received <= 0)
+                break;
+
+            buffer.append(chunk, static_cast<size_t>(received));
+
+            output.clear();
+            Consume(buffer, output);
+
+            size_t sent = 0;
+
+            while (sent < output.size())
+            {
+                ssize_t result = send(client, output.data() + sent, output.size() - sent, MSG_NOSIGNAL);
+                if (result <= 0)
+                    break;
+
+                sent += static_cast<size_t>(result);
+            }
+
+            if (sent < output.size())
+                break;
+        }
+
+        close(client);
+    }
+}
+#endif
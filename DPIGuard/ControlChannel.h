@@ -0,0 +1,56 @@
+#pragma once
+
+#include "ApplicationConfig.h"
+
+// Local control channel for changing single domains without rewriting and reloading the configuration file.
+// A named pipe on Windows and a Unix socket elsewhere, only one client is served at a time.
+//
+// Every request is one line and gets one line back, "OK" with an optional YAML value or "ERROR" with a reason:
+//   add <domain>       adds a domain entry, written as in the domains list of the configuration
+//   update <domain>    replaces the entry of the same name
+//   remove <name>      removes the entry of that name
+//   get <name>         the entry of that name
+//   match <host>       the entry a host name matches, ~ if none
+class ControlChannel
+{
+public:
+    explicit ControlChannel(ApplicationConfig& appConfig);
+    ~ControlChannel();
+
+    // Pipe name or socket path
+    bool Start(const std::string& path);
+    void Stop();
+
+    // One request line, the response without line break
+    std::string Execute(const std::string& request);
+
+    // True once after domains were changed, for the caller to save the configuration file
+    bool TakeModified();
+
+    uint64_t Requests() const;
+    uint64_t Failures() const;
+private:
+    void Serve();
+    // Executes the complete lines in buffer and appends the responses to output
+    void Consume(std::string& buffer, std::string& output);
+
+    std::string ExecuteChange(const std::string& command, const std::string& argument);
+private:
+    ApplicationConfig& m_appConfig;
+
+    std::unique_ptr<std::thread> m_thread;
+    std::atomic<bool> m_stop;
+    std::string m_path;
+
+#ifdef _WIN32
+    HANDLE m_pipe;
+    HANDLE m_stopEvent;
+#else
+    int m_socket;
+    int m_stopEvent;
+#endif
+
+    std::atomic<bool> m_modified;
+    std::atomic<uint64_t> m_requests;
+    std::atomic<uint64_t> m_failures;
+};
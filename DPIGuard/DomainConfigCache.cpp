@@ -0,0 +1,165 @@
+#include "StdAfx.h"
+#include "DomainConfigCache.h"
+#include "Utils.h"
+
+DomainConfigCache::DomainConfigCache(size_t capacity /*= 4096*/)
+    : m_setMask(0), m_hits(0), m_misses(0)
+{
+    size_t sets = 1;
+    while (sets * 2 < capacity)
+        sets *= 2;
+
+    m_entries.resize(sets * 2);
+    m_recent.resize(sets);
+    m_setMask = sets - 1;
+}
+
+std::shared_ptr<const ApplicationConfig::DomainConfig> DomainConfigCache::Get(ApplicationConfig& appConfig, const std::string& domain)
+{
+    Entry key;
+    MakeKey(appConfig, domain, key);
+
+    if (Entry* entry = Probe(key))
+        return entry->domainConfig;
+
+    m_misses++;
+
+    // Negative results are cached as well, most of the looked up names are not configured
+    std::shared_ptr<const ApplicationConfig::DomainConfig> domainConfig = appConfig.GetDomainConfig(key.domain);
+    Insert(key, domainConfig);
+
+    return domainConfig;
+}
+
+void DomainConfigCache::Get(ApplicationConfig& appConfig, const std::string* const* domains, size_t count,
+    std::shared_ptr<const ApplicationConfig::DomainConfig>* domainConfigs)
+{
+    m_keys.resize(count);
+    m_missed.clear();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        MakeKey(appConfig, *domains[i], m_keys[i]);
+
+        // Both ways of the set, an entry takes about a cache line
+        const Entry* ways = &m_entries[(static_cast<size_t>(m_keys[i].hash) & m_setMask) * 2];
+        Utils::Prefetch(ways);
+        Utils::Prefetch(ways + 1);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (Entry* entry = Probe(m_keys[i]))
+            domainConfigs[i] = entry->domainConfig;
+        else
+            m_missed.push_back(i);
+    }
+
+    if (m_missed.empty())
+        return;
+
+    m_missedDomains.clear();
+    for (size_t i : m_missed)
+        m_missedDomains.push_back(&m_keys[i].domain);
+
+    m_missedConfigs.resize(m_missed.size());
+    appConfig.GetDomainConfigs(m_missedDomains.data(), m_missedDomains.size(), m_missedConfigs.data());
+
+    for (size_t i = 0; i < m_missed.size(); i++)
+    {
+        Entry& key = m_keys[m_missed[i]];
+
+        // The same name can miss more than once in a batch, it is only cached once
+        if (Entry* entry = Probe(key))
+        {
+            domainConfigs[m_missed[i]] = entry->domainConfig;
+            continue;
+        }
+
+        m_misses++;
+
+        domainConfigs[m_missed[i]] = m_missedConfigs[i];
+        Insert(key, m_missedConfigs[i]);
+    }
+}
+
+bool DomainConfigCache::Find(ApplicationConfig& appConfig, const std::string& domain, std::shared_ptr<const ApplicationConfig::DomainConfig>& domainConfig)
+{
+    Entry key;
+    MakeKey(appConfig, domain, key);
+
+    Entry* entry = Probe(key);
+    if (!entry)
+        return false;
+
+    domainConfig = entry->domainConfig;
+    return true;
+}
+
+void DomainConfigCache::Clear()
+{
+    for (Entry& entry : m_entries)
+        entry = Entry();
+
+    std::fill(m_recent.begin(), m_recent.end(), static_cast<uint8_t>(0));
+}
+
+size_t DomainConfigCache::Capacity() const
+{
+    return m_entries.size();
+}
+
+uint64_t DomainConfigCache::Hits() const
+{
+    return m_hits;
+}
+
+uint64_t DomainConfigCache::Misses() const
+{
+    return m_misses;
+}
+
+void DomainConfigCache::MakeKey(ApplicationConfig& appConfig, const std::string& domain, Entry& key)
+{
+    // Domain matching is case insensitive, so the cache is keyed by the lower case name
+    key.domain = domain;
+    std::transform(key.domain.begin(), key.domain.end(), key.domain.begin(), [](char c) {
+        return static_cast<char>(tolower(static_cast<uint8_t>(c)));
+    });
+
+    key.hash = Utils::HashString(key.domain.c_str(), key.domain.size());
+    key.generation = appConfig.Generation();
+}
+
+DomainConfigCache::Entry* DomainConfigCache::Probe(const Entry& key)
+{
+    size_t set = static_cast<size_t>(key.hash) & m_setMask;
+    Entry* ways = &m_entries[set * 2];
+
+    for (uint8_t way = 0; way < 2; way++)
+    {
+        Entry& entry = ways[way];
+
+        if (entry.hash == key.hash && entry.generation == key.generation && entry.domain == key.domain)
+        {
+            m_recent[set] = way;
+            m_hits++;
+
+            return &entry;
+        }
+    }
+
+    return nullptr;
+}
+
+void DomainConfigCache::Insert(Entry& key, const std::shared_ptr<const ApplicationConfig::DomainConfig>& domainConfig)
+{
+    size_t set = static_cast<size_t>(key.hash) & m_setMask;
+    uint8_t victim = m_recent[set] ^ 1;
+
+    Entry& entry = m_entries[set * 2 + victim];
+    entry = std::move(key);
+    entry.domainConfig = domainConfig;
+
+    m_recent[set] = victim;
+}
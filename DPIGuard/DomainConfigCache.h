@@ -0,0 +1,60 @@
+#pragma once
+
+#include "ApplicationConfig.h"
+
+// Bounded two-way set associative cache in front of ApplicationConfig::GetDomainConfig.
+// Not thread safe, each packet processing thread owns its own instance.
+class DomainConfigCache
+{
+public:
+    DomainConfigCache(size_t capacity = 4096);
+
+    std::shared_ptr<const ApplicationConfig::DomainConfig> Get(ApplicationConfig& appConfig, const std::string& domain);
+    // Get for count names at once: every name is hashed and its set requested before the first one is probed,
+    // and the names that missed are matched together
+    void Get(ApplicationConfig& appConfig, const std::string* const* domains, size_t count,
+        std::shared_ptr<const ApplicationConfig::DomainConfig>* domainConfigs);
+    // Like Get, but false instead of matching when the domain is not cached
+    bool Find(ApplicationConfig& appConfig, const std::string& domain, std::shared_ptr<const ApplicationConfig::DomainConfig>& domainConfig);
+
+    void Clear();
+
+    size_t Capacity() const;
+
+    uint64_t Hits() const;
+    uint64_t Misses() const;
+private:
+    struct Entry
+    {
+        Entry()
+            : hash(0), generation(0)
+        {
+        }
+
+        uint64_t hash;
+        uint64_t generation;
+        std::string domain;
+        std::shared_ptr<const ApplicationConfig::DomainConfig> domainConfig;
+    };
+
+    // Fills in the lower case name, its hash and the configuration generation of key
+    static void MakeKey(ApplicationConfig& appConfig, const std::string& domain, Entry& key);
+    // The entry holding key if there is one
+    Entry* Probe(const Entry& key);
+    // Replaces the least recently used way of the key's set
+    void Insert(Entry& key, const std::shared_ptr<const ApplicationConfig::DomainConfig>& domainConfig);
+
+    std::vector<Entry> m_entries;
+    // Index of the most recently used way for each set
+    std::vector<uint8_t> m_recent;
+    size_t m_setMask;
+
+    // Batched lookups only, kept to avoid allocating per batch
+    std::vector<Entry> m_keys;
+    std::vector<size_t> m_missed;
+    std::vector<const std::string*> m_missedDomains;
+    std::vector<std::shared_ptr<const ApplicationConfig::DomainConfig>> m_missedConfigs;
+
+    uint64_t m_hits;
+    uint64_t m_misses;
+};
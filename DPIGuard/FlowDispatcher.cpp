@@ -0,0 +1,443 @@
+#include "StdAfx.h"
+#include "FlowDispatcher.h"
+
+static const size_t WORKER_SPIN_COUNT = 256;
+// Fragments a worker can have queued for the send thread
+static const size_t WORKER_COPY_COUNT = 256;
+// Packets the send thread takes from one ring before it looks at the next
+static const size_t SENDER_BATCH_SIZE = 32;
+// Packets a worker takes from its ring and classifies together
+static const size_t WORKER_BATCH_SIZE = 32;
+
+void FlowDispatcher::Signal::Notify()
+{
+    // Pairs with the fence in Wait, either the consumer sees the pushed item or this sees it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (sleeping.load(std::memory_order_relaxed))
+    {
+        std::unique_lock<std::mutex> locked(lock);
+        cv.notify_one();
+    }
+}
+
+void FlowDispatcher::Signal::Stop()
+{
+    {
+        std::unique_lock<std::mutex> locked(lock);
+        stop.store(true, std::memory_order_release);
+    }
+
+    cv.notify_one();
+}
+
+FlowDispatcher::WorkerDevice::WorkerDevice(FlowDispatcher& dispatcher, Worker& worker)
+    : m_dispatcher(dispatcher), m_worker(worker)
+{
+}
+
+bool FlowDispatcher::WorkerDevice::Recv(WinDivertPacket& /*packet*/)
+{
+    return false;
+}
+
+bool FlowDispatcher::WorkerDevice::Send(const WinDivertPacket& packet)
+{
+    WinDivertPacket* copy = nullptr;
+
+    // Every copy is queued, wait for the send thread to catch up
+    while (!m_worker.freeCopies.TryPop(copy))
+        std::this_thread::yield();
+
+    *copy = packet;
+
+    m_dispatcher.Enqueue(m_worker.outgoing, Outgoing(copy, false));
+
+    return true;
+}
+
+FlowDispatcher::Worker::Worker(FlowDispatcher& dispatcher, ApplicationConfig& appConfig, PacketCapture* capture, size_t packets)
+    : device(dispatcher.m_sendThread ? new WorkerDevice(dispatcher, *this) : nullptr)
+    , processor(appConfig, device ? *device : dispatcher.m_device, capture), packets(packets), freePackets(packets)
+    , outgoing(dispatcher.m_sendThread ? packets + WORKER_COPY_COUNT : 0), freeCopies(dispatcher.m_sendThread ? WORKER_COPY_COUNT : 0)
+{
+    if (!device)
+        return;
+
+    copies.reserve(WORKER_COPY_COUNT);
+
+    for (size_t i = 0; i < WORKER_COPY_COUNT; i++)
+    {
+        copies.push_back(std::make_unique<WinDivertPacket>(4096, dispatcher.m_packetArena));
+        freeCopies.TryPush(copies.back().get());
+    }
+}
+
+FlowDispatcher::FlowDispatcher(ApplicationConfig& appConfig, PacketDevice& device, PacketCapture* capture, size_t workers,
+    bool sendThread /*= false*/, size_t packets /*= 1024*/)
+    : m_device(device), m_sendThread(sendThread)
+{
+    workers = std::max<size_t>(workers, 1);
+    packets = std::max(packets, workers);
+
+    // Buffers of the pool and of the copies, packets that grow past them move to the heap
+    if (appConfig.Engine().largePages)
+        m_packetArena = std::make_shared<LargePageArena>("packet pool", (packets + (sendThread ? workers * WORKER_COPY_COUNT : 0)) * 4096);
+
+    m_packets.reserve(packets);
+    m_freePackets.reserve(packets);
+
+    for (size_t i = 0; i < packets; i++)
+    {
+        m_packets.push_back(std::make_unique<WinDivertPacket>(4096, m_packetArena));
+        m_freePackets.push_back(m_packets.back().get());
+    }
+
+    // Every ring can hold the whole pool, so pushing only waits for the pool itself
+    for (size_t i = 0; i < workers; i++)
+        m_workers.push_back(std::make_unique<Worker>(*this, appConfig, capture, packets));
+
+    for (std::unique_ptr<Worker>& worker : m_workers)
+        worker->thread = std::thread(&FlowDispatcher::WorkerMain, this, std::ref(*worker));
+
+    if (m_sendThread)
+    {
+        m_bypass.reset(new SpscRing<Outgoing>(packets));
+        m_sentPackets.reset(new SpscRing<WinDivertPacket*>(packets));
+
+        m_sender = std::thread(&FlowDispatcher::SenderMain, this);
+    }
+}
+
+FlowDispatcher::~FlowDispatcher()
+{
+    StopWorkers();
+}
+
+void FlowDispatcher::SetVerbose(bool verbose)
+{
+    // Workers only touch their processor once packets arrive
+    for (std::unique_ptr<Worker>& worker : m_workers)
+        worker->processor.SetVerbose(verbose);
+}
+
+void FlowDispatcher::EnableFeedback(StrategyScoreboard& scoreboard, int64_t timestampFrequency)
+{
+    // Inbound responses hash to the same worker as the outbound segment, so every tracker sees whole flows
+    for (std::unique_ptr<Worker>& worker : m_workers)
+        worker->processor.EnableFeedback(scoreboard, timestampFrequency);
+}
+
+void FlowDispatcher::EnableRecordSplitting(int64_t timestampFrequency)
+{
+    for (std::unique_ptr<Worker>& worker : m_workers)
+        worker->processor.EnableRecordSplitting(timestampFrequency);
+}
+
+void FlowDispatcher::EnableRetransmissionCache(int64_t timestampFrequency)
+{
+    for (std::unique_ptr<Worker>& worker : m_workers)
+        worker->processor.EnableRetransmissionCache(timestampFrequency);
+}
+
+void FlowDispatcher::EnableShadow()
+{
+    for (std::unique_ptr<Worker>& worker : m_workers)
+        worker->processor.EnableShadow();
+}
+
+void FlowDispatcher::EnableHostnameStats(HostnameStats& stats)
+{
+    for (std::unique_ptr<Worker>& worker : m_workers)
+        worker->processor.EnableHostnameStats(stats);
+}
+
+void FlowDispatcher::EnableOverloadControl(uint64_t budget, OverloadController::Action action, int64_t timestampFrequency)
+{
+    // Packets keep their capture timestamps in the rings, so the time spent there counts as well
+    for (std::unique_ptr<Worker>& worker : m_workers)
+        worker->processor.EnableOverloadControl(budget, action, timestampFrequency);
+}
+
+void FlowDispatcher::Run()
+{
+    while (true)
+    {
+        WinDivertPacket* packet = AcquirePacket();
+
+        if (!m_device.Recv(*packet))
+        {
+            m_freePackets.push_back(packet);
+            break;
+        }
+
+        if (!packet->Dissect() || !packet->Tcp())
+        {
+            if (m_sendThread)
+            {
+                Enqueue(*m_bypass, Outgoing(packet, true));
+                continue;
+            }
+
+            m_device.Send(*packet);
+            m_freePackets.push_back(packet);
+            continue;
+        }
+
+        Dispatch(*m_workers[HashFlow(*packet) % m_workers.size()], packet);
+    }
+
+    StopWorkers();
+}
+
+size_t FlowDispatcher::Workers() const
+{
+    return m_workers.size();
+}
+
+const PacketProcessor& FlowDispatcher::Processor(size_t index) const
+{
+    return m_workers.at(index)->processor;
+}
+
+uint64_t FlowDispatcher::HashFlow(WinDivertPacket& packet)
+{
+    const uint8_t* srcAddr = nullptr;
+    const uint8_t* dstAddr = nullptr;
+    size_t addrLength = 0;
+
+    if (packet.IPv4())
+    {
+        srcAddr = reinterpret_cast<const uint8_t*>(&packet.IPv4()->SrcAddr);
+        dstAddr = reinterpret_cast<const uint8_t*>(&packet.IPv4()->DstAddr);
+        addrLength = 4;
+    }
+    else if (packet.IPv6())
+    {
+        srcAddr = reinterpret_cast<const uint8_t*>(packet.IPv6()->SrcAddr);
+        dstAddr = reinterpret_cast<const uint8_t*>(packet.IPv6()->DstAddr);
+        addrLength = 16;
+    }
+
+    uint64_t srcHash = 0;
+    uint64_t dstHash = 0;
+
+    for (size_t i = 0; i < addrLength; i++)
+    {
+        srcHash = (srcHash ^ srcAddr[i]) * 0x100000001b3ULL;
+        dstHash = (dstHash ^ dstAddr[i]) * 0x100000001b3ULL;
+    }
+
+    if (packet.Tcp())
+    {
+        srcHash = (srcHash ^ packet.Tcp()->SrcPort) * 0x100000001b3ULL;
+        dstHash = (dstHash ^ packet.Tcp()->DstPort) * 0x100000001b3ULL;
+    }
+
+    // Adding the endpoint hashes makes the result independent of the direction
+    uint64_t hash = srcHash + dstHash;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+void FlowDispatcher::WorkerMain(Worker& worker)
+{
+    size_t idle = 0;
+    WinDivertPacket* batch[WORKER_BATCH_SIZE];
+
+    while (true)
+    {
+        size_t count = 0;
+        while (count < WORKER_BATCH_SIZE && worker.packets.TryPop(batch[count]))
+            count++;
+
+        if (count != 0)
+        {
+            idle = 0;
+
+            worker.processor.PrepareBatch(batch, count);
+
+            for (size_t i = 0; i < count; i++)
+            {
+                WinDivertPacket* packet = batch[i];
+
+                if (worker.processor.HandlePacket(*packet))
+                {
+                    while (!worker.freePackets.TryPush(packet))
+                        std::this_thread::yield();
+                }
+                else if (m_sendThread)
+                {
+                    // Goes back to the pool once the send thread is done with it
+                    Enqueue(worker.outgoing, Outgoing(packet, true));
+                }
+                else
+                {
+                    m_device.Send(*packet);
+
+                    while (!worker.freePackets.TryPush(packet))
+                        std::this_thread::yield();
+                }
+            }
+
+            continue;
+        }
+
+        if (worker.signal.stop.load(std::memory_order_acquire) && worker.packets.Empty())
+        {
+            worker.processor.FlushHostnameStats();
+            break;
+        }
+
+        if (++idle < WORKER_SPIN_COUNT)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        // Names counted before the traffic stopped would otherwise wait for the next one
+        worker.processor.FlushHostnameStats();
+
+        worker.signal.Wait([&worker]() {
+            return worker.packets.Empty();
+        });
+
+        idle = 0;
+    }
+}
+
+void FlowDispatcher::SenderMain()
+{
+    size_t idle = 0;
+
+    auto empty = [this]() {
+        if (!m_bypass->Empty())
+            return false;
+
+        for (std::unique_ptr<Worker>& worker : m_workers)
+        {
+            if (!worker->outgoing.Empty())
+                return false;
+        }
+
+        return true;
+    };
+
+    while (true)
+    {
+        size_t sent = 0;
+        Outgoing outgoing;
+
+        // Bounded batches per ring, so that a busy worker cannot hold back the others
+        for (size_t i = 0; i < SENDER_BATCH_SIZE && m_bypass->TryPop(outgoing); i++, sent++)
+        {
+            m_device.Send(*outgoing.packet);
+            m_sentPackets->TryPush(outgoing.packet);
+        }
+
+        for (std::unique_ptr<Worker>& worker : m_workers)
+        {
+            for (size_t i = 0; i < SENDER_BATCH_SIZE && worker->outgoing.TryPop(outgoing); i++, sent++)
+                Transmit(*worker, outgoing);
+        }
+
+        if (sent != 0)
+        {
+            idle = 0;
+            continue;
+        }
+
+        // Workers are joined before the send thread is stopped, nothing is queued after that
+        if (m_senderSignal.stop.load(std::memory_order_acquire) && empty())
+            break;
+
+        if (++idle < WORKER_SPIN_COUNT)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        m_senderSignal.Wait(empty);
+        idle = 0;
+    }
+}
+
+WinDivertPacket* FlowDispatcher::AcquirePacket()
+{
+    while (m_freePackets.empty())
+    {
+        for (std::unique_ptr<Worker>& worker : m_workers)
+        {
+            WinDivertPacket* packet = nullptr;
+
+            while (worker->freePackets.TryPop(packet))
+                m_freePackets.push_back(packet);
+        }
+
+        if (m_sentPackets)
+        {
+            WinDivertPacket* packet = nullptr;
+
+            while (m_sentPackets->TryPop(packet))
+                m_freePackets.push_back(packet);
+        }
+
+        // Every packet is queued on a worker or the send thread, wait for them to catch up
+        if (m_freePackets.empty())
+            std::this_thread::yield();
+    }
+
+    WinDivertPacket* packet = m_freePackets.back();
+    m_freePackets.pop_back();
+
+    return packet;
+}
+
+void FlowDispatcher::Dispatch(Worker& worker, WinDivertPacket* packet)
+{
+    while (!worker.packets.TryPush(packet))
+        std::this_thread::yield();
+
+    worker.signal.Notify();
+}
+
+void FlowDispatcher::Enqueue(SpscRing<Outgoing>& ring, const Outgoing& outgoing)
+{
+    while (!ring.TryPush(outgoing))
+        std::this_thread::yield();
+
+    m_senderSignal.Notify();
+}
+
+void FlowDispatcher::Transmit(Worker& worker, const Outgoing& outgoing)
+{
+    m_device.Send(*outgoing.packet);
+
+    // Both rings can hold everything that could be in flight, so pushing never fails
+    if (outgoing.received)
+        m_sentPackets->TryPush(outgoing.packet);
+    else
+        worker.freeCopies.TryPush(outgoing.packet);
+}
+
+void FlowDispatcher::StopWorkers()
+{
+    for (std::unique_ptr<Worker>& worker : m_workers)
+        worker->signal.Stop();
+
+    for (std::unique_ptr<Worker>& worker : m_workers)
+    {
+        if (worker->thread.joinable())
+            worker->thread.join();
+    }
+
+    // Workers may still have queued packets while draining
+    m_senderSignal.Stop();
+
+    if (m_sender.joinable())
+        m_sender.join();
+}
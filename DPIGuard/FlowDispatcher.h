@@ -0,0 +1,145 @@
+#pragma once
+
+#include "PacketProcessor.h"
+#include "SpscRing.h"
+
+// Receives packets on the calling thread and hands them to worker threads by a symmetric hash of the
+// TCP/IP 5-tuple, so both directions of a connection always land on the same worker and per-flow state
+// never has to be shared. Workers send through the shared device, or with a send thread hand their packets
+// over to it, so that blocking receives, classification and blocking sends overlap. All rings are bounded,
+// a stage that falls behind stalls the one before it.
+class FlowDispatcher
+{
+public:
+    FlowDispatcher(ApplicationConfig& appConfig, PacketDevice& device, PacketCapture* capture, size_t workers,
+        bool sendThread = false, size_t packets = 1024);
+    ~FlowDispatcher();
+
+    void SetVerbose(bool verbose);
+    void EnableFeedback(StrategyScoreboard& scoreboard, int64_t timestampFrequency);
+    void EnableRecordSplitting(int64_t timestampFrequency);
+    void EnableRetransmissionCache(int64_t timestampFrequency);
+    void EnableShadow();
+    void EnableHostnameStats(HostnameStats& stats);
+    void EnableOverloadControl(uint64_t budget, OverloadController::Action action, int64_t timestampFrequency);
+
+    // Returns once the device stops delivering packets and all workers have drained
+    void Run();
+
+    size_t Workers() const;
+    const PacketProcessor& Processor(size_t index) const;
+
+    static uint64_t HashFlow(WinDivertPacket& packet);
+private:
+    // Lets a consumer sleep once its rings stay empty, producers wake it after pushing
+    struct Signal
+    {
+        Signal()
+            : sleeping(false), stop(false)
+        {
+        }
+
+        // Producer side, after pushing
+        void Notify();
+        void Stop();
+
+        // Consumer side, sleeps unless idle() turns false or the consumer is stopping
+        template<typename Idle>
+        void Wait(Idle idle)
+        {
+            std::unique_lock<std::mutex> locked(lock);
+
+            sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (idle() && !stop.load(std::memory_order_acquire))
+                cv.wait(locked);
+
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+
+        std::mutex lock;
+        std::condition_variable cv;
+        std::atomic<bool> sleeping;
+        std::atomic<bool> stop;
+    };
+
+    // A packet for the send thread. Received packets go back to the pool once sent, copies back to their worker.
+    struct Outgoing
+    {
+        Outgoing()
+            : packet(nullptr), received(false)
+        {
+        }
+
+        Outgoing(WinDivertPacket* packet, bool received)
+            : packet(packet), received(received)
+        {
+        }
+
+        WinDivertPacket* packet;
+        bool received;
+    };
+
+    struct Worker;
+
+    // Device of a worker's processor with a send thread, fragments are copied and queued instead of sent
+    class WorkerDevice : public PacketDevice
+    {
+    public:
+        WorkerDevice(FlowDispatcher& dispatcher, Worker& worker);
+
+        bool Recv(WinDivertPacket& packet) override;
+        bool Send(const WinDivertPacket& packet) override;
+    private:
+        FlowDispatcher& m_dispatcher;
+        Worker& m_worker;
+    };
+
+    struct Worker
+    {
+        Worker(FlowDispatcher& dispatcher, ApplicationConfig& appConfig, PacketCapture* capture, size_t packets);
+
+        // Only with a send thread, constructed before the processor that sends through it
+        std::unique_ptr<WorkerDevice> device;
+        PacketProcessor processor;
+
+        SpscRing<WinDivertPacket*> packets;
+        // Handled packets going back to the receiving thread
+        SpscRing<WinDivertPacket*> freePackets;
+
+        // Packets for the send thread and the copies it gives back
+        SpscRing<Outgoing> outgoing;
+        SpscRing<WinDivertPacket*> freeCopies;
+        std::vector<std::unique_ptr<WinDivertPacket>> copies;
+
+        std::thread thread;
+        Signal signal;
+    };
+
+    void WorkerMain(Worker& worker);
+    void SenderMain();
+
+    WinDivertPacket* AcquirePacket();
+    void Dispatch(Worker& worker, WinDivertPacket* packet);
+    void Enqueue(SpscRing<Outgoing>& ring, const Outgoing& outgoing);
+    void Transmit(Worker& worker, const Outgoing& outgoing);
+
+    void StopWorkers();
+private:
+    PacketDevice& m_device;
+    bool m_sendThread;
+
+    std::shared_ptr<LargePageArena> m_packetArena;
+    std::vector<std::unique_ptr<WinDivertPacket>> m_packets;
+    std::vector<WinDivertPacket*> m_freePackets;
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+
+    // Packets the receiving thread does not dispatch, and sent packets going back to it
+    std::unique_ptr<SpscRing<Outgoing>> m_bypass;
+    std::unique_ptr<SpscRing<WinDivertPacket*>> m_sentPackets;
+
+    std::thread m_sender;
+    Signal m_senderSignal;
+};
@@ -0,0 +1,58 @@
+#include "StdAfx.h"
+#include "FlowKey.h"
+
+bool FlowKey::FromPacket(WinDivertPacket& packet, bool outbound, FlowKey& key)
+{
+    if (!packet.Tcp())
+        return false;
+
+    const uint8_t* srcAddr = nullptr;
+    const uint8_t* dstAddr = nullptr;
+    size_t addrLength = 0;
+
+    if (packet.IPv4())
+    {
+        srcAddr = reinterpret_cast<const uint8_t*>(&packet.IPv4()->SrcAddr);
+        dstAddr = reinterpret_cast<const uint8_t*>(&packet.IPv4()->DstAddr);
+        addrLength = 4;
+    }
+    else if (packet.IPv6())
+    {
+        srcAddr = reinterpret_cast<const uint8_t*>(packet.IPv6()->SrcAddr);
+        dstAddr = reinterpret_cast<const uint8_t*>(packet.IPv6()->DstAddr);
+        addrLength = 16;
+    }
+    else
+    {
+        return false;
+    }
+
+    if (outbound)
+    {
+        std::copy(srcAddr, srcAddr + addrLength, key.clientAddress.begin());
+        std::copy(dstAddr, dstAddr + addrLength, key.serverAddress.begin());
+        key.clientPort = packet.Tcp()->SrcPort;
+        key.serverPort = packet.Tcp()->DstPort;
+    }
+    else
+    {
+        std::copy(dstAddr, dstAddr + addrLength, key.clientAddress.begin());
+        std::copy(srcAddr, srcAddr + addrLength, key.serverAddress.begin());
+        key.clientPort = packet.Tcp()->DstPort;
+        key.serverPort = packet.Tcp()->SrcPort;
+    }
+
+    return true;
+}
+
+size_t FlowKeyHash::operator()(const FlowKey& key) const
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < key.clientAddress.size(); i++)
+        hash = (hash ^ key.clientAddress[i] ^ (static_cast<uint64_t>(key.serverAddress[i]) << 8)) * 0x100000001b3ULL;
+
+    hash = (hash ^ key.clientPort ^ (static_cast<uint64_t>(key.serverPort) << 16)) * 0x100000001b3ULL;
+
+    return static_cast<size_t>(hash ^ (hash >> 32));
+}
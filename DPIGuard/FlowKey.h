@@ -0,0 +1,34 @@
+#pragma once
+
+#include "WinDivertPacket.h"
+
+// Addresses and ports of the client and the server of a TCP connection, the same for both directions
+struct FlowKey
+{
+    FlowKey()
+    {
+        clientAddress.fill(0);
+        serverAddress.fill(0);
+        clientPort = 0;
+        serverPort = 0;
+    }
+
+    bool operator==(const FlowKey& rhs) const
+    {
+        return clientPort == rhs.clientPort && serverPort == rhs.serverPort &&
+            clientAddress == rhs.clientAddress && serverAddress == rhs.serverAddress;
+    }
+
+    // The client is the source of outbound packets and the destination of inbound ones
+    static bool FromPacket(WinDivertPacket& packet, bool outbound, FlowKey& key);
+
+    std::array<uint8_t, 16> clientAddress;
+    std::array<uint8_t, 16> serverAddress;
+    uint16_t clientPort;
+    uint16_t serverPort;
+};
+
+struct FlowKeyHash
+{
+    size_t operator()(const FlowKey& key) const;
+};
@@ -0,0 +1,188 @@
+#include "StdAfx.h"
+#include "HandshakeTracker.h"
+#include "Utils.h"
+
+// Pending handshakes are checked for timeouts at most once per second of packet time
+static const uint64_t EXPIRE_INTERVAL = 1000000;
+
+HandshakeTracker::HandshakeTracker(StrategyScoreboard& scoreboard, int64_t timestampFrequency, size_t capacity /*= 65536*/,
+    bool largePages /*= false*/)
+    : m_scoreboard(scoreboard), m_timestampFrequency(std::max<int64_t>(timestampFrequency, 1)), m_capacity(capacity)
+    , m_lastExpire(0), m_completed(0), m_resets(0), m_retransmissions(0), m_timeouts(0)
+{
+    if (!largePages)
+        return;
+
+    // Nodes plus the bucket array, reserved here so that the table never rehashes out of the arena
+    std::shared_ptr<LargePageArena> arena = std::make_shared<LargePageArena>("flow table",
+        capacity * (sizeof(FlowTable::value_type) + 4 * sizeof(void*)));
+
+    FlowTable flows(0, FlowKeyHash(), std::equal_to<FlowKey>(), FlowTable::allocator_type(arena));
+    flows.reserve(capacity);
+
+    m_flows.swap(flows);
+}
+
+StrategyScoreboard::Strategy HandshakeTracker::Select(WinDivertPacket& packet, StrategyScoreboard::Protocol protocol,
+    const std::string& domain, const StrategyScoreboard::Strategy& configured)
+{
+    FlowKey key;
+
+    // Tracked again once the copy is sent with the strategy chosen now
+    if (Retransmitted(packet) && FlowKey::FromPacket(packet, true, key))
+        m_flows.erase(key);
+
+    return m_scoreboard.Select(protocol, domain, configured);
+}
+
+bool HandshakeTracker::Retransmitted(WinDivertPacket& packet)
+{
+    FlowKey key;
+
+    if (!FlowKey::FromPacket(packet, true, key))
+        return false;
+
+    auto it = m_flows.find(key);
+
+    if (it == m_flows.end() || it->second.sequenceNumber != packet.Tcp()->SeqNum)
+        return false;
+
+    // The client sends the segment again, the fragments did not get through or were not acknowledged in time
+    m_scoreboard.Report(it->second.protocol, it->second.domain, it->second.strategy, false, 0);
+    it->second.sent = Now(packet);
+
+    m_retransmissions++;
+
+    return true;
+}
+
+void HandshakeTracker::Track(WinDivertPacket& packet, StrategyScoreboard::Protocol protocol,
+    const std::string& domain, const StrategyScoreboard::Strategy& strategy)
+{
+    FlowKey key;
+
+    if (!FlowKey::FromPacket(packet, true, key))
+        return;
+
+    uint64_t now = Now(packet);
+
+    Expire(now);
+
+    if (m_flows.size() >= m_capacity && m_flows.find(key) == m_flows.end())
+        return;
+
+    Entry& entry = m_flows[key];
+    entry.protocol = protocol;
+    entry.domain = domain;
+    entry.strategy = strategy;
+    entry.sent = now;
+    entry.sequenceNumber = packet.Tcp()->SeqNum;
+}
+
+void HandshakeTracker::HandleInbound(WinDivertPacket& packet)
+{
+    FlowKey key;
+
+    if (!FlowKey::FromPacket(packet, false, key))
+        return;
+
+    uint64_t now = Now(packet);
+
+    Expire(now);
+
+    auto it = m_flows.find(key);
+    if (it == m_flows.end())
+        return;
+
+    Entry& entry = it->second;
+
+    const uint8_t* data = packet.Data();
+    uint32_t dataLength = packet.DataLength();
+
+    bool success = false;
+
+    if (packet.Tcp()->Rst)
+    {
+        m_resets++;
+    }
+    else if (data && entry.protocol == StrategyScoreboard::Protocol::Tls && dataLength >= 6 && data[0] == 22 && data[5] == 2)
+    {
+        // Content Type: Handshake (22), Handshake Type: Server Hello (2)
+        success = true;
+    }
+    else if (data && entry.protocol == StrategyScoreboard::Protocol::Tls && dataLength >= 1 && data[0] == 21)
+    {
+        // Content Type: Alert (21), the server did not like what arrived
+        m_resets++;
+    }
+    else if (data && entry.protocol == StrategyScoreboard::Protocol::Http && dataLength >= 5 && memcmp(data, "HTTP/", 5) == 0)
+    {
+        success = true;
+    }
+    else
+    {
+        // Window updates and anything else that does not decide the handshake
+        return;
+    }
+
+    if (success)
+        m_completed++;
+
+    m_scoreboard.Report(entry.protocol, entry.domain, entry.strategy, success, now > entry.sent ? now - entry.sent : 0);
+    m_flows.erase(it);
+}
+
+size_t HandshakeTracker::Pending() const
+{
+    return m_flows.size();
+}
+
+uint64_t HandshakeTracker::Completed() const
+{
+    return m_completed;
+}
+
+uint64_t HandshakeTracker::Resets() const
+{
+    return m_resets;
+}
+
+uint64_t HandshakeTracker::Retransmissions() const
+{
+    return m_retransmissions;
+}
+
+uint64_t HandshakeTracker::Timeouts() const
+{
+    return m_timeouts;
+}
+
+uint64_t HandshakeTracker::Now(const WinDivertPacket& packet) const
+{
+    return Utils::ConvertTicks(packet.Address().Timestamp, m_timestampFrequency, 1000000);
+}
+
+void HandshakeTracker::Expire(uint64_t now)
+{
+    if (now >= m_lastExpire && now - m_lastExpire < EXPIRE_INTERVAL)
+        return;
+
+    m_lastExpire = now;
+
+    uint64_t timeout = static_cast<uint64_t>(m_scoreboard.Timeout()) * 1000;
+
+    for (auto it = m_flows.begin(); it != m_flows.end(); )
+    {
+        if (now > it->second.sent && now - it->second.sent >= timeout)
+        {
+            m_scoreboard.Report(it->second.protocol, it->second.domain, it->second.strategy, false, 0);
+            it = m_flows.erase(it);
+
+            m_timeouts++;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "FlowKey.h"
+#include "StrategyScoreboard.h"
+#include "WinDivertPacket.h"
+
+#include <unordered_map>
+
+// Follows connections whose first data segment was fragmented until the server answers, and reports the outcome
+// to the scoreboard. A ServerHello or an HTTP response completes the handshake, a RST or TLS alert from the
+// server, a retransmission of the fragmented segment or no answer within the timeout fails it.
+// Not thread safe, every packet processing thread owns its own instance and sees both directions of its flows.
+class HandshakeTracker
+{
+public:
+    // timestampFrequency is the tick rate of WINDIVERT_ADDRESS::Timestamp. With largePages the table is sized for
+    // capacity flows up front and kept in a large page arena.
+    HandshakeTracker(StrategyScoreboard& scoreboard, int64_t timestampFrequency, size_t capacity = 65536, bool largePages = false);
+
+    // Strategy for an outbound first data segment, a retransmission of a tracked one fails the previous strategy
+    StrategyScoreboard::Strategy Select(WinDivertPacket& packet, StrategyScoreboard::Protocol protocol,
+        const std::string& domain, const StrategyScoreboard::Strategy& configured);
+
+    // Fails the strategy of a tracked segment the client sends again. The flow stays tracked with the same strategy,
+    // for a copy split without Select, and waits for the response to the copy. False if the segment is not tracked
+    bool Retransmitted(WinDivertPacket& packet);
+
+    // Starts waiting for the response to a segment sent with strategy
+    void Track(WinDivertPacket& packet, StrategyScoreboard::Protocol protocol,
+        const std::string& domain, const StrategyScoreboard::Strategy& strategy);
+
+    // Inbound packets, the packet must be dissected already
+    void HandleInbound(WinDivertPacket& packet);
+
+    size_t Pending() const;
+
+    uint64_t Completed() const;
+    uint64_t Resets() const;
+    uint64_t Retransmissions() const;
+    uint64_t Timeouts() const;
+private:
+    struct Entry
+    {
+        Entry()
+            : protocol(StrategyScoreboard::Protocol::Tls), sent(0), sequenceNumber(0)
+        {
+        }
+
+        StrategyScoreboard::Protocol protocol;
+        std::string domain;
+        StrategyScoreboard::Strategy strategy;
+        // Microseconds
+        uint64_t sent;
+        uint32_t sequenceNumber;
+    };
+
+    uint64_t Now(const WinDivertPacket& packet) const;
+    void Expire(uint64_t now);
+private:
+    StrategyScoreboard& m_scoreboard;
+    int64_t m_timestampFrequency;
+    size_t m_capacity;
+
+    typedef std::unordered_map<FlowKey, Entry, FlowKeyHash, std::equal_to<FlowKey>,
+        ArenaAllocator<std::pair<const FlowKey, Entry>>> FlowTable;
+
+    FlowTable m_flows;
+    uint64_t m_lastExpire;
+
+    uint64_t m_completed;
+    uint64_t m_resets;
+    uint64_t m_retransmissions;
+    uint64_t m_timeouts;
+};
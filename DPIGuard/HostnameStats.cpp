@@ -0,0 +1,299 @@
+#include "StdAfx.h"
+#include "HostnameStats.h"
+
+static const uint32_t EMPTY_SLOT = 0xffffffff;
+
+HeavyHitters::HeavyHitters(size_t capacity /*= 1024*/)
+    : m_size(0), m_total(0), m_tableMask(0)
+{
+    capacity = std::max<size_t>(capacity, 1);
+
+    size_t tableSize = 1;
+    while (tableSize < capacity * 2)
+        tableSize *= 2;
+
+    m_counters.resize(capacity);
+    m_heap.reserve(capacity);
+    m_table.assign(tableSize, EMPTY_SLOT);
+    m_tableMask = tableSize - 1;
+}
+
+void HeavyHitters::Add(const std::string& name, uint64_t count /*= 1*/)
+{
+    if (!name.empty())
+        Add(name.data(), std::min<size_t>(name.size(), MAX_NAME_LENGTH), count, 0);
+}
+
+void HeavyHitters::Merge(const HeavyHitters& other)
+{
+    uint64_t total = m_total + other.m_total;
+
+    for (uint32_t index : other.m_heap)
+    {
+        const Counter& counter = other.m_counters[index];
+        Add(counter.name.data(), counter.name.size(), counter.count, counter.error);
+    }
+
+    // Counts other had already given up on are part of its total only
+    m_total = total;
+}
+
+void HeavyHitters::Clear()
+{
+    // Names keep their buffers, so that a cleared sketch fills up again without allocating
+    m_size = 0;
+    m_total = 0;
+    m_heap.clear();
+    std::fill(m_table.begin(), m_table.end(), EMPTY_SLOT);
+}
+
+size_t HeavyHitters::Capacity() const
+{
+    return m_counters.size();
+}
+
+size_t HeavyHitters::Size() const
+{
+    return m_size;
+}
+
+uint64_t HeavyHitters::Total() const
+{
+    return m_total;
+}
+
+std::vector<HeavyHitters::Entry> HeavyHitters::Top(size_t count) const
+{
+    std::vector<Entry> entries;
+    entries.reserve(m_size);
+
+    for (uint32_t index : m_heap)
+    {
+        Entry entry;
+        entry.name = m_counters[index].name;
+        entry.count = m_counters[index].count;
+        entry.error = m_counters[index].error;
+
+        entries.push_back(std::move(entry));
+    }
+
+    count = std::min(count, entries.size());
+
+    std::partial_sort(entries.begin(), entries.begin() + count, entries.end(), [](const Entry& lhs, const Entry& rhs) {
+        return lhs.count != rhs.count ? lhs.count > rhs.count : lhs.name < rhs.name;
+    });
+
+    entries.resize(count);
+
+    return entries;
+}
+
+void HeavyHitters::Add(const char* name, size_t length, uint64_t count, uint64_t error)
+{
+    uint64_t hash = Hash(name, length);
+    uint32_t index = Find(name, length, hash);
+
+    m_total += count;
+
+    if (index != EMPTY_SLOT)
+    {
+        m_counters[index].count += count;
+        m_counters[index].error += error;
+
+        SiftDown(m_counters[index].heapIndex);
+        return;
+    }
+
+    if (m_size < m_counters.size())
+    {
+        index = static_cast<uint32_t>(m_size++);
+
+        Counter& counter = m_counters[index];
+        counter.name.assign(name, length);
+        counter.count = count;
+        counter.error = error;
+        counter.hash = hash;
+        counter.heapIndex = static_cast<uint32_t>(m_heap.size());
+
+        m_heap.push_back(index);
+        Insert(index);
+        SiftUp(counter.heapIndex);
+        return;
+    }
+
+    // The least counted name makes room, its count becomes the new name's error
+    index = m_heap[0];
+
+    Erase(index);
+
+    Counter& counter = m_counters[index];
+    counter.name.assign(name, length);
+    counter.error = counter.count + error;
+    counter.count += count;
+    counter.hash = hash;
+
+    Insert(index);
+    SiftDown(0);
+}
+
+uint32_t HeavyHitters::Find(const char* name, size_t length, uint64_t hash) const
+{
+    for (size_t slot = hash & m_tableMask; m_table[slot] != EMPTY_SLOT; slot = (slot + 1) & m_tableMask)
+    {
+        const Counter& counter = m_counters[m_table[slot]];
+
+        if (counter.hash == hash && counter.name.size() == length && memcmp(counter.name.data(), name, length) == 0)
+            return m_table[slot];
+    }
+
+    return EMPTY_SLOT;
+}
+
+void HeavyHitters::Insert(uint32_t index)
+{
+    size_t slot = m_counters[index].hash & m_tableMask;
+
+    while (m_table[slot] != EMPTY_SLOT)
+        slot = (slot + 1) & m_tableMask;
+
+    m_table[slot] = index;
+}
+
+void HeavyHitters::Erase(uint32_t index)
+{
+    size_t slot = m_counters[index].hash & m_tableMask;
+
+    while (m_table[slot] != index)
+        slot = (slot + 1) & m_tableMask;
+
+    // Backward shift deletion, entries after the hole move up unless they are already at or after their home slot
+    size_t next = (slot + 1) & m_tableMask;
+
+    while (m_table[next] != EMPTY_SLOT)
+    {
+        size_t home = m_counters[m_table[next]].hash & m_tableMask;
+
+        if (((next - home) & m_tableMask) >= ((next - slot) & m_tableMask))
+        {
+            m_table[slot] = m_table[next];
+            slot = next;
+        }
+
+        next = (next + 1) & m_tableMask;
+    }
+
+    m_table[slot] = EMPTY_SLOT;
+}
+
+void HeavyHitters::SiftUp(uint32_t position)
+{
+    while (position > 0)
+    {
+        uint32_t parent = (position - 1) / 2;
+
+        if (m_counters[m_heap[parent]].count <= m_counters[m_heap[position]].count)
+            break;
+
+        Swap(parent, position);
+        position = parent;
+    }
+}
+
+void HeavyHitters::SiftDown(uint32_t position)
+{
+    uint32_t size = static_cast<uint32_t>(m_heap.size());
+
+    while (true)
+    {
+        uint32_t smallest = position;
+        uint32_t left = position * 2 + 1;
+        uint32_t right = left + 1;
+
+        if (left < size && m_counters[m_heap[left]].count < m_counters[m_heap[smallest]].count)
+            smallest = left;
+        if (right < size && m_counters[m_heap[right]].count < m_counters[m_heap[smallest]].count)
+            smallest = right;
+
+        if (smallest == position)
+            break;
+
+        Swap(smallest, position);
+        position = smallest;
+    }
+}
+
+void HeavyHitters::Swap(uint32_t a, uint32_t b)
+{
+    std::swap(m_heap[a], m_heap[b]);
+
+    m_counters[m_heap[a]].heapIndex = a;
+    m_counters[m_heap[b]].heapIndex = b;
+}
+
+uint64_t HeavyHitters::Hash(const char* name, size_t length)
+{
+    // FNV-1a, finalized so that the low bits used for the table depend on every byte
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= static_cast<uint8_t>(name[i]);
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash ^ (hash >> 32);
+}
+
+HostnameStats::HostnameStats(size_t capacity /*= 1024*/)
+    : m_capacity(capacity), m_matched(capacity), m_skipped(capacity)
+{
+}
+
+size_t HostnameStats::Capacity() const
+{
+    return m_capacity;
+}
+
+void HostnameStats::Merge(const HeavyHitters& matched, const HeavyHitters& skipped)
+{
+    std::unique_lock<std::mutex> locked(m_lock);
+
+    m_matched.Merge(matched);
+    m_skipped.Merge(skipped);
+}
+
+void HostnameStats::Print(size_t count) const
+{
+    std::vector<HeavyHitters::Entry> matched;
+    std::vector<HeavyHitters::Entry> skipped;
+    uint64_t matchedTotal = 0;
+    uint64_t skippedTotal = 0;
+
+    {
+        std::unique_lock<std::mutex> locked(m_lock);
+
+        matched = m_matched.Top(count);
+        skipped = m_skipped.Top(count);
+        matchedTotal = m_matched.Total();
+        skippedTotal = m_skipped.Total();
+    }
+
+    auto print = [](const char* title, uint64_t total, const std::vector<HeavyHitters::Entry>& entries) {
+        printf("[+] %s host names: %llu connections\n", title, static_cast<unsigned long long>(total));
+
+        for (const HeavyHitters::Entry& entry : entries)
+        {
+            if (entry.error == 0)
+            {
+                printf("[+] %12llu %s\n", static_cast<unsigned long long>(entry.count), entry.name.c_str());
+                continue;
+            }
+
+            printf("[+] %12llu %s (up to %llu too many)\n", static_cast<unsigned long long>(entry.count),
+                entry.name.c_str(), static_cast<unsigned long long>(entry.error));
+        }
+    };
+
+    print("Matched", matchedTotal, matched);
+    print("Skipped", skippedTotal, skipped);
+}
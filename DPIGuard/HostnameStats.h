@@ -0,0 +1,105 @@
+#pragma once
+
+// Space-Saving heavy hitter sketch (Metwally et al.) over host names. Only capacity names are counted; a new
+// name replaces the least counted one and inherits its count as the error. Every name seen more often than
+// Total() / capacity times is guaranteed to be in the sketch, and memory does not grow with the number of
+// distinct names. Not thread safe.
+class HeavyHitters
+{
+public:
+    struct Entry
+    {
+        Entry()
+        {
+            count = 0;
+            error = 0;
+        }
+
+        std::string name;
+        // Overestimates the true count by at most error
+        uint64_t count;
+        uint64_t error;
+    };
+
+    // Longer names are truncated so that every counter has a fixed upper bound
+    enum
+    {
+        MAX_NAME_LENGTH = 255
+    };
+
+    explicit HeavyHitters(size_t capacity = 1024);
+
+    void Add(const std::string& name, uint64_t count = 1);
+    // Counts and errors of other are added, the result keeps the guarantee for the combined stream
+    void Merge(const HeavyHitters& other);
+    void Clear();
+
+    size_t Capacity() const;
+    size_t Size() const;
+    // Sum of all counts added, including those of names that were replaced
+    uint64_t Total() const;
+
+    // Most counted names first
+    std::vector<Entry> Top(size_t count) const;
+private:
+    struct Counter
+    {
+        Counter()
+        {
+            count = 0;
+            error = 0;
+            hash = 0;
+            heapIndex = 0;
+        }
+
+        std::string name;
+        uint64_t count;
+        uint64_t error;
+        uint64_t hash;
+        uint32_t heapIndex;
+    };
+
+    void Add(const char* name, size_t length, uint64_t count, uint64_t error);
+
+    uint32_t Find(const char* name, size_t length, uint64_t hash) const;
+    void Insert(uint32_t index);
+    void Erase(uint32_t index);
+
+    void SiftUp(uint32_t position);
+    void SiftDown(uint32_t position);
+    void Swap(uint32_t a, uint32_t b);
+
+    static uint64_t Hash(const char* name, size_t length);
+private:
+    std::vector<Counter> m_counters;
+    size_t m_size;
+    uint64_t m_total;
+
+    // Min-heap of counter indexes by count, the root is replaced next
+    std::vector<uint32_t> m_heap;
+
+    // Open addressing with linear probing from name hashes to counter indexes, at most half full
+    std::vector<uint32_t> m_table;
+    size_t m_tableMask;
+};
+
+// Hottest matched and skipped host names of all packet processing threads. Every thread counts into its own
+// sketches and merges them in here from time to time, so the packet path takes no lock.
+class HostnameStats
+{
+public:
+    explicit HostnameStats(size_t capacity = 1024);
+
+    size_t Capacity() const;
+
+    void Merge(const HeavyHitters& matched, const HeavyHitters& skipped);
+
+    // Both lists with counts and error bounds
+    void Print(size_t count) const;
+private:
+    size_t m_capacity;
+
+    mutable std::mutex m_lock;
+    HeavyHitters m_matched;
+    HeavyHitters m_skipped;
+};
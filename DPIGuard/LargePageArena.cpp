@@ -0,0 +1,236 @@
+#include "StdAfx.h"
+#include "LargePageArena.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+// Arenas that exist, for Report
+static std::mutex& ArenasLock()
+{
+    static std::mutex lock;
+    return lock;
+}
+
+static std::vector<const LargePageArena*>& Arenas()
+{
+    static std::vector<const LargePageArena*> arenas;
+    return arenas;
+}
+
+#ifdef _WIN32
+// MEM_LARGE_PAGES fails unless SeLockMemoryPrivilege is enabled in the process token. Administrators and services
+// usually hold it, but it is disabled until asked for. Tried once per process.
+static bool EnableLockMemoryPrivilege()
+{
+    static bool enabled = []() {
+        HANDLE token = nullptr;
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+            return false;
+
+        TOKEN_PRIVILEGES privileges;
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+        bool result = LookupPrivilegeValueW(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+            AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) &&
+            GetLastError() != ERROR_NOT_ALL_ASSIGNED;
+
+        CloseHandle(token);
+
+        if (!result)
+            printf("[!] SeLockMemoryPrivilege is not held, large pages are not available\n");
+
+        return result;
+    }();
+
+    return enabled;
+}
+#endif
+
+LargePageArena::LargePageArena(const std::string& name, size_t size)
+    : m_name(name), m_base(nullptr), m_size(0), m_used(0), m_backing(Backing::SmallPages), m_overflows(0)
+{
+    m_freeBlocks.resize(MAX_RECYCLED_SIZE / ALIGNMENT + 1, nullptr);
+
+    Map(size);
+
+    std::lock_guard<std::mutex> locked(ArenasLock());
+    Arenas().push_back(this);
+}
+
+LargePageArena::~LargePageArena()
+{
+    {
+        std::lock_guard<std::mutex> locked(ArenasLock());
+        Arenas().erase(std::remove(Arenas().begin(), Arenas().end(), this), Arenas().end());
+    }
+
+    Unmap();
+}
+
+void* LargePageArena::Allocate(size_t size)
+{
+    size = std::max<size_t>((size + ALIGNMENT - 1) & ~static_cast<size_t>(ALIGNMENT - 1), ALIGNMENT);
+
+    std::lock_guard<std::mutex> locked(m_lock);
+
+    if (size <= MAX_RECYCLED_SIZE)
+    {
+        void*& head = m_freeBlocks[size / ALIGNMENT];
+
+        if (head)
+        {
+            void* block = head;
+            head = *static_cast<void**>(block);
+
+            return block;
+        }
+    }
+
+    if (size > m_size - m_used)
+    {
+        m_overflows++;
+        return nullptr;
+    }
+
+    void* block = m_base + m_used;
+    m_used += size;
+
+    return block;
+}
+
+void LargePageArena::Free(void* block, size_t size)
+{
+    size = std::max<size_t>((size + ALIGNMENT - 1) & ~static_cast<size_t>(ALIGNMENT - 1), ALIGNMENT);
+
+    if (size > MAX_RECYCLED_SIZE)
+        return;
+
+    std::lock_guard<std::mutex> locked(m_lock);
+
+    void*& head = m_freeBlocks[size / ALIGNMENT];
+
+    *static_cast<void**>(block) = head;
+    head = block;
+}
+
+bool LargePageArena::Contains(const void* block) const
+{
+    const uint8_t* address = static_cast<const uint8_t*>(block);
+
+    return address >= m_base && address < m_base + m_size;
+}
+
+const std::string& LargePageArena::Name() const
+{
+    return m_name;
+}
+
+LargePageArena::Backing LargePageArena::GetBacking() const
+{
+    return m_backing;
+}
+
+size_t LargePageArena::Size() const
+{
+    return m_size;
+}
+
+size_t LargePageArena::Used() const
+{
+    return m_used;
+}
+
+uint64_t LargePageArena::Overflows() const
+{
+    return m_overflows;
+}
+
+void LargePageArena::Report(FILE* file /*= stdout*/)
+{
+    std::lock_guard<std::mutex> locked(ArenasLock());
+
+    for (const LargePageArena* arena : Arenas())
+    {
+        const char* backing = "small pages";
+        if (arena->m_backing == Backing::LargePages)
+            backing = "large pages";
+        else if (arena->m_backing == Backing::TransparentHugePages)
+            backing = "transparent huge pages requested";
+
+        fprintf(file, "[+] Arena %s: %zu KB in %s, %zu KB used\n", arena->m_name.c_str(), arena->m_size / 1024, backing, arena->m_used / 1024);
+    }
+}
+
+void LargePageArena::Map(size_t size)
+{
+    size = std::max<size_t>(size, ALIGNMENT);
+
+    size_t largePageSize = LargePageSize();
+    size_t largeSize = (size + largePageSize - 1) / largePageSize * largePageSize;
+
+#ifdef _WIN32
+    if (EnableLockMemoryPrivilege())
+    {
+        m_base = static_cast<uint8_t*>(VirtualAlloc(nullptr, largeSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE));
+
+        if (m_base)
+        {
+            m_size = largeSize;
+            m_backing = Backing::LargePages;
+            return;
+        }
+    }
+
+    m_base = static_cast<uint8_t*>(VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+    if (m_base)
+        m_size = size;
+#else
+    void* base = mmap(nullptr, largeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (base != MAP_FAILED)
+    {
+        m_base = static_cast<uint8_t*>(base);
+        m_size = largeSize;
+        m_backing = Backing::LargePages;
+        return;
+    }
+
+    // Rounded up as well, so that transparent huge pages can cover all of it
+    base = mmap(nullptr, largeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return;
+
+    m_base = static_cast<uint8_t*>(base);
+    m_size = largeSize;
+
+    if (madvise(base, largeSize, MADV_HUGEPAGE) == 0)
+        m_backing = Backing::TransparentHugePages;
+#endif
+}
+
+void LargePageArena::Unmap()
+{
+    if (!m_base)
+        return;
+
+#ifdef _WIN32
+    VirtualFree(m_base, 0, MEM_RELEASE);
+#else
+    munmap(m_base, m_size);
+#endif
+
+    m_base = nullptr;
+    m_size = 0;
+}
+
+size_t LargePageArena::LargePageSize()
+{
+#ifdef _WIN32
+    size_t size = GetLargePageMinimum();
+    return size != 0 ? size : 2 * 1024 * 1024;
+#else
+    return 2 * 1024 * 1024;
+#endif
+}
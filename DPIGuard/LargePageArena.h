@@ -0,0 +1,128 @@
+#pragma once
+
+// Memory for large lookup structures and packet pools, backed by large pages when the system grants them so that
+// lookups spread over many megabytes miss the TLB less often. On Windows that takes MEM_LARGE_PAGES and
+// SeLockMemoryPrivilege, on Linux pages reserved for MAP_HUGETLB. Otherwise the arena falls back to ordinary
+// pages, on Linux with transparent huge pages requested. The whole size is mapped up front. Freed blocks are
+// kept for the next allocation of the same size, larger blocks than MAX_RECYCLED_SIZE are not reused.
+// Allocating takes a lock, lookups in the memory do not.
+class LargePageArena
+{
+public:
+    enum class Backing : uint8_t
+    {
+        // Locked large pages
+        LargePages = 0,
+        // Ordinary pages the kernel may merge into transparent huge pages
+        TransparentHugePages,
+        SmallPages
+    };
+
+    enum
+    {
+        ALIGNMENT = 16,
+        MAX_RECYCLED_SIZE = 4096
+    };
+
+    LargePageArena(const std::string& name, size_t size);
+    ~LargePageArena();
+
+    LargePageArena(const LargePageArena&) = delete;
+    LargePageArena& operator=(const LargePageArena&) = delete;
+
+    // Null once the arena is exhausted, the caller then allocates elsewhere
+    void* Allocate(size_t size);
+    void Free(void* block, size_t size);
+    bool Contains(const void* block) const;
+
+    const std::string& Name() const;
+    Backing GetBacking() const;
+    // Bytes mapped and bytes handed out so far
+    size_t Size() const;
+    size_t Used() const;
+    // Allocations that did not fit
+    uint64_t Overflows() const;
+
+    // Logs every arena that exists and how it is backed
+    static void Report(FILE* file = stdout);
+private:
+    void Map(size_t size);
+    void Unmap();
+
+    static size_t LargePageSize();
+private:
+    std::string m_name;
+    uint8_t* m_base;
+    size_t m_size;
+    size_t m_used;
+    Backing m_backing;
+
+    // Heads of the lists of freed blocks, by size in units of ALIGNMENT. Each free block starts with a pointer
+    // to the next one.
+    std::vector<void*> m_freeBlocks;
+    uint64_t m_overflows;
+
+    std::mutex m_lock;
+};
+
+// Standard allocator on top of an arena, allocations the arena cannot serve go to the heap. Without an arena it
+// is a plain heap allocator, so containers can use it whether large pages are enabled or not.
+template<typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    ArenaAllocator()
+    {
+    }
+
+    explicit ArenaAllocator(const std::shared_ptr<LargePageArena>& arena)
+        : m_arena(arena)
+    {
+    }
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& rhs)
+        : m_arena(rhs.Arena())
+    {
+    }
+
+    T* allocate(size_t count)
+    {
+        void* block = m_arena ? m_arena->Allocate(count * sizeof(T)) : nullptr;
+        if (!block)
+            block = ::operator new(count * sizeof(T));
+
+        return static_cast<T*>(block);
+    }
+
+    void deallocate(T* block, size_t count)
+    {
+        if (m_arena && m_arena->Contains(block))
+            m_arena->Free(block, count * sizeof(T));
+        else
+            ::operator delete(block);
+    }
+
+    const std::shared_ptr<LargePageArena>& Arena() const
+    {
+        return m_arena;
+    }
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U>& rhs) const
+    {
+        return m_arena == rhs.Arena();
+    }
+
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U>& rhs) const
+    {
+        return m_arena != rhs.Arena();
+    }
+private:
+    std::shared_ptr<LargePageArena> m_arena;
+};
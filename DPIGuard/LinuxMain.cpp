@@ -0,0 +1,554 @@
+#include "StdAfx.h"
+#include "ApplicationConfig.h"
+#include "ApplicationVersion.h"
+#include "ControlChannel.h"
+#include "FlowDispatcher.h"
+#include "HostnameStats.h"
+#include "LargePageArena.h"
+#include "NfQueueDevice.h"
+#include "OverloadController.h"
+#include "PacketCapture.h"
+#include "PacketSocketDevice.h"
+#include "ShadowDevice.h"
+#include "SpinPolicy.h"
+#include "StrategyScoreboard.h"
+#include "Utils.h"
+
+#include <cerrno>
+#include <csignal>
+
+#include <pthread.h>
+
+// Linux entry point on a netfilter queue. The WinDivert filter becomes the ruleset, see README.md.
+// SIGHUP reloads the configuration, SIGINT and SIGTERM stop. Shadow mode sniffs on a packet socket instead
+// and needs no ruleset.
+
+static const char* DEFAULT_CONFIG_PATH = "/etc/dpiguard/DPIGuard.config.yml";
+
+static int CommandHelp()
+{
+    static const char* MESSAGE = \
+        "Usage: dpiguard [OPTION]\n"
+        "\n"
+        "  -h, --help               display this help and exit\n"
+        "      --version            display version information and exit\n"
+        "  -c, --config FILE        configuration file (default %s)\n"
+        "      --shadow             classify a copy of the traffic without modifying it,\n"
+        "                           print what would have been done on exit\n"
+        "      --interface IF       sniff on IF only in shadow mode (default all)\n";
+
+    printf(MESSAGE, DEFAULT_CONFIG_PATH);
+    return 0;
+}
+
+static int CommandVersion()
+{
+    static const char* MESSAGE = \
+        "DPIGuard %s\n"
+        "\n"
+        "Copyright (C) 2021 mrsshr https://github.com/mrsshr/dpiguard\n"
+        "License GPLv3+: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>.\n"
+        "This is free software: you are free to change and redistribute it.\n"
+        "There is NO WARRANTY, to the extent permitted by law.\n";
+
+    printf(MESSAGE, APPLICATION_VERSION);
+    return 0;
+}
+
+// Capture and feedback files live next to the configuration file
+static std::wstring GetSiblingPath(const std::string& configPath, const char* fileName)
+{
+    size_t separator = configPath.rfind('/');
+    std::string directory = separator == std::string::npos ? std::string(".") : configPath.substr(0, separator);
+
+    return Utils::Utf8ToWide(directory + "/" + fileName);
+}
+
+static void SaveScoreboard(StrategyScoreboard& scoreboard, const std::wstring& scoreboardPath)
+{
+    if (scoreboardPath.empty() || !scoreboard.Modified())
+        return;
+
+    if (!scoreboard.SaveFile(scoreboardPath))
+        printf("[-] Failed to save feedback file\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::string configPath = DEFAULT_CONFIG_PATH;
+    std::string interfaceName;
+    bool shadowMode = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--version") == 0)
+            return CommandVersion();
+
+        if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) && i + 1 < argc)
+        {
+            configPath = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--shadow") == 0)
+        {
+            shadowMode = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--interface") == 0 && i + 1 < argc)
+        {
+            interfaceName = argv[++i];
+            continue;
+        }
+
+        return CommandHelp();
+    }
+
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+
+    printf("[+] Loading configuration\n");
+
+    ApplicationConfig appConfig;
+    const std::wstring appConfigPath = Utils::Utf8ToWide(configPath);
+
+    if (!appConfig.LoadFile(appConfigPath))
+    {
+        printf("[-] The configuration file is invalid or corrupted. Aborting\n");
+        return 1;
+    }
+
+    // Copied once, the configuration may be reloaded while packets are processed
+    ApplicationConfig::FeedbackConfig feedbackConfig = appConfig.Feedback();
+    const ApplicationConfig::NfQueueConfig nfQueueConfig = appConfig.NfQueue();
+    const ApplicationConfig::EngineConfig engineConfig = appConfig.Engine();
+    const ApplicationConfig::QueueConfig queueConfig = appConfig.Queue();
+    const ApplicationConfig::CaptureConfig captureConfig = appConfig.Capture();
+    const ApplicationConfig::OverloadConfig overloadConfig = appConfig.Overload();
+
+    // Unmodified connections say nothing about fragmentation strategies
+    if (shadowMode)
+        feedbackConfig.enabled = false;
+
+    StrategyScoreboard scoreboard;
+    std::wstring scoreboardPath;
+
+    if (feedbackConfig.enabled)
+    {
+        scoreboardPath = GetSiblingPath(configPath, "DPIGuard.feedback.yml");
+        scoreboard.Configure(feedbackConfig.timeout, feedbackConfig.offsets);
+
+        if (scoreboard.LoadFile(scoreboardPath))
+            printf("[+] Selecting strategies from server responses (%zu domains known)\n", scoreboard.Domains());
+        else
+            printf("[-] The feedback file is invalid or corrupted, starting over\n");
+    }
+
+    // Signals are taken by the monitor thread only, packet threads are never interrupted
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    NfQueueDevice queueDevice;
+    PacketSocketDevice socketDevice;
+    ShadowDevice shadowDevice(socketDevice);
+
+    PacketDevice& device = shadowMode ? static_cast<PacketDevice&>(shadowDevice) : queueDevice;
+
+    if (shadowMode)
+    {
+        printf("[+] Initializing packet socket on %s\n", interfaceName.empty() ? "all interfaces" : interfaceName.c_str());
+
+        if (!socketDevice.Open(interfaceName.c_str()))
+        {
+            printf("[-] Failed to open packet socket: %s\n", strerror(errno));
+            return 1;
+        }
+
+        printf("[+] Shadow mode, packets are not modified\n");
+    }
+    else
+    {
+        printf("[+] Initializing netfilter queue %u\n", static_cast<unsigned>(nfQueueConfig.number));
+
+        NfQueueDevice::Injection injection = nfQueueConfig.injection == "verdict" ?
+            NfQueueDevice::Injection::Verdict : NfQueueDevice::Injection::Raw;
+
+        if (!queueDevice.Open(nfQueueConfig.number, static_cast<uint32_t>(queueConfig.length), injection,
+            nfQueueConfig.mark, nfQueueConfig.mtu, nfQueueConfig.batch))
+        {
+            printf("[-] Failed to open netfilter queue: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    std::unique_ptr<SpinPolicy> spinPolicy;
+
+    // The packet socket of shadow mode has nothing to gain, it only watches
+    if (engineConfig.spin != 0 && !shadowMode)
+    {
+        spinPolicy.reset(new SpinPolicy(engineConfig.spin));
+        queueDevice.SetSpinPolicy(spinPolicy.get());
+
+        printf("[+] Latency mode: spinning up to %llu us before blocking\n", static_cast<unsigned long long>(engineConfig.spin));
+    }
+
+    // Sniffed packets cannot be changed, so shadow mode keeps segmenting
+    bool recordSplitting = appConfig.UsesTlsRecords() && !shadowMode;
+
+    if (recordSplitting)
+        printf("[+] TLS record splitting: the ruleset must queue every packet of port 443 in both directions\n");
+
+    OverloadController::Action overloadAction = overloadConfig.action == "cached" ?
+        OverloadController::Action::Cached : OverloadController::Action::Pass;
+
+    // Packet socket timestamps are wall clock time, there only the processing time counts
+    int64_t overloadFrequency = shadowMode ? 0 : NfQueueDevice::TIMESTAMP_FREQUENCY;
+
+    if (overloadConfig.budget != 0)
+    {
+        printf("[+] Shedding load over %llu us per packet (%s)\n", static_cast<unsigned long long>(overloadConfig.budget),
+            overloadConfig.action.c_str());
+    }
+
+    PacketCapture capture;
+
+    if (captureConfig.enabled)
+    {
+        if (capture.Start(GetSiblingPath(configPath, "DPIGuard.capture.pcapng"), captureConfig.maxFileSize, captureConfig.maxFiles))
+            printf("[+] Capturing unexpected packets\n");
+        else
+            printf("[-] Failed to open packet capture file: %s\n", strerror(errno));
+    }
+
+    const ApplicationConfig::StatsConfig statsConfig = appConfig.Stats();
+    std::unique_ptr<HostnameStats> hostnameStats;
+
+    if (statsConfig.enabled)
+        hostnameStats.reset(new HostnameStats(statsConfig.capacity));
+
+    ApplicationConfig::ControlConfig controlConfig = appConfig.Control();
+    ControlChannel control(appConfig);
+
+    // A configuration under evaluation is left as it was written
+    if (shadowMode)
+        controlConfig.persist = false;
+
+    if (controlConfig.enabled)
+    {
+        if (controlConfig.path.empty())
+            controlConfig.path = Utils::WideToUtf8(GetSiblingPath(configPath, "DPIGuard.control.sock"));
+
+        if (control.Start(controlConfig.path))
+            printf("[+] Control channel on %s\n", controlConfig.path.c_str());
+        else
+            printf("[-] Failed to open control channel %s: %s\n", controlConfig.path.c_str(), strerror(errno));
+    }
+
+    // Domains changed through the control channel, saved every few seconds rather than on every change
+    auto saveControlChanges = [&]() {
+        if (control.TakeModified() && controlConfig.persist && !appConfig.SaveFile(appConfigPath))
+            printf("[-] Failed to save the configuration file\n");
+    };
+
+    std::atomic<bool> stopping(false);
+
+    std::thread monitor([&]() {
+        std::chrono::steady_clock::time_point reported = std::chrono::steady_clock::now();
+
+        while (!stopping.load())
+        {
+            if (hostnameStats && statsConfig.interval != 0 &&
+                std::chrono::steady_clock::now() - reported >= std::chrono::seconds(statsConfig.interval))
+            {
+                hostnameStats->Print(statsConfig.top);
+                reported = std::chrono::steady_clock::now();
+            }
+
+            timespec timeout = { 5, 0 };
+            int signal = sigtimedwait(&signals, nullptr, &timeout);
+
+            if (signal == SIGHUP)
+            {
+                if (appConfig.LoadFile(appConfigPath))
+                {
+                    // Control channel changes not saved yet are replaced by the file
+                    control.TakeModified();
+                    printf("[+] The configuration file has been reloaded.\n");
+                }
+                else
+                    printf("[-] The new configuration file is invalid or corrupted.\n");
+            }
+            else if (signal == SIGINT || signal == SIGTERM)
+            {
+                if (shadowMode)
+                    socketDevice.Shutdown();
+                else
+                    queueDevice.Shutdown();
+                break;
+            }
+            else
+            {
+                SaveScoreboard(scoreboard, scoreboardPath);
+                saveControlChanges();
+            }
+        }
+    });
+
+    printf("[+] Initialization complete\n");
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    uint64_t completed = 0;
+    uint64_t resets = 0;
+    uint64_t retransmissions = 0;
+    uint64_t timeouts = 0;
+
+    auto addHandshakes = [&](const PacketProcessor& processor) {
+        if (const HandshakeTracker* handshakes = processor.Handshakes())
+        {
+            completed += handshakes->Completed();
+            resets += handshakes->Resets();
+            retransmissions += handshakes->Retransmissions();
+            timeouts += handshakes->Timeouts();
+        }
+    };
+
+    uint64_t split = 0;
+    uint64_t shifted = 0;
+    uint64_t refused = 0;
+    uint64_t expired = 0;
+
+    auto addRecordSplits = [&](const PacketProcessor& processor) {
+        if (const RecordSplitTracker* recordSplits = processor.RecordSplits())
+        {
+            split += recordSplits->Split();
+            shifted += recordSplits->Shifted();
+            refused += recordSplits->Refused();
+            expired += recordSplits->Expired();
+        }
+    };
+
+    uint64_t recorded = 0;
+    uint64_t resplit = 0;
+    uint64_t evicted = 0;
+
+    auto addRetransmissions = [&](const PacketProcessor& processor) {
+        if (const RetransmissionCache* retransmissionCache = processor.Retransmissions())
+        {
+            recorded += retransmissionCache->Recorded();
+            resplit += retransmissionCache->Retransmissions();
+            evicted += retransmissionCache->Evicted();
+        }
+    };
+
+    ShadowRecorder shadow;
+
+    auto addShadow = [&](const PacketProcessor& processor) {
+        if (const ShadowRecorder* recorder = processor.Shadow())
+            shadow.Merge(*recorder);
+    };
+
+    OverloadController overload(overloadConfig.budget * 1000, overloadAction);
+
+    auto addOverload = [&](const PacketProcessor& processor) {
+        if (const OverloadController* controller = processor.Overload())
+            overload.Merge(*controller);
+    };
+
+    // Once everything that allocates from them is set up
+    auto reportArenas = [&]() {
+        if (engineConfig.largePages)
+            LargePageArena::Report();
+    };
+
+    try
+    {
+        size_t workers = engineConfig.workers;
+        bool staged = engineConfig.staged;
+
+        if (workers > 1 || staged)
+        {
+            if (staged)
+                printf("[+] Staged pipeline: receive, %zu classify workers, send\n", workers);
+            else
+                printf("[+] Dispatching flows to %zu workers\n", workers);
+
+            FlowDispatcher dispatcher(appConfig, device, &capture, workers, staged);
+
+            if (feedbackConfig.enabled)
+                dispatcher.EnableFeedback(scoreboard, NfQueueDevice::TIMESTAMP_FREQUENCY);
+
+            if (recordSplitting)
+                dispatcher.EnableRecordSplitting(NfQueueDevice::TIMESTAMP_FREQUENCY);
+
+            if (shadowMode)
+            {
+                dispatcher.SetVerbose(false);
+                dispatcher.EnableShadow();
+            }
+            else
+            {
+                // Sniffed packets are never split, so neither are their retransmissions
+                dispatcher.EnableRetransmissionCache(NfQueueDevice::TIMESTAMP_FREQUENCY);
+            }
+
+            if (hostnameStats)
+                dispatcher.EnableHostnameStats(*hostnameStats);
+
+            if (overloadConfig.budget != 0)
+                dispatcher.EnableOverloadControl(overloadConfig.budget, overloadAction, overloadFrequency);
+
+            reportArenas();
+            dispatcher.Run();
+
+            for (size_t i = 0; i < dispatcher.Workers(); i++)
+            {
+                hits += dispatcher.Processor(i).DomainCache().Hits();
+                misses += dispatcher.Processor(i).DomainCache().Misses();
+
+                addHandshakes(dispatcher.Processor(i));
+                addRecordSplits(dispatcher.Processor(i));
+                addRetransmissions(dispatcher.Processor(i));
+                addShadow(dispatcher.Processor(i));
+                addOverload(dispatcher.Processor(i));
+            }
+        }
+        else
+        {
+            WinDivertPacket packet(65536);
+            PacketProcessor processor(appConfig, device, &capture);
+
+            if (feedbackConfig.enabled)
+                processor.EnableFeedback(scoreboard, NfQueueDevice::TIMESTAMP_FREQUENCY);
+
+            if (recordSplitting)
+                processor.EnableRecordSplitting(NfQueueDevice::TIMESTAMP_FREQUENCY);
+
+            if (shadowMode)
+            {
+                processor.SetVerbose(false);
+                processor.EnableShadow();
+            }
+            else
+            {
+                // Sniffed packets are never split, so neither are their retransmissions
+                processor.EnableRetransmissionCache(NfQueueDevice::TIMESTAMP_FREQUENCY);
+            }
+
+            if (hostnameStats)
+                processor.EnableHostnameStats(*hostnameStats);
+
+            if (overloadConfig.budget != 0)
+                processor.EnableOverloadControl(overloadConfig.budget, overloadAction, overloadFrequency);
+
+            reportArenas();
+
+            while (device.Recv(packet))
+                processor.Process(packet);
+
+            processor.FlushHostnameStats();
+
+            hits = processor.DomainCache().Hits();
+            misses = processor.DomainCache().Misses();
+
+            addHandshakes(processor);
+            addRecordSplits(processor);
+            addRetransmissions(processor);
+            addShadow(processor);
+            addOverload(processor);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        printf("[-] Unexpected error. Aborting (%s)\n", e.what());
+    }
+
+    // A receive error ends the loop without a signal
+    stopping.store(true);
+    monitor.join();
+
+    const NfQueueDevice::Metrics metrics = queueDevice.Stats();
+    const PacketSocketDevice::Metrics socketMetrics = socketDevice.Stats();
+
+    control.Stop();
+    saveControlChanges();
+
+    queueDevice.Close();
+    socketDevice.Close();
+    capture.Stop();
+
+    printf("[+] Domain cache: %llu hits, %llu misses\n",
+        static_cast<unsigned long long>(hits), static_cast<unsigned long long>(misses));
+
+    if (spinPolicy)
+        spinPolicy->Print();
+
+    if (overloadConfig.budget != 0)
+        overload.Print();
+
+    if (shadowMode)
+    {
+        printf("[+] Packet socket: %llu packets, %llu dropped\n",
+            static_cast<unsigned long long>(socketMetrics.packets), static_cast<unsigned long long>(socketMetrics.drops));
+
+        printf("[+] Shadow: %llu packets received, %llu packets would have been sent\n",
+            static_cast<unsigned long long>(shadowDevice.Received()), static_cast<unsigned long long>(shadowDevice.Sent()));
+
+        shadow.Print(50);
+    }
+    else
+    {
+        printf("[+] Netfilter queue: %llu packets, %llu GSO, %llu accepted in %llu batches, %llu verdicts, %llu injected, %llu bypassed\n",
+            static_cast<unsigned long long>(metrics.packets), static_cast<unsigned long long>(metrics.gsoPackets),
+            static_cast<unsigned long long>(metrics.batchedVerdicts), static_cast<unsigned long long>(metrics.batches),
+            static_cast<unsigned long long>(metrics.verdicts), static_cast<unsigned long long>(metrics.injected),
+            static_cast<unsigned long long>(metrics.bypassed));
+    }
+
+    if (feedbackConfig.enabled)
+    {
+        printf("[+] Handshakes: %llu completed, %llu reset, %llu retransmitted, %llu timed out\n",
+            static_cast<unsigned long long>(completed), static_cast<unsigned long long>(resets),
+            static_cast<unsigned long long>(retransmissions), static_cast<unsigned long long>(timeouts));
+    }
+
+    if (recordSplitting)
+    {
+        printf("[+] TLS record splitting: %llu flows split, %llu packets shifted, %llu refused, %llu expired\n",
+            static_cast<unsigned long long>(split), static_cast<unsigned long long>(shifted),
+            static_cast<unsigned long long>(refused), static_cast<unsigned long long>(expired));
+    }
+
+    if (!shadowMode)
+    {
+        printf("[+] Retransmissions: %llu split again from %llu segments recorded, %llu flows evicted\n",
+            static_cast<unsigned long long>(resplit), static_cast<unsigned long long>(recorded),
+            static_cast<unsigned long long>(evicted));
+    }
+
+    if (captureConfig.enabled)
+    {
+        printf("[+] Packet capture: %llu captured, %llu dropped\n",
+            static_cast<unsigned long long>(capture.Captured()), static_cast<unsigned long long>(capture.Dropped()));
+    }
+
+    if (controlConfig.enabled)
+    {
+        printf("[+] Control channel: %llu requests, %llu failed\n",
+            static_cast<unsigned long long>(control.Requests()), static_cast<unsigned long long>(control.Failures()));
+    }
+
+    if (hostnameStats)
+        hostnameStats->Print(statsConfig.top);
+
+    SaveScoreboard(scoreboard, scoreboardPath);
+
+    printf("[+] Stopped\n");
+
+    return 0;
+}
@@ -0,0 +1,720 @@
+#include "StdAfx.h"
+#include "NfQueueDevice.h"
+#include "PacketPipeline.h"
+
+#include <cerrno>
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_queue.h>
+#include <linux/netlink.h>
+
+// Room for a batch of full size GSO packets and their netlink headers
+static const size_t RECV_BUFFER_SIZE = 4 * 65536;
+static const int SOCKET_BUFFER_SIZE = 8 * 1024 * 1024;
+
+static uint64_t MonotonicMicroseconds()
+{
+    timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return static_cast<uint64_t>(now.tv_sec) * 1000000 + static_cast<uint64_t>(now.tv_nsec) / 1000;
+}
+
+// NFQA_TIMESTAMP is wall clock time, on the monotonic clock unless it is in the future. Old ones are kept, a backlog
+// of several seconds is what load shedding has to see
+static bool CaptureMicroseconds(const nfqnl_msg_packet_timestamp& timestamp, uint64_t& captured)
+{
+    timespec now = {};
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    uint64_t realtime = static_cast<uint64_t>(now.tv_sec) * 1000000 + static_cast<uint64_t>(now.tv_nsec) / 1000;
+    uint64_t stamped = be64toh(timestamp.sec) * 1000000 + be64toh(timestamp.usec);
+
+    uint64_t monotonic = MonotonicMicroseconds();
+
+    if (stamped == 0 || stamped > realtime || realtime - stamped > monotonic)
+        return false;
+
+    captured = monotonic - (realtime - stamped);
+    return true;
+}
+
+static void BeginMessage(std::vector<uint8_t>& message, uint16_t type, uint16_t flags, uint16_t queue)
+{
+    message.assign(NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(nfgenmsg)), 0);
+
+    nlmsghdr* header = reinterpret_cast<nlmsghdr*>(message.data());
+    header->nlmsg_type = static_cast<uint16_t>((NFNL_SUBSYS_QUEUE << 8) | type);
+    header->nlmsg_flags = static_cast<uint16_t>(NLM_F_REQUEST | flags);
+
+    nfgenmsg* generic = reinterpret_cast<nfgenmsg*>(message.data() + NLMSG_HDRLEN);
+    generic->nfgen_family = AF_UNSPEC;
+    generic->version = NFNETLINK_V0;
+    generic->res_id = htons(queue);
+}
+
+static void AddAttribute(std::vector<uint8_t>& message, uint16_t type, const void* data, size_t length)
+{
+    size_t offset = message.size();
+
+    message.resize(offset + NLA_ALIGN(NLA_HDRLEN + length), 0);
+
+    nlattr* attribute = reinterpret_cast<nlattr*>(message.data() + offset);
+    attribute->nla_len = static_cast<uint16_t>(NLA_HDRLEN + length);
+    attribute->nla_type = type;
+
+    if (length != 0)
+        memcpy(message.data() + offset + NLA_HDRLEN, data, length);
+}
+
+static void EndMessage(std::vector<uint8_t>& message)
+{
+    reinterpret_cast<nlmsghdr*>(message.data())->nlmsg_len = static_cast<uint32_t>(message.size());
+}
+
+static bool SendMessage(int socket, const std::vector<uint8_t>& message)
+{
+    sockaddr_nl kernel = {};
+    kernel.nl_family = AF_NETLINK;
+
+    ssize_t sent = sendto(socket, message.data(), message.size(), 0, reinterpret_cast<const sockaddr*>(&kernel), sizeof(kernel));
+
+    return sent == static_cast<ssize_t>(message.size());
+}
+
+NfQueueDevice::NfQueueDevice()
+    : m_socket(-1), m_rawSocket4(-1), m_rawSocket6(-1), m_event(-1)
+    , m_queue(0), m_injection(Injection::Raw), m_mtu(1500), m_batch(64)
+    , m_recvOffset(0), m_recvLength(0), m_spinPolicy(nullptr), m_waited(false), m_caught(false)
+    , m_stamped(false), m_accepted(0), m_blocked(false), m_injected(0), m_shutdown(false)
+{
+}
+
+NfQueueDevice::~NfQueueDevice()
+{
+    Close();
+}
+
+bool NfQueueDevice::Open(uint16_t queue, uint32_t maxLength, Injection injection, uint32_t mark, size_t mtu, size_t batch)
+{
+    Close();
+
+    m_queue = queue;
+    m_injection = injection;
+    m_mtu = mtu;
+    m_batch = std::max<size_t>(batch, 1);
+
+    m_socket = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    m_rawSocket4 = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+    m_rawSocket6 = socket(AF_INET6, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+    m_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (m_socket < 0 || m_rawSocket4 < 0 || m_rawSocket6 < 0 || m_event < 0)
+    {
+        int error = errno;
+        Close();
+        errno = error;
+        return false;
+    }
+
+    sockaddr_nl local = {};
+    local.nl_family = AF_NETLINK;
+
+    int one = 1;
+
+    // Injected packets must not be queued again, and the receive buffer absorbs bursts while workers are busy
+    if (bind(m_socket, reinterpret_cast<const sockaddr*>(&local), sizeof(local)) != 0 ||
+        setsockopt(m_rawSocket4, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) != 0 ||
+        setsockopt(m_rawSocket6, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) != 0 ||
+        !Configure(queue, maxLength))
+    {
+        int error = errno;
+        Close();
+        errno = error;
+        return false;
+    }
+
+    if (setsockopt(m_socket, SOL_SOCKET, SO_RCVBUFFORCE, &SOCKET_BUFFER_SIZE, sizeof(SOCKET_BUFFER_SIZE)) != 0)
+        setsockopt(m_socket, SOL_SOCKET, SO_RCVBUF, &SOCKET_BUFFER_SIZE, sizeof(SOCKET_BUFFER_SIZE));
+
+    // Overruns lose packets the kernel already gave up on, they are no reason to stop
+    setsockopt(m_socket, SOL_NETLINK, NETLINK_NO_ENOBUFS, &one, sizeof(one));
+
+    m_recvBuffer.resize(RECV_BUFFER_SIZE);
+    m_recvOffset = 0;
+    m_recvLength = 0;
+
+    m_shutdown.store(false, std::memory_order_relaxed);
+
+    return true;
+}
+
+void NfQueueDevice::Close()
+{
+    if (m_socket >= 0)
+    {
+        // Release whatever was decided already, the rest is dropped with the queue
+        std::unique_lock<std::mutex> locked(m_lock);
+        Flush();
+
+        m_pending.clear();
+        m_accepted = 0;
+    }
+
+    for (int* fd : { &m_socket, &m_rawSocket4, &m_rawSocket6, &m_event })
+    {
+        if (*fd >= 0)
+        {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void NfQueueDevice::Shutdown()
+{
+    uint64_t value = 1;
+
+    m_shutdown.store(true, std::memory_order_relaxed);
+
+    if (m_event >= 0)
+    {
+        ssize_t written = write(m_event, &value, sizeof(value));
+        (void)written;
+    }
+}
+
+void NfQueueDevice::SetSpinPolicy(SpinPolicy* policy)
+{
+    m_spinPolicy = policy;
+}
+
+bool NfQueueDevice::Recv(WinDivertPacket& packet)
+{
+    for (;;)
+    {
+        if (m_shutdown.load(std::memory_order_relaxed))
+            return false;
+
+        while (m_recvOffset < m_recvLength)
+        {
+            const nlmsghdr* header = reinterpret_cast<const nlmsghdr*>(m_recvBuffer.data() + m_recvOffset);
+            size_t remaining = m_recvLength - m_recvOffset;
+
+            if (remaining < NLMSG_HDRLEN || header->nlmsg_len < NLMSG_HDRLEN || header->nlmsg_len > remaining)
+            {
+                m_recvOffset = m_recvLength;
+                break;
+            }
+
+            m_recvOffset += std::min<size_t>(NLMSG_ALIGN(header->nlmsg_len), remaining);
+
+            if (header->nlmsg_type == ((NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_PACKET) &&
+                ParsePacket(reinterpret_cast<const uint8_t*>(header), header->nlmsg_len, packet))
+            {
+                // The first packet after a wait is the one that was waited for
+                if (m_waited && m_stamped)
+                {
+                    uint64_t now = MonotonicMicroseconds();
+                    uint64_t captured = static_cast<uint64_t>(packet.Address().Timestamp);
+
+                    if (now >= captured)
+                        m_spinPolicy->ObserveDelay(now - captured, m_caught);
+                }
+
+                m_waited = false;
+                return true;
+            }
+
+            if (header->nlmsg_type == NLMSG_ERROR && header->nlmsg_len >= NLMSG_HDRLEN + sizeof(nlmsgerr))
+            {
+                const nlmsgerr* error = reinterpret_cast<const nlmsgerr*>(NLMSG_DATA(header));
+
+                if (error->error != 0)
+                    printf("[-] Netfilter queue verdict failed: %d\n", -error->error);
+            }
+        }
+
+        ssize_t received = recv(m_socket, m_recvBuffer.data(), m_recvBuffer.size(), MSG_DONTWAIT);
+
+        if (received > 0)
+        {
+            m_recvOffset = 0;
+            m_recvLength = static_cast<size_t>(received);
+            continue;
+        }
+
+        if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ENOBUFS)
+            return false;
+
+        // Nothing is waiting, so accept verdicts held back for a batch go out now
+        {
+            std::unique_lock<std::mutex> locked(m_lock);
+
+            Flush();
+            m_blocked = true;
+        }
+
+        uint64_t started = 0;
+        uint64_t spinTime = 0;
+
+        if (m_spinPolicy)
+        {
+            started = SpinPolicy::Now();
+
+            uint64_t budget = m_spinPolicy->Budget();
+            uint64_t now = started;
+
+            while (now - started < budget && !m_shutdown.load(std::memory_order_relaxed))
+            {
+                received = recv(m_socket, m_recvBuffer.data(), m_recvBuffer.size(), MSG_DONTWAIT);
+                if (received > 0)
+                    break;
+
+                SpinPolicy::Pause();
+                now = SpinPolicy::Now();
+            }
+
+            spinTime = now - started;
+
+            if (received > 0)
+            {
+                {
+                    std::unique_lock<std::mutex> locked(m_lock);
+                    m_blocked = false;
+                }
+
+                uint64_t wait = SpinPolicy::Now() - started;
+                m_spinPolicy->Observe(wait, wait, true);
+
+                m_waited = true;
+                m_caught = true;
+
+                m_recvOffset = 0;
+                m_recvLength = static_cast<size_t>(received);
+                continue;
+            }
+        }
+
+        pollfd fds[2] = { { m_socket, POLLIN, 0 }, { m_event, POLLIN, 0 } };
+        int result = poll(fds, 2, -1);
+
+        {
+            std::unique_lock<std::mutex> locked(m_lock);
+            m_blocked = false;
+        }
+
+        if (m_spinPolicy)
+        {
+            m_spinPolicy->Observe(SpinPolicy::Now() - started, spinTime, false);
+
+            m_waited = true;
+            m_caught = false;
+        }
+
+        if (result < 0 && errno != EINTR)
+            return false;
+
+        if (result > 0 && (fds[1].revents & POLLIN) != 0)
+            return false;
+    }
+}
+
+bool NfQueueDevice::Send(const WinDivertPacket& packet)
+{
+    std::unique_lock<std::mutex> locked(m_lock);
+
+    Pending* pending = FindPending(packet.Address().Reserved2);
+
+    if (pending && pending->state == State::Bypassed)
+        return true;
+
+    if (!pending || pending->state != State::Undecided)
+    {
+        locked.unlock();
+        return Inject(packet);
+    }
+
+    bool result = true;
+
+    // Fragments are always shorter, at the same length this is the packet as it was received or changed in place.
+    // Changed packets, inbound ones among them, take the verdict whatever the injection.
+    bool sameLength = packet.Buffer().size() == pending->length;
+    bool changed = sameLength && packet.Tcp() && packet.Tcp()->Checksum != pending->checksum;
+
+    if (sameLength && !changed)
+    {
+        pending->state = State::Accepted;
+        m_accepted++;
+    }
+    else if (m_injection == Injection::Verdict || changed)
+    {
+        pending->state = State::Done;
+        result = SendVerdict(pending->id, NF_ACCEPT, &packet);
+    }
+    else if (Inject(packet))
+    {
+        pending->state = State::Done;
+        result = SendVerdict(pending->id, NF_DROP, nullptr);
+    }
+    else
+    {
+        // Fail open, the connection goes on without fragmentation
+        pending->state = State::Bypassed;
+        m_metrics.bypassed++;
+
+        result = SendVerdict(pending->id, NF_ACCEPT, nullptr);
+    }
+
+    if (m_blocked || m_accepted >= m_batch)
+        result &= Flush();
+
+    return result;
+}
+
+NfQueueDevice::Metrics NfQueueDevice::Stats()
+{
+    std::unique_lock<std::mutex> locked(m_lock);
+
+    Metrics metrics = m_metrics;
+    metrics.injected = m_injected.load(std::memory_order_relaxed);
+
+    return metrics;
+}
+
+bool NfQueueDevice::Configure(uint16_t queue, uint32_t maxLength)
+{
+    nfqnl_msg_config_cmd command = {};
+    command.command = NFQNL_CFG_CMD_BIND;
+
+    nfqnl_msg_config_params params = {};
+    params.copy_range = htonl(0xffff);
+    params.copy_mode = NFQNL_COPY_PACKET;
+
+    uint32_t queueLength = htonl(maxLength);
+    uint32_t flags = htonl(NFQA_CFG_F_FAIL_OPEN | NFQA_CFG_F_GSO);
+
+    if (!SendConfig(queue, NFQA_CFG_CMD, &command, sizeof(command)))
+        return false;
+    if (!SendConfig(queue, NFQA_CFG_PARAMS, &params, sizeof(params)))
+        return false;
+    if (!SendConfig(queue, NFQA_CFG_QUEUE_MAXLEN, &queueLength, sizeof(queueLength)))
+        return false;
+
+    // Mask and value of the flags go together in one message
+    BeginMessage(m_message, NFQNL_MSG_CONFIG, NLM_F_ACK, queue);
+    AddAttribute(m_message, NFQA_CFG_MASK, &flags, sizeof(flags));
+    AddAttribute(m_message, NFQA_CFG_FLAGS, &flags, sizeof(flags));
+    EndMessage(m_message);
+
+    return SendMessage(m_socket, m_message) && ReceiveAck();
+}
+
+bool NfQueueDevice::SendConfig(uint16_t queue, uint16_t attribute, const void* data, size_t length)
+{
+    BeginMessage(m_message, NFQNL_MSG_CONFIG, NLM_F_ACK, queue);
+    AddAttribute(m_message, attribute, data, length);
+    EndMessage(m_message);
+
+    return SendMessage(m_socket, m_message) && ReceiveAck();
+}
+
+bool NfQueueDevice::ReceiveAck()
+{
+    uint8_t buffer[4096];
+
+    ssize_t received = recv(m_socket, buffer, sizeof(buffer), 0);
+    if (received < static_cast<ssize_t>(NLMSG_HDRLEN + sizeof(nlmsgerr)))
+        return false;
+
+    const nlmsghdr* header = reinterpret_cast<const nlmsghdr*>(buffer);
+    if (header->nlmsg_type != NLMSG_ERROR)
+        return false;
+
+    const nlmsgerr* error = reinterpret_cast<const nlmsgerr*>(NLMSG_DATA(header));
+    if (error->error != 0)
+    {
+        errno = -error->error;
+        return false;
+    }
+
+    return true;
+}
+
+bool NfQueueDevice::ParsePacket(const uint8_t* message, size_t length, WinDivertPacket& packet)
+{
+    size_t offset = NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(nfgenmsg));
+
+    const nfqnl_msg_packet_hdr* packetHeader = nullptr;
+    const uint8_t* payload = nullptr;
+    size_t payloadLength = 0;
+    uint32_t inDevice = 0;
+    uint32_t outDevice = 0;
+    uint32_t skbInfo = 0;
+    uint64_t captured = 0;
+
+    m_stamped = false;
+
+    while (offset + NLA_HDRLEN <= length)
+    {
+        const nlattr* attribute = reinterpret_cast<const nlattr*>(message + offset);
+
+        if (attribute->nla_len < NLA_HDRLEN || offset + attribute->nla_len > length)
+            break;
+
+        const uint8_t* data = message + offset + NLA_HDRLEN;
+        size_t dataLength = attribute->nla_len - NLA_HDRLEN;
+
+        switch (attribute->nla_type & NLA_TYPE_MASK)
+        {
+        case NFQA_PACKET_HDR:
+            if (dataLength >= sizeof(nfqnl_msg_packet_hdr))
+                packetHeader = reinterpret_cast<const nfqnl_msg_packet_hdr*>(data);
+            break;
+        case NFQA_PAYLOAD:
+            payload = data;
+            payloadLength = dataLength;
+            break;
+        case NFQA_IFINDEX_INDEV:
+            if (dataLength >= 4)
+                inDevice = ntohl(*reinterpret_cast<const uint32_t*>(data));
+            break;
+        case NFQA_IFINDEX_OUTDEV:
+            if (dataLength >= 4)
+                outDevice = ntohl(*reinterpret_cast<const uint32_t*>(data));
+            break;
+        case NFQA_TIMESTAMP:
+            if (dataLength >= sizeof(nfqnl_msg_packet_timestamp))
+            {
+                // Attributes are only 4 byte aligned
+                nfqnl_msg_packet_timestamp timestamp;
+                memcpy(&timestamp, data, sizeof(timestamp));
+
+                m_stamped = CaptureMicroseconds(timestamp, captured);
+            }
+            break;
+        case NFQA_SKB_INFO:
+            if (dataLength >= 4)
+                skbInfo = ntohl(*reinterpret_cast<const uint32_t*>(data));
+            break;
+        default:
+            break;
+        }
+
+        offset += NLA_ALIGN(attribute->nla_len);
+    }
+
+    if (!packetHeader)
+        return false;
+
+    uint32_t id = ntohl(packetHeader->packet_id);
+
+    packet.Buffer().assign(payload, payload + payloadLength);
+    packet.Dissect();
+
+    WINDIVERT_ADDRESS& address = packet.Address();
+    address = WINDIVERT_ADDRESS();
+    address.Timestamp = static_cast<INT64>(m_stamped ? captured : MonotonicMicroseconds());
+    address.IPv6 = packet.IPv6() != nullptr;
+    address.Reserved2 = id;
+
+    switch (packetHeader->hook)
+    {
+    case NF_INET_LOCAL_IN:
+        address.Outbound = 0;
+        break;
+    case NF_INET_LOCAL_OUT:
+        address.Outbound = 1;
+        break;
+    default:
+    {
+        // Forwarded traffic goes both ways through the same hook, server responses come from the well-known ports
+        uint16_t sourcePort = packet.Tcp() ? ntohs(packet.Tcp()->SrcPort) : 0;
+
+        address.Outbound = sourcePort != 80 && sourcePort != 443;
+        break;
+    }
+    }
+
+    address.Network.IfIdx = address.Outbound ? outDevice : inDevice;
+
+    std::unique_lock<std::mutex> locked(m_lock);
+
+    Pending pending;
+    pending.id = id;
+    pending.length = static_cast<uint32_t>(payloadLength);
+    pending.checksum = packet.Tcp() ? packet.Tcp()->Checksum : 0;
+    pending.state = State::Undecided;
+
+    m_pending.push_back(pending);
+
+    m_metrics.packets++;
+
+    if ((skbInfo & NFQA_SKB_GSO) != 0)
+        m_metrics.gsoPackets++;
+
+    return true;
+}
+
+NfQueueDevice::Pending* NfQueueDevice::FindPending(uint32_t id)
+{
+    // Ids only grow within a queue
+    auto it = std::lower_bound(m_pending.begin(), m_pending.end(), id, [](const Pending& pending, uint32_t value) {
+        return pending.id < value;
+    });
+
+    if (it == m_pending.end() || it->id != id)
+        return nullptr;
+
+    return &*it;
+}
+
+bool NfQueueDevice::SendVerdict(uint32_t id, uint32_t verdict, const WinDivertPacket* packet)
+{
+    nfqnl_msg_verdict_hdr header = {};
+    header.verdict = htonl(verdict);
+    header.id = htonl(id);
+
+    BeginMessage(m_message, NFQNL_MSG_VERDICT, 0, m_queue);
+    AddAttribute(m_message, NFQA_VERDICT_HDR, &header, sizeof(header));
+
+    if (packet)
+        AddAttribute(m_message, NFQA_PAYLOAD, packet->Buffer().data(), packet->Buffer().size());
+
+    EndMessage(m_message);
+
+    m_metrics.verdicts++;
+
+    return SendMessage(m_socket, m_message);
+}
+
+bool NfQueueDevice::SendBatchVerdict(uint32_t id, uint32_t verdict)
+{
+    nfqnl_msg_verdict_hdr header = {};
+    header.verdict = htonl(verdict);
+    header.id = htonl(id);
+
+    BeginMessage(m_message, NFQNL_MSG_VERDICT_BATCH, 0, m_queue);
+    AddAttribute(m_message, NFQA_VERDICT_HDR, &header, sizeof(header));
+    EndMessage(m_message);
+
+    m_metrics.batches++;
+
+    return SendMessage(m_socket, m_message);
+}
+
+bool NfQueueDevice::Flush()
+{
+    // A batch verdict covers every queued packet up to its id, so it stops at the first undecided one
+    uint32_t last = 0;
+    size_t accepted = 0;
+
+    while (!m_pending.empty() && m_pending.front().state != State::Undecided)
+    {
+        if (m_pending.front().state == State::Accepted)
+        {
+            last = m_pending.front().id;
+            accepted++;
+        }
+
+        m_pending.pop_front();
+    }
+
+    if (accepted == 0)
+        return true;
+
+    m_accepted -= accepted;
+    m_metrics.batchedVerdicts += accepted;
+
+    return SendBatchVerdict(last, NF_ACCEPT);
+}
+
+bool NfQueueDevice::Inject(const WinDivertPacket& packet)
+{
+    if (packet.Buffer().size() <= m_mtu)
+        return InjectSegment(packet);
+
+    // The rest of a GSO packet, cut into segments that fit the MTU
+    WinDivertPacket remaining = packet;
+    remaining.Dissect();
+
+    while (remaining.Buffer().size() > m_mtu && remaining.Tcp() && remaining.Data())
+    {
+        size_t headerLength = remaining.Data() - remaining.Buffer().data();
+        if (headerLength >= m_mtu)
+            break;
+
+        WinDivertPacket segment;
+        WinDivertPacket rest;
+
+        bool fragmented = remaining.IPv4() ?
+            Pipeline<IPv4>::Fragment(remaining, m_mtu - headerLength, segment, rest) :
+            Pipeline<IPv6>::Fragment(remaining, m_mtu - headerLength, segment, rest);
+
+        if (!fragmented || !InjectSegment(segment))
+            return false;
+
+        remaining = rest;
+        remaining.Dissect();
+    }
+
+    return InjectSegment(remaining);
+}
+
+bool NfQueueDevice::InjectSegment(const WinDivertPacket& packet)
+{
+    const WinDivertPacket::PacketBuffer& buffer = packet.Buffer();
+
+    if (buffer.empty())
+        return false;
+
+    ssize_t sent = -1;
+
+    switch (buffer[0] >> 4)
+    {
+    case 4:
+    {
+        if (buffer.size() < sizeof(WINDIVERT_IPHDR))
+            return false;
+
+        sockaddr_in destination = {};
+        destination.sin_family = AF_INET;
+        memcpy(&destination.sin_addr, &reinterpret_cast<const WINDIVERT_IPHDR*>(buffer.data())->DstAddr, 4);
+
+        sent = sendto(m_rawSocket4, buffer.data(), buffer.size(), 0, reinterpret_cast<const sockaddr*>(&destination), sizeof(destination));
+        break;
+    }
+    case 6:
+    {
+        if (buffer.size() < sizeof(WINDIVERT_IPV6HDR))
+            return false;
+
+        sockaddr_in6 destination = {};
+        destination.sin6_family = AF_INET6;
+        memcpy(&destination.sin6_addr, reinterpret_cast<const WINDIVERT_IPV6HDR*>(buffer.data())->DstAddr, 16);
+
+        sent = sendto(m_rawSocket6, buffer.data(), buffer.size(), 0, reinterpret_cast<const sockaddr*>(&destination), sizeof(destination));
+        break;
+    }
+    default:
+        return false;
+    }
+
+    if (sent != static_cast<ssize_t>(buffer.size()))
+        return false;
+
+    // Counted apart from the other metrics, workers inject later fragments without holding the lock
+    m_injected.fetch_add(1, std::memory_order_relaxed);
+
+    return true;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "PacketDevice.h"
+#include "SpinPolicy.h"
+
+#include <deque>
+
+// Linux backend on a netfilter queue, talking nfnetlink directly. The queue is bound with fail-open, so the
+// kernel accepts packets instead of dropping them while the queue is full, and with GSO, so that locally
+// generated segments arrive unsegmented, up to 64 KB.
+// Received packets carry their queue id in WINDIVERT_ADDRESS::Reserved2 and fragments inherit it. A packet sent
+// back unchanged is accepted, and consecutive accept verdicts go out as one batch verdict while more packets
+// are waiting. The first fragment of a packet replaces it, either through raw sockets and a drop verdict or as
+// the payload of its accept verdict, and later fragments go out through raw sockets carrying the configured
+// mark. Injected packets are segmented to the MTU.
+class NfQueueDevice : public PacketDevice
+{
+public:
+    enum class Injection
+    {
+        Raw = 0,
+        Verdict
+    };
+
+    struct Metrics
+    {
+        Metrics()
+        {
+            packets = 0;
+            gsoPackets = 0;
+            batches = 0;
+            batchedVerdicts = 0;
+            verdicts = 0;
+            injected = 0;
+            bypassed = 0;
+        }
+
+        uint64_t packets;
+        uint64_t gsoPackets;
+        // Batch verdicts and the packets they accepted
+        uint64_t batches;
+        uint64_t batchedVerdicts;
+        // Drop and modified payload verdicts
+        uint64_t verdicts;
+        uint64_t injected;
+        // Packets accepted unmodified because their first fragment could not be sent
+        uint64_t bypassed;
+    };
+
+    // WINDIVERT_ADDRESS::Timestamp of received packets is in microseconds on CLOCK_MONOTONIC, when the kernel
+    // queued the packet if it reports that, otherwise when it was received
+    static const int64_t TIMESTAMP_FREQUENCY = 1000000;
+
+    NfQueueDevice();
+    ~NfQueueDevice();
+
+    bool Open(uint16_t queue, uint32_t maxLength, Injection injection, uint32_t mark, size_t mtu, size_t batch);
+    void Close();
+
+    // Makes Recv return false, safe to call from a signal handler
+    void Shutdown();
+
+    // Polls the socket within the policy's budget before blocking, and reports the delay of packets that ended a wait
+    void SetSpinPolicy(SpinPolicy* policy);
+
+    bool Recv(WinDivertPacket& packet) override;
+    bool Send(const WinDivertPacket& packet) override;
+
+    Metrics Stats();
+private:
+    enum class State : uint8_t
+    {
+        Undecided = 0,
+        Accepted,
+        // Decided by a verdict of its own
+        Done,
+        // The first fragment could not be sent, the original was accepted and the rest is dropped
+        Bypassed
+    };
+
+    struct Pending
+    {
+        uint32_t id;
+        uint32_t length;
+        // TCP checksum as received, a packet sent back at the same length with another one was changed in place
+        uint16_t checksum;
+        State state;
+    };
+
+    bool Configure(uint16_t queue, uint32_t maxLength);
+    bool SendConfig(uint16_t queue, uint16_t attribute, const void* data, size_t length);
+    bool ReceiveAck();
+
+    bool ParsePacket(const uint8_t* message, size_t length, WinDivertPacket& packet);
+
+    Pending* FindPending(uint32_t id);
+    bool SendVerdict(uint32_t id, uint32_t verdict, const WinDivertPacket* packet);
+    bool SendBatchVerdict(uint32_t id, uint32_t verdict);
+    bool Flush();
+
+    bool Inject(const WinDivertPacket& packet);
+    bool InjectSegment(const WinDivertPacket& packet);
+private:
+    int m_socket;
+    int m_rawSocket4;
+    int m_rawSocket6;
+    int m_event;
+
+    uint16_t m_queue;
+    Injection m_injection;
+    size_t m_mtu;
+    size_t m_batch;
+
+    std::vector<uint8_t> m_recvBuffer;
+    size_t m_recvOffset;
+    size_t m_recvLength;
+    SpinPolicy* m_spinPolicy;
+    // A wait for packets ended, the next one received tells the policy how long it took to arrive
+    bool m_waited;
+    bool m_caught;
+    // The packet parsed last carries the time the kernel queued it rather than the time it was received
+    bool m_stamped;
+
+    // Packets handed to Recv and not yet released, in id order. Guarded by m_lock like everything below
+    std::deque<Pending> m_pending;
+    size_t m_accepted;
+    // The receiving thread waits for packets, accept verdicts must not be held back
+    bool m_blocked;
+    std::vector<uint8_t> m_message;
+    Metrics m_metrics;
+    std::atomic<uint64_t> m_injected;
+
+    std::atomic<bool> m_shutdown;
+
+    std::mutex m_lock;
+};
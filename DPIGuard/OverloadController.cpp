@@ -0,0 +1,98 @@
+#include "StdAfx.h"
+#include "OverloadController.h"
+
+OverloadController::OverloadController(uint64_t budget, Action action)
+    : m_budget(budget), m_action(action), m_cost(0), m_shedInRow(0)
+{
+}
+
+uint64_t OverloadController::Budget() const
+{
+    return m_budget;
+}
+
+OverloadController::Action OverloadController::GetAction() const
+{
+    return m_action;
+}
+
+uint64_t OverloadController::Cost() const
+{
+    return m_cost;
+}
+
+bool OverloadController::Shed(uint64_t captured, uint64_t now)
+{
+    m_metrics.packets++;
+
+    uint64_t delay = captured != 0 && now > captured ? now - captured : 0;
+    m_metrics.maxDelay = std::max(m_metrics.maxDelay, delay);
+
+    if (delay + m_cost <= m_budget)
+    {
+        m_shedInRow = 0;
+        return false;
+    }
+
+    if (++m_shedInRow >= PROBE_INTERVAL)
+    {
+        m_shedInRow = 0;
+        m_metrics.probes++;
+        return false;
+    }
+
+    m_metrics.shed++;
+    return true;
+}
+
+void OverloadController::Processed(uint64_t captured, uint64_t started, uint64_t finished)
+{
+    uint64_t cost = finished > started ? finished - started : 0;
+
+    m_cost = m_cost - m_cost / 16 + cost / 16;
+
+    m_metrics.processed++;
+    m_metrics.processingTime += cost;
+
+    uint64_t since = captured != 0 && captured < started ? captured : started;
+
+    if (finished - since > m_budget)
+        m_metrics.late++;
+}
+
+void OverloadController::Uncached()
+{
+    m_metrics.uncached++;
+}
+
+void OverloadController::Merge(const OverloadController& other)
+{
+    const Metrics& metrics = other.Stats();
+
+    m_metrics.packets += metrics.packets;
+    m_metrics.shed += metrics.shed;
+    m_metrics.uncached += metrics.uncached;
+    m_metrics.probes += metrics.probes;
+    m_metrics.late += metrics.late;
+    m_metrics.processed += metrics.processed;
+    m_metrics.processingTime += metrics.processingTime;
+    m_metrics.maxDelay = std::max(m_metrics.maxDelay, metrics.maxDelay);
+}
+
+const OverloadController::Metrics& OverloadController::Stats() const
+{
+    return m_metrics;
+}
+
+void OverloadController::Print() const
+{
+    printf("[+] Load shedding: %llu of %llu packets shed (%s), %llu processed over the %llu us budget, "
+        "%.1f us per processed packet, max delay %.1f us\n",
+        static_cast<unsigned long long>(m_metrics.shed), static_cast<unsigned long long>(m_metrics.packets),
+        m_action == Action::Pass ? "passed through" : "matched from the domain cache",
+        static_cast<unsigned long long>(m_metrics.late), static_cast<unsigned long long>(m_budget / 1000),
+        m_metrics.processingTime / 1000.0 / std::max<uint64_t>(m_metrics.processed, 1), m_metrics.maxDelay / 1000.0);
+
+    if (m_action == Action::Cached && m_metrics.shed != 0)
+        printf("[+] Load shedding: %llu host names of shed packets were not cached\n", static_cast<unsigned long long>(m_metrics.uncached));
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+// Decides per packet whether there is still time to classify it. A packet's delay is how long it waited between
+// capture and the start of processing, in the device queue and in the ring in front of a worker. When that delay
+// plus the usual processing time would exceed the budget the packet is shed, so that a backlog drains instead of
+// stalling every connection behind it. Without capture times only the processing time counts. Processing time
+// is only learnt from packets that are not shed, so every PROBE_INTERVAL-th packet shed in a row is processed
+// anyway. All times are in nanoseconds. Not thread safe, every packet processing thread owns its own instance
+// and the results are merged.
+class OverloadController
+{
+public:
+    enum class Action : uint8_t
+    {
+        // Shed packets are forwarded unmodified without looking at them
+        Pass = 0,
+        // Shed packets are classified with what the domain cache already knows, other names go on unmodified
+        Cached
+    };
+
+    enum
+    {
+        PROBE_INTERVAL = 64
+    };
+
+    struct Metrics
+    {
+        Metrics()
+        {
+            packets = 0;
+            shed = 0;
+            uncached = 0;
+            probes = 0;
+            late = 0;
+            processed = 0;
+            processingTime = 0;
+            maxDelay = 0;
+        }
+
+        uint64_t packets;
+        uint64_t shed;
+        // Host names of shed packets that were not in the domain cache
+        uint64_t uncached;
+        // Packets processed in full while shedding, to measure the processing time
+        uint64_t probes;
+        // Packets processed in full that still took longer than the budget
+        uint64_t late;
+        uint64_t processed;
+        uint64_t processingTime;
+        uint64_t maxDelay;
+    };
+
+    OverloadController(uint64_t budget, Action action);
+
+    uint64_t Budget() const;
+    Action GetAction() const;
+    // Recent processing time of a packet that is not shed
+    uint64_t Cost() const;
+
+    // Whether the packet captured at captured, 0 if unknown, is shed when processing starts at now
+    bool Shed(uint64_t captured, uint64_t now);
+    // A packet that was not shed took from started to finished
+    void Processed(uint64_t captured, uint64_t started, uint64_t finished);
+    // A shed packet's host name was not in the domain cache
+    void Uncached();
+
+    void Merge(const OverloadController& other);
+
+    const Metrics& Stats() const;
+
+    void Print() const;
+private:
+    uint64_t m_budget;
+    Action m_action;
+
+    // Moving average over about the last 16 processed packets
+    uint64_t m_cost;
+    uint64_t m_shedInRow;
+
+    Metrics m_metrics;
+};
@@ -0,0 +1,405 @@
+#include "StdAfx.h"
+#include "PacketCapture.h"
+#include "Utils.h"
+
+#ifdef _WIN32
+#include <share.h>
+#endif
+
+// pcapng block types and options, see draft-ietf-opsawg-pcapng
+static const uint32_t SECTION_HEADER_BLOCK = 0x0a0d0d0a;
+static const uint32_t INTERFACE_DESCRIPTION_BLOCK = 0x00000001;
+static const uint32_t ENHANCED_PACKET_BLOCK = 0x00000006;
+
+static const uint32_t BYTE_ORDER_MAGIC = 0x1a2b3c4d;
+
+static const uint16_t OPT_ENDOFOPT = 0;
+static const uint16_t OPT_COMMENT = 1;
+static const uint16_t SHB_USERAPPL = 4;
+static const uint16_t IF_TSRESOL = 9;
+static const uint16_t EPB_FLAGS = 2;
+
+// Raw IPv4 or IPv6 without a link layer header
+static const uint16_t LINKTYPE_RAW = 101;
+
+static const uint32_t EPB_FLAGS_INBOUND = 1;
+static const uint32_t EPB_FLAGS_OUTBOUND = 2;
+
+static FILE* OpenCaptureFile(const std::wstring& filePath)
+{
+#ifdef _WIN32
+    return _wfsopen(filePath.c_str(), L"wb", _SH_DENYWR);
+#else
+    return fopen(Utils::WideToUtf8(filePath).c_str(), "wb");
+#endif
+}
+
+static bool RenameCaptureFile(const std::wstring& filePath, const std::wstring& newFilePath)
+{
+#ifdef _WIN32
+    return MoveFileExW(filePath.c_str(), newFilePath.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+    return rename(Utils::WideToUtf8(filePath).c_str(), Utils::WideToUtf8(newFilePath).c_str()) == 0;
+#endif
+}
+
+static void AppendUInt16(std::vector<uint8_t>& block, uint16_t value)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    block.insert(block.end(), bytes, bytes + sizeof(value));
+}
+
+static void AppendUInt32(std::vector<uint8_t>& block, uint32_t value)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    block.insert(block.end(), bytes, bytes + sizeof(value));
+}
+
+static void AppendPadded(std::vector<uint8_t>& block, const void* data, size_t length)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+
+    block.insert(block.end(), bytes, bytes + length);
+    block.resize(block.size() + ((4 - (length & 3)) & 3), 0);
+}
+
+static void AppendOption(std::vector<uint8_t>& block, uint16_t code, const void* data, size_t length)
+{
+    AppendUInt16(block, code);
+    AppendUInt16(block, static_cast<uint16_t>(length));
+    AppendPadded(block, data, length);
+}
+
+// Block Type and Block Total Length are written first, the length is patched once the body is known
+static void BeginBlock(std::vector<uint8_t>& block, uint32_t type)
+{
+    block.clear();
+
+    AppendUInt32(block, type);
+    AppendUInt32(block, 0);
+}
+
+static void EndBlock(std::vector<uint8_t>& block)
+{
+    uint32_t totalLength = static_cast<uint32_t>(block.size() + sizeof(uint32_t));
+
+    memcpy(block.data() + sizeof(uint32_t), &totalLength, sizeof(totalLength));
+    AppendUInt32(block, totalLength);
+}
+
+PacketCapture::PacketCapture(size_t slots /*= 256*/)
+    : m_slotMask(0), m_tail(0), m_head(0), m_running(false), m_captured(0), m_dropped(0)
+    , m_maxFileSize(0), m_maxFiles(0), m_file(nullptr), m_fileSize(0), m_headerSize(0), m_writerStop(false)
+{
+    size_t capacity = 1;
+    while (capacity < slots)
+        capacity *= 2;
+
+    m_slots.reset(new Slot[capacity]);
+    m_slotMask = capacity - 1;
+
+    for (size_t i = 0; i < capacity; i++)
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+PacketCapture::~PacketCapture()
+{
+    Stop();
+}
+
+bool PacketCapture::Start(const std::wstring& filePath, uint64_t maxFileSize, size_t maxFiles)
+{
+    if (m_writerThread)
+        return false;
+
+    m_filePath = filePath;
+    m_maxFileSize = maxFileSize;
+    m_maxFiles = std::max<size_t>(maxFiles, 1);
+
+    if (!OpenFile())
+        return false;
+
+    m_writerStop = false;
+    m_writerThread = std::make_unique<std::thread>(&PacketCapture::WriterMain, this);
+
+    m_running.store(true, std::memory_order_release);
+
+    return true;
+}
+
+void PacketCapture::Stop()
+{
+    m_running.store(false, std::memory_order_release);
+
+    if (!m_writerThread)
+        return;
+
+    {
+        std::unique_lock<std::mutex> locked(m_writerLock);
+        m_writerStop = true;
+    }
+
+    m_writerCv.notify_all();
+
+    if (m_writerThread->joinable())
+        m_writerThread->join();
+
+    m_writerThread.reset();
+
+    CloseFile();
+}
+
+bool PacketCapture::Capture(const WinDivertPacket& packet, Reason reason)
+{
+    if (!m_running.load(std::memory_order_acquire))
+        return false;
+
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    Slot* slot = nullptr;
+
+    while (true)
+    {
+        slot = &m_slots[tail & m_slotMask];
+
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(tail);
+
+        if (difference == 0)
+        {
+            if (m_tail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (difference < 0)
+        {
+            // The writer has not caught up yet
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else
+        {
+            tail = m_tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    const WinDivertPacket::PacketBuffer& buffer = packet.Buffer();
+
+    slot->reason = reason;
+    slot->outbound = packet.Address().Outbound != 0;
+    slot->timestamp = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    slot->length = static_cast<uint32_t>(buffer.size());
+    slot->capturedLength = static_cast<uint32_t>(std::min(buffer.size(), static_cast<size_t>(SNAPSHOT_LENGTH)));
+
+    memcpy(slot->data, buffer.data(), slot->capturedLength);
+
+    slot->sequence.store(tail + 1, std::memory_order_release);
+
+    m_captured.fetch_add(1, std::memory_order_relaxed);
+
+    return true;
+}
+
+uint64_t PacketCapture::Captured() const
+{
+    return m_captured.load(std::memory_order_relaxed);
+}
+
+uint64_t PacketCapture::Dropped() const
+{
+    return m_dropped.load(std::memory_order_relaxed);
+}
+
+const char* PacketCapture::ReasonName(Reason reason)
+{
+    switch (reason)
+    {
+    case Reason::HttpParseError:
+        return "HTTP parse error";
+    case Reason::TlsParseError:
+        return "TLS parse error";
+    case Reason::UnknownTlsVersion:
+        return "Unknown TLS version";
+    case Reason::TruncatedClientHello:
+        return "Truncated ClientHello";
+    default:
+        break;
+    }
+
+    return "Unknown";
+}
+
+void PacketCapture::WriterMain()
+{
+    bool stop = false;
+
+    while (true)
+    {
+        bool written = false;
+
+        while (true)
+        {
+            Slot& slot = m_slots[m_head & m_slotMask];
+
+            if (slot.sequence.load(std::memory_order_acquire) != m_head + 1)
+                break;
+
+            if (m_file != nullptr && !WritePacket(slot))
+            {
+                printf("[-] Failed to write packet capture file\n");
+                CloseFile();
+            }
+
+            // Hand the slot back to the producers one lap ahead
+            slot.sequence.store(m_head + m_slotMask + 1, std::memory_order_release);
+            m_head++;
+
+            written = true;
+        }
+
+        if (written && m_file != nullptr)
+            fflush(m_file);
+
+        // Producers never signal, the ring is polled so that the packet path stays free of locks
+        if (stop)
+            break;
+
+        std::unique_lock<std::mutex> locked(m_writerLock);
+
+        stop = m_writerCv.wait_for(locked, std::chrono::milliseconds(100), [&]() {
+            return m_writerStop;
+        });
+    }
+}
+
+bool PacketCapture::OpenFile()
+{
+    m_file = OpenCaptureFile(m_filePath);
+    if (m_file == nullptr)
+        return false;
+
+    m_fileSize = 0;
+
+    if (!WriteHeader())
+    {
+        CloseFile();
+        return false;
+    }
+
+    m_headerSize = m_fileSize;
+
+    return true;
+}
+
+void PacketCapture::CloseFile()
+{
+    if (m_file == nullptr)
+        return;
+
+    fclose(m_file);
+    m_file = nullptr;
+}
+
+bool PacketCapture::RotateFile()
+{
+    CloseFile();
+
+    for (size_t index = m_maxFiles - 1; index > 0; index--)
+        RenameCaptureFile(RotatedFilePath(index - 1), RotatedFilePath(index));
+
+    return OpenFile();
+}
+
+bool PacketCapture::WriteBlock(const std::vector<uint8_t>& block)
+{
+    if (fwrite(block.data(), 1, block.size(), m_file) != block.size())
+        return false;
+
+    m_fileSize += block.size();
+
+    return true;
+}
+
+bool PacketCapture::WriteHeader()
+{
+    static const char USER_APPLICATION[] = "DPIGuard";
+
+    // Section Header Block
+    BeginBlock(m_block, SECTION_HEADER_BLOCK);
+    AppendUInt32(m_block, BYTE_ORDER_MAGIC);
+    AppendUInt16(m_block, 1);
+    AppendUInt16(m_block, 0);
+    // Section Length is not known in advance
+    AppendUInt32(m_block, 0xffffffff);
+    AppendUInt32(m_block, 0xffffffff);
+    AppendOption(m_block, SHB_USERAPPL, USER_APPLICATION, sizeof(USER_APPLICATION) - 1);
+    AppendOption(m_block, OPT_ENDOFOPT, nullptr, 0);
+    EndBlock(m_block);
+
+    if (!WriteBlock(m_block))
+        return false;
+
+    // Interface Description Block, timestamps are in microseconds
+    uint8_t timestampResolution = 6;
+
+    BeginBlock(m_block, INTERFACE_DESCRIPTION_BLOCK);
+    AppendUInt16(m_block, LINKTYPE_RAW);
+    AppendUInt16(m_block, 0);
+    AppendUInt32(m_block, static_cast<uint32_t>(SNAPSHOT_LENGTH));
+    AppendOption(m_block, IF_TSRESOL, &timestampResolution, sizeof(timestampResolution));
+    AppendOption(m_block, OPT_ENDOFOPT, nullptr, 0);
+    EndBlock(m_block);
+
+    return WriteBlock(m_block);
+}
+
+bool PacketCapture::WritePacket(const Slot& slot)
+{
+    const char* reasonName = ReasonName(slot.reason);
+    uint32_t flags = slot.outbound ? EPB_FLAGS_OUTBOUND : EPB_FLAGS_INBOUND;
+
+    // Enhanced Packet Block, the reason is stored as the packet comment
+    BeginBlock(m_block, ENHANCED_PACKET_BLOCK);
+    AppendUInt32(m_block, 0);
+    AppendUInt32(m_block, static_cast<uint32_t>(slot.timestamp >> 32));
+    AppendUInt32(m_block, static_cast<uint32_t>(slot.timestamp));
+    AppendUInt32(m_block, slot.capturedLength);
+    AppendUInt32(m_block, slot.length);
+    AppendPadded(m_block, slot.data, slot.capturedLength);
+    AppendOption(m_block, OPT_COMMENT, reasonName, strlen(reasonName));
+    AppendOption(m_block, EPB_FLAGS, &flags, sizeof(flags));
+    AppendOption(m_block, OPT_ENDOFOPT, nullptr, 0);
+    EndBlock(m_block);
+
+    // A file always takes at least one packet, even if the packet alone exceeds the limit
+    if (m_maxFileSize != 0 && m_fileSize > m_headerSize && m_fileSize + m_block.size() > m_maxFileSize)
+    {
+        // BeginBlock reuses m_block for the new file header
+        std::vector<uint8_t> block;
+        block.swap(m_block);
+
+        bool rotated = RotateFile();
+
+        block.swap(m_block);
+
+        if (!rotated)
+            return false;
+    }
+
+    return WriteBlock(m_block);
+}
+
+std::wstring PacketCapture::RotatedFilePath(size_t index) const
+{
+    if (index == 0)
+        return m_filePath;
+
+    std::wstring suffix = L"." + std::to_wstring(index);
+
+    size_t extensionOffset = m_filePath.rfind(L'.');
+    size_t separatorOffset = m_filePath.find_last_of(L"\\/");
+
+    if (extensionOffset == std::wstring::npos || (separatorOffset != std::wstring::npos && extensionOffset < separatorOffset))
+        return m_filePath + suffix;
+
+    return m_filePath.substr(0, extensionOffset) + suffix + m_filePath.substr(extensionOffset);
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "WinDivertPacket.h"
+
+// Records packets the classifier could not make sense of into a rotating pcapng file.
+// Capture copies the packet into a bounded lock-free ring and never blocks, a background thread drains the ring
+// to disk. When the ring is full the packet is dropped and counted.
+class PacketCapture
+{
+public:
+    enum class Reason : uint8_t
+    {
+        HttpParseError = 1,
+        TlsParseError,
+        UnknownTlsVersion,
+        TruncatedClientHello
+    };
+
+    PacketCapture(size_t slots = 256);
+    ~PacketCapture();
+
+    // filePath is the current file, older files are kept as name.1.pcapng up to name.(maxFiles - 1).pcapng
+    bool Start(const std::wstring& filePath, uint64_t maxFileSize, size_t maxFiles);
+    void Stop();
+
+    // Safe to call from any number of threads, does nothing unless started
+    bool Capture(const WinDivertPacket& packet, Reason reason);
+
+    uint64_t Captured() const;
+    uint64_t Dropped() const;
+
+    static const char* ReasonName(Reason reason);
+private:
+    static const size_t SNAPSHOT_LENGTH = 4096;
+
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+
+        Reason reason;
+        bool outbound;
+        uint64_t timestamp;
+        uint32_t length;
+        uint32_t capturedLength;
+        uint8_t data[SNAPSHOT_LENGTH];
+    };
+
+    void WriterMain();
+
+    bool OpenFile();
+    void CloseFile();
+    bool RotateFile();
+
+    bool WriteBlock(const std::vector<uint8_t>& block);
+    bool WriteHeader();
+    bool WritePacket(const Slot& slot);
+
+    std::wstring RotatedFilePath(size_t index) const;
+private:
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_slotMask;
+
+    // Multi producer single consumer, producers claim m_tail, the writer owns m_head
+    alignas(64) std::atomic<size_t> m_tail;
+    alignas(64) size_t m_head;
+
+    std::atomic<bool> m_running;
+    std::atomic<uint64_t> m_captured;
+    std::atomic<uint64_t> m_dropped;
+
+    std::wstring m_filePath;
+    uint64_t m_maxFileSize;
+    size_t m_maxFiles;
+
+    FILE* m_file;
+    uint64_t m_fileSize;
+    uint64_t m_headerSize;
+    std::vector<uint8_t> m_block;
+
+    std::unique_ptr<std::thread> m_writerThread;
+    std::condition_variable m_writerCv;
+    std::mutex m_writerLock;
+    bool m_writerStop;
+};
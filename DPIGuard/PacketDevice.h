@@ -0,0 +1,14 @@
+#pragma once
+
+#include "WinDivertPacket.h"
+
+// Source and sink of diverted packets, implemented by the capture backends.
+// Send must be safe to call from several threads at once.
+class PacketDevice
+{
+public:
+    virtual ~PacketDevice() = default;
+
+    virtual bool Recv(WinDivertPacket& packet) = 0;
+    virtual bool Send(const WinDivertPacket& packet) = 0;
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+// Header only IPv4/IPv6/TCP dissector, replaces WinDivertHelperParsePacket on the packet path.
+// Only the layers DPIGuard looks at are parsed, other transport protocols end up in the payload.
+class PacketDissector
+{
+public:
+    struct Layers
+    {
+        const uint8_t* ipv4;
+        const uint8_t* ipv6;
+        const uint8_t* tcp;
+        const uint8_t* data;
+        uint32_t dataLength;
+        uint8_t protocol;
+        bool fragment;
+    };
+
+    static bool Dissect(const uint8_t* packet, size_t length, Layers& layers)
+    {
+        layers.ipv4 = nullptr;
+        layers.ipv6 = nullptr;
+        layers.tcp = nullptr;
+        layers.data = nullptr;
+        layers.dataLength = 0;
+        layers.protocol = 0;
+        layers.fragment = false;
+
+        if (packet == nullptr || length < 1)
+            return false;
+
+        const uint8_t* cursor = packet;
+        size_t remaining = 0;
+        uint8_t protocol = 0;
+        bool fragment = false;
+
+        switch (packet[0] >> 4)
+        {
+        case 4:
+        {
+            // Version/IHL, TOS, Total Length, ID, Flags/Fragment Offset, TTL, Protocol, Checksum, Src, Dst
+            if (length < IPV4_HEADER_LENGTH)
+                return false;
+
+            size_t headerLength = static_cast<size_t>(packet[0] & 0x0f) * 4;
+            size_t totalLength = ReadUInt16(packet + 2);
+
+            if (headerLength < IPV4_HEADER_LENGTH || totalLength < headerLength || length < headerLength)
+                return false;
+
+            uint16_t fragmentField = ReadUInt16(packet + 6);
+            uint16_t fragmentOffset = fragmentField & 0x1fff;
+
+            fragment = fragmentOffset != 0 || (fragmentField & 0x2000) != 0;
+            protocol = packet[9];
+
+            layers.ipv4 = packet;
+
+            cursor = packet + headerLength;
+            remaining = std::min(totalLength, length) - headerLength;
+
+            // Only the first fragment carries the transport header
+            if (fragmentOffset != 0)
+                protocol = NO_NEXT_HEADER;
+
+            break;
+        }
+        case 6:
+        {
+            // Version/Traffic Class/Flow Label, Payload Length, Next Header, Hop Limit, Src, Dst
+            if (length < IPV6_HEADER_LENGTH)
+                return false;
+
+            size_t payloadLength = ReadUInt16(packet + 4);
+
+            layers.ipv6 = packet;
+
+            protocol = packet[6];
+            cursor = packet + IPV6_HEADER_LENGTH;
+            remaining = std::min(payloadLength, length - IPV6_HEADER_LENGTH);
+
+            bool extensionHeader = true;
+
+            while (extensionHeader)
+            {
+                size_t extensionLength = 0;
+
+                switch (protocol)
+                {
+                case 0:   // Hop-by-Hop Options
+                case 43:  // Routing
+                case 60:  // Destination Options
+                    if (remaining < 2)
+                        return true;
+
+                    extensionLength = (static_cast<size_t>(cursor[1]) + 1) * 8;
+                    break;
+                case 44:  // Fragment
+                {
+                    if (remaining < 8)
+                        return true;
+
+                    uint16_t fragmentField = ReadUInt16(cursor + 2);
+
+                    fragment = true;
+                    extensionLength = 8;
+
+                    if ((fragmentField & 0xfff8) != 0)
+                    {
+                        protocol = NO_NEXT_HEADER;
+                        cursor += extensionLength;
+                        remaining -= extensionLength;
+                        extensionHeader = false;
+                        continue;
+                    }
+
+                    break;
+                }
+                case 51:  // Authentication Header
+                    if (remaining < 2)
+                        return true;
+
+                    extensionLength = (static_cast<size_t>(cursor[1]) + 2) * 4;
+                    break;
+                default:
+                    extensionHeader = false;
+                    continue;
+                }
+
+                if (remaining < extensionLength)
+                    return true;
+
+                protocol = cursor[0];
+                cursor += extensionLength;
+                remaining -= extensionLength;
+            }
+
+            break;
+        }
+        default:
+            return false;
+        }
+
+        layers.protocol = protocol;
+        layers.fragment = fragment;
+
+        if (protocol == TCP_PROTOCOL && remaining >= TCP_HEADER_LENGTH)
+        {
+            size_t headerLength = static_cast<size_t>(cursor[12] >> 4) * 4;
+
+            if (headerLength >= TCP_HEADER_LENGTH && headerLength <= remaining)
+            {
+                layers.tcp = cursor;
+
+                cursor += headerLength;
+                remaining -= headerLength;
+            }
+        }
+
+        if (remaining > 0)
+        {
+            layers.data = cursor;
+            layers.dataLength = static_cast<uint32_t>(remaining);
+        }
+
+        return true;
+    }
+private:
+    static const size_t IPV4_HEADER_LENGTH = 20;
+    static const size_t IPV6_HEADER_LENGTH = 40;
+    static const size_t TCP_HEADER_LENGTH = 20;
+
+    static const uint8_t TCP_PROTOCOL = 6;
+    static const uint8_t NO_NEXT_HEADER = 59;
+
+    static uint16_t ReadUInt16(const uint8_t* p)
+    {
+        return static_cast<uint16_t>((p[0] << 8) | p[1]);
+    }
+};
@@ -0,0 +1,228 @@
+#pragma once
+
+#include "WinDivertPacket.h"
+
+// IP family traits for Pipeline, everything that differs between IPv4 and IPv6 is resolved at compile time.
+struct IPv4
+{
+    typedef WINDIVERT_IPHDR Header;
+
+    static const size_t ADDRESS_LENGTH = 4;
+
+    static Header* GetHeader(WinDivertPacket& packet)
+    {
+        return packet.IPv4();
+    }
+
+    static const uint8_t* DestinationAddress(const Header* header)
+    {
+        return reinterpret_cast<const uint8_t*>(&header->DstAddr);
+    }
+
+    // Total Length covers the IP header
+    static void SetLength(Header* header, size_t packetLength)
+    {
+        WriteUInt16(reinterpret_cast<uint8_t*>(&header->Length), static_cast<uint16_t>(packetLength));
+    }
+
+    static void UpdateHeaderChecksum(Header* header)
+    {
+        header->Checksum = 0;
+
+        uint32_t sum = Sum(reinterpret_cast<const uint8_t*>(header), static_cast<size_t>(header->HdrLength) * 4, 0);
+        WriteUInt16(reinterpret_cast<uint8_t*>(&header->Checksum), Fold(sum));
+    }
+
+    // Source Address, Destination Address, Zero, Protocol, TCP Length
+    static uint32_t PseudoHeaderSum(const Header* header, size_t transportLength)
+    {
+        uint32_t sum = Sum(reinterpret_cast<const uint8_t*>(&header->SrcAddr), ADDRESS_LENGTH * 2, 0);
+
+        sum += 6;
+        sum += static_cast<uint32_t>(transportLength);
+
+        return sum;
+    }
+
+    static uint32_t Sum(const uint8_t* data, size_t length, uint32_t sum)
+    {
+        for (size_t i = 0; i + 1 < length; i += 2)
+            sum += (static_cast<uint32_t>(data[i]) << 8) | data[i + 1];
+
+        if (length & 1)
+            sum += static_cast<uint32_t>(data[length - 1]) << 8;
+
+        return sum;
+    }
+
+    static uint16_t Fold(uint32_t sum)
+    {
+        while (sum >> 16)
+            sum = (sum & 0xffff) + (sum >> 16);
+
+        return static_cast<uint16_t>(~sum);
+    }
+
+    static void WriteUInt16(uint8_t* p, uint16_t value)
+    {
+        p[0] = static_cast<uint8_t>(value >> 8);
+        p[1] = static_cast<uint8_t>(value);
+    }
+};
+
+struct IPv6
+{
+    typedef WINDIVERT_IPV6HDR Header;
+
+    static const size_t ADDRESS_LENGTH = 16;
+    static const size_t HEADER_LENGTH = 40;
+
+    static Header* GetHeader(WinDivertPacket& packet)
+    {
+        return packet.IPv6();
+    }
+
+    static const uint8_t* DestinationAddress(const Header* header)
+    {
+        return reinterpret_cast<const uint8_t*>(header->DstAddr);
+    }
+
+    // Payload Length excludes the fixed header but covers extension headers
+    static void SetLength(Header* header, size_t packetLength)
+    {
+        IPv4::WriteUInt16(reinterpret_cast<uint8_t*>(&header->Length), static_cast<uint16_t>(packetLength - HEADER_LENGTH));
+    }
+
+    static void UpdateHeaderChecksum(Header*)
+    {
+    }
+
+    // Source Address, Destination Address, Upper-Layer Packet Length, Zero, Next Header
+    static uint32_t PseudoHeaderSum(const Header* header, size_t transportLength)
+    {
+        uint32_t sum = IPv4::Sum(reinterpret_cast<const uint8_t*>(header->SrcAddr), ADDRESS_LENGTH * 2, 0);
+
+        sum += 6;
+        sum += static_cast<uint32_t>(transportLength >> 16);
+        sum += static_cast<uint32_t>(transportLength & 0xffff);
+
+        return sum;
+    }
+};
+
+// TCP segmentation for a single IP family, selected once per packet.
+template<typename Family>
+class Pipeline
+{
+public:
+    // Content type, version and length of a TLS record
+    enum
+    {
+        RECORD_HEADER_LENGTH = 5
+    };
+
+    static const uint8_t* DestinationAddress(WinDivertPacket& packet)
+    {
+        return Family::DestinationAddress(Family::GetHeader(packet));
+    }
+
+    // Splits the TCP payload at offset, firstPacket carries the bytes before it
+    static bool Fragment(WinDivertPacket& packet, size_t offset, WinDivertPacket& firstPacket, WinDivertPacket& secondPacket)
+    {
+        if (packet.DataLength() <= offset)
+            return false;
+
+        size_t headerLength = packet.Data() - packet.Buffer().data();
+
+        size_t firstDataLength = offset;
+        size_t secondDataLength = packet.DataLength() - offset;
+
+        firstPacket = packet;
+        firstPacket.Buffer().resize(headerLength + firstDataLength);
+        Finish(firstPacket, 0);
+
+        secondPacket = packet;
+        secondPacket.Buffer().resize(headerLength + secondDataLength);
+        memcpy(secondPacket.Data(), packet.Data() + offset, secondDataLength);
+        Finish(secondPacket, static_cast<uint32_t>(firstDataLength));
+
+        return true;
+    }
+
+    // Splits the TLS record at the start of the TCP payload in two, the first one carries offset bytes of its
+    // handshake message. The record header that is inserted makes splitPacket RECORD_HEADER_LENGTH bytes longer,
+    // so splitPacket needs that much more capacity than packet. The split point must lie in this segment.
+    static bool SplitRecord(WinDivertPacket& packet, size_t offset, WinDivertPacket& splitPacket)
+    {
+        const uint8_t* data = packet.Data();
+        size_t dataLength = packet.DataLength();
+
+        if (!data || dataLength < RECORD_HEADER_LENGTH)
+            return false;
+
+        size_t recordLength = (static_cast<size_t>(data[3]) << 8) | data[4];
+
+        if (offset == 0 || offset >= recordLength || RECORD_HEADER_LENGTH + offset > dataLength)
+            return false;
+
+        size_t headerLength = data - packet.Buffer().data();
+        size_t splitLength = RECORD_HEADER_LENGTH + offset;
+
+        if (packet.Buffer().size() + RECORD_HEADER_LENGTH > 65535 ||
+            splitPacket.Buffer().capacity() < packet.Buffer().size() + RECORD_HEADER_LENGTH)
+            return false;
+
+        splitPacket = packet;
+        splitPacket.Buffer().resize(packet.Buffer().size() + RECORD_HEADER_LENGTH);
+
+        uint8_t* splitData = splitPacket.Buffer().data() + headerLength;
+
+        // The rest of the payload moves behind a copy of the record header that covers the rest of the message
+        memcpy(splitData + splitLength + RECORD_HEADER_LENGTH, data + splitLength, dataLength - splitLength);
+        memcpy(splitData + splitLength, data, 3);
+        IPv4::WriteUInt16(splitData + splitLength + 3, static_cast<uint16_t>(recordLength - offset));
+        IPv4::WriteUInt16(splitData + 3, static_cast<uint16_t>(offset));
+
+        Finish(splitPacket, 0);
+
+        // Dissected again for the new payload length
+        return splitPacket.Dissect();
+    }
+
+    // After the sequence or acknowledgement numbers of a packet were changed in place
+    static void UpdateChecksums(WinDivertPacket& packet)
+    {
+        Finish(packet, 0);
+    }
+private:
+    static void Finish(WinDivertPacket& packet, uint32_t sequenceOffset)
+    {
+        typename Family::Header* header = Family::GetHeader(packet);
+        PWINDIVERT_TCPHDR tcp = packet.Tcp();
+
+        uint8_t* tcpBytes = reinterpret_cast<uint8_t*>(tcp);
+        size_t tcpLength = packet.Buffer().data() + packet.Buffer().size() - tcpBytes;
+
+        Family::SetLength(header, packet.Buffer().size());
+        Family::UpdateHeaderChecksum(header);
+
+        if (sequenceOffset != 0)
+        {
+            uint8_t* seqNum = reinterpret_cast<uint8_t*>(&tcp->SeqNum);
+            uint32_t value = ((static_cast<uint32_t>(seqNum[0]) << 24) | (static_cast<uint32_t>(seqNum[1]) << 16) |
+                (static_cast<uint32_t>(seqNum[2]) << 8) | seqNum[3]) + sequenceOffset;
+
+            seqNum[0] = static_cast<uint8_t>(value >> 24);
+            seqNum[1] = static_cast<uint8_t>(value >> 16);
+            seqNum[2] = static_cast<uint8_t>(value >> 8);
+            seqNum[3] = static_cast<uint8_t>(value);
+        }
+
+        tcp->Checksum = 0;
+
+        uint32_t sum = Family::PseudoHeaderSum(header, tcpLength);
+        sum = IPv4::Sum(tcpBytes, tcpLength, sum);
+
+        IPv4::WriteUInt16(reinterpret_cast<uint8_t*>(&tcp->Checksum), IPv4::Fold(sum));
+    }
+};
@@ -0,0 +1,878 @@
+#include "StdAfx.h"
+#include "PacketProcessor.h"
+#include "BufferReader.h"
+#include "HttpRequestParser.h"
+#include "PacketPipeline.h"
+#include "Utils.h"
+
+static uint64_t Nanoseconds()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+PacketProcessor::PacketProcessor(ApplicationConfig& appConfig, PacketDevice& device, PacketCapture* capture /*= nullptr*/)
+    : m_appConfig(appConfig), m_device(device), m_capture(capture), m_verbose(true), m_stageStart(0)
+    , m_hostnameStats(nullptr), m_timestampFrequency(0), m_shedding(false), m_batchNext(0), m_prepared(nullptr)
+{
+}
+
+void PacketProcessor::SetVerbose(bool verbose)
+{
+    m_verbose = verbose;
+}
+
+void PacketProcessor::EnableFeedback(StrategyScoreboard& scoreboard, int64_t timestampFrequency)
+{
+    m_handshakeTracker.reset(new HandshakeTracker(scoreboard, timestampFrequency, 65536, m_appConfig.Engine().largePages));
+}
+
+void PacketProcessor::EnableRecordSplitting(int64_t timestampFrequency)
+{
+    m_recordSplitTracker.reset(new RecordSplitTracker(timestampFrequency));
+}
+
+void PacketProcessor::EnableRetransmissionCache(int64_t timestampFrequency)
+{
+    m_retransmissionCache.reset(new RetransmissionCache(timestampFrequency));
+}
+
+void PacketProcessor::EnableShadow()
+{
+    m_shadow.reset(new ShadowRecorder());
+}
+
+void PacketProcessor::EnableHostnameStats(HostnameStats& stats)
+{
+    m_hostnameStats = &stats;
+    m_matchedNames.reset(new HeavyHitters(stats.Capacity()));
+    m_skippedNames.reset(new HeavyHitters(stats.Capacity()));
+    m_hostnameStatsMerged = std::chrono::steady_clock::now();
+}
+
+void PacketProcessor::FlushHostnameStats()
+{
+    if (!m_hostnameStats || (m_matchedNames->Total() == 0 && m_skippedNames->Total() == 0))
+        return;
+
+    m_hostnameStats->Merge(*m_matchedNames, *m_skippedNames);
+
+    m_matchedNames->Clear();
+    m_skippedNames->Clear();
+    m_hostnameStatsMerged = std::chrono::steady_clock::now();
+}
+
+void PacketProcessor::EnableOverloadControl(uint64_t budget, OverloadController::Action action, int64_t timestampFrequency)
+{
+    m_overload.reset(new OverloadController(budget * 1000, action));
+    m_timestampFrequency = timestampFrequency;
+}
+
+void PacketProcessor::Process(WinDivertPacket& packet)
+{
+    if (m_shadow)
+    {
+        uint64_t start = Nanoseconds();
+        m_stageStart = start;
+
+        bool handled = packet.Dissect();
+        EndStage(ShadowRecorder::Stage::Dissect);
+
+        handled = handled && HandlePacket(packet);
+        m_shadow->Record(ShadowRecorder::Stage::Total, Nanoseconds() - start);
+
+        if (!handled)
+            m_device.Send(packet);
+
+        return;
+    }
+
+    if (packet.Dissect())
+    {
+        if (HandlePacket(packet))
+            return;
+    }
+
+    m_device.Send(packet);
+}
+
+void PacketProcessor::PrepareBatch(WinDivertPacket* const* packets, size_t count)
+{
+    m_batchNext = 0;
+
+    if (m_shadow || m_overload)
+    {
+        m_batch.clear();
+        return;
+    }
+
+    m_batch.resize(count);
+    m_batchDomains.clear();
+
+    // Every packet is parsed before the first host name is matched, then all of them are matched together
+    for (size_t i = 0; i < count; i++)
+    {
+        WinDivertPacket& packet = *packets[i];
+        PreparedPacket& prepared = m_batch[i];
+
+        prepared.packet = &packet;
+        prepared.retransmission = false;
+        prepared.parsed = false;
+        prepared.hostName.clear();
+        prepared.hostNameOffset = 0;
+        prepared.domainConfig.reset();
+        prepared.fingerprintConfig.reset();
+
+        if (!packet.Tcp() || !packet.Address().Outbound)
+            continue;
+
+        if (m_retransmissionCache && m_retransmissionCache->Find(packet, prepared.plan))
+        {
+            prepared.retransmission = true;
+            continue;
+        }
+
+        switch (Utils::ntohs(packet.Tcp()->DstPort))
+        {
+        case 80:
+            prepared.parsed = ParseHttp(packet, prepared.hostName, prepared.hostNameOffset);
+            break;
+        case 443:
+        {
+            TlsFingerprint* fingerprint = m_appConfig.UsesFingerprints() ? &m_fingerprint : nullptr;
+            prepared.parsed = ParseTls(packet, prepared.hostName, prepared.hostNameOffset, fingerprint);
+
+            if (prepared.parsed && fingerprint && fingerprint->complete)
+                prepared.fingerprintConfig = m_appConfig.GetFingerprintConfig(*fingerprint);
+
+            break;
+        }
+        default:
+            break;
+        }
+
+        if (prepared.parsed && !prepared.hostName.empty())
+            m_batchDomains.push_back(&prepared.hostName);
+    }
+
+    if (m_batchDomains.empty())
+        return;
+
+    m_batchDomainConfigs.resize(m_batchDomains.size());
+    m_domainConfigCache.Get(m_appConfig, m_batchDomains.data(), m_batchDomains.size(), m_batchDomainConfigs.data());
+
+    for (size_t i = 0, j = 0; i < count; i++)
+    {
+        if (m_batch[i].parsed && !m_batch[i].hostName.empty())
+            m_batch[i].domainConfig = std::move(m_batchDomainConfigs[j++]);
+    }
+}
+
+bool PacketProcessor::HandlePacket(WinDivertPacket& packet)
+{
+    // Before anything may shed or pass the packet, a flow with split records must stay in step
+    if (m_recordSplitTracker && m_recordSplitTracker->Shift(packet))
+    {
+        if (packet.IPv4())
+            Pipeline<IPv4>::UpdateChecksums(packet);
+        else
+            Pipeline<IPv6>::UpdateChecksums(packet);
+    }
+
+    if (m_batchNext < m_batch.size() && m_batch[m_batchNext].packet == &packet)
+    {
+        m_prepared = &m_batch[m_batchNext++];
+        bool handled = Classify(packet);
+        m_prepared = nullptr;
+
+        return handled;
+    }
+
+    if (!m_overload)
+        return Classify(packet);
+
+    uint64_t captured = 0;
+    INT64 timestamp = packet.Address().Timestamp;
+
+    if (m_timestampFrequency > 0 && timestamp > 0)
+        captured = Utils::ConvertTicks(timestamp, m_timestampFrequency, 1000000000);
+
+    uint64_t started = Nanoseconds();
+
+    if (!m_overload->Shed(captured, started))
+    {
+        bool handled = Classify(packet);
+        m_overload->Processed(captured, started, Nanoseconds());
+
+        return handled;
+    }
+
+    // Forwarded unmodified by the caller
+    if (m_overload->GetAction() == OverloadController::Action::Pass)
+        return false;
+
+    m_shedding = true;
+    bool handled = Classify(packet);
+    m_shedding = false;
+
+    return handled;
+}
+
+bool PacketProcessor::Classify(WinDivertPacket& packet)
+{
+    if (!packet.Tcp())
+        return false;
+
+    // Server responses are only diverted for the handshake tracker and always go on unmodified
+    if (!packet.Address().Outbound)
+    {
+        if (m_handshakeTracker)
+            m_handshakeTracker->HandleInbound(packet);
+
+        return false;
+    }
+
+    if (packet.IPv4())
+        return HandleTcp<IPv4>(packet);
+
+    if (packet.IPv6())
+        return HandleTcp<IPv6>(packet);
+
+    return false;
+}
+
+template<typename Family>
+bool PacketProcessor::HandleTcp(WinDivertPacket& packet)
+{
+    // A segment sent again is split the way it was the first time, without parsing or matching it again
+    if (m_retransmissionCache)
+    {
+        RetransmissionCache::Plan plan;
+        bool retransmission = false;
+
+        if (m_prepared)
+        {
+            plan = m_prepared->plan;
+            retransmission = m_prepared->retransmission;
+        }
+        else
+        {
+            retransmission = m_retransmissionCache->Find(packet, plan);
+        }
+
+        if (retransmission && DoRetransmission<Family>(packet, plan))
+            return true;
+    }
+
+    switch (Utils::ntohs(packet.Tcp()->DstPort))
+    {
+    case 80:
+        return HandleHttp<Family>(packet);
+    case 443:
+        return HandleHttps<Family>(packet);
+    default:
+        break;
+    }
+
+    return false;
+}
+
+template<typename Family>
+bool PacketProcessor::HandleHttp(WinDivertPacket& packet)
+{
+    if (m_prepared)
+        return m_prepared->parsed && HandleHttpFragmentation<Family>(packet, m_prepared->hostName, m_prepared->hostNameOffset);
+
+    std::string hostName;
+    size_t hostNameOffset = 0;
+
+    if (!ParseHttp(packet, hostName, hostNameOffset))
+        return false;
+
+    return HandleHttpFragmentation<Family>(packet, hostName, hostNameOffset);
+}
+
+template<typename Family>
+bool PacketProcessor::HandleHttps(WinDivertPacket& packet)
+{
+    if (m_prepared)
+    {
+        return m_prepared->parsed && HandleTlsFragmentation<Family>(packet, m_prepared->hostName, m_prepared->hostNameOffset,
+            m_prepared->fingerprintConfig);
+    }
+
+    std::string serverName;
+    size_t serverNameOffset = 0;
+
+    // Only walked to the end when a fingerprint could match
+    TlsFingerprint* fingerprint = m_appConfig.UsesFingerprints() ? &m_fingerprint : nullptr;
+
+    if (!ParseTls(packet, serverName, serverNameOffset, fingerprint))
+        return false;
+
+    std::shared_ptr<const ApplicationConfig::FingerprintConfig> fingerprintConfig;
+    if (fingerprint && fingerprint->complete)
+        fingerprintConfig = m_appConfig.GetFingerprintConfig(*fingerprint);
+
+    return HandleTlsFragmentation<Family>(packet, serverName, serverNameOffset, fingerprintConfig);
+}
+
+template<typename Family>
+bool PacketProcessor::HandleHttpFragmentation(WinDivertPacket& packet, const std::string& hostName, size_t hostNameOffset)
+{
+    EndStage(ShadowRecorder::Stage::Parse);
+
+    std::shared_ptr<const ApplicationConfig::DomainConfig> domainConfig;
+    if (!hostName.empty() && !GetDomainConfig(hostName, domainConfig))
+        return false;
+
+    if (!domainConfig)
+    {
+        std::shared_ptr<const ApplicationConfig::NetworkConfig> networkConfig = GetNetworkConfig<Family>(packet);
+        EndStage(ShadowRecorder::Stage::Match);
+
+        if (!networkConfig)
+        {
+            if (m_verbose && !hostName.empty())
+                printf("[+] HTTP[Skip]: %s\n", hostName.c_str());
+
+            RecordDecision(StrategyScoreboard::Protocol::Http, ShadowRecorder::Decision::Skip, hostName);
+            return false;
+        }
+
+        const std::string& matched = hostName.empty() ? networkConfig->network : hostName;
+
+        if (!networkConfig->httpFragmentationEnabled)
+        {
+            RecordDecision(StrategyScoreboard::Protocol::Http, ShadowRecorder::Decision::Disabled, matched);
+            return false;
+        }
+
+        if (m_verbose)
+            printf("[+] HTTP[OK]: %s (%s)\n", hostName.c_str(), networkConfig->network.c_str());
+
+        bool fragmented = DoTcpFragmentation<Family>(packet, networkConfig->httpFragmentationOffset, networkConfig->httpFragmentationOutOfOrder);
+
+        RecordDecision(StrategyScoreboard::Protocol::Http, fragmented ? ShadowRecorder::Decision::Fragment : ShadowRecorder::Decision::Failed, matched);
+        return fragmented;
+    }
+
+    EndStage(ShadowRecorder::Stage::Match);
+
+    if (!domainConfig->httpFragmentationEnabled)
+    {
+        RecordDecision(StrategyScoreboard::Protocol::Http, ShadowRecorder::Decision::Disabled, hostName);
+        return false;
+    }
+
+    if (m_verbose)
+        printf("[+] HTTP[OK]: %s\n", hostName.c_str());
+
+    bool fragmented = DoTrackedFragmentation<Family>(packet, StrategyScoreboard::Protocol::Http, hostName,
+        domainConfig->httpFragmentationOffset, domainConfig->httpFragmentationOutOfOrder);
+
+    RecordDecision(StrategyScoreboard::Protocol::Http, fragmented ? ShadowRecorder::Decision::Fragment : ShadowRecorder::Decision::Failed, hostName);
+    return fragmented;
+}
+
+template<typename Family>
+bool PacketProcessor::HandleTlsFragmentation(WinDivertPacket& packet, const std::string& serverName, size_t serverNameOffset,
+    const std::shared_ptr<const ApplicationConfig::FingerprintConfig>& fingerprintConfig)
+{
+    EndStage(ShadowRecorder::Stage::Parse);
+
+    // The client decides before the server it talks to
+    if (fingerprintConfig)
+    {
+        EndStage(ShadowRecorder::Stage::Match);
+
+        const std::string& matched = serverName.empty() ? fingerprintConfig->fingerprint : serverName;
+
+        if (!fingerprintConfig->tlsFragmentationEnabled)
+        {
+            RecordDecision(StrategyScoreboard::Protocol::Tls, ShadowRecorder::Decision::Disabled, matched);
+            return false;
+        }
+
+        if (m_verbose)
+            printf("[+] TLS[OK]: %s (%s)\n", serverName.c_str(), fingerprintConfig->fingerprint.c_str());
+
+        bool fragmented = (fingerprintConfig->tlsFragmentationRecords && DoRecordSplitting<Family>(packet, fingerprintConfig->tlsFragmentationOffset)) ||
+            DoTcpFragmentation<Family>(packet, fingerprintConfig->tlsFragmentationOffset, fingerprintConfig->tlsFragmentationOutOfOrder);
+
+        RecordDecision(StrategyScoreboard::Protocol::Tls, fragmented ? ShadowRecorder::Decision::Fragment : ShadowRecorder::Decision::Failed, matched);
+        return fragmented;
+    }
+
+    std::shared_ptr<const ApplicationConfig::DomainConfig> domainConfig;
+    if (!serverName.empty() && !GetDomainConfig(serverName, domainConfig))
+        return false;
+
+    if (!domainConfig)
+    {
+        std::shared_ptr<const ApplicationConfig::NetworkConfig> networkConfig = GetNetworkConfig<Family>(packet);
+        EndStage(ShadowRecorder::Stage::Match);
+
+        if (!networkConfig)
+        {
+            if (m_verbose && !serverName.empty())
+                printf("[+] TLS[Skip]: %s\n", serverName.c_str());
+
+            RecordDecision(StrategyScoreboard::Protocol::Tls, ShadowRecorder::Decision::Skip, serverName);
+            return false;
+        }
+
+        const std::string& matched = serverName.empty() ? networkConfig->network : serverName;
+
+        if (!networkConfig->tlsFragmentationEnabled)
+        {
+            RecordDecision(StrategyScoreboard::Protocol::Tls, ShadowRecorder::Decision::Disabled, matched);
+            return false;
+        }
+
+        if (m_verbose)
+            printf("[+] TLS[OK]: %s (%s)\n", serverName.c_str(), networkConfig->network.c_str());
+
+        bool fragmented = (networkConfig->tlsFragmentationRecords && DoRecordSplitting<Family>(packet, networkConfig->tlsFragmentationOffset)) ||
+            DoTcpFragmentation<Family>(packet, networkConfig->tlsFragmentationOffset, networkConfig->tlsFragmentationOutOfOrder);
+
+        RecordDecision(StrategyScoreboard::Protocol::Tls, fragmented ? ShadowRecorder::Decision::Fragment : ShadowRecorder::Decision::Failed, matched);
+        return fragmented;
+    }
+
+    EndStage(ShadowRecorder::Stage::Match);
+
+    if (!domainConfig->tlsFragmentationEnabled)
+    {
+        RecordDecision(StrategyScoreboard::Protocol::Tls, ShadowRecorder::Decision::Disabled, serverName);
+        return false;
+    }
+
+    if (m_verbose)
+        printf("[+] TLS[OK]: %s\n", serverName.c_str());
+
+    bool fragmented = DoTrackedFragmentation<Family>(packet, StrategyScoreboard::Protocol::Tls, serverName,
+        domainConfig->tlsFragmentationOffset, domainConfig->tlsFragmentationOutOfOrder, domainConfig->tlsFragmentationRecords);
+
+    RecordDecision(StrategyScoreboard::Protocol::Tls, fragmented ? ShadowRecorder::Decision::Fragment : ShadowRecorder::Decision::Failed, serverName);
+    return fragmented;
+}
+
+bool PacketProcessor::ParseHttp(WinDivertPacket& packet, std::string& hostName, size_t& hostNameOffset)
+{
+    if (!packet.Data())
+        return false;
+
+    try
+    {
+        const uint8_t* data = packet.Data();
+        uint32_t dataLength = packet.DataLength();
+
+        HttpRequestParser parser;
+        HttpRequestParser::Result result = parser.Parse(data, dataLength);
+
+        if (result == HttpRequestParser::Result::Bad)
+            return false;
+
+        const std::array<int, 4>* header = parser.GetHeader("Host");
+        if (header == nullptr)
+            return true;
+
+        int valueBegin = header->at(2);
+        int valueEnd = header->at(3);
+
+        hostName.assign(data + valueBegin, data + valueEnd);
+        hostNameOffset = valueBegin;
+
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        printf("[-] Unexpected error while parsing HTTP packet (%s)\n", e.what());
+
+        CaptureAnomaly(packet, PacketCapture::Reason::HttpParseError);
+    }
+
+    return false;
+}
+
+bool PacketProcessor::ParseTls(WinDivertPacket& packet, std::string& serverName, size_t& serverNameOffset,
+    TlsFingerprint* fingerprint /*= nullptr*/)
+{
+    if (!packet.Data())
+        return false;
+
+    uint16_t recordLength = 0;
+
+    try
+    {
+        BufferReader reader(packet.Data(), packet.DataLength());
+
+        // Content Type: Handshake (22)
+        // Version: TLS 1.0 (0x0301)
+        // Length: 512
+
+        try
+        {
+            uint8_t contentType = reader.UInt8();
+            uint16_t version = Utils::ntohs(reader.UInt16());
+            recordLength = Utils::ntohs(reader.UInt16());
+
+            if (contentType != 22 || version != 0x0301)
+                return false;
+        }
+        catch (const std::out_of_range&)
+        {
+            return false;
+        }
+
+        // Handshake Type: Client Hello (1)
+        // Length: 508
+        // Version: TLS 1.2 (0x0303)
+        // Random: 19ecfc70399dbe45a24a73d099ba4a3b8ad91042e90105c8e6271fb93cd6b78f
+        // Session ID Length: 32
+        // Session ID: 51ca63b4499b93beba73f581ef06c088abc7cd0e7a21166bd60dce014a00b321
+        // Cipher Suites Length: 62
+        // Cipher Suites (31 suites)
+        // Compression Methods Length: 1
+        // Compression Methods (1 method)
+
+        uint8_t handshakeType = reader.UInt8();
+        if (handshakeType != 1)
+            return false;
+
+        uint8_t handshakeLengthBytes[4];
+        handshakeLengthBytes[0] = 0;
+        handshakeLengthBytes[1] = reader.UInt8();
+        handshakeLengthBytes[2] = reader.UInt8();
+        handshakeLengthBytes[3] = reader.UInt8();
+        uint8_t handshakeLength = Utils::ntohl(*reinterpret_cast<uint32_t*>(handshakeLengthBytes));
+
+        uint16_t handshakeVersion = Utils::ntohs(reader.UInt16());
+        // TLS 1.0, TLS 1.1, TLS 1.2
+        if (handshakeVersion != 0x0301 && handshakeVersion != 0x0302 && handshakeVersion != 0x0303)
+        {
+            CaptureAnomaly(packet, PacketCapture::Reason::UnknownTlsVersion);
+            return false;
+        }
+
+        if (fingerprint)
+        {
+            fingerprint->Clear();
+            fingerprint->version = handshakeVersion;
+        }
+
+        reader.Forward(32);
+
+        uint8_t sessionIdLength = reader.UInt8();
+        reader.Forward(sessionIdLength);
+
+        uint16_t cipherSuitesLength = Utils::ntohs(reader.UInt16());
+
+        if (fingerprint)
+        {
+            const uint8_t* cipherSuites = static_cast<const uint8_t*>(reader.Consume(cipherSuitesLength));
+
+            for (size_t i = 0; i + 1 < cipherSuitesLength; i += 2)
+            {
+                uint16_t cipherSuite = static_cast<uint16_t>((cipherSuites[i] << 8) | cipherSuites[i + 1]);
+
+                if (!TlsFingerprint::IsGrease(cipherSuite))
+                    fingerprint->cipherSuites.push_back(cipherSuite);
+            }
+        }
+        else
+        {
+            reader.Forward(cipherSuitesLength);
+        }
+
+        uint8_t compressionMethodsLength = reader.UInt8();
+        reader.Forward(compressionMethodsLength);
+
+        bool serverNameFound = false;
+
+        // Extensions Length: 373
+        uint16_t extensionsLength = Utils::ntohs(reader.UInt16());
+        while (extensionsLength)
+        {
+            // The ClientHello continues in the next segment within the header of an extension
+            if (fingerprint && reader.Offset() + sizeof(uint16_t) * 2 > reader.Length())
+            {
+                fingerprint = nullptr;
+
+                if (serverNameFound)
+                    return true;
+            }
+
+            // Extension: server_name (len=14)
+            // Type: server_name (0)
+            // Length: 14
+
+            uint16_t extensionType = Utils::ntohs(reader.UInt16());
+            uint16_t extensionLength = Utils::ntohs(reader.UInt16());
+
+            size_t nextOffset = reader.Offset() + extensionLength;
+
+            if (fingerprint && nextOffset > reader.Length())
+            {
+                // The ClientHello continues in the next segment, only its server name can be matched
+                fingerprint = nullptr;
+
+                if (serverNameFound)
+                    return true;
+            }
+
+            if (fingerprint)
+            {
+                size_t offset = reader.Offset();
+
+                fingerprint->AddExtension(extensionType, static_cast<const uint8_t*>(reader.Consume(extensionLength)), extensionLength);
+                reader.Offset(offset);
+            }
+
+            if (extensionType == 0)
+            {
+                // Server Name list length: 12
+
+                // Extension: server_name (len=14)
+                // Type: server_name (0)
+                // Length: 14
+
+                uint16_t serverNameListLength = Utils::ntohs(reader.UInt16());
+
+                uint16_t serverNameType = reader.UInt8();
+                uint16_t serverNameLength = Utils::ntohs(reader.UInt16());
+
+                size_t offset = reader.Offset();
+
+                const char* serverNameBuffer = reinterpret_cast<const char*>(reader.Consume(serverNameLength));
+                serverName.assign(serverNameBuffer, serverNameBuffer + serverNameLength);
+                serverNameOffset = offset;
+
+                // Fingerprints need the extensions that follow as well
+                if (!fingerprint)
+                    return true;
+
+                serverNameFound = true;
+            }
+
+            reader.Offset(nextOffset);
+
+            uint32_t totalExtensionLength = sizeof(uint16_t) * 2 + extensionLength;
+            if (extensionsLength < totalExtensionLength)
+                break;
+
+            extensionsLength -= totalExtensionLength;
+        }
+
+        if (fingerprint)
+            fingerprint->complete = true;
+
+        // Without a server_name extension (IP literal or ECH) only network rules can apply
+        return true;
+    }
+    catch (const std::out_of_range& e)
+    {
+        // The ClientHello continues in the next segment before its server name, as large ones do
+        if (packet.DataLength() < sizeof(uint8_t) + sizeof(uint16_t) * 2 + recordLength)
+            return false;
+
+        if (m_verbose)
+            printf("[-] Unexpected error while parsing TLS packet (%s)\n", e.what());
+
+        // Its lengths are inconsistent
+        CaptureAnomaly(packet, PacketCapture::Reason::TruncatedClientHello);
+    }
+    catch (const std::exception& e)
+    {
+        if (m_verbose)
+            printf("[-] Unexpected error while parsing TLS packet (%s)\n", e.what());
+
+        CaptureAnomaly(packet, PacketCapture::Reason::TlsParseError);
+    }
+
+    return false;
+}
+
+bool PacketProcessor::GetDomainConfig(const std::string& domain, std::shared_ptr<const ApplicationConfig::DomainConfig>& domainConfig)
+{
+    if (m_prepared)
+    {
+        domainConfig = m_prepared->domainConfig;
+        return true;
+    }
+
+    if (!m_shedding)
+    {
+        domainConfig = m_domainConfigCache.Get(m_appConfig, domain);
+        return true;
+    }
+
+    if (m_domainConfigCache.Find(m_appConfig, domain, domainConfig))
+        return true;
+
+    m_overload->Uncached();
+    return false;
+}
+
+template<typename Family>
+std::shared_ptr<const ApplicationConfig::NetworkConfig> PacketProcessor::GetNetworkConfig(WinDivertPacket& packet)
+{
+    return m_appConfig.GetNetworkConfig(Pipeline<Family>::DestinationAddress(packet), Family::ADDRESS_LENGTH == 16);
+}
+
+template<typename Family>
+bool PacketProcessor::DoTcpFragmentation(WinDivertPacket& packet, size_t offset, bool outOfOrder)
+{
+    WinDivertPacket firstPacket;
+    WinDivertPacket secondPacket;
+
+    if (!Pipeline<Family>::Fragment(packet, offset, firstPacket, secondPacket))
+        return false;
+
+    EndStage(ShadowRecorder::Stage::Fragment);
+
+    if (outOfOrder)
+        std::swap(firstPacket, secondPacket);
+
+    m_device.Send(firstPacket);
+    m_device.Send(secondPacket);
+
+    if (m_retransmissionCache)
+    {
+        RetransmissionCache::Plan plan;
+        plan.offset = offset;
+        plan.outOfOrder = outOfOrder;
+
+        m_retransmissionCache->Record(packet, plan);
+    }
+
+    return true;
+}
+
+template<typename Family>
+bool PacketProcessor::DoRecordSplitting(WinDivertPacket& packet, size_t offset)
+{
+    // The flow could not be kept in step without seeing all of it
+    if (!m_recordSplitTracker)
+        return false;
+
+    WinDivertPacket splitPacket(packet.Buffer().size() + Pipeline<Family>::RECORD_HEADER_LENGTH);
+
+    if (!Pipeline<Family>::SplitRecord(packet, offset, splitPacket))
+        return false;
+
+    if (!m_recordSplitTracker->Track(packet, Pipeline<Family>::RECORD_HEADER_LENGTH + offset, Pipeline<Family>::RECORD_HEADER_LENGTH))
+        return false;
+
+    EndStage(ShadowRecorder::Stage::Fragment);
+
+    m_device.Send(splitPacket);
+
+    if (m_retransmissionCache)
+    {
+        RetransmissionCache::Plan plan;
+        plan.offset = offset;
+        plan.records = true;
+
+        m_retransmissionCache->Record(packet, plan);
+    }
+
+    return true;
+}
+
+template<typename Family>
+bool PacketProcessor::DoTrackedFragmentation(WinDivertPacket& packet, StrategyScoreboard::Protocol protocol, const std::string& domain,
+    size_t offset, bool outOfOrder, bool records /*= false*/)
+{
+    if (!m_handshakeTracker)
+        return (records && DoRecordSplitting<Family>(packet, offset)) || DoTcpFragmentation<Family>(packet, offset, outOfOrder);
+
+    StrategyScoreboard::Strategy strategy = m_handshakeTracker->Select(packet, protocol, domain, StrategyScoreboard::Strategy(offset, outOfOrder));
+
+    if (!(records && DoRecordSplitting<Family>(packet, strategy.offset)) &&
+        !DoTcpFragmentation<Family>(packet, strategy.offset, strategy.outOfOrder))
+        return false;
+
+    m_handshakeTracker->Track(packet, protocol, domain, strategy);
+
+    return true;
+}
+
+template<typename Family>
+bool PacketProcessor::DoRetransmission(WinDivertPacket& packet, const RetransmissionCache::Plan& plan)
+{
+    if (!(plan.records && DoRecordSplitting<Family>(packet, plan.offset)) &&
+        !DoTcpFragmentation<Family>(packet, plan.offset, plan.outOfOrder))
+        return false;
+
+    // The scoreboard still learns that the strategy failed, but the copy keeps it and is scored on its own
+    if (m_handshakeTracker)
+        m_handshakeTracker->Retransmitted(packet);
+
+    return true;
+}
+
+void PacketProcessor::CaptureAnomaly(const WinDivertPacket& packet, PacketCapture::Reason reason)
+{
+    if (m_capture)
+        m_capture->Capture(packet, reason);
+}
+
+void PacketProcessor::EndStage(ShadowRecorder::Stage stage)
+{
+    if (!m_shadow)
+        return;
+
+    uint64_t now = Nanoseconds();
+
+    m_shadow->Record(stage, now - m_stageStart);
+    m_stageStart = now;
+}
+
+void PacketProcessor::RecordDecision(StrategyScoreboard::Protocol protocol, ShadowRecorder::Decision decision, const std::string& domain)
+{
+    if (m_shadow)
+        m_shadow->Record(protocol, decision, domain);
+
+    if (m_hostnameStats)
+    {
+        if (decision == ShadowRecorder::Decision::Skip)
+            m_skippedNames->Add(domain);
+        else
+            m_matchedNames->Add(domain);
+
+        if (std::chrono::steady_clock::now() - m_hostnameStatsMerged >= std::chrono::seconds(1))
+            FlushHostnameStats();
+    }
+}
+
+const DomainConfigCache& PacketProcessor::DomainCache() const
+{
+    return m_domainConfigCache;
+}
+
+const HandshakeTracker* PacketProcessor::Handshakes() const
+{
+    return m_handshakeTracker.get();
+}
+
+const RecordSplitTracker* PacketProcessor::RecordSplits() const
+{
+    return m_recordSplitTracker.get();
+}
+
+const RetransmissionCache* PacketProcessor::Retransmissions() const
+{
+    return m_retransmissionCache.get();
+}
+
+const ShadowRecorder* PacketProcessor::Shadow() const
+{
+    return m_shadow.get();
+}
+
+const OverloadController* PacketProcessor::Overload() const
+{
+    return m_overload.get();
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "ApplicationConfig.h"
+#include "DomainConfigCache.h"
+#include "HandshakeTracker.h"
+#include "HostnameStats.h"
+#include "OverloadController.h"
+#include "PacketCapture.h"
+#include "PacketDevice.h"
+#include "RecordSplitTracker.h"
+#include "RetransmissionCache.h"
+#include "ShadowRecorder.h"
+
+// Classification and fragmentation of diverted packets. Every packet processing thread owns one instance,
+// so that per-thread state such as the domain cache needs no locking.
+class PacketProcessor
+{
+public:
+    PacketProcessor(ApplicationConfig& appConfig, PacketDevice& device, PacketCapture* capture = nullptr);
+
+    // Logs every classified host name, enabled by default
+    void SetVerbose(bool verbose);
+
+    // Lets the scoreboard choose the strategy for configured domains and follows inbound responses to score it.
+    // timestampFrequency is the tick rate of WINDIVERT_ADDRESS::Timestamp
+    void EnableFeedback(StrategyScoreboard& scoreboard, int64_t timestampFrequency);
+
+    // Lets tlsFragmentation.records split ClientHellos into two records within one segment, and keeps the
+    // sequence numbers of those flows in step. Every packet of port 443 must pass through in both directions,
+    // without this records fall back to TCP segmentation
+    void EnableRecordSplitting(int64_t timestampFrequency);
+
+    // Splits a fragmented segment the client sends again the way it was split the first time, without parsing or
+    // matching it again. timestampFrequency is the tick rate of WINDIVERT_ADDRESS::Timestamp
+    void EnableRetransmissionCache(int64_t timestampFrequency);
+
+    // Records every decision and how long each stage took, for sniffed traffic
+    void EnableShadow();
+
+    // Counts matched and skipped host names in sketches of the same capacity as stats, merged into it every second
+    void EnableHostnameStats(HostnameStats& stats);
+    // Merges what was counted since the last merge, for when the processor stops or goes idle
+    void FlushHostnameStats();
+
+    // Sheds packets in HandlePacket that waited so long since capture that classifying them would take more
+    // than budget microseconds. timestampFrequency is the tick rate of WINDIVERT_ADDRESS::Timestamp on the
+    // clock of std::chrono::steady_clock, 0 if timestamps are on another clock
+    void EnableOverloadControl(uint64_t budget, OverloadController::Action action, int64_t timestampFrequency);
+
+    // Dissects and handles the packet, forwarding it if it was not consumed
+    void Process(WinDivertPacket& packet);
+
+    // Returns true if the packet was consumed, the packet must be dissected already. A packet that is not
+    // consumed may still have been changed in place, such as the sequence numbers of a flow with split records
+    bool HandlePacket(WinDivertPacket& packet);
+
+    // Parses count dissected packets and matches their host names together, a phase at a time across the
+    // batch so that the cache misses of the lookups overlap. HandlePacket then takes the packets in the same
+    // order, any other packet is handled on its own. Does nothing in shadow mode or with overload control,
+    // which time and shed single packets
+    void PrepareBatch(WinDivertPacket* const* packets, size_t count);
+
+    const DomainConfigCache& DomainCache() const;
+    // Null unless feedback is enabled
+    const HandshakeTracker* Handshakes() const;
+    // Null unless record splitting is enabled
+    const RecordSplitTracker* RecordSplits() const;
+    // Null unless the retransmission cache is enabled
+    const RetransmissionCache* Retransmissions() const;
+    // Null unless shadow mode is enabled
+    const ShadowRecorder* Shadow() const;
+    // Null unless overload control is enabled
+    const OverloadController* Overload() const;
+private:
+    // A packet parsed by PrepareBatch and the domain its host name matched
+    struct PreparedPacket
+    {
+        PreparedPacket()
+            : packet(nullptr), retransmission(false), parsed(false), hostNameOffset(0)
+        {
+        }
+
+        WinDivertPacket* packet;
+        // A segment sent again, split by plan without being parsed
+        bool retransmission;
+        RetransmissionCache::Plan plan;
+        // False if the packet is not an HTTP request or ClientHello
+        bool parsed;
+        std::string hostName;
+        size_t hostNameOffset;
+        std::shared_ptr<const ApplicationConfig::DomainConfig> domainConfig;
+        // Only for ClientHellos while fingerprints are configured
+        std::shared_ptr<const ApplicationConfig::FingerprintConfig> fingerprintConfig;
+    };
+
+    // HandlePacket without overload control
+    bool Classify(WinDivertPacket& packet);
+
+    // Everything below HandlePacket is specialised for IPv4 or IPv6
+    template<typename Family>
+    bool HandleTcp(WinDivertPacket& packet);
+    template<typename Family>
+    bool HandleHttp(WinDivertPacket& packet);
+    template<typename Family>
+    bool HandleHttps(WinDivertPacket& packet);
+
+    // False if the packet is not an HTTP request, hostName stays empty without a Host header
+    bool ParseHttp(WinDivertPacket& packet, std::string& hostName, size_t& hostNameOffset);
+    // False if the packet is not a ClientHello, serverName stays empty without a server_name extension. With
+    // fingerprint, every extension is walked instead of stopping at server_name
+    bool ParseTls(WinDivertPacket& packet, std::string& serverName, size_t& serverNameOffset, TlsFingerprint* fingerprint = nullptr);
+
+    template<typename Family>
+    bool HandleHttpFragmentation(WinDivertPacket& packet, const std::string& hostName, size_t hostNameOffset);
+    template<typename Family>
+    bool HandleTlsFragmentation(WinDivertPacket& packet, const std::string& serverName, size_t serverNameOffset,
+        const std::shared_ptr<const ApplicationConfig::FingerprintConfig>& fingerprintConfig);
+
+    // False while shedding if the domain is not cached, the packet then goes on unmodified
+    bool GetDomainConfig(const std::string& domain, std::shared_ptr<const ApplicationConfig::DomainConfig>& domainConfig);
+    template<typename Family>
+    std::shared_ptr<const ApplicationConfig::NetworkConfig> GetNetworkConfig(WinDivertPacket& packet);
+
+    template<typename Family>
+    bool DoTcpFragmentation(WinDivertPacket& packet, size_t offset, bool outOfOrder);
+    // False if the packet cannot be split within itself, the caller then falls back to DoTcpFragmentation
+    template<typename Family>
+    bool DoRecordSplitting(WinDivertPacket& packet, size_t offset);
+    // Replaces the configured strategy with the scoreboard's choice when feedback is enabled
+    template<typename Family>
+    bool DoTrackedFragmentation(WinDivertPacket& packet, StrategyScoreboard::Protocol protocol, const std::string& domain,
+        size_t offset, bool outOfOrder, bool records = false);
+    // False if the segment could not be split by plan
+    template<typename Family>
+    bool DoRetransmission(WinDivertPacket& packet, const RetransmissionCache::Plan& plan);
+
+    void CaptureAnomaly(const WinDivertPacket& packet, PacketCapture::Reason reason);
+
+    // Shadow mode only, the stage ends now and the next one starts
+    void EndStage(ShadowRecorder::Stage stage);
+    void RecordDecision(StrategyScoreboard::Protocol protocol, ShadowRecorder::Decision decision, const std::string& domain);
+private:
+    ApplicationConfig& m_appConfig;
+    PacketDevice& m_device;
+    PacketCapture* m_capture;
+    bool m_verbose;
+
+    DomainConfigCache m_domainConfigCache;
+    // Reused for every ClientHello
+    TlsFingerprint m_fingerprint;
+    std::unique_ptr<HandshakeTracker> m_handshakeTracker;
+    std::unique_ptr<RecordSplitTracker> m_recordSplitTracker;
+    std::unique_ptr<RetransmissionCache> m_retransmissionCache;
+
+    std::unique_ptr<ShadowRecorder> m_shadow;
+    uint64_t m_stageStart;
+
+    HostnameStats* m_hostnameStats;
+    std::unique_ptr<HeavyHitters> m_matchedNames;
+    std::unique_ptr<HeavyHitters> m_skippedNames;
+    std::chrono::steady_clock::time_point m_hostnameStatsMerged;
+
+    std::unique_ptr<OverloadController> m_overload;
+    int64_t m_timestampFrequency;
+    // The current packet is shed but still classified from the domain cache
+    bool m_shedding;
+
+    std::vector<PreparedPacket> m_batch;
+    size_t m_batchNext;
+    std::vector<const std::string*> m_batchDomains;
+    std::vector<std::shared_ptr<const ApplicationConfig::DomainConfig>> m_batchDomainConfigs;
+    // Set while HandlePacket takes a prepared packet, parsing and matching are then skipped
+    PreparedPacket* m_prepared;
+};
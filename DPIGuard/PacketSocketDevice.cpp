@@ -0,0 +1,226 @@
+#include "StdAfx.h"
+#include "PacketSocketDevice.h"
+
+#include <cerrno>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+PacketSocketDevice::PacketSocketDevice()
+    : m_socket(-1), m_event(-1), m_ring(nullptr), m_blockSize(0), m_blocks(0)
+    , m_block(0), m_remaining(0), m_next(nullptr), m_shutdown(false)
+{
+}
+
+PacketSocketDevice::~PacketSocketDevice()
+{
+    Close();
+}
+
+bool PacketSocketDevice::Open(const char* interfaceName, size_t blockSize /*= 1 << 20*/, size_t blocks /*= 64*/)
+{
+    Close();
+
+    // Loaded with the packet type, passing PACKET_OUTGOING whole and dropping everything else
+    sock_filter code[] = {
+        { BPF_LD | BPF_B | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_PKTTYPE) },
+        { BPF_JMP | BPF_JEQ | BPF_K, 0, 1, PACKET_OUTGOING },
+        { BPF_RET | BPF_K, 0, 0, 0x40000 },
+        { BPF_RET | BPF_K, 0, 0, 0 }
+    };
+
+    sock_fprog filter = {};
+    filter.len = static_cast<unsigned short>(sizeof(code) / sizeof(code[0]));
+    filter.filter = code;
+
+    int version = TPACKET_V3;
+
+    // Full blocks are handed over when they are full or after 10 ms
+    tpacket_req3 request = {};
+    request.tp_block_size = static_cast<unsigned int>(blockSize);
+    request.tp_block_nr = static_cast<unsigned int>(blocks);
+    request.tp_frame_size = 2048;
+    request.tp_frame_nr = static_cast<unsigned int>(blockSize * blocks / 2048);
+    request.tp_retire_blk_tov = 10;
+
+    sockaddr_ll local = {};
+    local.sll_family = AF_PACKET;
+    local.sll_protocol = htons(ETH_P_ALL);
+
+    if (interfaceName && *interfaceName)
+    {
+        local.sll_ifindex = static_cast<int>(if_nametoindex(interfaceName));
+
+        if (local.sll_ifindex == 0)
+            return false;
+    }
+
+    // Network layer packets without the link header, like WinDivert delivers them
+    m_socket = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, htons(ETH_P_ALL));
+    m_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (m_socket < 0 || m_event < 0 ||
+        setsockopt(m_socket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) != 0 ||
+        setsockopt(m_socket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0 ||
+        setsockopt(m_socket, SOL_PACKET, PACKET_RX_RING, &request, sizeof(request)) != 0)
+    {
+        int error = errno;
+        Close();
+        errno = error;
+        return false;
+    }
+
+    void* ring = mmap(nullptr, blockSize * blocks, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, m_socket, 0);
+
+    // Locking the ring needs CAP_IPC_LOCK or a high enough RLIMIT_MEMLOCK, it works without
+    if (ring == MAP_FAILED)
+        ring = mmap(nullptr, blockSize * blocks, PROT_READ | PROT_WRITE, MAP_SHARED, m_socket, 0);
+
+    if (ring == MAP_FAILED || bind(m_socket, reinterpret_cast<const sockaddr*>(&local), sizeof(local)) != 0)
+    {
+        int error = errno;
+
+        if (ring != MAP_FAILED)
+            munmap(ring, blockSize * blocks);
+
+        Close();
+        errno = error;
+        return false;
+    }
+
+    m_ring = static_cast<uint8_t*>(ring);
+    m_blockSize = blockSize;
+    m_blocks = blocks;
+    m_block = 0;
+    m_remaining = 0;
+    m_next = nullptr;
+
+    m_shutdown.store(false, std::memory_order_relaxed);
+
+    return true;
+}
+
+void PacketSocketDevice::Close()
+{
+    if (m_ring)
+    {
+        munmap(m_ring, m_blockSize * m_blocks);
+        m_ring = nullptr;
+    }
+
+    for (int* fd : { &m_socket, &m_event })
+    {
+        if (*fd >= 0)
+        {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void PacketSocketDevice::Shutdown()
+{
+    uint64_t value = 1;
+
+    m_shutdown.store(true, std::memory_order_relaxed);
+
+    if (m_event >= 0)
+    {
+        ssize_t written = write(m_event, &value, sizeof(value));
+        (void)written;
+    }
+}
+
+bool PacketSocketDevice::Recv(WinDivertPacket& packet)
+{
+    while (m_remaining == 0)
+    {
+        if (!NextBlock())
+            return false;
+    }
+
+    const tpacket3_hdr* header = reinterpret_cast<const tpacket3_hdr*>(m_next);
+    const uint8_t* data = m_next + header->tp_mac;
+
+    packet.Buffer().assign(data, data + header->tp_snaplen);
+    packet.Dissect();
+
+    // Forwarded traffic leaves through an interface in both directions, server responses come from the well-known ports
+    uint16_t sourcePort = packet.Tcp() ? ntohs(packet.Tcp()->SrcPort) : 0;
+
+    WINDIVERT_ADDRESS& address = packet.Address();
+    address = WINDIVERT_ADDRESS();
+    address.Timestamp = static_cast<INT64>(static_cast<uint64_t>(header->tp_sec) * 1000000 + header->tp_nsec / 1000);
+    address.Outbound = sourcePort != 80 && sourcePort != 443;
+    address.IPv6 = packet.IPv6() != nullptr;
+    address.Sniffed = 1;
+
+    m_next += header->tp_next_offset;
+    m_remaining--;
+
+    return true;
+}
+
+bool PacketSocketDevice::Send(const WinDivertPacket&)
+{
+    return false;
+}
+
+PacketSocketDevice::Metrics PacketSocketDevice::Stats()
+{
+    // The kernel resets its counters on every read
+    tpacket_stats_v3 stats = {};
+    socklen_t length = sizeof(stats);
+
+    if (m_socket >= 0 && getsockopt(m_socket, SOL_PACKET, PACKET_STATISTICS, &stats, &length) == 0)
+    {
+        m_metrics.packets += stats.tp_packets;
+        m_metrics.drops += stats.tp_drops;
+    }
+
+    return m_metrics;
+}
+
+bool PacketSocketDevice::NextBlock()
+{
+    // The block that was just read goes back to the kernel
+    if (m_next)
+    {
+        tpacket_block_desc* done = reinterpret_cast<tpacket_block_desc*>(m_ring + m_block * m_blockSize);
+        __atomic_store_n(&done->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+
+        m_block = (m_block + 1) % m_blocks;
+        m_next = nullptr;
+    }
+
+    tpacket_block_desc* block = reinterpret_cast<tpacket_block_desc*>(m_ring + m_block * m_blockSize);
+
+    while ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+    {
+        if (m_shutdown.load(std::memory_order_relaxed))
+            return false;
+
+        pollfd fds[2] = { { m_socket, POLLIN, 0 }, { m_event, POLLIN, 0 } };
+        int result = poll(fds, 2, -1);
+
+        if (result < 0 && errno != EINTR)
+            return false;
+
+        if (result > 0 && (fds[1].revents & POLLIN) != 0)
+            return false;
+    }
+
+    m_next = reinterpret_cast<const uint8_t*>(block) + block->hdr.bh1.offset_to_first_pkt;
+    m_remaining = block->hdr.bh1.num_pkts;
+
+    return !m_shutdown.load(std::memory_order_relaxed);
+}
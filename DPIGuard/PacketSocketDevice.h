@@ -0,0 +1,59 @@
+#pragma once
+
+#include "PacketDevice.h"
+
+// Linux sniffing backend for shadow mode on a TPACKET_V3 ring of an AF_PACKET socket. A socket filter passes
+// only packets leaving an interface, which covers locally generated and forwarded traffic once each, and
+// packets are copied from the ring as they are received. Nothing can be sent.
+class PacketSocketDevice : public PacketDevice
+{
+public:
+    struct Metrics
+    {
+        Metrics()
+        {
+            packets = 0;
+            drops = 0;
+        }
+
+        // As counted by the kernel, drops are packets that found the ring full
+        uint64_t packets;
+        uint64_t drops;
+    };
+
+    // WINDIVERT_ADDRESS::Timestamp of received packets is in microseconds
+    static const int64_t TIMESTAMP_FREQUENCY = 1000000;
+
+    PacketSocketDevice();
+    ~PacketSocketDevice();
+
+    // All interfaces if interfaceName is null or empty
+    bool Open(const char* interfaceName, size_t blockSize = 1 << 20, size_t blocks = 64);
+    void Close();
+
+    // Makes Recv return false, safe to call from a signal handler
+    void Shutdown();
+
+    bool Recv(WinDivertPacket& packet) override;
+    bool Send(const WinDivertPacket& packet) override;
+
+    Metrics Stats();
+private:
+    bool NextBlock();
+private:
+    int m_socket;
+    int m_event;
+
+    uint8_t* m_ring;
+    size_t m_blockSize;
+    size_t m_blocks;
+
+    // Block being read, packets left in it and the next one
+    size_t m_block;
+    uint32_t m_remaining;
+    const uint8_t* m_next;
+
+    Metrics m_metrics;
+
+    std::atomic<bool> m_shutdown;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+// Longest prefix match table for addresses of AddressLength bytes.
+// A multibit trie with a 16 bit first stride followed by 8 bit strides, built with leaf pushing, so a lookup
+// is one memory access per level without any backtracking. IPv4 needs at most 3 accesses, IPv6 at most 15.
+template<size_t AddressLength>
+class PrefixTable
+{
+    static_assert(AddressLength >= 2, "address is too short");
+public:
+    typedef std::array<uint8_t, AddressLength> Address;
+
+    struct Prefix
+    {
+        Address address;
+        uint8_t length;
+        // Non-zero value returned by Lookup
+        uint32_t value;
+    };
+
+    // When several prefixes of the same length are equal, the first one wins
+    void Build(const std::vector<Prefix>& prefixes)
+    {
+        m_root.clear();
+        m_nodes.clear();
+
+        if (prefixes.empty())
+            return;
+
+        std::vector<size_t> order(prefixes.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+
+        // Shorter prefixes first so longer ones overwrite them, duplicates in reverse so the first one is written last
+        std::sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+            if (prefixes[lhs].length != prefixes[rhs].length)
+                return prefixes[lhs].length < prefixes[rhs].length;
+
+            return lhs > rhs;
+        });
+
+        m_root.assign(ROOT_SIZE, 0);
+
+        for (size_t index : order)
+            Insert(prefixes[index]);
+    }
+
+    uint32_t Lookup(const uint8_t* address) const
+    {
+        if (m_root.empty())
+            return 0;
+
+        uint32_t entry = m_root[(address[0] << 8) | address[1]];
+
+        for (size_t i = 2; (entry & CHILD) && i < AddressLength; i++)
+            entry = m_nodes[((entry & ~CHILD) << 8) | address[i]];
+
+        return entry;
+    }
+
+    bool Empty() const
+    {
+        return m_root.empty();
+    }
+
+    size_t Size() const
+    {
+        return (m_root.size() + m_nodes.size()) * sizeof(uint32_t);
+    }
+private:
+    static const uint32_t CHILD = 0x80000000U;
+    static const size_t ROOT_SIZE = 65536;
+    static const size_t NODE_SIZE = 256;
+
+    void Insert(const Prefix& prefix)
+    {
+        size_t length = std::min<size_t>(prefix.length, AddressLength * 8);
+        uint32_t value = prefix.value & ~CHILD;
+
+        if (length <= 16)
+        {
+            size_t first = ((prefix.address[0] << 8) | prefix.address[1]) & ~((1U << (16 - length)) - 1) & 0xffff;
+            size_t count = static_cast<size_t>(1) << (16 - length);
+
+            std::fill(m_root.begin() + first, m_root.begin() + first + count, value);
+            return;
+        }
+
+        // Entries are addressed by index, growing m_nodes invalidates pointers into it
+        std::vector<uint32_t>* table = &m_root;
+        size_t entry = (prefix.address[0] << 8) | prefix.address[1];
+        size_t remaining = length - 16;
+
+        for (size_t i = 2; ; i++)
+        {
+            if (!((*table)[entry] & CHILD))
+            {
+                // Push the shorter prefix down into the new node
+                uint32_t pushed = (*table)[entry];
+                uint32_t node = static_cast<uint32_t>(m_nodes.size() / NODE_SIZE);
+
+                m_nodes.resize(m_nodes.size() + NODE_SIZE, pushed);
+                (*table)[entry] = CHILD | node;
+            }
+
+            size_t base = static_cast<size_t>((*table)[entry] & ~CHILD) * NODE_SIZE;
+
+            if (remaining <= 8)
+            {
+                size_t first = prefix.address[i] & ~((1U << (8 - remaining)) - 1) & 0xff;
+                size_t count = static_cast<size_t>(1) << (8 - remaining);
+
+                std::fill(m_nodes.begin() + base + first, m_nodes.begin() + base + first + count, value);
+                return;
+            }
+
+            table = &m_nodes;
+            entry = base + prefix.address[i];
+            remaining -= 8;
+        }
+    }
+
+    std::vector<uint32_t> m_root;
+    std::vector<uint32_t> m_nodes;
+};
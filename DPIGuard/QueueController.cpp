@@ -0,0 +1,158 @@
+#include "StdAfx.h"
+#include "QueueController.h"
+
+QueueController::QueueController()
+    : m_adaptive(false), m_calmPeriod(0), m_receivedSize(0), m_calmSince(0)
+{
+    Configure(Parameters(), false);
+}
+
+void QueueController::Configure(const Parameters& configured, bool adaptive, uint64_t calmPeriod /*= 30000000*/)
+{
+    m_configured = Clamp(configured);
+    m_current = m_configured;
+    m_adaptive = adaptive;
+    m_calmPeriod = calmPeriod;
+
+    m_received.clear();
+    m_receivedSize = 0;
+    m_calmSince = 0;
+
+    m_metrics = Metrics();
+}
+
+bool QueueController::Observe(uint64_t enqueued, uint64_t received, size_t length)
+{
+    uint64_t wait = received > enqueued ? received - enqueued : 0;
+
+    // Packets received before this one arrived had left the queue, the rest were ahead of it
+    while (!m_received.empty() && m_received.front().time <= enqueued)
+    {
+        m_receivedSize -= m_received.front().length;
+        m_received.pop_front();
+    }
+
+    uint64_t queueLength = m_received.size() + 1;
+    uint64_t queueSize = m_receivedSize + length;
+
+    // The driver never queues more than the maximum length, older entries can only be stale
+    if (m_received.size() >= WINDIVERT_PARAM_QUEUE_LENGTH_MAX)
+    {
+        m_receivedSize -= m_received.front().length;
+        m_received.pop_front();
+    }
+
+    Received entry;
+    entry.time = received;
+    entry.length = length;
+
+    m_received.push_back(entry);
+    m_receivedSize += length;
+
+    size_t bucket = 0;
+    while (bucket + 1 < WAIT_BUCKETS && (wait >> bucket) != 0)
+        bucket++;
+
+    m_metrics.packets++;
+    m_metrics.bytes += length;
+    m_metrics.maxWait = std::max(m_metrics.maxWait, wait);
+    m_metrics.maxQueueLength = std::max(m_metrics.maxQueueLength, queueLength);
+    m_metrics.maxQueueSize = std::max(m_metrics.maxQueueSize, queueSize);
+    m_metrics.waitHistogram[bucket]++;
+
+    if (wait * 2 > m_current.time * 1000)
+        m_metrics.latePackets++;
+
+    if (!m_adaptive)
+        return false;
+
+    if (m_metrics.packets == 1)
+        m_calmSince = received;
+
+    bool changed = Grow(queueLength, queueSize, wait);
+
+    if (queueLength * 8 >= m_current.length || queueSize * 8 >= m_current.size || wait * 8 >= m_current.time * 1000)
+    {
+        m_calmSince = received;
+    }
+    else if (received - m_calmSince >= m_calmPeriod)
+    {
+        changed |= Shrink();
+        m_calmSince = received;
+    }
+
+    if (changed)
+        m_metrics.adjustments++;
+
+    return changed;
+}
+
+const QueueController::Parameters& QueueController::Current() const
+{
+    return m_current;
+}
+
+const QueueController::Metrics& QueueController::Stats() const
+{
+    return m_metrics;
+}
+
+uint64_t QueueController::WaitPercentile(double fraction) const
+{
+    uint64_t rank = static_cast<uint64_t>(fraction * m_metrics.packets);
+    uint64_t count = 0;
+
+    for (size_t i = 0; i < WAIT_BUCKETS; i++)
+    {
+        count += m_metrics.waitHistogram[i];
+
+        if (count > rank || i + 1 == WAIT_BUCKETS)
+            return i + 1 == WAIT_BUCKETS ? m_metrics.maxWait : (1ULL << i);
+    }
+
+    return 0;
+}
+
+bool QueueController::Grow(uint64_t queueLength, uint64_t queueSize, uint64_t wait)
+{
+    Parameters next = m_current;
+
+    while (queueLength * 2 > next.length && next.length < WINDIVERT_PARAM_QUEUE_LENGTH_MAX)
+        next.length = std::min<uint64_t>(next.length * 2, WINDIVERT_PARAM_QUEUE_LENGTH_MAX);
+
+    while (queueSize * 2 > next.size && next.size < WINDIVERT_PARAM_QUEUE_SIZE_MAX)
+        next.size = std::min<uint64_t>(next.size * 2, WINDIVERT_PARAM_QUEUE_SIZE_MAX);
+
+    while (wait * 2 > next.time * 1000 && next.time < WINDIVERT_PARAM_QUEUE_TIME_MAX)
+        next.time = std::min<uint64_t>(next.time * 2, WINDIVERT_PARAM_QUEUE_TIME_MAX);
+
+    if (next == m_current)
+        return false;
+
+    m_current = next;
+    return true;
+}
+
+bool QueueController::Shrink()
+{
+    Parameters next;
+    next.length = std::max(m_configured.length, m_current.length / 2);
+    next.time = std::max(m_configured.time, m_current.time / 2);
+    next.size = std::max(m_configured.size, m_current.size / 2);
+
+    if (next == m_current)
+        return false;
+
+    m_current = next;
+    return true;
+}
+
+QueueController::Parameters QueueController::Clamp(const Parameters& parameters)
+{
+    Parameters result;
+    result.length = std::min<uint64_t>(std::max<uint64_t>(parameters.length, WINDIVERT_PARAM_QUEUE_LENGTH_MIN), WINDIVERT_PARAM_QUEUE_LENGTH_MAX);
+    result.time = std::min<uint64_t>(std::max<uint64_t>(parameters.time, WINDIVERT_PARAM_QUEUE_TIME_MIN), WINDIVERT_PARAM_QUEUE_TIME_MAX);
+    result.size = std::min<uint64_t>(std::max<uint64_t>(parameters.size, WINDIVERT_PARAM_QUEUE_SIZE_MIN), WINDIVERT_PARAM_QUEUE_SIZE_MAX);
+
+    return result;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <deque>
+
+// Watches how long packets wait in the WinDivert queue and sizes the queue for the bursts it sees.
+// The packets ahead of a received packet are the ones received before it that were still queued when it arrived,
+// so the queue length and size at every arrival follow from the capture and receive times alone. When a burst
+// fills half the queue length, size or time the limit is doubled right away, after a long calm period it is
+// halved again down to the configured value. All times are in microseconds.
+class QueueController
+{
+public:
+    struct Parameters
+    {
+        Parameters()
+        {
+            length = WINDIVERT_PARAM_QUEUE_LENGTH_DEFAULT;
+            time = WINDIVERT_PARAM_QUEUE_TIME_DEFAULT;
+            size = WINDIVERT_PARAM_QUEUE_SIZE_DEFAULT;
+        }
+
+        bool operator==(const Parameters& rhs) const
+        {
+            return length == rhs.length && time == rhs.time && size == rhs.size;
+        }
+
+        // Packets, milliseconds and bytes like WINDIVERT_PARAM_QUEUE_LENGTH, QUEUE_TIME and QUEUE_SIZE
+        uint64_t length;
+        uint64_t time;
+        uint64_t size;
+    };
+
+    enum
+    {
+        // Bucket i counts waits below 2^i microseconds, the last one everything longer
+        WAIT_BUCKETS = 25
+    };
+
+    struct Metrics
+    {
+        Metrics()
+        {
+            packets = 0;
+            bytes = 0;
+            maxWait = 0;
+            latePackets = 0;
+            maxQueueLength = 0;
+            maxQueueSize = 0;
+            adjustments = 0;
+            std::fill(std::begin(waitHistogram), std::end(waitHistogram), 0);
+        }
+
+        uint64_t packets;
+        uint64_t bytes;
+        uint64_t maxWait;
+        // Packets that waited more than half the queue time, close to being dropped by the driver
+        uint64_t latePackets;
+        uint64_t maxQueueLength;
+        uint64_t maxQueueSize;
+        uint64_t adjustments;
+        uint64_t waitHistogram[WAIT_BUCKETS];
+    };
+
+    QueueController();
+
+    // Parameters are clamped to the driver limits, the adaptive controller never goes below them
+    void Configure(const Parameters& configured, bool adaptive, uint64_t calmPeriod = 30000000);
+
+    // Packet captured at enqueued and received at received. Returns true if Current() changed
+    bool Observe(uint64_t enqueued, uint64_t received, size_t length);
+
+    const Parameters& Current() const;
+    const Metrics& Stats() const;
+
+    // Upper bound of the bucket holding the given fraction of all waits
+    uint64_t WaitPercentile(double fraction) const;
+private:
+    struct Received
+    {
+        uint64_t time;
+        size_t length;
+    };
+
+    bool Grow(uint64_t queueLength, uint64_t queueSize, uint64_t wait);
+    bool Shrink();
+
+    static Parameters Clamp(const Parameters& parameters);
+private:
+    Parameters m_configured;
+    Parameters m_current;
+    bool m_adaptive;
+    uint64_t m_calmPeriod;
+
+    // Receive times of the packets that may still have been queued when the next one arrived
+    std::deque<Received> m_received;
+    uint64_t m_receivedSize;
+
+    // Start of the current calm period, any packet that fills an eighth of a limit restarts it
+    uint64_t m_calmSince;
+
+    Metrics m_metrics;
+};
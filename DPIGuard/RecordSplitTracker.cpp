@@ -0,0 +1,251 @@
+#include "StdAfx.h"
+#include "RecordSplitTracker.h"
+#include "Utils.h"
+
+// Idle flows are looked for at most every ten seconds of packet time
+static const uint64_t EXPIRE_INTERVAL = 10000000;
+// Keepalives start after two hours of silence, a flow that stays quiet for longer is most likely gone
+static const uint64_t IDLE_TIMEOUT = 7200ULL * 1000000;
+
+RecordSplitTracker::RecordSplitTracker(int64_t timestampFrequency, size_t capacity /*= 65536*/)
+    : m_timestampFrequency(std::max<int64_t>(timestampFrequency, 1)), m_capacity(capacity)
+    , m_lastExpire(0), m_split(0), m_shifted(0), m_refused(0), m_expired(0)
+{
+}
+
+bool RecordSplitTracker::Track(WinDivertPacket& packet, size_t offset, uint32_t length)
+{
+    FlowKey key;
+
+    if (!FlowKey::FromPacket(packet, true, key))
+        return false;
+
+    uint64_t now = Now(packet);
+
+    Expire(now);
+
+    uint32_t insertSequence = Utils::ntohl(packet.Tcp()->SeqNum) + static_cast<uint32_t>(offset);
+
+    auto it = m_flows.find(key);
+
+    if (it != m_flows.end())
+    {
+        // The same segment again, anything else would take a second shift
+        if (it->second.insertSequence != insertSequence || it->second.length != length)
+        {
+            m_refused++;
+            return false;
+        }
+
+        it->second.lastSeen = now;
+        return true;
+    }
+
+    if (m_flows.size() >= m_capacity)
+    {
+        m_refused++;
+        return false;
+    }
+
+    Entry& entry = m_flows[key];
+    entry.insertSequence = insertSequence;
+    entry.length = length;
+    entry.lastSeen = now;
+
+    m_split++;
+
+    return true;
+}
+
+bool RecordSplitTracker::Shift(WinDivertPacket& packet)
+{
+    if (m_flows.empty() || !packet.Tcp())
+        return false;
+
+    bool outbound = packet.Address().Outbound != 0;
+
+    FlowKey key;
+
+    if (!FlowKey::FromPacket(packet, outbound, key))
+        return false;
+
+    uint64_t now = Now(packet);
+
+    Expire(now);
+
+    auto it = m_flows.find(key);
+    if (it == m_flows.end())
+        return false;
+
+    PWINDIVERT_TCPHDR tcp = packet.Tcp();
+
+    // A new connection between the same addresses and ports
+    if (outbound && tcp->Syn)
+    {
+        m_flows.erase(it);
+        return false;
+    }
+
+    Entry& entry = it->second;
+    entry.lastSeen = now;
+
+    bool shifted = false;
+
+    if (outbound)
+    {
+        uint32_t sequenceNumber = Utils::ntohl(tcp->SeqNum);
+
+        if (static_cast<int32_t>(sequenceNumber - entry.insertSequence) >= 0)
+        {
+            tcp->SeqNum = Utils::ntohl(sequenceNumber + entry.length);
+            shifted = true;
+        }
+    }
+    else
+    {
+        if (tcp->Ack)
+        {
+            uint32_t acknowledgement = Utils::ntohl(tcp->AckNum);
+            uint32_t mapped = MapAcknowledgement(entry, acknowledgement);
+
+            if (mapped != acknowledgement)
+            {
+                tcp->AckNum = Utils::ntohl(mapped);
+                shifted = true;
+            }
+        }
+
+        shifted = ShiftSackBlocks(entry, packet) || shifted;
+    }
+
+    // Nothing follows a reset
+    if (tcp->Rst)
+        m_flows.erase(it);
+
+    if (shifted)
+        m_shifted++;
+
+    return shifted;
+}
+
+size_t RecordSplitTracker::Flows() const
+{
+    return m_flows.size();
+}
+
+uint64_t RecordSplitTracker::Split() const
+{
+    return m_split;
+}
+
+uint64_t RecordSplitTracker::Shifted() const
+{
+    return m_shifted;
+}
+
+uint64_t RecordSplitTracker::Refused() const
+{
+    return m_refused;
+}
+
+uint64_t RecordSplitTracker::Expired() const
+{
+    return m_expired;
+}
+
+uint32_t RecordSplitTracker::MapAcknowledgement(const Entry& entry, uint32_t acknowledgement)
+{
+    int32_t distance = static_cast<int32_t>(acknowledgement - entry.insertSequence);
+
+    if (distance <= 0)
+        return acknowledgement;
+
+    // Part of the inserted bytes, none of the client's bytes behind them
+    if (static_cast<uint32_t>(distance) < entry.length)
+        return entry.insertSequence;
+
+    return acknowledgement - entry.length;
+}
+
+bool RecordSplitTracker::ShiftSackBlocks(const Entry& entry, WinDivertPacket& packet)
+{
+    PWINDIVERT_TCPHDR tcp = packet.Tcp();
+
+    size_t headerLength = static_cast<size_t>(tcp->HdrLength) * 4;
+    if (headerLength <= sizeof(WINDIVERT_TCPHDR))
+        return false;
+
+    uint8_t* options = reinterpret_cast<uint8_t*>(tcp) + sizeof(WINDIVERT_TCPHDR);
+    size_t optionsLength = headerLength - sizeof(WINDIVERT_TCPHDR);
+
+    bool shifted = false;
+
+    for (size_t i = 0; i < optionsLength; )
+    {
+        // End of Option List
+        if (options[i] == 0)
+            break;
+
+        // No-Operation
+        if (options[i] == 1)
+        {
+            i++;
+            continue;
+        }
+
+        if (i + 1 >= optionsLength)
+            break;
+
+        size_t length = options[i + 1];
+        if (length < 2 || i + length > optionsLength)
+            break;
+
+        // SACK: left and right edges of the blocks received
+        if (options[i] == 5)
+        {
+            for (size_t j = i + 2; j + 4 <= i + length; j += 4)
+            {
+                uint32_t edge = 0;
+                memcpy(&edge, options + j, 4);
+
+                uint32_t mapped = Utils::ntohl(MapAcknowledgement(entry, Utils::ntohl(edge)));
+
+                if (mapped != edge)
+                {
+                    memcpy(options + j, &mapped, 4);
+                    shifted = true;
+                }
+            }
+        }
+
+        i += length;
+    }
+
+    return shifted;
+}
+
+uint64_t RecordSplitTracker::Now(const WinDivertPacket& packet) const
+{
+    return Utils::ConvertTicks(packet.Address().Timestamp, m_timestampFrequency, 1000000);
+}
+
+void RecordSplitTracker::Expire(uint64_t now)
+{
+    if (now >= m_lastExpire && now - m_lastExpire < EXPIRE_INTERVAL)
+        return;
+
+    m_lastExpire = now;
+
+    for (auto it = m_flows.begin(); it != m_flows.end(); )
+    {
+        if (now > it->second.lastSeen && now - it->second.lastSeen >= IDLE_TIMEOUT)
+        {
+            it = m_flows.erase(it);
+            m_expired++;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "FlowKey.h"
+
+#include <unordered_map>
+
+// Follows connections whose ClientHello went out split into two TLS records within one segment. The record header
+// that was inserted puts the server's view of the client's stream ahead of the client's own, so for the rest of
+// the connection outbound sequence numbers are moved forward and the server's acknowledgements, SACK blocks
+// included, are moved back. Every packet of these connections has to pass through in both directions.
+// Not thread safe, every packet processing thread owns its own instance and sees both directions of its flows.
+class RecordSplitTracker
+{
+public:
+    // timestampFrequency is the tick rate of WINDIVERT_ADDRESS::Timestamp
+    RecordSplitTracker(int64_t timestampFrequency, size_t capacity = 65536);
+
+    // Before an outbound segment goes out with length bytes inserted offset bytes into its payload. False if the
+    // flow cannot be followed, the segment must then not be lengthened.
+    bool Track(WinDivertPacket& packet, size_t offset, uint32_t length);
+
+    // Moves the sequence number of an outbound or the acknowledgement of an inbound packet of a tracked flow in
+    // place. False if the packet stays as it is, otherwise the caller updates the checksums.
+    bool Shift(WinDivertPacket& packet);
+
+    size_t Flows() const;
+
+    uint64_t Split() const;
+    uint64_t Shifted() const;
+    // Segments that were not split because the table was full or the flow was split before
+    uint64_t Refused() const;
+    uint64_t Expired() const;
+private:
+    struct Entry
+    {
+        Entry()
+            : insertSequence(0), length(0), lastSeen(0)
+        {
+        }
+
+        // Sequence number of the client byte the inserted bytes went in front of
+        uint32_t insertSequence;
+        uint32_t length;
+        // Microseconds
+        uint64_t lastSeen;
+    };
+
+    // From the server's numbering of the client's stream back to the client's
+    static uint32_t MapAcknowledgement(const Entry& entry, uint32_t acknowledgement);
+    static bool ShiftSackBlocks(const Entry& entry, WinDivertPacket& packet);
+
+    uint64_t Now(const WinDivertPacket& packet) const;
+    void Expire(uint64_t now);
+private:
+    int64_t m_timestampFrequency;
+    size_t m_capacity;
+
+    std::unordered_map<FlowKey, Entry, FlowKeyHash> m_flows;
+    uint64_t m_lastExpire;
+
+    uint64_t m_split;
+    uint64_t m_shifted;
+    uint64_t m_refused;
+    uint64_t m_expired;
+};
@@ -0,0 +1,137 @@
+#include "StdAfx.h"
+#include "RetransmissionCache.h"
+#include "Utils.h"
+
+// Clients give up on a connection after a handful of retransmissions with the timeout doubling each time,
+// within about two minutes even with the largest timeouts in use
+static const uint64_t IDLE_TIMEOUT = 120ULL * 1000000;
+
+RetransmissionCache::RetransmissionCache(int64_t timestampFrequency, size_t capacity /*= 16384*/)
+    : m_timestampFrequency(std::max<int64_t>(timestampFrequency, 1)), m_setMask(0)
+    , m_recorded(0), m_retransmissions(0), m_evicted(0)
+{
+    size_t sets = 1;
+    while (sets * 2 < capacity)
+        sets *= 2;
+
+    m_entries.resize(sets * 2);
+    m_setMask = sets - 1;
+}
+
+void RetransmissionCache::Record(WinDivertPacket& packet, const Plan& plan)
+{
+    FlowKey key;
+
+    if (!FlowKey::FromPacket(packet, true, key) || packet.DataLength() == 0)
+        return;
+
+    uint64_t now = Now(packet);
+    uint32_t sequenceNumber = Utils::ntohl(packet.Tcp()->SeqNum);
+
+    Entry* entry = Probe(key);
+
+    if (entry)
+    {
+        // The retransmission that was just split again
+        if (entry->sequenceNumber == sequenceNumber && entry->length == packet.DataLength())
+        {
+            entry->lastSeen = now;
+            return;
+        }
+    }
+    else
+    {
+        // A free way, otherwise the one seen least recently
+        Entry* ways = &m_entries[(FlowKeyHash()(key) & m_setMask) * 2];
+        entry = ways[0].length == 0 || (ways[1].length != 0 && ways[0].lastSeen <= ways[1].lastSeen) ? ways : ways + 1;
+
+        if (entry->length != 0 && !Expired(*entry, now))
+            m_evicted++;
+
+        entry->key = key;
+    }
+
+    entry->sequenceNumber = sequenceNumber;
+    entry->length = packet.DataLength();
+    entry->lastSeen = now;
+    entry->plan = plan;
+
+    m_recorded++;
+}
+
+bool RetransmissionCache::Find(WinDivertPacket& packet, Plan& plan)
+{
+    if (m_recorded == 0 || !packet.Tcp())
+        return false;
+
+    FlowKey key;
+
+    if (!FlowKey::FromPacket(packet, true, key))
+        return false;
+
+    Entry* entry = Probe(key);
+    if (!entry)
+        return false;
+
+    uint64_t now = Now(packet);
+
+    if (packet.Tcp()->Syn || Expired(*entry, now))
+    {
+        entry->length = 0;
+        return false;
+    }
+
+    // Later segments of the flow go on, the recorded one may still have to be sent again until it is acknowledged
+    if (entry->sequenceNumber != Utils::ntohl(packet.Tcp()->SeqNum) || entry->length != packet.DataLength())
+        return false;
+
+    entry->lastSeen = now;
+    plan = entry->plan;
+
+    m_retransmissions++;
+
+    return true;
+}
+
+size_t RetransmissionCache::Capacity() const
+{
+    return m_entries.size();
+}
+
+uint64_t RetransmissionCache::Recorded() const
+{
+    return m_recorded;
+}
+
+uint64_t RetransmissionCache::Retransmissions() const
+{
+    return m_retransmissions;
+}
+
+uint64_t RetransmissionCache::Evicted() const
+{
+    return m_evicted;
+}
+
+RetransmissionCache::Entry* RetransmissionCache::Probe(const FlowKey& key)
+{
+    Entry* ways = &m_entries[(FlowKeyHash()(key) & m_setMask) * 2];
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        if (ways[i].length != 0 && ways[i].key == key)
+            return ways + i;
+    }
+
+    return nullptr;
+}
+
+bool RetransmissionCache::Expired(const Entry& entry, uint64_t now) const
+{
+    return now > entry.lastSeen && now - entry.lastSeen >= IDLE_TIMEOUT;
+}
+
+uint64_t RetransmissionCache::Now(const WinDivertPacket& packet) const
+{
+    return Utils::ConvertTicks(packet.Address().Timestamp, m_timestampFrequency, 1000000);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "FlowKey.h"
+
+// Remembers how the first data segment of a connection was split, so that when the client sends it again because
+// the fragments were lost or not acknowledged in time, the copy is split the same way without parsing and matching
+// it a second time. A record split must be repeated byte for byte anyway, the server may have part of it already.
+// Bounded two-way set associative table, a lookup touches a single set.
+// Not thread safe, every packet processing thread owns its own instance and sees all outbound packets of its flows.
+class RetransmissionCache
+{
+public:
+    // How the segment was split
+    struct Plan
+    {
+        Plan()
+            : offset(0), outOfOrder(false), records(false)
+        {
+        }
+
+        size_t offset;
+        bool outOfOrder;
+        // Two TLS records within the segment rather than two segments
+        bool records;
+    };
+
+    // timestampFrequency is the tick rate of WINDIVERT_ADDRESS::Timestamp
+    RetransmissionCache(int64_t timestampFrequency, size_t capacity = 16384);
+
+    // After an outbound segment went out split according to plan, replacing what was remembered for the flow
+    void Record(WinDivertPacket& packet, const Plan& plan);
+
+    // True with the plan if the outbound packet repeats the segment recorded for its flow, the same sequence number
+    // and payload length. A new connection between the same addresses and ports forgets the flow.
+    bool Find(WinDivertPacket& packet, Plan& plan);
+
+    size_t Capacity() const;
+
+    uint64_t Recorded() const;
+    uint64_t Retransmissions() const;
+    // Flows forgotten for another one before their segment could have been sent again
+    uint64_t Evicted() const;
+private:
+    struct Entry
+    {
+        Entry()
+            : sequenceNumber(0), length(0), lastSeen(0)
+        {
+        }
+
+        FlowKey key;
+        uint32_t sequenceNumber;
+        // 0 if the way is free
+        uint32_t length;
+        // Microseconds
+        uint64_t lastSeen;
+        Plan plan;
+    };
+
+    // The way holding key in its set, null if there is none
+    Entry* Probe(const FlowKey& key);
+    bool Expired(const Entry& entry, uint64_t now) const;
+
+    uint64_t Now(const WinDivertPacket& packet) const;
+private:
+    int64_t m_timestampFrequency;
+
+    std::vector<Entry> m_entries;
+    size_t m_setMask;
+
+    uint64_t m_recorded;
+    uint64_t m_retransmissions;
+    uint64_t m_evicted;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "PacketDevice.h"
+
+// Receives from a sniffing device and swallows everything sent back, so that the packet processor runs its
+// full path without a single packet being injected. Counts what would have gone out.
+class ShadowDevice : public PacketDevice
+{
+public:
+    explicit ShadowDevice(PacketDevice& device)
+        : m_device(device), m_received(0), m_sent(0)
+    {
+    }
+
+    bool Recv(WinDivertPacket& packet) override
+    {
+        if (!m_device.Recv(packet))
+            return false;
+
+        m_received.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool Send(const WinDivertPacket&) override
+    {
+        m_sent.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    uint64_t Received() const
+    {
+        return m_received.load(std::memory_order_relaxed);
+    }
+
+    // Original packets and fragments that would have been sent
+    uint64_t Sent() const
+    {
+        return m_sent.load(std::memory_order_relaxed);
+    }
+private:
+    PacketDevice& m_device;
+
+    std::atomic<uint64_t> m_received;
+    std::atomic<uint64_t> m_sent;
+};
@@ -0,0 +1,159 @@
+#include "StdAfx.h"
+#include "ShadowRecorder.h"
+
+static const char* STAGE_NAMES[] = { "dissect", "parse", "match", "fragment", "total" };
+static const char* PROTOCOL_NAMES[] = { "HTTP", "TLS" };
+
+ShadowRecorder::ShadowRecorder(size_t maxDomains /*= 65536*/)
+    : m_maxDomains(maxDomains), m_otherDomains(0)
+{
+    for (auto& decisions : m_decisions)
+        std::fill(std::begin(decisions), std::end(decisions), 0);
+}
+
+void ShadowRecorder::Record(Stage stage, uint64_t nanoseconds)
+{
+    Histogram& histogram = m_stages[static_cast<size_t>(stage)];
+
+    size_t bucket = 0;
+    while (bucket + 1 < LATENCY_BUCKETS && (nanoseconds >> bucket) != 0)
+        bucket++;
+
+    histogram.samples++;
+    histogram.max = std::max(histogram.max, nanoseconds);
+    histogram.buckets[bucket]++;
+}
+
+void ShadowRecorder::Record(StrategyScoreboard::Protocol protocol, Decision decision, const std::string& domain)
+{
+    m_decisions[static_cast<size_t>(protocol)][static_cast<size_t>(decision)]++;
+
+    // Unmatched names are what the configuration is not about, and there are too many of them
+    if (decision == Decision::Skip || domain.empty())
+        return;
+
+    auto it = m_domains.find(domain);
+
+    if (it != m_domains.end())
+        it->second++;
+    else if (m_domains.size() < m_maxDomains)
+        m_domains.emplace(domain, 1);
+    else
+        m_otherDomains++;
+}
+
+void ShadowRecorder::Merge(const ShadowRecorder& other)
+{
+    for (size_t i = 0; i < 2; i++)
+    {
+        for (size_t j = 0; j < static_cast<size_t>(Decision::Count); j++)
+            m_decisions[i][j] += other.m_decisions[i][j];
+    }
+
+    for (size_t i = 0; i < static_cast<size_t>(Stage::Count); i++)
+    {
+        m_stages[i].samples += other.m_stages[i].samples;
+        m_stages[i].max = std::max(m_stages[i].max, other.m_stages[i].max);
+
+        for (size_t j = 0; j < LATENCY_BUCKETS; j++)
+            m_stages[i].buckets[j] += other.m_stages[i].buckets[j];
+    }
+
+    for (const auto& domain : other.m_domains)
+    {
+        auto it = m_domains.find(domain.first);
+
+        if (it != m_domains.end())
+            it->second += domain.second;
+        else if (m_domains.size() < m_maxDomains)
+            m_domains.emplace(domain.first, domain.second);
+        else
+            m_otherDomains += domain.second;
+    }
+
+    m_otherDomains += other.m_otherDomains;
+}
+
+uint64_t ShadowRecorder::Decisions(StrategyScoreboard::Protocol protocol, Decision decision) const
+{
+    return m_decisions[static_cast<size_t>(protocol)][static_cast<size_t>(decision)];
+}
+
+uint64_t ShadowRecorder::OtherDomains() const
+{
+    return m_otherDomains;
+}
+
+uint64_t ShadowRecorder::Samples(Stage stage) const
+{
+    return m_stages[static_cast<size_t>(stage)].samples;
+}
+
+uint64_t ShadowRecorder::Percentile(Stage stage, double fraction) const
+{
+    const Histogram& histogram = m_stages[static_cast<size_t>(stage)];
+
+    uint64_t rank = static_cast<uint64_t>(fraction * histogram.samples);
+    uint64_t count = 0;
+
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        count += histogram.buckets[i];
+
+        if (count > rank || i + 1 == LATENCY_BUCKETS)
+            return i + 1 == LATENCY_BUCKETS ? histogram.max : std::min<uint64_t>(histogram.max, 1ULL << i);
+    }
+
+    return 0;
+}
+
+uint64_t ShadowRecorder::Max(Stage stage) const
+{
+    return m_stages[static_cast<size_t>(stage)].max;
+}
+
+std::vector<std::pair<std::string, uint64_t>> ShadowRecorder::TopDomains(size_t count) const
+{
+    std::vector<std::pair<std::string, uint64_t>> domains(m_domains.begin(), m_domains.end());
+
+    count = std::min(count, domains.size());
+
+    std::partial_sort(domains.begin(), domains.begin() + count, domains.end(),
+        [](const std::pair<std::string, uint64_t>& lhs, const std::pair<std::string, uint64_t>& rhs) {
+            return lhs.second != rhs.second ? lhs.second > rhs.second : lhs.first < rhs.first;
+        });
+
+    domains.resize(count);
+
+    return domains;
+}
+
+void ShadowRecorder::Print(size_t topDomains) const
+{
+    for (size_t i = 0; i < 2; i++)
+    {
+        printf("[+] %s: %llu fragmented, %llu skipped, %llu disabled, %llu failed\n", PROTOCOL_NAMES[i],
+            static_cast<unsigned long long>(m_decisions[i][static_cast<size_t>(Decision::Fragment)]),
+            static_cast<unsigned long long>(m_decisions[i][static_cast<size_t>(Decision::Skip)]),
+            static_cast<unsigned long long>(m_decisions[i][static_cast<size_t>(Decision::Disabled)]),
+            static_cast<unsigned long long>(m_decisions[i][static_cast<size_t>(Decision::Failed)]));
+    }
+
+    for (size_t i = 0; i < static_cast<size_t>(Stage::Count); i++)
+    {
+        Stage stage = static_cast<Stage>(i);
+
+        printf("[+] Stage %-8s %12llu samples, p50 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns\n", STAGE_NAMES[i],
+            static_cast<unsigned long long>(Samples(stage)), static_cast<unsigned long long>(Percentile(stage, 0.5)),
+            static_cast<unsigned long long>(Percentile(stage, 0.99)), static_cast<unsigned long long>(Percentile(stage, 0.999)),
+            static_cast<unsigned long long>(Max(stage)));
+    }
+
+    printf("[+] Matched %zu names%s\n", m_domains.size(), m_otherDomains != 0 ? " and more" : "");
+
+    for (const auto& domain : TopDomains(topDomains))
+        printf("[+] %12llu %s\n", static_cast<unsigned long long>(domain.second), domain.first.c_str());
+
+    if (m_otherDomains != 0)
+        printf("[+] %12llu (other names)\n", static_cast<unsigned long long>(m_otherDomains));
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "StrategyScoreboard.h"
+
+#include <unordered_map>
+
+// What the packet processor would have done to sniffed traffic, for trying a configuration without touching
+// any packets: decision counts per protocol, the host names that matched and how long each processing stage
+// took. Not thread safe, every packet processing thread owns its own instance and the results are merged.
+class ShadowRecorder
+{
+public:
+    enum class Stage : uint8_t
+    {
+        // Packet headers
+        Dissect = 0,
+        // HTTP request or ClientHello up to the host name
+        Parse,
+        // Domain and network configuration lookup
+        Match,
+        // Splitting the segment
+        Fragment,
+        // Everything from receive to the decision
+        Total,
+        Count
+    };
+
+    enum class Decision : uint8_t
+    {
+        Fragment = 0,
+        // Neither a domain nor a network matched
+        Skip,
+        // Matched with fragmentation disabled for the protocol
+        Disabled,
+        // Matched, but the payload was too short for the offset
+        Failed,
+        Count
+    };
+
+    enum
+    {
+        // Bucket i counts durations below 2^i nanoseconds, the last one everything longer
+        LATENCY_BUCKETS = 32
+    };
+
+    ShadowRecorder(size_t maxDomains = 65536);
+
+    void Record(Stage stage, uint64_t nanoseconds);
+    // domain is the host name, or the network that matched when there was none
+    void Record(StrategyScoreboard::Protocol protocol, Decision decision, const std::string& domain);
+
+    void Merge(const ShadowRecorder& other);
+
+    uint64_t Decisions(StrategyScoreboard::Protocol protocol, Decision decision) const;
+    // Names beyond maxDomains are counted here only
+    uint64_t OtherDomains() const;
+
+    uint64_t Samples(Stage stage) const;
+    // Upper bound of the bucket holding the given fraction of the stage's durations
+    uint64_t Percentile(Stage stage, double fraction) const;
+    uint64_t Max(Stage stage) const;
+
+    // Matched names with the most connections first
+    std::vector<std::pair<std::string, uint64_t>> TopDomains(size_t count) const;
+
+    void Print(size_t topDomains) const;
+private:
+    struct Histogram
+    {
+        Histogram()
+        {
+            samples = 0;
+            max = 0;
+            std::fill(std::begin(buckets), std::end(buckets), 0);
+        }
+
+        uint64_t samples;
+        uint64_t max;
+        uint64_t buckets[LATENCY_BUCKETS];
+    };
+private:
+    size_t m_maxDomains;
+
+    uint64_t m_decisions[2][static_cast<size_t>(Decision::Count)];
+    Histogram m_stages[static_cast<size_t>(Stage::Count)];
+
+    std::unordered_map<std::string, uint64_t> m_domains;
+    uint64_t m_otherDomains;
+};
@@ -0,0 +1,120 @@
+#include "StdAfx.h"
+#include "SpinPolicy.h"
+
+SpinPolicy::SpinPolicy(uint64_t maxBudget)
+    : m_maxBudget(maxBudget), m_budget(maxBudget), m_histogramTotal(0), m_started(Now())
+{
+    std::fill(std::begin(m_histogram), std::end(m_histogram), 0);
+}
+
+uint64_t SpinPolicy::MaxBudget() const
+{
+    return m_maxBudget;
+}
+
+uint64_t SpinPolicy::Budget() const
+{
+    return m_budget;
+}
+
+void SpinPolicy::Observe(uint64_t wait, uint64_t spinTime, bool caught)
+{
+    m_metrics.waits++;
+    m_metrics.spinTime += spinTime;
+
+    if (caught)
+        m_metrics.caught++;
+
+    size_t bucket = 0;
+    while (bucket < WAIT_BUCKETS - 1 && wait >= (1ULL << bucket))
+        bucket++;
+
+    m_histogram[bucket]++;
+    m_histogramTotal++;
+
+    if (m_histogramTotal >= WAIT_WINDOW)
+    {
+        m_histogramTotal = 0;
+
+        for (uint64_t& count : m_histogram)
+        {
+            count /= 2;
+            m_histogramTotal += count;
+        }
+    }
+
+    Adapt();
+}
+
+void SpinPolicy::ObserveDelay(uint64_t delay, bool caught)
+{
+    if (caught)
+    {
+        m_metrics.caughtDelay += delay;
+        m_metrics.caughtDelays++;
+    }
+    else
+    {
+        m_metrics.blockedDelay += delay;
+        m_metrics.blockedDelays++;
+    }
+}
+
+const SpinPolicy::Metrics& SpinPolicy::Stats() const
+{
+    return m_metrics;
+}
+
+void SpinPolicy::Print() const
+{
+    uint64_t elapsed = std::max<uint64_t>(Now() - m_started, 1);
+
+    printf("[+] Spin receive: budget %llu of %llu us, %llu of %llu waits caught spinning, %.1f s spinning (%.1f%% of a core)\n",
+        static_cast<unsigned long long>(m_budget), static_cast<unsigned long long>(m_maxBudget),
+        static_cast<unsigned long long>(m_metrics.caught), static_cast<unsigned long long>(m_metrics.waits),
+        m_metrics.spinTime / 1000000.0, 100.0 * m_metrics.spinTime / elapsed);
+
+    if (m_metrics.caughtDelays != 0 && m_metrics.blockedDelays != 0)
+    {
+        printf("[+] Receive delay: %.1f us after spinning, %.1f us after blocking\n",
+            static_cast<double>(m_metrics.caughtDelay) / m_metrics.caughtDelays,
+            static_cast<double>(m_metrics.blockedDelay) / m_metrics.blockedDelays);
+    }
+}
+
+uint64_t SpinPolicy::Now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void SpinPolicy::Adapt()
+{
+    if (m_histogramTotal == 0)
+        return;
+
+    // Bucket i holds waits below 2^i, so 2^i is a budget that catches all of them
+    uint64_t covered = 0;
+    size_t bucket = 0;
+
+    for (; bucket < WAIT_BUCKETS; bucket++)
+    {
+        covered += m_histogram[bucket];
+
+        if (covered * 10 >= m_histogramTotal * 9)
+            break;
+    }
+
+    if (bucket < WAIT_BUCKETS - 1 && (1ULL << bucket) <= m_maxBudget)
+    {
+        m_budget = 1ULL << bucket;
+        return;
+    }
+
+    // Waits the maximum budget would catch
+    covered = 0;
+
+    for (bucket = 0; bucket < WAIT_BUCKETS - 1 && (1ULL << bucket) <= m_maxBudget; bucket++)
+        covered += m_histogram[bucket];
+
+    m_budget = covered * 2 >= m_histogramTotal ? m_maxBudget : 0;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+// How long a receive loop busy-polls for the next packet before it blocks. Blocking costs a thread wake-up on
+// every packet that arrives while the loop sleeps, spinning costs a core while nothing arrives. The budget
+// follows the recent waits for packets: it covers nine out of ten of them if that fits into the maximum, it is
+// the maximum if that still catches at least half of them, and spinning stops while most waits are longer.
+// All times are in microseconds. Not thread safe, one policy per receiving thread.
+class SpinPolicy
+{
+public:
+    enum
+    {
+        // Bucket i counts waits below 2^i microseconds, the last one everything longer
+        WAIT_BUCKETS = 21,
+        // Waits after which the histogram is halved, so that old traffic patterns fade out
+        WAIT_WINDOW = 256
+    };
+
+    struct Metrics
+    {
+        Metrics()
+        {
+            waits = 0;
+            caught = 0;
+            spinTime = 0;
+            caughtDelay = 0;
+            caughtDelays = 0;
+            blockedDelay = 0;
+            blockedDelays = 0;
+        }
+
+        // Times the loop had to wait for a packet, and how often spinning caught it
+        uint64_t waits;
+        uint64_t caught;
+        // Busy time spent spinning, caught or not
+        uint64_t spinTime;
+        // Capture to receive delays of packets caught spinning and of packets received after blocking
+        uint64_t caughtDelay;
+        uint64_t caughtDelays;
+        uint64_t blockedDelay;
+        uint64_t blockedDelays;
+    };
+
+    explicit SpinPolicy(uint64_t maxBudget);
+
+    uint64_t MaxBudget() const;
+    // Current budget, 0 blocks right away
+    uint64_t Budget() const;
+
+    // A wait for a packet that took wait in total, spinTime of it spinning. caught if spinning ended it
+    void Observe(uint64_t wait, uint64_t spinTime, bool caught);
+    // Capture to receive delay of a packet that ended a wait
+    void ObserveDelay(uint64_t delay, bool caught);
+
+    const Metrics& Stats() const;
+
+    // Budget, waits caught, CPU time spent spinning and the delay blocking adds
+    void Print() const;
+
+    // Tells the CPU that this is a spin loop
+    static void Pause()
+    {
+#if defined(_WIN32)
+        YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    static uint64_t Now();
+private:
+    void Adapt();
+private:
+    uint64_t m_maxBudget;
+    uint64_t m_budget;
+
+    uint64_t m_histogram[WAIT_BUCKETS];
+    uint64_t m_histogramTotal;
+
+    Metrics m_metrics;
+    uint64_t m_started;
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+// Bounded lock-free single producer, single consumer ring.
+template<typename T>
+class SpscRing
+{
+public:
+    explicit SpscRing(size_t capacity)
+        : m_mask(0), m_head(0), m_cachedTail(0), m_tail(0), m_cachedHead(0)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size *= 2;
+
+        m_slots.resize(size);
+        m_mask = size - 1;
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Producer side
+    bool TryPush(const T& value)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+
+        if (tail - m_cachedHead > m_mask)
+        {
+            m_cachedHead = m_head.load(std::memory_order_acquire);
+
+            if (tail - m_cachedHead > m_mask)
+                return false;
+        }
+
+        m_slots[tail & m_mask] = value;
+        m_tail.store(tail + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    // Consumer side
+    bool TryPop(T& value)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+
+        if (head == m_cachedTail)
+        {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+
+            if (head == m_cachedTail)
+                return false;
+        }
+
+        value = m_slots[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    bool Empty() const
+    {
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+    }
+
+    size_t Size() const
+    {
+        size_t head = m_head.load(std::memory_order_acquire);
+        size_t tail = m_tail.load(std::memory_order_acquire);
+
+        return tail - head;
+    }
+
+    size_t Capacity() const
+    {
+        return m_slots.size();
+    }
+private:
+    std::vector<T> m_slots;
+    size_t m_mask;
+
+    // Consumer owned, kept on separate cache lines from the producer
+    alignas(64) std::atomic<size_t> m_head;
+    size_t m_cachedTail;
+
+    alignas(64) std::atomic<size_t> m_tail;
+    size_t m_cachedHead;
+};
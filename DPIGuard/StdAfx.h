@@ -1,13 +1,17 @@
 #pragma once
 
+#ifdef _WIN32
 #include "TargetVer.h"
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #include <tchar.h>
+#endif
 
 #include <cstdint>
 #include <cctype>
+#include <cstdio>
+#include <cstring>
 
 #include <array>
 #include <string>
@@ -15,6 +19,8 @@
 #include <vector>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <thread>
 #include <memory>
@@ -23,5 +29,18 @@
 #include <stdexcept>
 #include <system_error>
 
+#ifndef _WIN32
+// Outside Windows only the packet header definitions of windivert.h are used
+#define WINDIVERT_KERNEL
+#define INT8    int8_t
+#define UINT8   uint8_t
+#define INT16   int16_t
+#define UINT16  uint16_t
+#define INT32   int32_t
+#define UINT32  uint32_t
+#define INT64   int64_t
+#define UINT64  uint64_t
+#endif
+
 #include <windivert.h>
 #include <yaml-cpp/yaml.h>
@@ -0,0 +1,331 @@
+#include "StdAfx.h"
+#include "StrategyScoreboard.h"
+#include "Utils.h"
+
+static const uint64_t EXPLORE_INTERVAL = 16;
+static const double MAX_SAMPLES = 64;
+static const double LATENCY_WEIGHT = 0.2;
+
+static const char* PROTOCOL_NAMES[] = { "http", "tls" };
+
+StrategyScoreboard::StrategyScoreboard(size_t maxDomains /*= 65536*/)
+    : m_maxDomains(maxDomains), m_timeout(3000), m_modified(false)
+{
+    Configure(m_timeout, { 1, 2, 5 });
+}
+
+void StrategyScoreboard::Configure(uint32_t timeout, const std::vector<size_t>& offsets)
+{
+    std::lock_guard<std::mutex> locked(m_lock);
+
+    m_timeout = std::max<uint32_t>(timeout, 1);
+    m_candidates.clear();
+
+    for (size_t offset : offsets)
+    {
+        m_candidates.push_back(Strategy(offset, false));
+        m_candidates.push_back(Strategy(offset, true));
+    }
+}
+
+uint32_t StrategyScoreboard::Timeout() const
+{
+    return m_timeout;
+}
+
+StrategyScoreboard::Strategy StrategyScoreboard::Select(Protocol protocol, const std::string& domain, const Strategy& configured)
+{
+    std::lock_guard<std::mutex> locked(m_lock);
+
+    Board* board = GetBoard(protocol, domain);
+    if (!board)
+        return configured;
+
+    // The configured strategy comes first for new domains, both it and the candidates are checked on every call
+    // because the configuration may have been reloaded or the board loaded from a file
+    GetScore(*board, configured);
+
+    for (const Strategy& candidate : m_candidates)
+        GetScore(*board, candidate);
+
+    board->connections++;
+
+    Score* selected = nullptr;
+
+    for (Score& score : board->scores)
+    {
+        if (score.selected == 0)
+        {
+            selected = &score;
+            break;
+        }
+    }
+
+    if (!selected && board->connections % EXPLORE_INTERVAL == 0)
+    {
+        for (Score& score : board->scores)
+        {
+            if (!selected || score.selected < selected->selected)
+                selected = &score;
+        }
+    }
+
+    if (!selected)
+        selected = const_cast<Score*>(BestScore(*board));
+
+    selected->selected++;
+
+    return selected->strategy;
+}
+
+void StrategyScoreboard::Report(Protocol protocol, const std::string& domain, const Strategy& strategy, bool success, uint64_t latency)
+{
+    std::lock_guard<std::mutex> locked(m_lock);
+
+    Board* board = GetBoard(protocol, domain);
+    if (!board)
+        return;
+
+    Score& score = GetScore(*board, strategy);
+
+    if (success)
+    {
+        if (score.successes == 0)
+            score.latency = static_cast<double>(latency);
+        else
+            score.latency += LATENCY_WEIGHT * (static_cast<double>(latency) - score.latency);
+
+        score.successes++;
+    }
+    else
+    {
+        score.failures++;
+    }
+
+    if (score.successes + score.failures > MAX_SAMPLES)
+    {
+        score.successes /= 2;
+        score.failures /= 2;
+    }
+
+    m_modified = true;
+}
+
+bool StrategyScoreboard::Best(Protocol protocol, const std::string& domain, Strategy& strategy)
+{
+    std::lock_guard<std::mutex> locked(m_lock);
+
+    auto it = m_boards[static_cast<size_t>(protocol)].find(domain);
+    if (it == m_boards[static_cast<size_t>(protocol)].end())
+        return false;
+
+    const Score* score = BestScore(it->second);
+    if (!score || score->successes + score->failures == 0)
+        return false;
+
+    strategy = score->strategy;
+    return true;
+}
+
+size_t StrategyScoreboard::Domains()
+{
+    std::lock_guard<std::mutex> locked(m_lock);
+
+    return m_boards[0].size() + m_boards[1].size();
+}
+
+bool StrategyScoreboard::Modified() const
+{
+    return m_modified;
+}
+
+bool StrategyScoreboard::LoadFile(const std::wstring& filePath)
+{
+    const std::string scoreboardString = Utils::ReadTextFile(filePath.c_str());
+
+    if (scoreboardString.empty())
+        return Load(YAML::Node());
+
+    try
+    {
+        return Load(YAML::Load(scoreboardString));
+    }
+    catch (const YAML::Exception&)
+    {
+        return false;
+    }
+}
+
+bool StrategyScoreboard::Load(YAML::Node scoreboardNode)
+{
+    std::unordered_map<std::string, Board> boards[2];
+
+    if (!scoreboardNode.IsNull())
+    {
+        if (!scoreboardNode.IsMap())
+            return false;
+
+        try
+        {
+            for (size_t protocol = 0; protocol < 2; protocol++)
+            {
+                YAML::Node domainsNode = scoreboardNode[PROTOCOL_NAMES[protocol]];
+                if (!domainsNode.IsDefined())
+                    continue;
+
+                if (!domainsNode.IsMap())
+                    return false;
+
+                for (YAML::const_iterator it = domainsNode.begin(); it != domainsNode.end(); ++it)
+                {
+                    YAML::Node scoresNode = it->second;
+                    if (!scoresNode.IsSequence())
+                        return false;
+
+                    Board& board = boards[protocol][it->first.as<std::string>()];
+
+                    for (const YAML::Node& scoreNode : scoresNode)
+                    {
+                        Score score;
+                        score.strategy.offset = scoreNode["offset"].as<size_t>();
+                        score.strategy.outOfOrder = scoreNode["outOfOrder"].as<bool>();
+                        score.successes = scoreNode["successes"].as<double>();
+                        score.failures = scoreNode["failures"].as<double>();
+                        score.latency = scoreNode["latency"].as<double>();
+
+                        // Strategies with results are not tried again before the others
+                        score.selected = static_cast<uint64_t>(score.successes + score.failures + 0.5);
+
+                        board.connections += score.selected;
+                        board.scores.push_back(score);
+                    }
+                }
+            }
+        }
+        catch (const YAML::Exception&)
+        {
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> locked(m_lock);
+
+    m_boards[0] = std::move(boards[0]);
+    m_boards[1] = std::move(boards[1]);
+    m_modified = false;
+
+    return true;
+}
+
+bool StrategyScoreboard::SaveFile(const std::wstring& filePath)
+{
+    try
+    {
+        const YAML::Node scoreboardNode = Save();
+        const std::string scoreboardString = YAML::Dump(scoreboardNode);
+
+        return Utils::WriteTextFile(scoreboardString, filePath.c_str());
+    }
+    catch (const YAML::Exception&)
+    {
+        return false;
+    }
+}
+
+YAML::Node StrategyScoreboard::Save()
+{
+    std::lock_guard<std::mutex> locked(m_lock);
+
+    YAML::Node scoreboardNode;
+
+    for (size_t protocol = 0; protocol < 2; protocol++)
+    {
+        YAML::Node domainsNode = scoreboardNode[PROTOCOL_NAMES[protocol]];
+
+        for (const auto& entry : m_boards[protocol])
+        {
+            YAML::Node scoresNode;
+
+            // Strategies that were selected but never finished carry no information
+            for (const Score& score : entry.second.scores)
+            {
+                if (score.successes + score.failures == 0)
+                    continue;
+
+                YAML::Node scoreNode;
+                scoreNode["offset"] = score.strategy.offset;
+                scoreNode["outOfOrder"] = score.strategy.outOfOrder;
+                scoreNode["successes"] = score.successes;
+                scoreNode["failures"] = score.failures;
+                scoreNode["latency"] = static_cast<uint64_t>(score.latency);
+
+                scoresNode.push_back(scoreNode);
+            }
+
+            if (scoresNode.size() != 0)
+                domainsNode[entry.first] = scoresNode;
+        }
+    }
+
+    m_modified = false;
+
+    return scoreboardNode;
+}
+
+StrategyScoreboard::Board* StrategyScoreboard::GetBoard(Protocol protocol, const std::string& domain)
+{
+    std::unordered_map<std::string, Board>& boards = m_boards[static_cast<size_t>(protocol)];
+
+    auto it = boards.find(domain);
+    if (it != boards.end())
+        return &it->second;
+
+    // Past the limit new domains keep their configured strategy
+    if (boards.size() >= m_maxDomains)
+        return nullptr;
+
+    return &boards[domain];
+}
+
+StrategyScoreboard::Score& StrategyScoreboard::GetScore(Board& board, const Strategy& strategy)
+{
+    for (Score& score : board.scores)
+    {
+        if (score.strategy == strategy)
+            return score;
+    }
+
+    board.scores.push_back(Score());
+    board.scores.back().strategy = strategy;
+
+    return board.scores.back();
+}
+
+double StrategyScoreboard::Cost(const Score& score) const
+{
+    // Failure rate with a prior of half a failure, so that a single lucky handshake does not settle the choice
+    double timeout = m_timeout * 1000.0;
+    double failureRate = (score.failures + 0.5) / (score.successes + score.failures + 1);
+    double latency = score.successes > 0 ? score.latency : timeout;
+
+    return failureRate * timeout + (1 - failureRate) * latency;
+}
+
+const StrategyScoreboard::Score* StrategyScoreboard::BestScore(const Board& board) const
+{
+    const Score* best = nullptr;
+    double bestCost = 0;
+
+    for (const Score& score : board.scores)
+    {
+        double cost = Cost(score);
+
+        if (!best || cost < bestCost)
+        {
+            best = &score;
+            bestCost = cost;
+        }
+    }
+
+    return best;
+}
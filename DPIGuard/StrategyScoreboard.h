@@ -0,0 +1,103 @@
+#pragma once
+
+#include <unordered_map>
+
+// Per-domain record of how well each fragmentation strategy gets handshakes through. Every connection picks
+// the strategy with the lowest expected completion time, where a failed handshake costs the full timeout,
+// and every sixteenth connection of a domain tries the least used strategy so that results stay current.
+// Shared by all packet processing threads, it is only consulted once per connection.
+class StrategyScoreboard
+{
+public:
+    enum class Protocol : uint8_t
+    {
+        Http = 0,
+        Tls
+    };
+
+    struct Strategy
+    {
+        Strategy(size_t offset = 0, bool outOfOrder = false)
+            : offset(offset), outOfOrder(outOfOrder)
+        {
+        }
+
+        bool operator==(const Strategy& rhs) const
+        {
+            return offset == rhs.offset && outOfOrder == rhs.outOfOrder;
+        }
+
+        size_t offset;
+        bool outOfOrder;
+    };
+
+    StrategyScoreboard(size_t maxDomains = 65536);
+
+    // Timeout in milliseconds after which a handshake counts as failed, offsets are tried in order and out of order
+    void Configure(uint32_t timeout, const std::vector<size_t>& offsets);
+
+    uint32_t Timeout() const;
+
+    // Picks the strategy for the next connection to domain, the configured one is always a candidate
+    Strategy Select(Protocol protocol, const std::string& domain, const Strategy& configured);
+
+    // Outcome of a connection made with strategy, latency in microseconds from the first data segment to the response
+    void Report(Protocol protocol, const std::string& domain, const Strategy& strategy, bool success, uint64_t latency);
+
+    // Strategy with the lowest expected completion time, false if the domain has no results yet
+    bool Best(Protocol protocol, const std::string& domain, Strategy& strategy);
+
+    size_t Domains();
+
+    // True if results changed since the last Load or Save
+    bool Modified() const;
+
+    bool LoadFile(const std::wstring& filePath);
+    bool Load(YAML::Node scoreboardNode);
+
+    bool SaveFile(const std::wstring& filePath);
+    YAML::Node Save();
+private:
+    struct Score
+    {
+        Score()
+            : selected(0), successes(0), failures(0), latency(0)
+        {
+        }
+
+        Strategy strategy;
+
+        uint64_t selected;
+        // Halved once they add up to more than MAX_SAMPLES, so that old results fade out
+        double successes;
+        double failures;
+        // Moving average of successful handshakes in microseconds
+        double latency;
+    };
+
+    struct Board
+    {
+        Board()
+            : connections(0)
+        {
+        }
+
+        std::vector<Score> scores;
+        uint64_t connections;
+    };
+
+    Board* GetBoard(Protocol protocol, const std::string& domain);
+    Score& GetScore(Board& board, const Strategy& strategy);
+
+    double Cost(const Score& score) const;
+    const Score* BestScore(const Board& board) const;
+private:
+    size_t m_maxDomains;
+    uint32_t m_timeout;
+    std::vector<Strategy> m_candidates;
+
+    std::unordered_map<std::string, Board> m_boards[2];
+    std::atomic<bool> m_modified;
+
+    std::mutex m_lock;
+};
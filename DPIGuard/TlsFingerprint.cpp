@@ -0,0 +1,486 @@
+#include "StdAfx.h"
+#include "TlsFingerprint.h"
+
+static void AppendHex(std::string& s, const uint8_t* data, size_t length)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < length; i++)
+    {
+        s += digits[data[i] >> 4];
+        s += digits[data[i] & 0x0f];
+    }
+}
+
+// Feeds message to block 64 bytes at a time, followed by the padding and the bit length both digests use
+template<typename Block>
+static void Pad(const std::string& message, bool bigEndian, Block block)
+{
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(message.data());
+    size_t length = message.size();
+
+    size_t full = length / 64 * 64;
+    for (size_t offset = 0; offset < full; offset += 64)
+        block(data + offset);
+
+    uint8_t tail[128] = {};
+    size_t rest = length - full;
+
+    memcpy(tail, data + full, rest);
+    tail[rest] = 0x80;
+
+    size_t tailLength = rest < 56 ? 64 : 128;
+    uint64_t bits = static_cast<uint64_t>(length) * 8;
+
+    for (int i = 0; i < 8; i++)
+        tail[tailLength - 8 + i] = static_cast<uint8_t>(bits >> (bigEndian ? (7 - i) * 8 : i * 8));
+
+    block(tail);
+    if (tailLength == 128)
+        block(tail + 64);
+}
+
+static uint32_t RotateLeft(uint32_t value, int count)
+{
+    return (value << count) | (value >> (32 - count));
+}
+
+static uint32_t RotateRight(uint32_t value, int count)
+{
+    return (value >> count) | (value << (32 - count));
+}
+
+// RFC 1321, only for matching the published form of JA3
+static std::string Md5(const std::string& message)
+{
+    static const uint32_t K[64] =
+    {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+    };
+
+    static const int S[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+    uint32_t state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
+    Pad(message, false, [&](const uint8_t* block) {
+        uint32_t M[16];
+        for (int i = 0; i < 16; i++)
+        {
+            const uint8_t* p = block + i * 4;
+            M[i] = p[0] | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+        }
+
+        uint32_t a = state[0];
+        uint32_t b = state[1];
+        uint32_t c = state[2];
+        uint32_t d = state[3];
+
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t f;
+            int g;
+
+            switch (i / 16)
+            {
+            case 0:
+                f = (b & c) | (~b & d);
+                g = i;
+                break;
+            case 1:
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+                break;
+            case 2:
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+                break;
+            default:
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+                break;
+            }
+
+            uint32_t next = d;
+            d = c;
+            c = b;
+            b = b + RotateLeft(a + f + K[i] + M[g], S[(i / 16) * 4 + i % 4]);
+            a = next;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    });
+
+    uint8_t digest[16];
+    for (int i = 0; i < 16; i++)
+        digest[i] = static_cast<uint8_t>(state[i / 4] >> ((i % 4) * 8));
+
+    std::string hex;
+    AppendHex(hex, digest, sizeof(digest));
+
+    return hex;
+}
+
+// FIPS 180-4, the first 12 hex digits that JA4 keeps
+static std::string Sha256(const std::string& message)
+{
+    static const uint32_t K[64] =
+    {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+    Pad(message, true, [&](const uint8_t* block) {
+        uint32_t W[64];
+        for (int i = 0; i < 16; i++)
+        {
+            const uint8_t* p = block + i * 4;
+            W[i] = (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+        }
+
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = RotateRight(W[i - 15], 7) ^ RotateRight(W[i - 15], 18) ^ (W[i - 15] >> 3);
+            uint32_t s1 = RotateRight(W[i - 2], 17) ^ RotateRight(W[i - 2], 19) ^ (W[i - 2] >> 10);
+            W[i] = W[i - 16] + s0 + W[i - 7] + s1;
+        }
+
+        uint32_t v[8];
+        std::copy(state, state + 8, v);
+
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t S1 = RotateRight(v[4], 6) ^ RotateRight(v[4], 11) ^ RotateRight(v[4], 25);
+            uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+            uint32_t t1 = v[7] + S1 + ch + K[i] + W[i];
+            uint32_t S0 = RotateRight(v[0], 2) ^ RotateRight(v[0], 13) ^ RotateRight(v[0], 22);
+            uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+            uint32_t t2 = S0 + maj;
+
+            v[7] = v[6];
+            v[6] = v[5];
+            v[5] = v[4];
+            v[4] = v[3] + t1;
+            v[3] = v[2];
+            v[2] = v[1];
+            v[1] = v[0];
+            v[0] = t1 + t2;
+        }
+
+        for (int i = 0; i < 8; i++)
+            state[i] += v[i];
+    });
+
+    // Only the first 6 bytes are used
+    uint8_t digest[6];
+    for (int i = 0; i < 6; i++)
+        digest[i] = static_cast<uint8_t>(state[i / 4] >> ((3 - i % 4) * 8));
+
+    std::string hex;
+    AppendHex(hex, digest, sizeof(digest));
+
+    return hex;
+}
+
+static void AppendDecimal(std::string& s, uint32_t value)
+{
+    char digits[10];
+    size_t count = 0;
+
+    do
+    {
+        digits[count++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    while (count != 0)
+        s += digits[--count];
+}
+
+template<typename T>
+static void AppendDecimal(std::string& s, const std::vector<T>& values)
+{
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        if (i != 0)
+            s += '-';
+
+        AppendDecimal(s, values[i]);
+    }
+}
+
+static void AppendHex(std::string& s, const std::vector<uint16_t>& values)
+{
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        if (i != 0)
+            s += ',';
+
+        uint8_t bytes[2] = { static_cast<uint8_t>(values[i] >> 8), static_cast<uint8_t>(values[i]) };
+        AppendHex(s, bytes, sizeof(bytes));
+    }
+}
+
+// Big endian, the caller checks the length
+static uint16_t ReadUInt16(const uint8_t* p)
+{
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+void TlsFingerprint::AddExtension(uint16_t type, const uint8_t* data, size_t length)
+{
+    if (IsGrease(type))
+        return;
+
+    extensions.push_back(type);
+
+    // Read in place rather than through BufferReader, this runs for every value of every ClientHello. A list
+    // that does not fit its extension is left as far as it fits
+    switch (type)
+    {
+    case 0:
+        // server_name
+        serverName = true;
+        break;
+    case 10:
+    {
+        // supported_groups
+        if (length < 2)
+            break;
+
+        size_t listLength = std::min<size_t>(ReadUInt16(data), length - 2);
+
+        for (size_t i = 0; i + 1 < listLength; i += 2)
+        {
+            uint16_t group = ReadUInt16(data + 2 + i);
+
+            if (!IsGrease(group))
+                groups.push_back(group);
+        }
+
+        break;
+    }
+    case 11:
+    {
+        // ec_point_formats
+        if (length < 1)
+            break;
+
+        size_t listLength = std::min<size_t>(data[0], length - 1);
+        pointFormats.insert(pointFormats.end(), data + 1, data + 1 + listLength);
+
+        break;
+    }
+    case 13:
+    {
+        // signature_algorithms
+        if (length < 2)
+            break;
+
+        size_t listLength = std::min<size_t>(ReadUInt16(data), length - 2);
+
+        for (size_t i = 0; i + 1 < listLength; i += 2)
+            signatureAlgorithms.push_back(ReadUInt16(data + 2 + i));
+
+        break;
+    }
+    case 16:
+    {
+        // application_layer_protocol_negotiation, only the first protocol counts
+        if (length < 3 || static_cast<size_t>(data[2]) + 3 > length)
+            break;
+
+        alpn.assign(reinterpret_cast<const char*>(data + 3), data[2]);
+        break;
+    }
+    case 43:
+    {
+        // supported_versions
+        if (length < 1)
+            break;
+
+        size_t listLength = std::min<size_t>(data[0], length - 1);
+
+        for (size_t i = 0; i + 1 < listLength; i += 2)
+        {
+            uint16_t supported = ReadUInt16(data + 1 + i);
+
+            if (!IsGrease(supported))
+                supportedVersion = std::max(supportedVersion, supported);
+        }
+
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+std::string TlsFingerprint::Ja3() const
+{
+    // SSLVersion,Ciphers,Extensions,EllipticCurves,EllipticCurvePointFormats
+    std::string ja3;
+    ja3.reserve(6 * (1 + cipherSuites.size() + extensions.size() + groups.size() + pointFormats.size()));
+
+    AppendDecimal(ja3, version);
+
+    ja3 += ',';
+    AppendDecimal(ja3, cipherSuites);
+    ja3 += ',';
+    AppendDecimal(ja3, extensions);
+    ja3 += ',';
+    AppendDecimal(ja3, groups);
+    ja3 += ',';
+    AppendDecimal(ja3, pointFormats);
+
+    return ja3;
+}
+
+std::string TlsFingerprint::Ja3Hash() const
+{
+    return Md5(Ja3());
+}
+
+std::string TlsFingerprint::Ja4() const
+{
+    // Protocol, version, SNI, number of cipher suites and extensions, first and last character of the ALPN
+    std::string ja4 = "t";
+
+    switch (supportedVersion != 0 ? supportedVersion : version)
+    {
+    case 0x0304:
+        ja4 += "13";
+        break;
+    case 0x0303:
+        ja4 += "12";
+        break;
+    case 0x0302:
+        ja4 += "11";
+        break;
+    case 0x0301:
+        ja4 += "10";
+        break;
+    case 0x0300:
+        ja4 += "s3";
+        break;
+    default:
+        ja4 += "00";
+        break;
+    }
+
+    ja4 += serverName ? 'd' : 'i';
+
+    char counts[8];
+    snprintf(counts, sizeof(counts), "%02u%02u", static_cast<unsigned>(std::min<size_t>(cipherSuites.size(), 99)),
+        static_cast<unsigned>(std::min<size_t>(extensions.size(), 99)));
+    ja4 += counts;
+
+    if (alpn.empty())
+    {
+        ja4 += "00";
+    }
+    else if (isalnum(static_cast<uint8_t>(alpn.front())) && isalnum(static_cast<uint8_t>(alpn.back())))
+    {
+        ja4 += alpn.front();
+        ja4 += alpn.back();
+    }
+    else
+    {
+        std::string hex;
+        AppendHex(hex, reinterpret_cast<const uint8_t*>(alpn.data()), alpn.size());
+
+        ja4 += hex.front();
+        ja4 += hex.back();
+    }
+
+    // Sorted cipher suites
+    std::vector<uint16_t> sorted(cipherSuites);
+    std::sort(sorted.begin(), sorted.end());
+
+    std::string ciphers;
+    AppendHex(ciphers, sorted);
+
+    ja4 += '_';
+    ja4 += ciphers.empty() ? std::string(12, '0') : Sha256(ciphers);
+
+    // Sorted extensions without server_name and ALPN, then the signature algorithms in their order
+    sorted.clear();
+    for (uint16_t extension : extensions)
+    {
+        if (extension != 0 && extension != 16)
+            sorted.push_back(extension);
+    }
+
+    std::sort(sorted.begin(), sorted.end());
+
+    std::string extensionList;
+    AppendHex(extensionList, sorted);
+
+    if (!signatureAlgorithms.empty())
+    {
+        extensionList += '_';
+        AppendHex(extensionList, signatureAlgorithms);
+    }
+
+    ja4 += '_';
+    ja4 += sorted.empty() ? std::string(12, '0') : Sha256(extensionList);
+
+    return ja4;
+}
+
+TlsFingerprint::Format TlsFingerprint::Parse(std::string& text)
+{
+    auto isHex = [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    };
+
+    auto toLower = [](char c) {
+        return static_cast<char>(tolower(static_cast<uint8_t>(c)));
+    };
+
+    if (text.size() == 32 && std::all_of(text.begin(), text.end(), isHex))
+    {
+        std::transform(text.begin(), text.end(), text.begin(), toLower);
+        return Format::Ja3Hash;
+    }
+
+    // t13d1516h2_8daaf6152771_e5627efa2ab1
+    if (text.size() == 36 && text[0] == 't' && (text[3] == 'd' || text[3] == 'i') && text[10] == '_' && text[23] == '_')
+    {
+        bool counts = std::all_of(text.begin() + 4, text.begin() + 8, [](char c) { return c >= '0' && c <= '9'; });
+        bool hashes = std::all_of(text.begin() + 11, text.begin() + 23, isHex) && std::all_of(text.begin() + 24, text.end(), isHex);
+
+        if (!counts || !hashes)
+            return Format::Invalid;
+
+        // Ja4 writes the hashes in lower case
+        std::transform(text.begin() + 11, text.end(), text.begin() + 11, toLower);
+        return Format::Ja4;
+    }
+
+    // Five fields of decimal numbers joined by '-', only the version may not be empty
+    if (std::count(text.begin(), text.end(), ',') == 4 && !text.empty() && text[0] != ',' &&
+        std::all_of(text.begin(), text.end(), [](char c) { return (c >= '0' && c <= '9') || c == '-' || c == ','; }))
+    {
+        return Format::Ja3;
+    }
+
+    return Format::Invalid;
+}
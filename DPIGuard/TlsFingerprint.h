@@ -0,0 +1,72 @@
+#pragma once
+
+// What the JA3 and JA4 fingerprints of a ClientHello are made of, filled by the ClientHello parser in the same
+// pass that finds the server name. GREASE values are left out, as both formats require.
+struct TlsFingerprint
+{
+    // Forms a configured fingerprint can take
+    enum class Format : uint8_t
+    {
+        Invalid = 0,
+        // "771,4865-4866-4867,0-23-65281,29-23-24,0", matched without hashing
+        Ja3,
+        // MD5 of the JA3 string in hex, what JA3 lists publish
+        Ja3Hash,
+        // "t13d1516h2_8daaf6152771_e5627efa2ab1"
+        Ja4
+    };
+
+    TlsFingerprint()
+    {
+        Clear();
+    }
+
+    // Keeps the capacity of the lists, one instance is reused for every ClientHello
+    void Clear()
+    {
+        complete = false;
+        version = 0;
+        supportedVersion = 0;
+        serverName = false;
+
+        cipherSuites.clear();
+        extensions.clear();
+        groups.clear();
+        pointFormats.clear();
+        signatureAlgorithms.clear();
+        alpn.clear();
+    }
+
+    // Extensions in the order they were sent, data is the extension body
+    void AddExtension(uint16_t type, const uint8_t* data, size_t length);
+
+    std::string Ja3() const;
+    std::string Ja3Hash() const;
+    std::string Ja4() const;
+
+    // JA3 and JA4 hashes are lower case, Invalid if text is none of the formats
+    static Format Parse(std::string& text);
+
+    // 0x0a0a, 0x1a1a ... 0xfafa
+    static bool IsGrease(uint16_t value)
+    {
+        return (value & 0x0f0f) == 0x0a0a && (value >> 8) == (value & 0xff);
+    }
+
+    // False if the ClientHello continues in the next segment, the fingerprint then cannot be told
+    bool complete;
+    // ClientHello version
+    uint16_t version;
+    // Highest version in supported_versions, 0 without the extension
+    uint16_t supportedVersion;
+    bool serverName;
+
+    std::vector<uint16_t> cipherSuites;
+    // In the order they were sent
+    std::vector<uint16_t> extensions;
+    std::vector<uint16_t> groups;
+    std::vector<uint8_t> pointFormats;
+    std::vector<uint16_t> signatureAlgorithms;
+    // First protocol of application_layer_protocol_negotiation
+    std::string alpn;
+};
@@ -1,6 +1,11 @@
 #include "StdAfx.h"
 #include "Utils.h"
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef _WIN32
 std::wstring Utils::GetApplicationPath()
 {
     wchar_t buffer[MAX_PATH + 1];
@@ -10,12 +15,27 @@ std::wstring Utils::GetApplicationPath()
 }
 
 std::wstring Utils::GetApplicationConfigPath()
+{
+    return GetApplicationFilePath(L".config.yml");
+}
+
+std::wstring Utils::GetApplicationCapturePath()
+{
+    return GetApplicationFilePath(L".capture.pcapng");
+}
+
+std::wstring Utils::GetApplicationFeedbackPath()
+{
+    return GetApplicationFilePath(L".feedback.yml");
+}
+
+std::wstring Utils::GetApplicationFilePath(const wchar_t* suffix)
 {
     std::wstring result;
 
     std::wstring fullPath = GetApplicationPath();
 
-    result.reserve(fullPath.size() + 16);
+    result.reserve(fullPath.size() + wcslen(suffix));
 
     size_t filenameOffset = fullPath.rfind(L'\\');
 
@@ -30,7 +50,7 @@ std::wstring Utils::GetApplicationConfigPath()
         result.append(directory);
         result.push_back(L'\\');
         result.append(fullFileName);
-        result.append(L".config.yml");
+        result.append(suffix);
 
         return result;
     }
@@ -40,7 +60,7 @@ std::wstring Utils::GetApplicationConfigPath()
     result.append(directory);
     result.push_back(L'\\');
     result.append(fileName);
-    result.append(L".config.yml");
+    result.append(suffix);
 
     return result;
 }
@@ -121,6 +141,129 @@ bool Utils::CheckFileModified(const wchar_t* filePath, FILETIME& lastModifiedTim
     return true;
 }
 
+#else
+std::string Utils::ReadTextFile(const wchar_t* filePath)
+{
+    std::string content;
+    char buffer[4096];
+
+    FILE* file = fopen(WideToUtf8(filePath).c_str(), "rb");
+    if (file == nullptr)
+        return content;
+
+    size_t read = 0;
+
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        content.append(buffer, read);
+
+    if (ferror(file))
+        content.clear();
+
+    fclose(file);
+
+    return content;
+}
+
+bool Utils::WriteTextFile(const std::string& buffer, const wchar_t* filePath)
+{
+    FILE* file = fopen(WideToUtf8(filePath).c_str(), "wb");
+    if (file == nullptr)
+        return false;
+
+    size_t written = fwrite(buffer.c_str(), 1, buffer.size(), file);
+
+    if (fclose(file) != 0 || buffer.size() != written)
+        return false;
+
+    return true;
+}
+#endif
+
+std::string Utils::WideToUtf8(const std::wstring& s)
+{
+    std::string result;
+    result.reserve(s.size());
+
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        uint32_t c = static_cast<uint32_t>(s[i]);
+
+        // wchar_t is UTF-16 on Windows
+        if (c >= 0xd800 && c < 0xdc00 && i + 1 < s.size())
+        {
+            uint32_t low = static_cast<uint32_t>(s[i + 1]);
+
+            if (low >= 0xdc00 && low < 0xe000)
+            {
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                i++;
+            }
+        }
+
+        if (c < 0x80)
+        {
+            result.push_back(static_cast<char>(c));
+        }
+        else if (c < 0x800)
+        {
+            result.push_back(static_cast<char>(0xc0 | (c >> 6)));
+            result.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+        }
+        else if (c < 0x10000)
+        {
+            result.push_back(static_cast<char>(0xe0 | (c >> 12)));
+            result.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+            result.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+        }
+        else
+        {
+            result.push_back(static_cast<char>(0xf0 | (c >> 18)));
+            result.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3f)));
+            result.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+            result.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+        }
+    }
+
+    return result;
+}
+
+std::wstring Utils::Utf8ToWide(const std::string& s)
+{
+    std::wstring result;
+    result.reserve(s.size());
+
+    for (size_t i = 0; i < s.size(); )
+    {
+        uint32_t c = static_cast<uint8_t>(s[i]);
+        size_t length = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+
+        if (length > 1)
+            c &= 0x3f >> (length - 1);
+
+        if (i + length > s.size())
+            length = s.size() - i;
+
+        for (size_t j = 1; j < length; j++)
+            c = (c << 6) | (static_cast<uint8_t>(s[i + j]) & 0x3f);
+
+        i += length;
+
+        // wchar_t is UTF-16 on Windows
+        if (c >= 0x10000 && sizeof(wchar_t) == 2)
+        {
+            c -= 0x10000;
+            result.push_back(static_cast<wchar_t>(0xd800 + (c >> 10)));
+            result.push_back(static_cast<wchar_t>(0xdc00 + (c & 0x3ff)));
+        }
+        else
+        {
+            result.push_back(static_cast<wchar_t>(c));
+        }
+    }
+
+    return result;
+}
+
 bool Utils::MatchString(const char* s, const char* pattern)
 {
     while (*s && *pattern)
@@ -155,6 +298,150 @@ bool Utils::MatchString(const char* s, const char* pattern)
     return false;
 }
 
+uint64_t Utils::HashString(const char* s, size_t length)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= static_cast<uint8_t>(s[i]);
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+uint64_t Utils::ConvertTicks(int64_t ticks, int64_t frequency, uint64_t units)
+{
+    // Split in whole seconds and the remainder, so that high frequency counters do not overflow
+    uint64_t value = static_cast<uint64_t>(std::max<int64_t>(ticks, 0));
+    uint64_t perSecond = static_cast<uint64_t>(frequency);
+
+    return value / perSecond * units + value % perSecond * units / perSecond;
+}
+
+void Utils::Prefetch(const void* address)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#elif defined(__GNUC__)
+    __builtin_prefetch(address);
+#else
+    (void)address;
+#endif
+}
+
+bool Utils::ParseIPv4Address(const char* s, uint8_t (&address)[4])
+{
+    for (size_t i = 0; i < 4; i++)
+    {
+        if (i > 0 && *s++ != '.')
+            return false;
+
+        if (!isdigit(static_cast<uint8_t>(*s)))
+            return false;
+
+        uint32_t value = 0;
+        size_t digits = 0;
+
+        while (isdigit(static_cast<uint8_t>(*s)))
+        {
+            value = value * 10 + (*s++ - '0');
+
+            if (++digits > 3 || value > 255)
+                return false;
+        }
+
+        address[i] = static_cast<uint8_t>(value);
+    }
+
+    return *s == '\0';
+}
+
+bool Utils::ParseIPv6Address(const char* s, uint8_t (&address)[16])
+{
+    uint8_t head[16] = { 0 };
+    uint8_t tail[16] = { 0 };
+    size_t headLength = 0;
+    size_t tailLength = 0;
+    bool compressed = false;
+
+    if (s[0] == ':')
+    {
+        if (s[1] != ':')
+            return false;
+
+        compressed = true;
+        s += 2;
+    }
+
+    while (*s)
+    {
+        uint8_t* group = compressed ? tail : head;
+        size_t& groupLength = compressed ? tailLength : headLength;
+
+        if (headLength + tailLength > 14)
+            return false;
+
+        // Embedded IPv4 address in the last 32 bits
+        const char* next = s;
+        while (isxdigit(static_cast<uint8_t>(*next)))
+            next++;
+
+        if (*next == '.')
+        {
+            uint8_t ipv4[4];
+
+            if (headLength + tailLength > 12 || !ParseIPv4Address(s, ipv4))
+                return false;
+
+            memcpy(group + groupLength, ipv4, sizeof(ipv4));
+            groupLength += sizeof(ipv4);
+            break;
+        }
+
+        if (next == s || next - s > 4)
+            return false;
+
+        uint32_t value = 0;
+        for (; s < next; s++)
+            value = (value << 4) | (isdigit(static_cast<uint8_t>(*s)) ? *s - '0' : (tolower(*s) - 'a' + 10));
+
+        group[groupLength++] = static_cast<uint8_t>(value >> 8);
+        group[groupLength++] = static_cast<uint8_t>(value);
+
+        if (*s == '\0')
+            break;
+
+        if (*s++ != ':')
+            return false;
+
+        if (*s == ':')
+        {
+            if (compressed)
+                return false;
+
+            compressed = true;
+            s++;
+        }
+        else if (*s == '\0')
+        {
+            return false;
+        }
+    }
+
+    if (compressed ? (headLength + tailLength > 14) : (headLength != 16))
+        return false;
+
+    memset(address, 0, sizeof(address));
+    memcpy(address, head, headLength);
+    memcpy(address + 16 - tailLength, tail, tailLength);
+
+    return true;
+}
+
+#ifdef _WIN32
 std::string Utils::FormatIPAddress(uint32_t addr)
 {
     char buffer[32];
@@ -174,33 +461,42 @@ std::string Utils::FormatIPAddress(const uint32_t* addr)
 
     return buffer;
 }
+#endif
 
+// Byte order conversions are written out so they do not depend on the host or on WinDivert.dll
 uint16_t Utils::ntohs(uint16_t value)
 {
-    return WinDivertHelperNtohs(value);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+
+    return static_cast<uint16_t>((bytes[0] << 8) | bytes[1]);
 }
 
 uint16_t Utils::htons(uint16_t value)
 {
-    return WinDivertHelperHtons(value);
+    return ntohs(value);
 }
 
 uint32_t Utils::ntohl(uint32_t value)
 {
-    return WinDivertHelperNtohl(value);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+
+    return (static_cast<uint32_t>(bytes[0]) << 24) | (static_cast<uint32_t>(bytes[1]) << 16) |
+        (static_cast<uint32_t>(bytes[2]) << 8) | bytes[3];
 }
 
 uint32_t Utils::htonl(uint32_t value)
 {
-    return WinDivertHelperHtonl(value);
+    return ntohl(value);
 }
 
 uint64_t Utils::ntohll(uint64_t value)
 {
-    return WinDivertHelperNtohll(value);
+    const uint32_t* words = reinterpret_cast<const uint32_t*>(&value);
+
+    return (static_cast<uint64_t>(ntohl(words[0])) << 32) | ntohl(words[1]);
 }
 
 uint64_t Utils::htonll(uint64_t value)
 {
-    return WinDivertHelperHtonll(value);
+    return ntohll(value);
 }
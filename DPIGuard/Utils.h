@@ -3,18 +3,42 @@
 class Utils
 {
 public:
+#ifdef _WIN32
     static std::wstring GetApplicationPath();
     static std::wstring GetApplicationConfigPath();
+    static std::wstring GetApplicationCapturePath();
+    static std::wstring GetApplicationFeedbackPath();
+    // Application path with the extension replaced by suffix
+    static std::wstring GetApplicationFilePath(const wchar_t* suffix);
+#endif
 
     static std::string ReadTextFile(const wchar_t* filePath);
     static bool WriteTextFile(const std::string& buffer, const wchar_t* filePath);
 
+#ifdef _WIN32
     static bool CheckFileModified(const wchar_t* filePath, FILETIME& lastModifiedTime);
+#endif
+
+    static std::string WideToUtf8(const std::wstring& s);
+    static std::wstring Utf8ToWide(const std::string& s);
 
     static bool MatchString(const char* s, const char* pattern);
 
+    static uint64_t HashString(const char* s, size_t length);
+
+    // Counter ticks at frequency per second to units per second, 1000000 for microseconds. Negative ticks count as 0
+    static uint64_t ConvertTicks(int64_t ticks, int64_t frequency, uint64_t units);
+
+    // Hint that the cache line holding address is about to be read
+    static void Prefetch(const void* address);
+
+    static bool ParseIPv4Address(const char* s, uint8_t (&address)[4]);
+    static bool ParseIPv6Address(const char* s, uint8_t (&address)[16]);
+
+#ifdef _WIN32
     static std::string FormatIPAddress(uint32_t addr);
     static std::string FormatIPAddress(const uint32_t* addr);
+#endif
 
     static uint16_t ntohs(uint16_t value);
     static uint16_t htons(uint16_t value);
@@ -1,9 +1,14 @@
 #include "StdAfx.h"
 #include "WinDivertLib.h"
+#include "Utils.h"
 
 WinDivertLib::WinDivertLib()
-    : m_handle(INVALID_HANDLE_VALUE)
+    : m_handle(INVALID_HANDLE_VALUE), m_port(nullptr), m_completions(64), m_nextCompletion(0), m_completionCount(0)
+    , m_queueController(nullptr), m_frequency(1)
 {
+    LARGE_INTEGER frequency;
+    if (QueryPerformanceFrequency(&frequency))
+        m_frequency = frequency.QuadPart;
 }
 
 WinDivertLib::WinDivertLib(const char* filter, WINDIVERT_LAYER layer /*= WINDIVERT_LAYER_NETWORK */, int16_t priority /*= 0 */, uint64_t flags /*= 0 */)
@@ -37,6 +42,17 @@ void WinDivertLib::Close()
         WinDivertClose(m_handle);
         m_handle = INVALID_HANDLE_VALUE;
     }
+
+    if (m_port != nullptr)
+    {
+        CloseHandle(m_port);
+        m_port = nullptr;
+    }
+
+    m_nextCompletion = 0;
+    m_completionCount = 0;
+
+    m_queueController = nullptr;
 }
 
 bool WinDivertLib::Shutdown(WINDIVERT_SHUTDOWN how /*= WINDIVERT_SHUTDOWN_RECV */)
@@ -47,6 +63,35 @@ bool WinDivertLib::Shutdown(WINDIVERT_SHUTDOWN how /*= WINDIVERT_SHUTDOWN_RECV *
     return true;
 }
 
+bool WinDivertLib::SetParam(WINDIVERT_PARAM param, uint64_t value)
+{
+    if (WinDivertSetParam(m_handle, param, value) == FALSE)
+        return false;
+
+    return true;
+}
+
+bool WinDivertLib::GetParam(WINDIVERT_PARAM param, uint64_t& value)
+{
+    UINT64 result = 0;
+
+    if (WinDivertGetParam(m_handle, param, &result) == FALSE)
+        return false;
+
+    value = result;
+    return true;
+}
+
+bool WinDivertLib::SetQueueController(QueueController* controller)
+{
+    m_queueController = controller;
+
+    if (!m_queueController)
+        return true;
+
+    return ApplyQueueParameters(m_queueController->Current());
+}
+
 bool WinDivertLib::Recv(WinDivertPacket& packet)
 {
     uint32_t recvLength = 0;
@@ -68,6 +113,8 @@ bool WinDivertLib::Recv(WinDivertPacket& packet)
 
     packet.Buffer().resize(recvLength);
 
+    ObserveQueue(packet.Address().Timestamp, recvLength);
+
     return true;
 }
 
@@ -78,3 +125,131 @@ bool WinDivertLib::Send(const WinDivertPacket& packet)
 
     return true;
 }
+
+bool WinDivertLib::Submit(Request& request)
+{
+    if (m_port == nullptr)
+    {
+        m_port = CreateIoCompletionPort(m_handle, nullptr, 0, 1);
+
+        if (m_port == nullptr)
+            return false;
+    }
+
+    memset(&request.overlapped, 0, sizeof(request.overlapped));
+
+    request.length = 0;
+    request.addressLength = static_cast<uint32_t>(request.addresses.size() * sizeof(WINDIVERT_ADDRESS));
+    request.error = 0;
+
+    // The completion is queued on the port even if the receive completes right away
+    if (WinDivertRecvEx(m_handle, request.buffer.data(), static_cast<UINT>(request.buffer.size()), nullptr, 0,
+        request.addresses.data(), &request.addressLength, &request.overlapped) == FALSE && GetLastError() != ERROR_IO_PENDING)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool WinDivertLib::Complete(Request*& request)
+{
+    return Dequeue(request, INFINITE);
+}
+
+bool WinDivertLib::Poll(Request*& request)
+{
+    return Dequeue(request, 0);
+}
+
+void WinDivertLib::Cancel()
+{
+    CancelIoEx(m_handle, nullptr);
+}
+
+bool WinDivertLib::Dequeue(Request*& request, DWORD timeout)
+{
+    if (m_port == nullptr)
+        return false;
+
+    if (m_nextCompletion == m_completionCount)
+    {
+        ULONG count = 0;
+
+        if (GetQueuedCompletionStatusEx(m_port, m_completions.data(), static_cast<ULONG>(m_completions.size()), &count, timeout, FALSE) == FALSE)
+            return false;
+
+        m_nextCompletion = 0;
+        m_completionCount = count;
+    }
+
+    const OVERLAPPED_ENTRY& completion = m_completions[m_nextCompletion++];
+
+    request = CONTAINING_RECORD(completion.lpOverlapped, Request, overlapped);
+    request->length = completion.dwNumberOfBytesTransferred;
+
+    // The entry holds the NTSTATUS of the receive, the error code comes from the overlapped result
+    DWORD transferred = 0;
+
+    if (GetOverlappedResult(m_handle, &request->overlapped, &transferred, FALSE) == FALSE)
+    {
+        DWORD error = GetLastError();
+
+        // Like Recv, a truncated packet is still delivered
+        request->error = error == ERROR_INSUFFICIENT_BUFFER ? 0 : error;
+    }
+
+    if (request->error == 0)
+    {
+        size_t offset = 0;
+
+        for (size_t i = 0; i < request->addressLength / sizeof(WINDIVERT_ADDRESS) && offset < request->length; i++)
+        {
+            size_t length = PacketLength(request->buffer.data() + offset, request->length - offset);
+            if (length == 0)
+                break;
+
+            ObserveQueue(request->addresses[i].Timestamp, length);
+            offset += length;
+        }
+    }
+
+    return true;
+}
+
+void WinDivertLib::ObserveQueue(int64_t timestamp, size_t length)
+{
+    if (!m_queueController)
+        return;
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    if (m_queueController->Observe(Utils::ConvertTicks(timestamp, m_frequency, 1000000), Utils::ConvertTicks(now.QuadPart, m_frequency, 1000000), length))
+    {
+        const QueueController::Parameters& parameters = m_queueController->Current();
+
+        if (ApplyQueueParameters(parameters))
+        {
+            printf("[+] WinDivert queue: %llu packets, %llu ms, %llu bytes\n",
+                static_cast<unsigned long long>(parameters.length), static_cast<unsigned long long>(parameters.time),
+                static_cast<unsigned long long>(parameters.size));
+        }
+        else
+        {
+            printf("[-] Failed to set WinDivert queue parameters: %u\n", GetLastError());
+        }
+    }
+}
+
+bool WinDivertLib::ApplyQueueParameters(const QueueController::Parameters& parameters)
+{
+    if (!SetParam(WINDIVERT_PARAM_QUEUE_LENGTH, parameters.length))
+        return false;
+    if (!SetParam(WINDIVERT_PARAM_QUEUE_TIME, parameters.time))
+        return false;
+    if (!SetParam(WINDIVERT_PARAM_QUEUE_SIZE, parameters.size))
+        return false;
+
+    return true;
+}
@@ -1,8 +1,10 @@
 #pragma once
 
-#include "WinDivertPacket.h"
+#include "CompletionSource.h"
+#include "PacketDevice.h"
+#include "QueueController.h"
 
-class WinDivertLib
+class WinDivertLib : public PacketDevice, public CompletionSource
 {
 public:
     WinDivertLib();
@@ -14,8 +16,35 @@ public:
 
     bool Shutdown(WINDIVERT_SHUTDOWN how = WINDIVERT_SHUTDOWN_RECV);
 
-    bool Recv(WinDivertPacket& packet);
-    bool Send(const WinDivertPacket& packet);
+    bool SetParam(WINDIVERT_PARAM param, uint64_t value);
+    bool GetParam(WINDIVERT_PARAM param, uint64_t& value);
+
+    // Applies the controller's queue parameters now and whenever received packets make it change them.
+    // The controller must stay alive until it is replaced or the handle is closed
+    bool SetQueueController(QueueController* controller);
+
+    bool Recv(WinDivertPacket& packet) override;
+    bool Send(const WinDivertPacket& packet) override;
+
+    // Overlapped receives, completed on an I/O completion port created with the first one
+    bool Submit(Request& request) override;
+    bool Complete(Request*& request) override;
+    bool Poll(Request*& request) override;
+    void Cancel() override;
+private:
+    bool Dequeue(Request*& request, DWORD timeout);
+    void ObserveQueue(int64_t timestamp, size_t length);
+    bool ApplyQueueParameters(const QueueController::Parameters& parameters);
 private:
     HANDLE m_handle;
+    HANDLE m_port;
+
+    // Completions dequeued at once and not handed out yet
+    std::vector<OVERLAPPED_ENTRY> m_completions;
+    size_t m_nextCompletion;
+    size_t m_completionCount;
+
+    QueueController* m_queueController;
+    // Performance counter frequency, WINDIVERT_ADDRESS::Timestamp uses the same clock
+    int64_t m_frequency;
 };
@@ -1,8 +1,9 @@
 #include "StdAfx.h"
 #include "WinDivertPacket.h"
+#include "PacketDissector.h"
 
-WinDivertPacket::WinDivertPacket(size_t size /*= 4096*/)
-    : m_address(), m_ipv4(nullptr), m_ipv6(nullptr), m_tcp(nullptr)
+WinDivertPacket::WinDivertPacket(size_t size /*= 4096*/, const std::shared_ptr<LargePageArena>& arena /*= std::shared_ptr<LargePageArena>()*/)
+    : m_buffer(PacketBuffer::allocator_type(arena)), m_address(), m_ipv4(nullptr), m_ipv6(nullptr), m_tcp(nullptr)
     , m_data(nullptr), m_dataLength(0)
 {
     m_buffer.reserve(size);
@@ -19,29 +20,23 @@ WinDivertPacket& WinDivertPacket::operator=(const WinDivertPacket& rhs)
     m_buffer = rhs.m_buffer;
     m_address = rhs.m_address;
 
-    if (rhs.m_ipv4)
-        m_ipv4 = reinterpret_cast<PWINDIVERT_IPHDR>(m_buffer.data() + (reinterpret_cast<const uint8_t*>(rhs.m_ipv4) - rhs.m_buffer.data()));
-
-    if (rhs.m_ipv6)
-        m_ipv6 = reinterpret_cast<PWINDIVERT_IPV6HDR>(m_buffer.data() + (reinterpret_cast<const uint8_t*>(rhs.m_ipv6) - rhs.m_buffer.data()));
-
-    if (rhs.m_tcp)
-        m_tcp = reinterpret_cast<PWINDIVERT_TCPHDR>(m_buffer.data() + (reinterpret_cast<const uint8_t*>(rhs.m_tcp) - rhs.m_buffer.data()));
-
-    if (rhs.m_data)
-        m_data = m_buffer.data() + (rhs.m_data - rhs.m_buffer.data());
+    // Fields the source has not dissected must not keep pointing into an earlier packet
+    m_ipv4 = rhs.m_ipv4 ? reinterpret_cast<PWINDIVERT_IPHDR>(m_buffer.data() + (reinterpret_cast<const uint8_t*>(rhs.m_ipv4) - rhs.m_buffer.data())) : nullptr;
+    m_ipv6 = rhs.m_ipv6 ? reinterpret_cast<PWINDIVERT_IPV6HDR>(m_buffer.data() + (reinterpret_cast<const uint8_t*>(rhs.m_ipv6) - rhs.m_buffer.data())) : nullptr;
+    m_tcp = rhs.m_tcp ? reinterpret_cast<PWINDIVERT_TCPHDR>(m_buffer.data() + (reinterpret_cast<const uint8_t*>(rhs.m_tcp) - rhs.m_buffer.data())) : nullptr;
+    m_data = rhs.m_data ? m_buffer.data() + (rhs.m_data - rhs.m_buffer.data()) : nullptr;
 
     m_dataLength = rhs.m_dataLength;
 
     return *this;
 }
 
-const std::vector<uint8_t>& WinDivertPacket::Buffer() const
+const WinDivertPacket::PacketBuffer& WinDivertPacket::Buffer() const
 {
     return m_buffer;
 }
 
-std::vector<uint8_t>& WinDivertPacket::Buffer()
+WinDivertPacket::PacketBuffer& WinDivertPacket::Buffer()
 {
     return m_buffer;
 }
@@ -58,25 +53,38 @@ WINDIVERT_ADDRESS& WinDivertPacket::Address()
 
 bool WinDivertPacket::Dissect()
 {
-    m_ipv4 = nullptr;
-    m_ipv6 = nullptr;
-    m_tcp = nullptr;
-    m_data = nullptr;
-    m_dataLength = 0;
-
-    return WinDivertHelperParsePacket(
-        m_buffer.data(), (uint32_t)m_buffer.size(),
-        &m_ipv4, &m_ipv6, nullptr, nullptr, nullptr, &m_tcp, nullptr,
-        reinterpret_cast<void**>(&m_data), &m_dataLength,
-        nullptr, nullptr) != FALSE;
-}
-
-bool WinDivertPacket::RecalcChecksum()
-{
-    if (WinDivertHelperCalcChecksums(m_buffer.data(), (uint32_t)m_buffer.size(), &m_address, 0) == FALSE)
-        return false;
-
-    return true;
+    PacketDissector::Layers layers;
+
+    bool result = PacketDissector::Dissect(m_buffer.data(), m_buffer.size(), layers);
+
+    m_ipv4 = reinterpret_cast<PWINDIVERT_IPHDR>(const_cast<uint8_t*>(layers.ipv4));
+    m_ipv6 = reinterpret_cast<PWINDIVERT_IPV6HDR>(const_cast<uint8_t*>(layers.ipv6));
+    m_tcp = reinterpret_cast<PWINDIVERT_TCPHDR>(const_cast<uint8_t*>(layers.tcp));
+    m_data = const_cast<uint8_t*>(layers.data);
+    m_dataLength = layers.dataLength;
+
+#if defined(_WIN32) && defined(_DEBUG)
+    // Cross check TCP packets against the WinDivert parser
+    if (m_tcp)
+    {
+        PWINDIVERT_IPHDR ipv4 = nullptr;
+        PWINDIVERT_IPV6HDR ipv6 = nullptr;
+        PWINDIVERT_TCPHDR tcp = nullptr;
+        uint8_t* data = nullptr;
+        uint32_t dataLength = 0;
+
+        WinDivertHelperParsePacket(
+            m_buffer.data(), (uint32_t)m_buffer.size(),
+            &ipv4, &ipv6, nullptr, nullptr, nullptr, &tcp, nullptr,
+            reinterpret_cast<void**>(&data), &dataLength,
+            nullptr, nullptr);
+
+        if (ipv4 != m_ipv4 || ipv6 != m_ipv6 || tcp != m_tcp || data != m_data || dataLength != m_dataLength)
+            printf("[!] Packet dissector disagrees with WinDivert (%u bytes)\n", static_cast<uint32_t>(m_buffer.size()));
+    }
+#endif
+
+    return result;
 }
 
 PWINDIVERT_IPHDR WinDivertPacket::IPv4()
@@ -89,6 +97,11 @@ PWINDIVERT_IPV6HDR WinDivertPacket::IPv6()
     return m_ipv6;
 }
 
+const WINDIVERT_TCPHDR* WinDivertPacket::Tcp() const
+{
+    return m_tcp;
+}
+
 PWINDIVERT_TCPHDR WinDivertPacket::Tcp()
 {
     return m_tcp;
@@ -1,23 +1,28 @@
 #pragma once
 
+#include "LargePageArena.h"
+
 class WinDivertPacket
 {
 public:
-    WinDivertPacket(size_t size = 4096);
+    // Packet pools may keep their buffers in a large page arena
+    typedef std::vector<uint8_t, ArenaAllocator<uint8_t>> PacketBuffer;
+
+    WinDivertPacket(size_t size = 4096, const std::shared_ptr<LargePageArena>& arena = std::shared_ptr<LargePageArena>());
     WinDivertPacket(const WinDivertPacket& rhs);
     WinDivertPacket& operator=(const WinDivertPacket& rhs);
 
-    const std::vector<uint8_t>& Buffer() const;
-    std::vector<uint8_t>& Buffer();
+    const PacketBuffer& Buffer() const;
+    PacketBuffer& Buffer();
 
     const WINDIVERT_ADDRESS& Address() const;
     WINDIVERT_ADDRESS& Address();
 
     bool Dissect();
-    bool RecalcChecksum();
 
     PWINDIVERT_IPHDR IPv4();
     PWINDIVERT_IPV6HDR IPv6();
+    const WINDIVERT_TCPHDR* Tcp() const;
     PWINDIVERT_TCPHDR Tcp();
 
     const uint8_t* Data() const;
@@ -25,7 +30,7 @@ public:
 
     uint32_t DataLength() const;
 private:
-    std::vector<uint8_t> m_buffer;
+    PacketBuffer m_buffer;
     WINDIVERT_ADDRESS m_address;
 
     PWINDIVERT_IPHDR m_ipv4;